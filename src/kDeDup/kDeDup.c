@@ -28,19 +28,85 @@
 *   Header Files                                                               *
 *******************************************************************************/
 #include <k/kTypes.h>
-//#include <stdlib.h>
+#include <stdlib.h>
 #include <wchar.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "md5.h"
-//#include "sha2.h"
+#include "sha256.h"
+
+#ifdef KBUILD_OS_WINDOWS
+# include "nt/ntstuff.h"
+# include "nt/ntstat.h"
+# include "nt/fts-nt.h"
+# include "nt/nthlp.h"
+# include "nt/ntunlink.h"
+#else
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <fts.h>
+/* Hash the candidate files on several threads. */
+# define KDUP_WITH_THREADS
+#endif
 
-#include "nt/ntstuff.h"
-#include "nt/ntstat.h"
-#include "nt/fts-nt.h"
-#include "nt/nthlp.h"
-#include "nt/ntunlink.h"
+
+/*********************************************************************************************************************************
+*   Defined Constants And Macros                                                                                                 *
+*********************************************************************************************************************************/
+/** The size of the read buffer of each hashing thread.  */
+#define KDUP_HASH_BUF_SIZE      (2*1024*1024)
+/** The max number of hashing threads. */
+#define KDUP_MAX_THREADS        16
+
+/** @name Path string abstraction (UTF-16 on Windows, char elsewhere).
+ * @{ */
+#ifdef KBUILD_OS_WINDOWS
+typedef wchar_t KDUPCHAR;
+# define KDUP_T(a_sz)                       L ## a_sz
+# define KDUP_PATH_PRI                      "ls"
+# define KDUP_CHAR_PRI                      "lc"
+# define KDUP_STRLEN(a_psz)                 wcslen(a_psz)
+# define KDUP_STRCMP(a_psz1, a_psz2)        wcscmp(a_psz1, a_psz2)
+# define KDUP_STRTOUL(a_psz, a_ppszEnd)     wcstoul(a_psz, a_ppszEnd, 0)
+# define KDUP_FTS_OPEN(a_papszArgs, a_fOpt) nt_fts_openw(a_papszArgs, a_fOpt, NULL /*pfnCompare*/)
+# define KDUP_FTS_READ(a_pFts)              nt_fts_read(a_pFts)
+# define KDUP_FTS_SET(a_pFts, a_pEnt, a_f)  nt_fts_set(a_pFts, a_pEnt, a_f)
+# define KDUP_FTS_CLOSE(a_pFts)             nt_fts_close(a_pFts)
+# define KDUP_FTS_ACCPATH(a_pEnt)           ((a_pEnt)->fts_wcsaccpath)
+# define KDUP_FTS_STAT(a_pEnt)              (&(a_pEnt)->fts_stat)
+# define KDUP_FTS_DEFAULT_OPTIONS           (FTS_NOCHDIR | FTS_NO_ANSI)
+# define KDUP_STAT_BLOCK_SIZE               BIRD_STAT_BLOCK_SIZE
+# define KDUP_STAT_MTIME_NSEC(a_pSt)         ((a_pSt)->st_mtim.tv_nsec)
+#else
+typedef char KDUPCHAR;
+# define KDUP_T(a_sz)                       a_sz
+# define KDUP_PATH_PRI                      "s"
+# define KDUP_CHAR_PRI                      "c"
+# define KDUP_STRLEN(a_psz)                 strlen(a_psz)
+# define KDUP_STRCMP(a_psz1, a_psz2)        strcmp(a_psz1, a_psz2)
+# define KDUP_STRTOUL(a_psz, a_ppszEnd)     strtoul(a_psz, a_ppszEnd, 0)
+# define KDUP_FTS_OPEN(a_papszArgs, a_fOpt) fts_open(a_papszArgs, a_fOpt, NULL /*pfnCompare*/)
+# define KDUP_FTS_READ(a_pFts)              fts_read(a_pFts)
+# define KDUP_FTS_SET(a_pFts, a_pEnt, a_f)  fts_set(a_pFts, a_pEnt, a_f)
+# define KDUP_FTS_CLOSE(a_pFts)             fts_close(a_pFts)
+# define KDUP_FTS_ACCPATH(a_pEnt)           ((a_pEnt)->fts_accpath)
+# define KDUP_FTS_STAT(a_pEnt)              ((a_pEnt)->fts_statp)
+# define KDUP_FTS_DEFAULT_OPTIONS           (FTS_NOCHDIR | FTS_PHYSICAL)
+# define KDUP_STAT_BLOCK_SIZE               512
+# if defined(KBUILD_OS_DARWIN)
+#  define KDUP_STAT_MTIME_NSEC(a_pSt)        ((a_pSt)->st_mtimespec.tv_nsec)
+# elif defined(KBUILD_OS_LINUX) || defined(KBUILD_OS_FREEBSD) || defined(KBUILD_OS_SOLARIS)
+#  define KDUP_STAT_MTIME_NSEC(a_pSt)        ((a_pSt)->st_mtim.tv_nsec)
+# else
+#  define KDUP_STAT_MTIME_NSEC(a_pSt)        0
+# endif
+#endif
+/** @} */
 
 
 /*********************************************************************************************************************************
@@ -48,7 +114,7 @@
 *********************************************************************************************************************************/
 /**
  * The key is made up of two cryptographic hashes, collisions are
- * highly unlikely (once SHA2 is implemented).
+ * highly unlikely.
  */
 typedef struct KDUPFILENODEKEY
 {
@@ -77,6 +143,23 @@ typedef struct KDUPFILENODE
     KU64            uInode;
     /** The device number. */
     KU64            uDev;
+    /** The file size. */
+    KU64            cbFile;
+    /** The modification time, seconds part. */
+    KI64            tMTimeSec;
+    /** The modification time, nanoseconds part (0 if not available). */
+    KU32            uMTimeNsec;
+    /** The disk space allocated to the file. */
+    KU64            cbAllocated;
+    /** The hard link count of the file. */
+    KU32            cLinks;
+    /** The number of names we've found for the file, i.e. this one plus the
+     * pNextHardLink list, not counting symbolic links. */
+    KU32            cNames;
+    /** The order we found the files in. */
+    KU64            iSeq;
+    /** Set if we got here by following a symbolic link. */
+    KBOOL           fViaSymlink;
 
     /** Pointer to next hard linked node (same inode and udev values). */
     PKDUPFILENODE   pNextHardLink;
@@ -84,9 +167,11 @@ typedef struct KDUPFILENODE
     PKDUPFILENODE   pNextDup;
     /** Pointer to next duplicate node on the global list. */
     PKDUPFILENODE   pNextGlobalDup;
+    /** Pointer to the next file with the same size (KDUPSIZENODE::pFileHead). */
+    PKDUPFILENODE   pNextSameSize;
 
     /** The path to this file (variable size). */
-    wchar_t         wszPath[1];
+    KDUPCHAR        szPath[1];
 } KDUPFILENODE;
 
 /*#define KAVL_EQUAL_ALLOWED*/
@@ -100,20 +185,24 @@ typedef struct KDUPFILENODE
 #define KAVL_FN(name)           kDupFileTree_ ## name
 #define KAVL_TYPE(prefix,name)  prefix ## KDUPFILENODE ## name
 #define KAVL_INT(name)          KDUPFILENODEINT ## name
-#define KAVL_DECL(rettype)      static rettype
+#ifdef __GNUC__ /* kAvlBase.h always instantiates Remove, which we don't need. */
+# define KAVL_DECL(rettype)     static __attribute__((__unused__)) rettype
+#else
+# define KAVL_DECL(rettype)     static rettype
+#endif
 #define KAVL_G(key1, key2)      ( memcmp(&(key1), &(key2), sizeof(KDUPFILENODEKEY)) >  0 )
 #define KAVL_E(key1, key2)      ( memcmp(&(key1), &(key2), sizeof(KDUPFILENODEKEY)) == 0 )
 #define KAVL_NE(key1, key2)     ( memcmp(&(key1), &(key2), sizeof(KDUPFILENODEKEY)) != 0 )
 
 #define register
 #include <k/kAvlTmpl/kAvlBase.h>
-#include <k/kAvlTmpl/kAvlDoWithAll.h>
+//#include <k/kAvlTmpl/kAvlDoWithAll.h> - unused
 //#include <k/kAvlTmpl/kAvlEnum.h> - busted
 #include <k/kAvlTmpl/kAvlGet.h>
-#include <k/kAvlTmpl/kAvlGetBestFit.h>
-#include <k/kAvlTmpl/kAvlGetWithParent.h>
-#include <k/kAvlTmpl/kAvlRemove2.h>
-#include <k/kAvlTmpl/kAvlRemoveBestFit.h>
+//#include <k/kAvlTmpl/kAvlGetBestFit.h> - unused
+//#include <k/kAvlTmpl/kAvlGetWithParent.h> - unused
+//#include <k/kAvlTmpl/kAvlRemove2.h> - unused
+//#include <k/kAvlTmpl/kAvlRemoveBestFit.h> - unused
 #include <k/kAvlTmpl/kAvlUndef.h>
 #undef register
 
@@ -133,10 +222,14 @@ typedef struct KDUPSIZENODE
     PKDUPSIZENODE   mpRight;
     /** Tree height (hmm). */
     KU8             mHeight;
-    /** Number of files. */
+    /** Number of files on the pFileHead list. */
     KU32            cFiles;
-    /** Tree with same sized files.
-     * When cFiles is 1 the root node does not have hashes calculated yet.  */
+    /** The files with this size in the order we found them.
+     * Hardlinked files are moved off this list by kDupPrepareSize. */
+    PKDUPFILENODE   pFileHead;
+    /** Where to append the next file to the pFileHead list. */
+    PKDUPFILENODE  *ppFileTail;
+    /** Tree with same sized files, populated by kDupFindDuplicates. */
     KDUPFILENODEROOT FileRoot;
 } KDUPSIZENODE;
 
@@ -151,19 +244,45 @@ typedef struct KDUPSIZENODE
 #define KAVL_FN(name)           kDupSizeTree_ ## name
 #define KAVL_TYPE(prefix,name)  prefix ## KDUPSIZENODE ## name
 #define KAVL_INT(name)          KDUPSIZENODEINT ## name
-#define KAVL_DECL(rettype)      static rettype
+#ifdef __GNUC__ /* kAvlBase.h always instantiates Remove, which we don't need. */
+# define KAVL_DECL(rettype)     static __attribute__((__unused__)) rettype
+#else
+# define KAVL_DECL(rettype)     static rettype
+#endif
 
 #include <k/kAvlTmpl/kAvlBase.h>
 #include <k/kAvlTmpl/kAvlDoWithAll.h>
 //#include <k/kAvlTmpl/kAvlEnum.h> - busted
 #include <k/kAvlTmpl/kAvlGet.h>
-#include <k/kAvlTmpl/kAvlGetBestFit.h>
-#include <k/kAvlTmpl/kAvlGetWithParent.h>
-#include <k/kAvlTmpl/kAvlRemove2.h>
-#include <k/kAvlTmpl/kAvlRemoveBestFit.h>
+//#include <k/kAvlTmpl/kAvlGetBestFit.h> - unused
+//#include <k/kAvlTmpl/kAvlGetWithParent.h> - unused
+//#include <k/kAvlTmpl/kAvlRemove2.h> - unused
+//#include <k/kAvlTmpl/kAvlRemoveBestFit.h> - unused
 #include <k/kAvlTmpl/kAvlUndef.h>
 
 
+/**
+ * The files that needs hashing, shared by the hashing threads.
+ */
+typedef struct KDUPHASHQUEUE
+{
+    /** Array of files to hash. */
+    PKDUPFILENODE  *papFiles;
+    /** Number of files in the array. */
+    KSIZE           cFiles;
+    /** Number of array entries allocated. */
+    KSIZE           cAllocated;
+    /** The next file to pick up. */
+    KSIZE           iNext;
+#ifdef KDUP_WITH_THREADS
+    /** Protects iNext. */
+    pthread_mutex_t Mtx;
+#endif
+} KDUPHASHQUEUE;
+/** Pointer to the hashing queue. */
+typedef KDUPHASHQUEUE *PKDUPHASHQUEUE;
+
+
 /*********************************************************************************************************************************
 *   Global Variables                                                                                                             *
 *********************************************************************************************************************************/
@@ -182,9 +301,19 @@ static KU64     g_cbMinFileSize                 = 1;
 /** Maximum file size to care about.   */
 static KU64     g_cbMaxFileSize                 = KU64_MAX;
 
+/** The max number of hashing threads, 0 for one per CPU. */
+static unsigned g_cMaxHashThreads               = 0;
+
 /** The root of the size tree.   */
 static KDUPSIZENODEROOT g_SizeRoot;
 
+/** The files that needs hashing. */
+static KDUPHASHQUEUE    g_HashQueue;
+/** Sorting buffer used by kDupPrepareSize. */
+static PKDUPFILENODE   *g_papSortBuf            = NULL;
+/** Number of entries allocated for g_papSortBuf. */
+static KSIZE            g_cSortBufAllocated     = 0;
+
 /** Global list of duplicate file with duplicates.
  * @remarks This only contains the files in the hash tree, not the ones on
  *          the KDUPFILENODE::pNextDup list. */
@@ -194,14 +323,21 @@ static PKDUPFILENODE   *g_ppNextDuplicate       = &g_pDuplicateHead;
 
 /** Number of files we're tracking. */
 static KU64             g_cFiles                = 0;
-/** Number of hardlinked files or files entered more than once. */
+/** Number of hardlinked files or files entered more than once, not counting
+ * names reached via symbolic links. */
 static KU64             g_cHardlinked           = 0;
-/** Number of duplicates files (not hardlinked). */
+/** Number of files that had to be hashed. */
+static KU64             g_cHashed               = 0;
+/** Number of duplicates file names (not hardlinked, not symbolic links). */
 static KU64             g_cDuplicates           = 0;
-/** Number of duplicates files that can be hardlinked. */
+/** Number of duplicates file names that can be hardlinked, i.e. what
+ * --hardlink-duplicates will replace (g_cLinked) unless something fails. */
 static KU64             g_cDuplicatesSaved      = 0;
-/** Size that could be saved if the duplicates were hardlinked. */
+/** Size that could be saved if the duplicates were hardlinked.
+ * Only counts files where we've found all the names (hard links). */
 static KU64             g_cbDuplicatesSaved     = 0;
+/** Number of file names replaced by hard links (or that would be). */
+static KU64             g_cLinked               = 0;
 
 
 
@@ -216,7 +352,7 @@ static void *kDupAlloc(KSIZE cb)
     void *pvRet = malloc(cb);
     if (pvRet)
         return pvRet;
-    fprintf(stderr, "kDeDup: error: out of memory! (cb=%#z)\n", cb);
+    fprintf(stderr, "kDeDup: error: out of memory! (cb=%#lx)\n", (unsigned long)cb);
     return NULL;
 }
 
@@ -224,83 +360,121 @@ static void *kDupAlloc(KSIZE cb)
 #define kDupFree(ptr) free(ptr)
 
 
-static void kDupHashFile(PKDUPFILENODE pFileNode, FTSENT *pFtsEnt)
+/**
+ * Calculates the digests of a file.
+ *
+ * If the file cannot be read, the digests are faked such that the file will
+ * not match any other file.
+ *
+ * @param   pFileNode       The file.
+ * @param   pbBuf           Read buffer of KDUP_HASH_BUF_SIZE bytes.
+ */
+static void kDupHashFile(PKDUPFILENODE pFileNode, KU8 *pbBuf)
 {
     KSIZE           i;
     PKDUPFILENODE  *ppHash;
 
+    /*
+     * Init the hash calculation contexts.
+     */
+    struct MD5Context       Md5Ctx;
+    struct SHA256Context    Sha256Ctx;
+    MD5Init(&Md5Ctx);
+    SHA256Init(&Sha256Ctx);
+
+#ifdef KBUILD_OS_WINDOWS
     /*
      * Open the file.
      */
-    HANDLE hFile;
-    if (pFtsEnt && pFtsEnt->fts_parent && pFtsEnt->fts_parent->fts_dirfd != INVALID_HANDLE_VALUE)
-        hFile = birdOpenFileExW(pFtsEnt->fts_parent->fts_dirfd, pFtsEnt->fts_wcsname,
-                                FILE_READ_DATA | SYNCHRONIZE,
-                                FILE_ATTRIBUTE_NORMAL,
-                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-                                FILE_OPEN,
-                                FILE_NON_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT | FILE_SYNCHRONOUS_IO_NONALERT,
-                                OBJ_CASE_INSENSITIVE);
-    else
-        hFile = birdOpenFileExW(NULL, pFileNode->wszPath,
-                                FILE_READ_DATA | SYNCHRONIZE,
-                                FILE_ATTRIBUTE_NORMAL,
-                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-                                FILE_OPEN,
-                                FILE_NON_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT | FILE_SYNCHRONOUS_IO_NONALERT,
-                                OBJ_CASE_INSENSITIVE);
-    if (hFile != INVALID_HANDLE_VALUE)
     {
-        /*
-         * Init the hash calculation contexts.
-         */
-        struct MD5Context Md5Ctx;
-        //SHA256CONTEXT Sha256Ctx;
-        MD5Init(&Md5Ctx);
-        //Sha256Init(&Sha256Ctx);
-
-        /*
-         * Process the file chunk by chunk.
-         *
-         * We could complicate this by memory mapping medium sized files, but
-         * those kind of complications can wait.
-         */
-        for (;;)
+        HANDLE hFile = birdOpenFileExW(NULL, pFileNode->szPath,
+                                       FILE_READ_DATA | SYNCHRONIZE,
+                                       FILE_ATTRIBUTE_NORMAL,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                       FILE_OPEN,
+                                       FILE_NON_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT | FILE_SYNCHRONOUS_IO_NONALERT,
+                                       OBJ_CASE_INSENSITIVE);
+        if (hFile != INVALID_HANDLE_VALUE)
         {
-            static KU8          s_abBuffer[2*1024*1024];
-            MY_NTSTATUS         rcNt;
-            MY_IO_STATUS_BLOCK  Ios;
-            Ios.Information = -1;
-            Ios.u.Status    = -1;
-            rcNt = g_pfnNtReadFile(hFile, NULL /*hEvent*/, NULL /*pfnApc*/, NULL /*pvApcCtx*/,
-                                   &Ios, s_abBuffer, sizeof(s_abBuffer), NULL /*poffFile*/, NULL /*puKey*/);
-            if (MY_NT_SUCCESS(rcNt))
-            {
-                MD5Update(&Md5Ctx, s_abBuffer, (unsigned)Ios.Information);
-                //SHA256Update(&Sha256Ctx, s_abBuffer, Ios.Information);
-            }
-            else if (rcNt != STATUS_END_OF_FILE)
+            /*
+             * Process the file chunk by chunk.
+             *
+             * We could complicate this by memory mapping medium sized files, but
+             * those kind of complications can wait.
+             */
+            for (;;)
             {
-                fprintf(stderr, "kDeDup: warning: Error reading '%ls': %#x\n", pFileNode->wszPath, rcNt);
-                break;
+                MY_NTSTATUS         rcNt;
+                MY_IO_STATUS_BLOCK  Ios;
+                Ios.Information = -1;
+                Ios.u.Status    = -1;
+                rcNt = g_pfnNtReadFile(hFile, NULL /*hEvent*/, NULL /*pfnApc*/, NULL /*pvApcCtx*/,
+                                       &Ios, pbBuf, KDUP_HASH_BUF_SIZE, NULL /*poffFile*/, NULL /*puKey*/);
+                if (MY_NT_SUCCESS(rcNt))
+                {
+                    MD5Update(&Md5Ctx, pbBuf, (unsigned)Ios.Information);
+                    SHA256Update(&Sha256Ctx, pbBuf, (unsigned)Ios.Information);
+                }
+                else if (rcNt != STATUS_END_OF_FILE)
+                {
+                    fprintf(stderr, "kDeDup: warning: Error reading '%ls': %#x\n", pFileNode->szPath, rcNt);
+                    break;
+                }
+
+                /* Check for end of file. */
+                if (   rcNt == STATUS_END_OF_FILE
+                    || Ios.Information < KDUP_HASH_BUF_SIZE)
+                {
+                    MD5Final(pFileNode->mKey.abMd5, &Md5Ctx);
+                    SHA256Final(pFileNode->mKey.abSha2, &Sha256Ctx);
+
+                    birdCloseFile(hFile);
+                    return;
+                }
             }
 
-            /* Check for end of file. */
-            if (   rcNt == STATUS_END_OF_FILE
-                || Ios.Information < sizeof(s_abBuffer))
+            birdCloseFile(hFile);
+        }
+        else
+            fprintf(stderr, "kDeDup: warning: Failed to open '%ls': %s (%d)\n", pFileNode->szPath, strerror(errno), errno);
+    }
+#else
+    /*
+     * Open the file and process it chunk by chunk.
+     */
+    {
+        int fd = open(pFileNode->szPath, O_RDONLY);
+        if (fd >= 0)
+        {
+            for (;;)
             {
-                MD5Final(pFileNode->mKey.abMd5, &Md5Ctx);
-                //Sha256Final(pFileNode->mKey.abSha2, &Sha256Ctx);
+                long cbRead = read(fd, pbBuf, KDUP_HASH_BUF_SIZE);
+                if (cbRead > 0)
+                {
+                    MD5Update(&Md5Ctx, pbBuf, (unsigned)cbRead);
+                    SHA256Update(&Sha256Ctx, pbBuf, (unsigned)cbRead);
+                }
+                else if (cbRead == 0)
+                {
+                    MD5Final(pFileNode->mKey.abMd5, &Md5Ctx);
+                    SHA256Final(pFileNode->mKey.abSha2, &Sha256Ctx);
 
-                birdCloseFile(hFile);
-                return;
+                    close(fd);
+                    return;
+                }
+                else if (errno != EINTR)
+                {
+                    fprintf(stderr, "kDeDup: warning: Error reading '%s': %s (%d)\n", pFileNode->szPath, strerror(errno), errno);
+                    break;
+                }
             }
-        }
 
-        birdCloseFile(hFile);
+            close(fd);
+        }
+        else
+            fprintf(stderr, "kDeDup: warning: Failed to open '%s': %s (%d)\n", pFileNode->szPath, strerror(errno), errno);
     }
-    else
-        fprintf(stderr, "kDeDup: warning: Failed to open '%ls': %s (%d)\n", pFileNode->wszPath, strerror(errno), errno);
+#endif
 
     /*
      * Hashing failed.  We fake the digests by repeating the node pointer value
@@ -315,7 +489,10 @@ static void kDupHashFile(PKDUPFILENODE pFileNode, FTSENT *pFtsEnt)
 
 
 /**
- * Deal with one file, adding it to the tree if it matches the criteria.
+ * Deal with one file, adding it to the size tree if it matches the criteria.
+ *
+ * Hashing is deferred till we've seen all the files, so only files sharing
+ * their size with other files get hashed.
  *
  * @returns 0 on success, non-zero on failure.
  * @param   pFtsEnt         The FTS entry for the file.
@@ -325,23 +502,22 @@ static int kDupDoFile(FTSENT *pFtsEnt)
     KU64 cbFile;
 
     if (g_cVerbosity >= 2)
-        printf("debug: kDupDoFile(%ls)\n", pFtsEnt->fts_wcsaccpath);
+        printf("debug: kDupDoFile(%" KDUP_PATH_PRI ")\n", KDUP_FTS_ACCPATH(pFtsEnt));
 
     /*
      * Check that it's within the size range.
      */
-    cbFile = pFtsEnt->fts_stat.st_size;
+    cbFile = KDUP_FTS_STAT(pFtsEnt)->st_size;
     if (   cbFile >= g_cbMinFileSize
         && cbFile <= g_cbMaxFileSize)
     {
         /*
-         * Start out treating this like a unique file with a unique size, i.e.
-         * allocate all the structures we might possibly need.
+         * Create the file node.
          */
-        size_t        cbAccessPath = (wcslen(pFtsEnt->fts_wcsaccpath) + 1) * sizeof(wchar_t);
+        size_t        cbAccessPath = (KDUP_STRLEN(KDUP_FTS_ACCPATH(pFtsEnt)) + 1) * sizeof(KDUPCHAR);
         PKDUPFILENODE pFileNode = (PKDUPFILENODE)kDupAlloc(sizeof(*pFileNode) + cbAccessPath);
-        PKDUPSIZENODE pSizeNode = (PKDUPSIZENODE)kDupAlloc(sizeof(*pSizeNode));
-        if (!pFileNode || !pSizeNode)
+        PKDUPSIZENODE pSizeNode;
+        if (!pFileNode)
             return 3;
         g_cFiles++;
 
@@ -349,125 +525,77 @@ static int kDupDoFile(FTSENT *pFtsEnt)
         pFileNode->pNextHardLink    = NULL;
         pFileNode->pNextDup         = NULL;
         pFileNode->pNextGlobalDup   = NULL;
-        pFileNode->uDev             = pFtsEnt->fts_stat.st_dev;
-        pFileNode->uInode           = pFtsEnt->fts_stat.st_ino;
-        memcpy(pFileNode->wszPath, pFtsEnt->fts_wcsaccpath, cbAccessPath);
-
-        pSizeNode->mKey = cbFile;
-        pSizeNode->cFiles = 1;
-        kDupFileTree_Init(&pSizeNode->FileRoot);
-        kDupFileTree_Insert(&pSizeNode->FileRoot, pFileNode);
+        pFileNode->pNextSameSize    = NULL;
+        pFileNode->uDev             = KDUP_FTS_STAT(pFtsEnt)->st_dev;
+        pFileNode->uInode           = KDUP_FTS_STAT(pFtsEnt)->st_ino;
+        pFileNode->cbFile           = cbFile;
+        pFileNode->tMTimeSec        = KDUP_FTS_STAT(pFtsEnt)->st_mtime;
+        pFileNode->uMTimeNsec       = (KU32)KDUP_STAT_MTIME_NSEC(KDUP_FTS_STAT(pFtsEnt));
+        pFileNode->cbAllocated      = (KU64)KDUP_FTS_STAT(pFtsEnt)->st_blocks * KDUP_STAT_BLOCK_SIZE;
+        pFileNode->cLinks           = (KU32)KDUP_FTS_STAT(pFtsEnt)->st_nlink;
+        pFileNode->fViaSymlink      = pFtsEnt->fts_number != 0; /* see FTS_SL in kDupReadAll */
+        pFileNode->cNames           = !pFileNode->fViaSymlink;
+        pFileNode->iSeq             = g_cFiles;
+        memcpy(pFileNode->szPath, KDUP_FTS_ACCPATH(pFtsEnt), cbAccessPath);
 
         /*
-         * Try insert it.
+         * Append it to the list of files with this size.
          */
-        if (kDupSizeTree_Insert(&g_SizeRoot, pSizeNode))
-        { /* unique size, nothing more to do for now. */ }
-        else
+        pSizeNode = kDupSizeTree_Get(&g_SizeRoot, cbFile);
+        if (!pSizeNode)
         {
-            /*
-             * More than one file with this size.  We may need to hash the
-             * hash the file we encountered with this size, if this is the
-             * second one.  In that case we should check for hardlinked or
-             * double entering of the file first as well.
-             */
-            kDupFree(pSizeNode);
-            pSizeNode = kDupSizeTree_Get(&g_SizeRoot, cbFile);
-            if (pSizeNode->cFiles == 1)
-            {
-                PKDUPFILENODE pFirstFileNode = pSizeNode->FileRoot.mpRoot;
-                if (   pFirstFileNode->uInode == pFileNode->uInode
-                    && pFileNode->uInode != 0
-                    && pFirstFileNode->uDev   == pFileNode->uDev)
-                {
-                    pFileNode->pNextHardLink      = pFirstFileNode->pNextHardLink;
-                    pFirstFileNode->pNextHardLink = pFileNode;
-                    if (g_cVerbosity >= 1)
-                        printf("Found hardlinked: '%ls' -> '%ls' (ino:%#" KX64_PRI " dev:%#" KX64_PRI ")\n",
-                               pFileNode->wszPath, pFirstFileNode->wszPath, pFileNode->uInode, pFileNode->uDev);
-                    g_cHardlinked += 1;
-                    return 0;
-                }
-
-                kDupHashFile(pFirstFileNode, NULL);
-            }
-            kDupHashFile(pFileNode, pFtsEnt);
-
-            if (kDupFileTree_Insert(&pSizeNode->FileRoot, pFileNode))
-            {  /* great, unique content */ }
-            else
-            {
-                /*
-                 * Duplicate content.  Could be hardlinked or a duplicate entry.
-                 */
-                PKDUPFILENODE pDupFileNode = kDupFileTree_Get(&pSizeNode->FileRoot, pFileNode->mKey);
-                if (   pDupFileNode->uInode == pFileNode->uInode
-                    && pFileNode->uInode != 0
-                    && pDupFileNode->uDev   == pFileNode->uDev)
-                {
-                    pFileNode->pNextHardLink = pDupFileNode->pNextHardLink;
-                    pDupFileNode->pNextHardLink = pFileNode;
-                    if (g_cVerbosity >= 1)
-                        printf("Found hardlinked: '%ls' -> '%ls' (ino:%#" KX64_PRI " dev:%#" KX64_PRI ")\n",
-                               pFileNode->wszPath, pDupFileNode->wszPath, pFileNode->uInode, pFileNode->uDev);
-                    g_cHardlinked += 1;
-                }
-                else
-                {
-                    KBOOL fDifferentDev;
-
-                    /* Genuinly duplicate (or inode numbers are busted). */
-                    if (!pDupFileNode->pNextDup)
-                    {
-                        *g_ppNextDuplicate = pDupFileNode;
-                        g_ppNextDuplicate = &pDupFileNode->pNextGlobalDup;
-                    }
-
-                    /* The list is sorted by device to better facility hardlinking later. */
-                    while (   (fDifferentDev = pDupFileNode->uDev != pFileNode->uDev)
-                           && pDupFileNode->pNextDup)
-                        pDupFileNode = pDupFileNode->pNextDup;
-
-                    pFileNode->pNextDup = pDupFileNode->pNextDup;
-                    pDupFileNode->pNextDup = pFileNode;
-
-                    g_cDuplicates += 1;
-                    if (!fDifferentDev)
-                    {
-                        g_cDuplicatesSaved += 1;
-                        g_cbDuplicatesSaved += pFtsEnt->fts_stat.st_blocks * BIRD_STAT_BLOCK_SIZE;
-                        if (g_cVerbosity >= 1)
-                            printf("Found duplicate: '%ls' <-> '%ls'\n", pFileNode->wszPath, pDupFileNode->wszPath);
-                    }
-                    else if (g_cVerbosity >= 1)
-                        printf("Found duplicate: '%ls' <-> '%ls' (devices differ).\n", pFileNode->wszPath, pDupFileNode->wszPath);
-                }
-            }
+            pSizeNode = (PKDUPSIZENODE)kDupAlloc(sizeof(*pSizeNode));
+            if (!pSizeNode)
+                return 3;
+            pSizeNode->mKey       = cbFile;
+            pSizeNode->cFiles     = 0;
+            pSizeNode->pFileHead  = NULL;
+            pSizeNode->ppFileTail = &pSizeNode->pFileHead;
+            kDupFileTree_Init(&pSizeNode->FileRoot);
+            kDupSizeTree_Insert(&g_SizeRoot, pSizeNode);
         }
+        *pSizeNode->ppFileTail = pFileNode;
+        pSizeNode->ppFileTail  = &pFileNode->pNextSameSize;
+        pSizeNode->cFiles++;
     }
     else if (g_cVerbosity >= 1)
-        printf("Skipping '%ls' because %" KU64_PRI " bytes is outside the size range.\n",
-               pFtsEnt->fts_wcsaccpath, cbFile);
+        printf("Skipping '%" KDUP_PATH_PRI "' because %" KU64_PRI " bytes is outside the size range.\n",
+               KDUP_FTS_ACCPATH(pFtsEnt), cbFile);
     return 0;
 }
 
 
+#ifndef KBUILD_OS_WINDOWS
+/**
+ * Checks if a symbolic link FTS entry points to a directory.
+ *
+ * @returns K_TRUE if directory, K_FALSE if not or if the target is missing.
+ * @param   pFtsEnt         The FTS entry for the symbolic link.
+ */
+static KBOOL kDupIsDirSymlink(FTSENT *pFtsEnt)
+{
+    struct stat St;
+    return stat(pFtsEnt->fts_accpath, &St) == 0 && S_ISDIR(St.st_mode);
+}
+#endif
+
+
 /**
- * Process the non-option arguments, creating the file tree.
+ * Process the non-option arguments, creating the size tree.
  *
  * @returns 0 on success, non-zero on failure.
- * @param   papwszFtsArgs   The input in argv style.
+ * @param   papszFtsArgs    The input in argv style.
  * @param   fFtsOptions     The FTS options.
  */
-static int kDupReadAll(wchar_t **papwszFtsArgs, unsigned fFtsOptions)
+static int kDupReadAll(KDUPCHAR **papszFtsArgs, unsigned fFtsOptions)
 {
     int  rcExit = 0;
-    FTS *pFts = nt_fts_openw(papwszFtsArgs, fFtsOptions, NULL /*pfnCompare*/);
+    FTS *pFts = KDUP_FTS_OPEN(papszFtsArgs, fFtsOptions);
     if (pFts != NULL)
     {
         for (;;)
         {
-            FTSENT *pFtsEnt = nt_fts_read(pFts);
+            FTSENT *pFtsEnt = KDUP_FTS_READ(pFts);
             if (pFtsEnt)
             {
                 switch (pFtsEnt->fts_info)
@@ -482,10 +610,10 @@ static int kDupReadAll(wchar_t **papwszFtsArgs, unsigned fFtsOptions)
                         if (   g_fRecursive
                             || pFtsEnt->fts_level == FTS_ROOTLEVEL) /* enumerate dirs on the command line */
                             continue;
-                        rcExit = nt_fts_set(pFts, pFtsEnt, FTS_SKIP);
+                        rcExit = KDUP_FTS_SET(pFts, pFtsEnt, FTS_SKIP);
                         if (rcExit == 0)
                             continue;
-                        fprintf(stderr, "kDeDup: internal error: nt_fts_set failed!\n");
+                        fprintf(stderr, "kDeDup: internal error: fts_set failed!\n");
                         rcExit = 1;
                         break;
 
@@ -496,36 +624,40 @@ static int kDupReadAll(wchar_t **papwszFtsArgs, unsigned fFtsOptions)
                     case FTS_SL:
                         /* The nice thing on windows is that we already know whether it's a
                            directory or file when encountering the symbolic link. */
+#ifdef KBUILD_OS_WINDOWS
                         if (   (pFtsEnt->fts_stat.st_isdirsymlink ? g_fRecursiveViaSymlinks : g_fFollowSymlinkedFiles)
+#else
+                        if (   (kDupIsDirSymlink(pFtsEnt) ? g_fRecursiveViaSymlinks : g_fFollowSymlinkedFiles)
+#endif
                             &&  pFtsEnt->fts_number == 0)
                         {
                             pFtsEnt->fts_number++;
-                            rcExit = nt_fts_set(pFts, pFtsEnt, FTS_FOLLOW);
+                            rcExit = KDUP_FTS_SET(pFts, pFtsEnt, FTS_FOLLOW);
                             if (rcExit == 0)
                                 continue;
-                            fprintf(stderr, "kDeDup: internal error: nt_fts_set failed!\n");
+                            fprintf(stderr, "kDeDup: internal error: fts_set failed!\n");
                             rcExit = 1;
                         }
                         break;
 
                     case FTS_DC:
-                        fprintf(stderr, "kDeDup: warning: Ignoring cycle '%ls'!\n", pFtsEnt->fts_wcsaccpath);
+                        fprintf(stderr, "kDeDup: warning: Ignoring cycle '%" KDUP_PATH_PRI "'!\n", KDUP_FTS_ACCPATH(pFtsEnt));
                         continue;
 
                     case FTS_NS:
-                        fprintf(stderr, "kDeDup: warning: Failed to stat '%ls': %s (%d)\n",
-                                pFtsEnt->fts_wcsaccpath, strerror(pFtsEnt->fts_errno), pFtsEnt->fts_errno);
+                        fprintf(stderr, "kDeDup: warning: Failed to stat '%" KDUP_PATH_PRI "': %s (%d)\n",
+                                KDUP_FTS_ACCPATH(pFtsEnt), strerror(pFtsEnt->fts_errno), pFtsEnt->fts_errno);
                         continue;
 
                     case FTS_DNR:
-                        fprintf(stderr, "kDeDup: error: Error reading directory '%ls': %s (%d)\n",
-                                pFtsEnt->fts_wcsaccpath, strerror(pFtsEnt->fts_errno), pFtsEnt->fts_errno);
+                        fprintf(stderr, "kDeDup: error: Error reading directory '%" KDUP_PATH_PRI "': %s (%d)\n",
+                                KDUP_FTS_ACCPATH(pFtsEnt), strerror(pFtsEnt->fts_errno), pFtsEnt->fts_errno);
                         rcExit = 1;
                         break;
 
                     case FTS_ERR:
-                        fprintf(stderr, "kDeDup: error: Error on '%ls': %s (%d)\n",
-                                pFtsEnt->fts_wcsaccpath, strerror(pFtsEnt->fts_errno), pFtsEnt->fts_errno);
+                        fprintf(stderr, "kDeDup: error: Error on '%" KDUP_PATH_PRI "': %s (%d)\n",
+                                KDUP_FTS_ACCPATH(pFtsEnt), strerror(pFtsEnt->fts_errno), pFtsEnt->fts_errno);
                         rcExit = 1;
                         break;
 
@@ -537,8 +669,8 @@ static int kDupReadAll(wchar_t **papwszFtsArgs, unsigned fFtsOptions)
 
                     /* Not supposed to get here. */
                     default:
-                        fprintf(stderr, "kDeDup: internal error: fts_info=%d - '%ls'\n",
-                                pFtsEnt->fts_info, pFtsEnt->fts_wcsaccpath);
+                        fprintf(stderr, "kDeDup: internal error: fts_info=%d - '%" KDUP_PATH_PRI "'\n",
+                                pFtsEnt->fts_info, KDUP_FTS_ACCPATH(pFtsEnt));
                         rcExit = 1;
                         break;
                 }
@@ -547,21 +679,21 @@ static int kDupReadAll(wchar_t **papwszFtsArgs, unsigned fFtsOptions)
                 break;
             else
             {
-                fprintf(stderr, "kDeDup: error: nt_fts_read failed: %s (%d)\n", strerror(errno), errno);
+                fprintf(stderr, "kDeDup: error: fts_read failed: %s (%d)\n", strerror(errno), errno);
                 rcExit = 1;
                 break;
             }
         }
 
-        if (nt_fts_close(pFts) != 0)
+        if (KDUP_FTS_CLOSE(pFts) != 0)
         {
-            fprintf(stderr, "kDeDup: error: nt_fts_close failed: %s (%d)\n", strerror(errno), errno);
+            fprintf(stderr, "kDeDup: error: fts_close failed: %s (%d)\n", strerror(errno), errno);
             rcExit = 1;
         }
     }
     else
     {
-        fprintf(stderr, "kDeDup: error: nt_fts_openw failed: %s (%d)\n", strerror(errno), errno);
+        fprintf(stderr, "kDeDup: error: fts_open failed: %s (%d)\n", strerror(errno), errno);
         rcExit = 1;
     }
 
@@ -569,10 +701,437 @@ static int kDupReadAll(wchar_t **papwszFtsArgs, unsigned fFtsOptions)
 }
 
 
+/**
+ * qsort callback that sorts file nodes by device and inode, putting real names
+ * before symbolic links and otherwise keeping the order we found them in.
+ */
+static int kDupCompareInodes(const void *pv1, const void *pv2)
+{
+    PKDUPFILENODE pFile1 = *(PKDUPFILENODE const *)pv1;
+    PKDUPFILENODE pFile2 = *(PKDUPFILENODE const *)pv2;
+    if (pFile1->uDev != pFile2->uDev)
+        return pFile1->uDev < pFile2->uDev ? -1 : 1;
+    if (pFile1->uInode != pFile2->uInode)
+        return pFile1->uInode < pFile2->uInode ? -1 : 1;
+    if (pFile1->fViaSymlink != pFile2->fViaSymlink)
+        return pFile1->fViaSymlink ? 1 : -1;
+    return pFile1->iSeq < pFile2->iSeq ? -1 : pFile1->iSeq > pFile2->iSeq ? 1 : 0;
+}
+
+
+/**
+ * qsort callback that sorts file nodes in the order we found them.
+ */
+static int kDupCompareSeq(const void *pv1, const void *pv2)
+{
+    PKDUPFILENODE pFile1 = *(PKDUPFILENODE const *)pv1;
+    PKDUPFILENODE pFile2 = *(PKDUPFILENODE const *)pv2;
+    return pFile1->iSeq < pFile2->iSeq ? -1 : pFile1->iSeq > pFile2->iSeq ? 1 : 0;
+}
+
+
+/**
+ * kDupSizeTree_DoWithAll callback that weeds out hardlinked files from a size
+ * bucket and queues the remaining files for hashing if there are two or more
+ * of them.
+ *
+ * @returns 0 on success, non-zero on failure (stops the enumeration).
+ * @param   pSizeNode       The size bucket.
+ * @param   pvUser          Ignored.
+ */
+static int kDupPrepareSize(PKDUPSIZENODE pSizeNode, void *pvUser)
+{
+    PKDUPFILENODE   pFileNode;
+    KSIZE           cFiles;
+    KSIZE           cLeaders;
+    KSIZE           i;
+    (void)pvUser;
+
+    if (pSizeNode->cFiles < 2)
+        return 0;
+
+    /*
+     * Sort the files by inode so hard links to the same file end up next to
+     * each other, then chain them up on the first name we found.
+     */
+    if (pSizeNode->cFiles > g_cSortBufAllocated)
+    {
+        kDupFree(g_papSortBuf);
+        g_cSortBufAllocated = (pSizeNode->cFiles + 63) & ~(KSIZE)63;
+        g_papSortBuf = (PKDUPFILENODE *)kDupAlloc(g_cSortBufAllocated * sizeof(g_papSortBuf[0]));
+        if (!g_papSortBuf)
+        {
+            g_cSortBufAllocated = 0;
+            return 3;
+        }
+    }
+    cFiles = 0;
+    for (pFileNode = pSizeNode->pFileHead; pFileNode != NULL; pFileNode = pFileNode->pNextSameSize)
+        g_papSortBuf[cFiles++] = pFileNode;
+    qsort(g_papSortBuf, cFiles, sizeof(g_papSortBuf[0]), kDupCompareInodes);
+
+    cLeaders = 0;
+    for (i = 0; i < cFiles; i++)
+    {
+        PKDUPFILENODE pFirstFileNode = g_papSortBuf[i];
+        g_papSortBuf[cLeaders++] = pFirstFileNode;
+        while (   i + 1 < cFiles
+               && (pFileNode = g_papSortBuf[i + 1])->uInode == pFirstFileNode->uInode
+               && pFileNode->uInode != 0
+               && pFileNode->uDev   == pFirstFileNode->uDev)
+        {
+            pFileNode->pNextHardLink      = pFirstFileNode->pNextHardLink;
+            pFirstFileNode->pNextHardLink = pFileNode;
+            if (pFileNode->fViaSymlink)
+            {
+                if (g_cVerbosity >= 1)
+                    printf("Found symlinked: '%" KDUP_PATH_PRI "' -> '%" KDUP_PATH_PRI "' (ino:%#" KX64_PRI " dev:%#" KX64_PRI ")\n",
+                           pFileNode->szPath, pFirstFileNode->szPath, pFileNode->uInode, pFileNode->uDev);
+            }
+            else
+            {
+                pFirstFileNode->cNames += 1;
+                if (g_cVerbosity >= 1)
+                    printf("Found hardlinked: '%" KDUP_PATH_PRI "' -> '%" KDUP_PATH_PRI "' (ino:%#" KX64_PRI " dev:%#" KX64_PRI ")\n",
+                           pFileNode->szPath, pFirstFileNode->szPath, pFileNode->uInode, pFileNode->uDev);
+                g_cHardlinked += 1;
+            }
+            i++;
+        }
+    }
+
+    /*
+     * Put the remaining files back on the size list in the order we found
+     * them, and queue them for hashing if there is more than one.
+     */
+    if (cLeaders != cFiles)
+    {
+        qsort(g_papSortBuf, cLeaders, sizeof(g_papSortBuf[0]), kDupCompareSeq);
+        pSizeNode->ppFileTail = &pSizeNode->pFileHead;
+        for (i = 0; i < cLeaders; i++)
+        {
+            *pSizeNode->ppFileTail = g_papSortBuf[i];
+            pSizeNode->ppFileTail  = &g_papSortBuf[i]->pNextSameSize;
+        }
+        *pSizeNode->ppFileTail = NULL;
+        pSizeNode->cFiles = (KU32)cLeaders;
+    }
+
+    if (pSizeNode->cFiles >= 2)
+    {
+        PKDUPHASHQUEUE pQueue = &g_HashQueue;
+        if (pQueue->cFiles + pSizeNode->cFiles > pQueue->cAllocated)
+        {
+            KSIZE           cNew   = (pQueue->cFiles + pSizeNode->cFiles) * 2;
+            PKDUPFILENODE  *papNew = (PKDUPFILENODE *)realloc(pQueue->papFiles, cNew * sizeof(papNew[0]));
+            if (!papNew)
+            {
+                fprintf(stderr, "kDeDup: error: out of memory!\n");
+                return 3;
+            }
+            pQueue->papFiles   = papNew;
+            pQueue->cAllocated = cNew;
+        }
+        for (pFileNode = pSizeNode->pFileHead; pFileNode != NULL; pFileNode = pFileNode->pNextSameSize)
+            pQueue->papFiles[pQueue->cFiles++] = pFileNode;
+    }
+    return 0;
+}
+
+
+/**
+ * Hashing worker, picks files off the queue till it's empty.
+ *
+ * Also called on the main thread.
+ *
+ * @returns NULL.
+ * @param   pvUser          The hashing queue.
+ */
+static void *kDupHashWorker(void *pvUser)
+{
+    PKDUPHASHQUEUE pQueue = (PKDUPHASHQUEUE)pvUser;
+    KU8           *pbBuf  = (KU8 *)kDupAlloc(KDUP_HASH_BUF_SIZE);
+    if (pbBuf)
+    {
+        for (;;)
+        {
+            KSIZE i;
+#ifdef KDUP_WITH_THREADS
+            pthread_mutex_lock(&pQueue->Mtx);
+#endif
+            i = pQueue->iNext;
+            if (i < pQueue->cFiles)
+                pQueue->iNext = i + 1;
+#ifdef KDUP_WITH_THREADS
+            pthread_mutex_unlock(&pQueue->Mtx);
+#endif
+            if (i >= pQueue->cFiles)
+                break;
+            kDupHashFile(pQueue->papFiles[i], pbBuf);
+        }
+        kDupFree(pbBuf);
+    }
+    return NULL;
+}
+
+
+/**
+ * Hashes all the queued files, using several threads when possible.
+ *
+ * @returns 0 on success, non-zero on failure.
+ */
+static int kDupHashAll(void)
+{
+    PKDUPHASHQUEUE pQueue = &g_HashQueue;
+#ifdef KDUP_WITH_THREADS
+    pthread_t   aThreads[KDUP_MAX_THREADS];
+    unsigned    cThreads = 0;
+    long        cMax = g_cMaxHashThreads;
+#endif
+    if (pQueue->cFiles == 0)
+        return 0;
+    pQueue->iNext = 0;
+
+#ifdef KDUP_WITH_THREADS
+    if (cMax == 0)
+        cMax = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cMax > KDUP_MAX_THREADS)
+        cMax = KDUP_MAX_THREADS;
+    if (cMax > (long)pQueue->cFiles)
+        cMax = (long)pQueue->cFiles;
+
+    pthread_mutex_init(&pQueue->Mtx, NULL);
+    while ((long)cThreads + 1 < cMax)   /* the main thread is the last worker */
+    {
+        if (pthread_create(&aThreads[cThreads], NULL, kDupHashWorker, pQueue) != 0)
+            break;
+        cThreads++;
+    }
+#endif
+
+    kDupHashWorker(pQueue);
+
+#ifdef KDUP_WITH_THREADS
+    while (cThreads > 0)
+        pthread_join(aThreads[--cThreads], NULL);
+    pthread_mutex_destroy(&pQueue->Mtx);
+#endif
+
+    /* The workers only give up if they're out of memory. */
+    if (pQueue->iNext < pQueue->cFiles)
+        return 3;
+    g_cHashed = pQueue->cFiles;
+    return 0;
+}
+
+
+/**
+ * kDupSizeTree_DoWithAll callback that enters the hashed files of a size
+ * bucket into the hash tree, recording duplicates.
+ *
+ * @returns 0.
+ * @param   pSizeNode       The size bucket.
+ * @param   pvUser          Ignored.
+ */
+static int kDupFindDuplicates(PKDUPSIZENODE pSizeNode, void *pvUser)
+{
+    PKDUPFILENODE pFileNode;
+    PKDUPFILENODE pNextFileNode;
+    (void)pvUser;
+
+    if (pSizeNode->cFiles < 2)
+        return 0;
+
+    for (pFileNode = pSizeNode->pFileHead; pFileNode != NULL; pFileNode = pNextFileNode)
+    {
+        pNextFileNode = pFileNode->pNextSameSize;
+        if (kDupFileTree_Insert(&pSizeNode->FileRoot, pFileNode))
+        {  /* great, unique content */ }
+        else
+        {
+            /*
+             * Genuinly duplicate.  (Hard links were sorted out by kDupPrepareSize.)
+             */
+            PKDUPFILENODE pDupFileNode = kDupFileTree_Get(&pSizeNode->FileRoot, pFileNode->mKey);
+            KBOOL fDifferentDev;
+
+            if (!pDupFileNode->pNextDup)
+            {
+                *g_ppNextDuplicate = pDupFileNode;
+                g_ppNextDuplicate = &pDupFileNode->pNextGlobalDup;
+            }
+
+            /* The list is sorted by device to better facility hardlinking later. */
+            while (   (fDifferentDev = pDupFileNode->uDev != pFileNode->uDev)
+                   && pDupFileNode->pNextDup)
+                pDupFileNode = pDupFileNode->pNextDup;
+
+            pFileNode->pNextDup = pDupFileNode->pNextDup;
+            pDupFileNode->pNextDup = pFileNode;
+
+            /* Count names like kDupHardlinkDuplicates does (no symlinks). */
+            g_cDuplicates += pFileNode->cNames;
+            if (!fDifferentDev)
+            {
+                g_cDuplicatesSaved += pFileNode->cNames;
+                /* The space is only freed if we replace all the names of the file. */
+                if (pFileNode->cNames >= pFileNode->cLinks)
+                    g_cbDuplicatesSaved += pFileNode->cbAllocated;
+                if (g_cVerbosity >= 1)
+                    printf("Found duplicate: '%" KDUP_PATH_PRI "' <-> '%" KDUP_PATH_PRI "'\n",
+                           pFileNode->szPath, pDupFileNode->szPath);
+            }
+            else if (g_cVerbosity >= 1)
+                printf("Found duplicate: '%" KDUP_PATH_PRI "' <-> '%" KDUP_PATH_PRI "' (devices differ).\n",
+                       pFileNode->szPath, pDupFileNode->szPath);
+        }
+    }
+    return 0;
+}
+
+
+#ifdef KBUILD_OS_WINDOWS
+/**
+ * Replaces one file name with a hard link to the target file.
+ *
+ * @returns 0 on success, 1 on failure, 8 on fatal failure.
+ * @param   pTargetFile     The file to link to.
+ * @param   pwszPath        The name to replace.
+ */
+static int kDupHardlinkFile(PKDUPFILENODE pTargetFile, const wchar_t *pwszPath)
+{
+    /*
+     * Start by renaming the orinal file before we try create the hard link.
+     */
+    static const wchar_t s_wszBackupSuffix[] = L".kDepBackup";
+    wchar_t wszBackup[0x4000];
+    size_t  cwcPath = wcslen(pwszPath);
+    if (cwcPath + sizeof(s_wszBackupSuffix) / sizeof(wchar_t) < K_ELEMENTS(wszBackup))
+    {
+        memcpy(wszBackup, pwszPath, cwcPath * sizeof(wchar_t));
+        memcpy(&wszBackup[cwcPath], s_wszBackupSuffix, sizeof(s_wszBackupSuffix));
+        if (MoveFileW(pwszPath, wszBackup))
+        {
+            if (CreateHardLinkW(pwszPath, pTargetFile->szPath, NULL))
+            {
+                if (birdUnlinkForcedW(wszBackup) == 0)
+                {
+                    if (g_cVerbosity >= 1)
+                        printf("Hardlinked '%ls' to '%ls'.\n", pwszPath, pTargetFile->szPath);
+                }
+                else
+                {
+                    fprintf(stderr, "kDeDup: fatal: failed to delete '%ls' after hardlinking: %s (%d)\n",
+                            wszBackup, strerror(errno), errno);
+                    return 8;
+                }
+            }
+            else
+            {
+                fprintf(stderr, "kDeDup: error: failed to hard link '%ls' to '%ls': %u\n",
+                        pwszPath, wszBackup, GetLastError());
+                if (!MoveFileW(wszBackup, pwszPath))
+                {
+                    fprintf(stderr, "kDeDup: fatal: Restore back '%ls' to '%ls' after hardlinking faild: %u\n",
+                            wszBackup, pwszPath, GetLastError());
+                    return 8;
+                }
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "kDeDup: error: failed to rename '%ls' to '%ls': %u\n",
+                    pwszPath, wszBackup, GetLastError());
+            return 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "kDeDup: error: too long backup path: '%ls'\n", pwszPath);
+        return 1;
+    }
+    return 0;
+}
+
+#else  /* !KBUILD_OS_WINDOWS */
+
+/**
+ * Checks that a file is still the one we found while scanning.
+ *
+ * @returns K_TRUE if it is, K_FALSE (with warning) if not.
+ * @param   pszPath         The file name.
+ * @param   pFileNode       The file node (for dev, inode, size and
+ *                          modification time).
+ * @param   fFollow         Whether to follow symbolic links.
+ */
+static KBOOL kDupIsUnchanged(const char *pszPath, PKDUPFILENODE pFileNode, KBOOL fFollow)
+{
+    struct stat St;
+    if ((fFollow ? stat(pszPath, &St) : lstat(pszPath, &St)) != 0)
+        fprintf(stderr, "kDeDup: warning: Skipping '%s': %s (%d)\n", pszPath, strerror(errno), errno);
+    else if (   (KU64)St.st_dev  != pFileNode->uDev
+             || (KU64)St.st_ino  != pFileNode->uInode
+             || (KU64)St.st_size != pFileNode->cbFile
+             || (KI64)St.st_mtime != pFileNode->tMTimeSec
+             || (KU32)KDUP_STAT_MTIME_NSEC(&St) != pFileNode->uMTimeNsec
+             || !S_ISREG(St.st_mode))
+        fprintf(stderr, "kDeDup: warning: Skipping '%s' as it changed since scanning.\n", pszPath);
+    else
+        return K_TRUE;
+    return K_FALSE;
+}
+
+
+/**
+ * Replaces one file name with a hard link to the target file.
+ *
+ * The link is created under a temporary name in the same directory and then
+ * renamed over the original, so the name never goes missing.
+ *
+ * @returns 0 on success, 1 on failure.
+ * @param   pTargetFile     The file to link to.
+ * @param   pszPath         The name to replace.
+ */
+static int kDupHardlinkFile(PKDUPFILENODE pTargetFile, const char *pszPath)
+{
+    static const char s_szTmpSuffix[] = ".kDeDupTmp";
+    char    szTmp[0x4000];
+    size_t  cchPath = strlen(pszPath);
+    if (cchPath + sizeof(s_szTmpSuffix) <= sizeof(szTmp))
+    {
+        memcpy(szTmp, pszPath, cchPath);
+        memcpy(&szTmp[cchPath], s_szTmpSuffix, sizeof(s_szTmpSuffix));
+        if (linkat(AT_FDCWD, pTargetFile->szPath, AT_FDCWD, szTmp, AT_SYMLINK_FOLLOW) == 0)
+        {
+            if (rename(szTmp, pszPath) == 0)
+            {
+                if (g_cVerbosity >= 1)
+                    printf("Hardlinked '%s' to '%s'.\n", pszPath, pTargetFile->szPath);
+                return 0;
+            }
+            fprintf(stderr, "kDeDup: error: failed to rename '%s' to '%s': %s (%d)\n",
+                    szTmp, pszPath, strerror(errno), errno);
+            unlink(szTmp);
+        }
+        else
+            fprintf(stderr, "kDeDup: error: failed to hard link '%s' to '%s': %s (%d)\n",
+                    szTmp, pTargetFile->szPath, strerror(errno), errno);
+    }
+    else
+        fprintf(stderr, "kDeDup: error: too long temporary path: '%s'\n", pszPath);
+    return 1;
+}
+#endif /* !KBUILD_OS_WINDOWS */
+
+
 /**
  * Hardlink duplicates.
+ *
+ * @returns 0 on success, non-zero on failure.
+ * @param   fDryRun         Only report what would be done.
  */
-static int kDupHardlinkDuplicates(void)
+static int kDupHardlinkDuplicates(KBOOL fDryRun)
 {
     int           rcExit = 0;
     PKDUPFILENODE pFileNode;
@@ -587,60 +1146,44 @@ static int kDupHardlinkDuplicates(void)
              */
             if (pDupFile->uDev == pTargetFile->uDev)
             {
-                /** @todo compare the files?   */
-                if (1)
+                /*
+                 * Replace the file and all the other names we found for it,
+                 * leaving symbolic links alone.
+                 */
+                PKDUPFILENODE pName;
+#ifndef KBUILD_OS_WINDOWS
+                if (!fDryRun && !kDupIsUnchanged(pTargetFile->szPath, pTargetFile, K_TRUE /*fFollow*/))
+                {
+                    rcExit = 1;
+                    break;
+                }
+#endif
+                for (pName = pDupFile; pName != NULL; pName = pName->pNextHardLink)
                 {
-                    /*
-                     * Start by renaming the orinal file before we try create the hard link.
-                     */
-                    static const wchar_t s_wszBackupSuffix[] = L".kDepBackup";
-                    wchar_t wszBackup[0x4000];
-                    size_t  cwcPath = wcslen(pDupFile->wszPath);
-                    if (cwcPath + sizeof(s_wszBackupSuffix) / sizeof(wchar_t) < K_ELEMENTS(wszBackup))
+                    if (pName->fViaSymlink)
+                        continue;
+                    if (fDryRun)
+                        printf("Would hardlink '%" KDUP_PATH_PRI "' to '%" KDUP_PATH_PRI "'.\n",
+                               pName->szPath, pTargetFile->szPath);
+#ifndef KBUILD_OS_WINDOWS
+                    else if (!kDupIsUnchanged(pName->szPath, pDupFile, K_FALSE /*fFollow*/))
                     {
-                        memcpy(wszBackup, pDupFile->wszPath, cwcPath * sizeof(wchar_t));
-                        memcpy(&wszBackup[cwcPath], s_wszBackupSuffix, sizeof(s_wszBackupSuffix));
-                        if (MoveFileW(pDupFile->wszPath, wszBackup))
-                        {
-                            if (CreateHardLinkW(pDupFile->wszPath, pTargetFile->wszPath, NULL))
-                            {
-                                if (birdUnlinkForcedW(wszBackup) == 0)
-                                {
-                                    if (g_cVerbosity >= 1)
-                                        printf("Hardlinked '%ls' to '%ls'.\n", pDupFile->wszPath, pTargetFile->wszPath);
-                                }
-                                else
-                                {
-                                    fprintf(stderr, "kDeDup: fatal: failed to delete '%ls' after hardlinking: %s (%d)\n",
-                                            wszBackup, strerror(errno), errno);
-                                    return 8;
-                                }
-                            }
-                            else
-                            {
-                                fprintf(stderr, "kDeDup: error: failed to hard link '%ls' to '%ls': %u\n",
-                                        pDupFile->wszPath, wszBackup, GetLastError());
-                                if (!MoveFileW(wszBackup, pDupFile->wszPath))
-                                {
-                                    fprintf(stderr, "kDeDup: fatal: Restore back '%ls' to '%ls' after hardlinking faild: %u\n",
-                                            wszBackup, pDupFile->wszPath, GetLastError());
-                                    return 8;
-                                }
-                                rcExit = 1;
-                            }
-                        }
-                        else
-                        {
-                            fprintf(stderr, "kDeDup: error: failed to rename '%ls' to '%ls': %u\n",
-                                    pDupFile->wszPath, wszBackup, GetLastError());
-                            rcExit = 1;
-                        }
+                        rcExit = 1;
+                        continue;
                     }
+#endif
                     else
                     {
-                        fprintf(stderr, "kDeDup: error: too long backup path: '%ls'\n", pDupFile->wszPath);
-                        rcExit = 1;
+                        int rc = kDupHardlinkFile(pTargetFile, pName->szPath);
+                        if (rc == 8)
+                            return rc;
+                        if (rc != 0)
+                        {
+                            rcExit = rc;
+                            continue;
+                        }
                     }
+                    g_cLinked += 1;
                 }
             }
             /*
@@ -679,92 +1222,107 @@ static int usage(const char *pszName, FILE *pOut)
             "    mount point or via a symbolic link to a directory.\n"
             "  --no-one-file-system, --cross-file-systems\n"
             "    Reverses the effect of --one-file-system.\n"
+            "  -j <count>, --jobs <count>\n"
+            "    Max number of threads to hash files on.  Default is one per CPU.\n"
             "  -q, --quiet, -v,--verbose\n"
             "    Controls the output level.\n"
             "  --hardlink-duplicates\n"
             "    Hardlink duplicate files to remove duplicates and save space.  By default\n"
             "    no action is taken and only analysis is done.\n"
+            "  -n, --dry-run\n"
+            "    List the files --hardlink-duplicates would replace without changing\n"
+            "    anything.\n"
             );
     return 0;
 }
 
 
+#ifdef KBUILD_OS_WINDOWS
 int wmain(int argc, wchar_t **argv)
+#else
+int main(int argc, char **argv)
+#endif
 {
     int             rcExit;
 
     /*
      * Process parameters.  Position.
      */
-    wchar_t   **papwszFtsArgs = (wchar_t **)calloc(argc + 1, sizeof(wchar_t *));
+    KDUPCHAR  **papszFtsArgs  = (KDUPCHAR **)calloc(argc + 1, sizeof(KDUPCHAR *));
     unsigned    cFtsArgs      = 0;
-    unsigned    fFtsOptions   = FTS_NOCHDIR | FTS_NO_ANSI;
+    unsigned    fFtsOptions   = KDUP_FTS_DEFAULT_OPTIONS;
     KBOOL       fEndOfOptions = K_FALSE;
     KBOOL       fHardlinkDups = K_FALSE;
+    KBOOL       fDryRun       = K_FALSE;
     int         i;
     for (i = 1; i < argc; i++)
     {
-        wchar_t *pwszArg = argv[i];
-        if (   *pwszArg == '-'
+        KDUPCHAR *pszArg = argv[i];
+        if (   *pszArg == '-'
             && !fEndOfOptions)
         {
-            wchar_t wcOpt = *++pwszArg;
-            pwszArg++;
-            if (wcOpt == '-')
+            KDUPCHAR chOpt = *++pszArg;
+            pszArg++;
+            if (chOpt == '-')
             {
                 /* Translate long options. */
-                if (wcscmp(pwszArg, L"help") == 0)
-                    wcOpt = 'h';
-                else if (wcscmp(pwszArg, L"version") == 0)
-                    wcOpt = 'V';
-                else if (wcscmp(pwszArg, L"recursive") == 0)
-                    wcOpt = 'r';
-                else if (wcscmp(pwszArg, L"dereference-recursive") == 0)
-                    wcOpt = 'R';
-                else if (wcscmp(pwszArg, L"dereference") == 0)
-                    wcOpt = 'L';
-                else if (wcscmp(pwszArg, L"dereference-command-line") == 0)
-                    wcOpt = 'H';
-                else if (wcscmp(pwszArg, L"one-file-system") == 0)
-                    wcOpt = 'x';
+                if (KDUP_STRCMP(pszArg, KDUP_T("help")) == 0)
+                    chOpt = 'h';
+                else if (KDUP_STRCMP(pszArg, KDUP_T("version")) == 0)
+                    chOpt = 'V';
+                else if (KDUP_STRCMP(pszArg, KDUP_T("recursive")) == 0)
+                    chOpt = 'r';
+                else if (KDUP_STRCMP(pszArg, KDUP_T("dereference-recursive")) == 0)
+                    chOpt = 'R';
+                else if (KDUP_STRCMP(pszArg, KDUP_T("dereference")) == 0)
+                    chOpt = 'L';
+                else if (KDUP_STRCMP(pszArg, KDUP_T("dereference-command-line")) == 0)
+                    chOpt = 'H';
+                else if (KDUP_STRCMP(pszArg, KDUP_T("one-file-system")) == 0)
+                    chOpt = 'x';
+                else if (KDUP_STRCMP(pszArg, KDUP_T("jobs")) == 0)
+                    chOpt = 'j';
+                else if (KDUP_STRCMP(pszArg, KDUP_T("dry-run")) == 0)
+                    chOpt = 'n';
                 /* Process long options. */
-                else if (*pwszArg == '\0')
+                else if (*pszArg == '\0')
                 {
                     fEndOfOptions = K_TRUE;
                     continue;
                 }
-                else if (wcscmp(pwszArg, L"no-recursive") == 0)
+                else if (KDUP_STRCMP(pszArg, KDUP_T("no-recursive")) == 0)
                 {
                     g_fRecursive = g_fRecursiveViaSymlinks = K_FALSE;
                     continue;
                 }
-                else if (wcscmp(pwszArg, L"no-dereference-command-line") == 0)
+                else if (KDUP_STRCMP(pszArg, KDUP_T("no-dereference-command-line")) == 0)
                 {
                     fFtsOptions &= ~FTS_COMFOLLOW;
                     continue;
                 }
-                else if (   wcscmp(pwszArg, L"no-one-file-system") == 0
-                         || wcscmp(pwszArg, L"cross-file-systems") == 0)
+                else if (   KDUP_STRCMP(pszArg, KDUP_T("no-one-file-system")) == 0
+                         || KDUP_STRCMP(pszArg, KDUP_T("cross-file-systems")) == 0)
                 {
                     fFtsOptions &= ~FTS_XDEV;
                     continue;
                 }
-                else if (wcscmp(pwszArg, L"hardlink-duplicates") == 0)
+                else if (KDUP_STRCMP(pszArg, KDUP_T("hardlink-duplicates")) == 0)
                 {
                     fHardlinkDups = K_TRUE;
                     continue;
                 }
                 else
                 {
-                    fprintf(stderr, "kDeDup: syntax error: Unknown option '--%ls'\n", pwszArg);
+                    fprintf(stderr, "kDeDup: syntax error: Unknown option '--%" KDUP_PATH_PRI "'\n", pszArg);
                     return 2;
                 }
+                pszArg += KDUP_STRLEN(pszArg); /* no short options follow a long one */
             }
 
             /* Process one or more short options. */
             do
             {
-                switch (wcOpt)
+                switch (chOpt)
                 {
                     case 'r': /* --recursive */
                         g_fRecursive = K_TRUE;
@@ -786,6 +1344,32 @@ int wmain(int argc, wchar_t **argv)
                         fFtsOptions |= FTS_XDEV;
                         break;
 
+                    case 'j': /* --jobs <count> */
+                    {
+                        KDUPCHAR *pszEnd;
+                        if (*pszArg == '\0')
+                        {
+                            if (++i >= argc)
+                            {
+                                fprintf(stderr, "kDeDup: syntax error: The '-j' option requires a thread count\n");
+                                return 2;
+                            }
+                            pszArg = argv[i];
+                        }
+                        g_cMaxHashThreads = (unsigned)KDUP_STRTOUL(pszArg, &pszEnd);
+                        if (*pszEnd != '\0' || pszEnd == pszArg)
+                        {
+                            fprintf(stderr, "kDeDup: syntax error: Invalid thread count '%" KDUP_PATH_PRI "'\n", pszArg);
+                            return 2;
+                        }
+                        pszArg = pszEnd;
+                        break;
+                    }
+
+                    case 'n': /* --dry-run */
+                        fDryRun = K_TRUE;
+                        break;
+
                     case 'q':
                         g_cVerbosity = 0;
                         break;
@@ -800,42 +1384,58 @@ int wmain(int argc, wchar_t **argv)
                         return usage("kDeDup", stdout);
 
                     case 'V':
-                        printf("0.0.1\n");
+                        printf("0.0.2\n");
                         return 0;
 
                     default:
-                        fprintf(stderr, "kDeDup: syntax error: Unknown option '-%lc'\n", wcOpt);
+                        fprintf(stderr, "kDeDup: syntax error: Unknown option '-%" KDUP_CHAR_PRI "'\n", chOpt);
                         return 2;
                 }
 
-                wcOpt = *pwszArg++;
-            } while (wcOpt != '\0');
+                chOpt = *pszArg++;
+            } while (chOpt != '\0');
         }
         else
         {
             /*
              * Append non-option arguments to the FTS argument vector.
              */
-            papwszFtsArgs[cFtsArgs] = pwszArg;
+            papszFtsArgs[cFtsArgs] = pszArg;
             cFtsArgs++;
         }
     }
 
     /*
-     * Do the FTS processing.
+     * Do the FTS processing, then hash the files sharing their size with
+     * others and look for duplicates among them.
      */
     kDupSizeTree_Init(&g_SizeRoot);
-    rcExit = kDupReadAll(papwszFtsArgs, fFtsOptions);
+    rcExit = kDupReadAll(papszFtsArgs, fFtsOptions);
+    if (rcExit == 0)
+        rcExit = kDupSizeTree_DoWithAll(&g_SizeRoot, K_TRUE /*fFromLeft*/, kDupPrepareSize, NULL);
+    if (rcExit == 0)
+        rcExit = kDupHashAll();
     if (rcExit == 0)
     {
+        kDupSizeTree_DoWithAll(&g_SizeRoot, K_TRUE /*fFromLeft*/, kDupFindDuplicates, NULL);
+
         /*
          * Display the result.
          */
+        if (g_cVerbosity >= 1)
+            printf("Scanned %" KU64_PRI " files, hashed %" KU64_PRI " of them, %" KU64_PRI " were already hardlinked.\n",
+                   g_cFiles, g_cHashed, g_cHardlinked);
         printf("Found %" KU64_PRI " duplicate files, out which %" KU64_PRI " can be hardlinked saving %" KU64_PRI " bytes\n",
                g_cDuplicates, g_cDuplicatesSaved, g_cbDuplicatesSaved);
 
-        if (fHardlinkDups)
-            rcExit = kDupHardlinkDuplicates();
+        if (fHardlinkDups || fDryRun)
+        {
+            rcExit = kDupHardlinkDuplicates(fDryRun);
+            if (fDryRun)
+                printf("Would hardlink %" KU64_PRI " files.\n", g_cLinked);
+            else
+                printf("Hardlinked %" KU64_PRI " files.\n", g_cLinked);
+        }
     }
 
     return rcExit;
@@ -30,6 +30,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #ifdef _MSC_VER
 # include <io.h>
 #else
@@ -37,175 +39,234 @@
 #endif
 #include "kDep.h"
 
-#ifdef HAVE_FGETC_UNLOCKED
-# define FGETC(s)   getc_unlocked(s)
-#else
-# define FGETC(s)   fgetc(s)
-#endif
-
 #ifdef NEED_ISBLANK
 # define isblank(ch) ( (unsigned char)(ch) == ' ' || (unsigned char)(ch) == '\t' )
 #endif
 
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/** The size of the ParseCPrecompiler input buffer.
+ * Lines longer than this are only inspected up to this size. */
+#define KDEPPRE_BUF_SIZE    (256*1024)
+
+
+
+
+/**
+ * Writes the whole buffer to the tee file.
+ *
+ * @returns 0 on success, -1 on failure.
+ * @param   fd          The file descriptor to write to.
+ * @param   pch         What to write.
+ * @param   cb          How much to write.
+ */
+static int WriteAll(int fd, const char *pch, size_t cb)
+{
+    while (cb > 0)
+    {
+        long cbWritten = write(fd, pch, (long)cb);
+        if (cbWritten < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pch += cbWritten;
+        cb  -= cbWritten;
+    }
+    return 0;
+}
+
+
+/**
+ * Checks a line for a '#[[:space]]*line <num> "file"' or a '# <num> "file"'
+ * line marker and updates the current dependency accordingly.
+ *
+ * @param   pch         The start of the line.
+ * @param   pchEnd      The end of the line (exclusive, newline not included).
+ * @param   ppDep       Where the current dependency is kept.
+ */
+static void ParseLine(const char *pch, const char *pchEnd, PDEP *ppDep)
+{
+    char    szBuf[8192];
+    char   *psz;
+
+    /* first find '#' */
+    while (pch < pchEnd && isblank((unsigned char)*pch))
+        pch++;
+    if (pch >= pchEnd || *pch != '#')
+        return;
+
+    /* skip spaces */
+    pch++;
+    while (pch < pchEnd && isblank((unsigned char)*pch))
+        pch++;
+
+    /* check for "line" */
+    if (pchEnd - pch >= 4 && !memcmp(pch, "line", 4))
+    {
+        pch += 4;
+        if (pch >= pchEnd || !isblank((unsigned char)*pch))
+            return;
+        while (pch < pchEnd && isblank((unsigned char)*pch))
+            pch++;
+    }
+
+    /* line number followed by spaces */
+    if (pch >= pchEnd || *pch < '0' || *pch > '9')
+        return;
+    while (pch < pchEnd && isxdigit((unsigned char)*pch))
+        pch++;
+    if (pch >= pchEnd || !isblank((unsigned char)*pch))
+        return;
+    while (pch < pchEnd && isblank((unsigned char)*pch))
+        pch++;
+
+    /* quoted filename */
+    if (pch >= pchEnd || *pch != '"')
+        return;
+    pch++;
+
+    /* retreive and unescape the filename. */
+    psz = &szBuf[0];
+    while (     pch < pchEnd
+           &&   psz < &szBuf[sizeof(szBuf) - 1])
+    {
+        char ch = *pch++;
+        if (ch == '\\')
+        {
+            if (pch >= pchEnd)
+                break;
+            ch = *pch++;
+            switch (ch)
+            {
+                case '\\': ch = '/'; break;
+                case 't':  ch = '\t'; break;
+                case 'r':  ch = '\r'; break;
+                case 'n':  ch = '\n'; break;
+                case 'b':  ch = '\b'; break;
+                default:
+                    fprintf(stderr, "warning: unknown escape char '%c'\n", ch);
+                    continue;
 
+            }
+            *psz++ = ch;
+        }
+        else if (ch != '"')
+            *psz++ = ch;
+        else
+        {
+            size_t cchFilename = psz - &szBuf[0];
+            PDEP   pDep = *ppDep;
+            *psz = '\0';
+            /* compare with current dep, add & switch on mismatch. */
+            if (    !pDep
+                ||  pDep->cchFilename != cchFilename
+                ||  memcmp(pDep->szFilename, szBuf, cchFilename))
+                *ppDep = depAdd(szBuf, cchFilename);
+            break;
+        }
+    }
+}
 
 
 /**
  * Parses the output from a preprocessor of a C-style language.
  *
+ * The input is consumed in large blocks, optionally copied to the tee file as
+ * it comes in, and only the start of each line is inspected for line markers.
+ *
  * @returns 0 on success.
  * @returns 1 or other approriate exit code on failure.
- * @param   pInput      Input stream. (probably not seekable)
+ * @param   fdInput     Input file descriptor. (probably not seekable)
+ * @param   fdTee       File descriptor to copy the input to, -1 if none.
  */
-static int ParseCPrecompiler(FILE *pInput)
+static int ParseCPrecompiler(int fdInput, int fdTee)
 {
-    enum
-    {
-        C_DISCOVER = 0,
-        C_SKIP_LINE,
-        C_PARSE_FILENAME,
-        C_EOF
-    } enmMode = C_DISCOVER;
     PDEP    pDep = NULL;
-    int     ch = 0;
-    char    szBuf[8192];
+    int     fSkipLine = 0;
+    size_t  cbLeft = 0;
+    char   *pchBuf = (char *)malloc(KDEPPRE_BUF_SIZE);
+    if (!pchBuf)
+    {
+        fprintf(stderr, "error: out of memory\n");
+        return 1;
+    }
 
     for (;;)
     {
-        switch (enmMode)
+        const char *pch;
+        const char *pchEnd;
+        const char *pchEol;
+        long        cbRead = read(fdInput, pchBuf + cbLeft, (long)(KDEPPRE_BUF_SIZE - cbLeft));
+        if (cbRead < 0)
         {
-            /*
-             * Start of line, need to look for '#[[:space]]*line <num> "file"' and '# <num> "file"'.
-             */
-            case C_DISCOVER:
-                /* first find '#' */
-                while ((ch = FGETC(pInput)) != EOF)
-                    if (!isblank(ch))
-                        break;
-                if (ch == '#')
-                {
-                    /* skip spaces */
-                    while ((ch = FGETC(pInput)) != EOF)
-                        if (!isblank(ch))
-                            break;
-
-                    /* check for "line" */
-                    if (ch == 'l')
-                    {
-                        if (    (ch = FGETC(pInput)) == 'i'
-                            &&  (ch = FGETC(pInput)) == 'n'
-                            &&  (ch = FGETC(pInput)) == 'e')
-                        {
-                            ch = FGETC(pInput);
-                            if (isblank(ch))
-                            {
-                                /* skip spaces */
-                                while ((ch = FGETC(pInput)) != EOF)
-                                    if (!isblank(ch))
-                                        break;
-                            }
-                            else
-                                ch = 'x';
-                        }
-                        else
-                            ch = 'x';
-                    }
-
-                    /* line number */
-                    if (ch >= '0' && ch <= '9')
-                    {
-                        /* skip the number following spaces */
-                        while ((ch = FGETC(pInput)) != EOF)
-                            if (!isxdigit(ch))
-                                break;
-                        if (isblank(ch))
-                        {
-                            while ((ch = FGETC(pInput)) != EOF)
-                                if (!isblank(ch))
-                                    break;
-                            /* quoted filename */
-                            if (ch == '"')
-                            {
-                                enmMode = C_PARSE_FILENAME;
-                                break;
-                            }
-                        }
-                    }
-                }
-                enmMode = C_SKIP_LINE;
-                break;
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "error: read error: %s\n", strerror(errno));
+            free(pchBuf);
+            return 1;
+        }
+        if (    cbRead > 0
+            &&  fdTee != -1
+            &&  WriteAll(fdTee, pchBuf + cbLeft, cbRead))
+        {
+            fprintf(stderr, "error: write error: %s\n", strerror(errno));
+            free(pchBuf);
+            return 1;
+        }
 
-            /*
-             * Skip past the end of the current line.
-             */
-            case C_SKIP_LINE:
-                do
-                {
-                    if (    ch == '\r'
-                        ||  ch == '\n')
-                        break;
-                } while ((ch = FGETC(pInput)) != EOF);
-                enmMode = C_DISCOVER;
-                break;
+        pch    = pchBuf;
+        pchEnd = pchBuf + cbLeft + cbRead;
 
-            /*
-             * Parse the filename.
-             */
-            case C_PARSE_FILENAME:
+        /* finish skipping an overlong line. */
+        if (fSkipLine)
+        {
+            pchEol = (const char *)memchr(pch, '\n', pchEnd - pch);
+            if (pchEol)
             {
-                /* retreive and unescape the filename. */
-                char   *psz = &szBuf[0];
-                while (     (ch = FGETC(pInput)) != EOF
-                       &&   psz < &szBuf[sizeof(szBuf) - 1])
-                {
-                    if (ch == '\\')
-                    {
-                        ch = FGETC(pInput);
-                        switch (ch)
-                        {
-                            case '\\': ch = '/'; break;
-                            case 't':  ch = '\t'; break;
-                            case 'r':  ch = '\r'; break;
-                            case 'n':  ch = '\n'; break;
-                            case 'b':  ch = '\b'; break;
-                            default:
-                                fprintf(stderr, "warning: unknown escape char '%c'\n", ch);
-                                continue;
+                pch = pchEol + 1;
+                fSkipLine = 0;
+            }
+            else
+                pch = pchEnd;
+        }
 
-                        }
-                        *psz++ = ch == '\\' ? '/' : ch;
-                    }
-                    else if (ch != '"')
-                        *psz++ = ch;
-                    else
-                    {
-                        size_t cchFilename = psz - &szBuf[0];
-                        *psz = '\0';
-                        /* compare with current dep, add & switch on mismatch. */
-                        if (    !pDep
-                            ||  pDep->cchFilename != cchFilename
-                            ||  memcmp(pDep->szFilename, szBuf, cchFilename))
-                            pDep = depAdd(szBuf, cchFilename);
-                        break;
-                    }
-                }
-                enmMode = C_SKIP_LINE;
-                break;
+        /* process the complete lines, the last one is only complete at EOF. */
+        while (pch < pchEnd)
+        {
+            pchEol = (const char *)memchr(pch, '\n', pchEnd - pch);
+            if (!pchEol)
+            {
+                if (cbRead)
+                    break;
+                pchEol = pchEnd;
             }
+            ParseLine(pch, pchEol, &pDep);
+            pch = pchEol + 1;
+        }
+        if (!cbRead)
+            break;
 
-            /*
-             * Handle EOF.
-             */
-            case C_EOF:
-                if (feof(pInput))
-                    return 0;
-                enmMode = C_DISCOVER;
-                break;
+        /* move the incomplete line to the start of the buffer. */
+        cbLeft = pch < pchEnd ? pchEnd - pch : 0;
+        if (cbLeft >= KDEPPRE_BUF_SIZE)
+        {
+            ParseLine(pchBuf, pchEnd, &pDep);
+            fSkipLine = 1;
+            cbLeft = 0;
         }
-        if (ch == EOF)
-            enmMode = C_EOF;
+        else if (cbLeft && pch != pchBuf)
+            memmove(pchBuf, pch, cbLeft);
     }
 
+    free(pchBuf);
     return 0;
 }
 
@@ -213,9 +274,12 @@ static int ParseCPrecompiler(FILE *pInput)
 static int usage(FILE *pOut,  const char *argv0)
 {
     fprintf(pOut,
-            "usage: %s [-l=c] -o <output> -t <target> [-f] [-s] < - | <filename> | -e <cmdline> >\n"
+            "usage: %s [-l=c] -o <output> -t <target> [-f] [-s] [-T <tee>] < - | <filename> | -e <cmdline> >\n"
             "   or: %s --help\n"
-            "   or: %s --version\n",
+            "   or: %s --version\n"
+            "\n"
+            "  -T <tee>  Copy the input to <tee> ('-' for stdout) while scanning it,\n"
+            "            e.g. to feed the compiler from the same pipe.\n",
             argv0, argv0, argv0);
     return 1;
 }
@@ -229,7 +293,9 @@ int main(int argc, char *argv[])
     int         iExec = 0;
     FILE       *pOutput = NULL;
     const char *pszOutput = NULL;
-    FILE       *pInput = NULL;
+    int         fdInput = -1;
+    int         fdTee = -1;
+    const char *pszTee = NULL;
     const char *pszTarget = NULL;
     int         fStubs = 0;
     int         fFixCase = 0;
@@ -329,6 +395,29 @@ int main(int argc, char *argv[])
                     break;
                 }
 
+                /*
+                 * Tee file.
+                 */
+                case 'T':
+                {
+                    if (pszTee)
+                    {
+                        fprintf(stderr, "%s: syntax error: only one tee file!\n", argv[0]);
+                        return 1;
+                    }
+                    pszTee = &argv[i][2];
+                    if (!*pszTee)
+                    {
+                        if (++i >= argc)
+                        {
+                            fprintf(stderr, "%s: syntax error: The '-T' argument is missing the filename.\n", argv[0]);
+                            return 1;
+                        }
+                        pszTee = argv[i];
+                    }
+                    break;
+                }
+
                 /*
                  * Exec.
                  */
@@ -349,7 +438,7 @@ int main(int argc, char *argv[])
                  */
                 case '\0':
                 {
-                    pInput = stdin;
+                    fdInput = 0;
                     fInput = 1;
                     break;
                 }
@@ -395,8 +484,8 @@ int main(int argc, char *argv[])
         }
         else
         {
-            pInput = fopen(argv[i], "r");
-            if (!pInput)
+            fdInput = open(argv[i], O_RDONLY | O_BINARY);
+            if (fdInput < 0)
             {
                 fprintf(stderr, "%s: error: Failed to open input file '%s'.\n", argv[0], argv[i]);
                 return 1;
@@ -421,7 +510,7 @@ int main(int argc, char *argv[])
     /*
      * Got all we require?
      */
-    if (!pInput && iExec <= 0)
+    if (fdInput < 0 && iExec <= 0)
     {
         fprintf(stderr, "%s: syntax error: No input!\n", argv[0]);
         return 1;
@@ -437,6 +526,31 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    /*
+     * Open the tee file.
+     */
+    if (pszTee)
+    {
+        if (pszTee[0] == '-' && !pszTee[1])
+        {
+            if (pOutput == stdout)
+            {
+                fprintf(stderr, "%s: syntax error: The output and the tee file cannot both be stdout.\n", argv[0]);
+                return 1;
+            }
+            fdTee = 1;
+        }
+        else
+        {
+            fdTee = open(pszTee, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+            if (fdTee < 0)
+            {
+                fprintf(stderr, "%s: error: Failed to create tee file '%s'.\n", argv[0], pszTee);
+                return 1;
+            }
+        }
+    }
+
     /*
      * Spawn process?
      */
@@ -449,7 +563,12 @@ int main(int argc, char *argv[])
     /*
      * Do the parsing.
      */
-    i = ParseCPrecompiler(pInput);
+    i = ParseCPrecompiler(fdInput, fdTee);
+    if (fdTee > 1 && close(fdTee) && !i)
+    {
+        fprintf(stderr, "%s: error: Error writing to '%s'.\n", argv[0], pszTee);
+        i = 1;
+    }
 
     /*
      * Reap child.
@@ -41,6 +41,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <ctype.h>
+#include <time.h>
 #ifndef PATH_MAX
 # ifdef _MAX_PATH
 #  define PATH_MAX _MAX_PATH /* windows */
@@ -85,6 +86,24 @@
 # include <posix/sys/file.h>
 #endif
 
+/* Checksum the preprocessor output on a thread while reading it. */
+#if !defined(__WIN__) && !defined(__OS2__)
+# define KOC_WITH_SUM_THREAD
+# include <pthread.h>
+#endif
+
+/* The cache server (--server) talks to its clients over a unix socket. */
+#if !defined(__WIN__) && !defined(__OS2__)
+# define KOC_WITH_SERVER
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <poll.h>
+# include <signal.h>
+# ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+# endif
+#endif
+
 #include "crc32.h"
 #include "md5.h"
 #include "kDep.h"
@@ -103,9 +122,11 @@
 #if defined(__OS2__) || defined(__WIN__)
 # define IS_SLASH(ch)       ((ch) == '/' || (ch) == '\\')
 # define IS_SLASH_DRV(ch)   ((ch) == '/' || (ch) == '\\' || (ch) == ':')
+# define PATH_LIST_SEP      ';'
 #else
 # define IS_SLASH(ch)       ((ch) == '/')
 # define IS_SLASH_DRV(ch)   ((ch) == '/')
+# define PATH_LIST_SEP      ':'
 #endif
 
 #ifndef STDIN_FILENO
@@ -124,6 +145,45 @@
 #define KOC_BUF_INCR        KOC_BUF_ALIGNMENT
 #define KOC_BUF_ALIGNMENT   (4U*1024U*1024U)
 
+/** The number of shards a cache is split into (power of two). */
+#define KOC_CACHE_SHARDS    16
+/** The shard file magic ('KOC3'), also catches foreign byte order. */
+#define KOC_SHARD_MAGIC     0x4b4f4333U
+/** The shard file trailer magic, catches truncated files. */
+#define KOC_SHARD_END_MAGIC 0x454e4421U
+/** Calculates the shard key table hash of a compiler argument checksum and a
+ * preprocessor output checksum. */
+#define KOC_SHARD_HASH(a_pSumCompArgv, a_pSum) \
+    ( (a_pSumCompArgv)->crc32 ^ ((a_pSum)->crc32 * 0x9e3779b1U) )
+
+/** The max amount of data the checksum thread takes in one go. */
+#define KOC_SUM_THRD_CHUNK  (256U*1024U)
+
+/** Digests hit more recently than this (in seconds) don't get their last hit
+ * time refreshed, saving up to date entries from taking the cache lock. */
+#define KOC_LRU_TOUCH_SECS  (60U*60U)
+
+/** Magic of a compressed preprocessor output file ("\0OLz").  Real
+ * preprocessor output never starts with a zero byte. */
+#define KOC_LZ_MAGIC        0x7a4c4f00U
+/** The minimum match length of the compressor. */
+#define KOC_LZ_MIN_MATCH    4
+/** The size of the compressor hash table (log2). */
+#define KOC_LZ_HASH_BITS    14
+
+#ifndef UINT64_C
+# define UINT64_C(c)        (c ## ULL)
+#endif
+/** @name Fast 128-bit hash constants (see KOCHASH128).
+ * @{ */
+#define KOC_H128_PRIME1     UINT64_C(0x9E3779B185EBCA87)
+#define KOC_H128_PRIME2     UINT64_C(0xC2B2AE3D27D4EB4F)
+#define KOC_H128_PRIME3     UINT64_C(0x165667B19E3779F9)
+#define KOC_H128_PRIME4     UINT64_C(0x85EBCA77C2B2AE63)
+#define KOC_H128_PRIME5     UINT64_C(0x27D4EB2F165667C5)
+/** @} */
+#define KOC_ROTL64(a_u, a_cShift) ( ((a_u) << (a_cShift)) | ((a_u) >> (64 - (a_cShift))) )
+
 
 /*******************************************************************************
 *   Global Variables                                                           *
@@ -141,6 +201,10 @@ static size_t g_cMemMoves = 0;
 /** How much memory we've moved. */
 static size_t g_cbMemMoved = 0;
 
+/** Set if the fast 128-bit hash is used for checksums instead of CRC32 + MD5
+ * (--hash fast).  The two kinds of checksums never match each other. */
+static int g_fFastHash = 0;
+
 
 /*******************************************************************************
 *   Internal Functions                                                         *
@@ -150,6 +214,8 @@ static char *CalcRelativeName(const char *pszPath, const char *pszDir);
 static FILE *FOpenFileInDir(const char *pszName, const char *pszDir, const char *pszMode);
 static int   UnlinkFileInDir(const char *pszName, const char *pszDir);
 static int   RenameFileInDir(const char *pszOldName, const char *pszNewName, const char *pszDir);
+static int   ReplaceFileInDir(const char *pszTmpName, const char *pszName, const char *pszDir);
+static char *MakeTempName(const char *pszName);
 static int   DoesFileInDirExist(const char *pszName, const char *pszDir);
 static void *ReadFileInDir(const char *pszName, const char *pszDir, size_t *pcbFile);
 
@@ -368,6 +434,45 @@ static char *MakePathFromDirAndFile(const char *pszName, const char *pszDir)
 }
 
 
+/**
+ * Utility function that finds the executable a program name refers to.
+ *
+ * Names with a path are taken as they are, others are searched for in PATH.
+ *
+ * @returns malloced buffer containing the path, NULL if not found.
+ * @param   pszName     The program name (argv[0]).
+ */
+static char *FindExecutable(const char *pszName)
+{
+    const char *pszPath = getenv("PATH");
+    struct stat st;
+    if (FindFilenameInPath(pszName) != pszName)
+        return xstrdup(pszName);
+    while (pszPath && *pszPath)
+    {
+        const char *pszEnd = strchr(pszPath, PATH_LIST_SEP);
+        size_t cchDir = pszEnd ? (size_t)(pszEnd - pszPath) : strlen(pszPath);
+        char *pszDir = xmalloc(cchDir + 1);
+        char *pszExe;
+        memcpy(pszDir, pszPath, cchDir);
+        pszDir[cchDir] = '\0';
+        pszExe = MakePathFromDirAndFile(pszName, cchDir ? pszDir : ".");
+        free(pszDir);
+        if (!stat(pszExe, &st))
+            return pszExe;
+#if defined(__OS2__) || defined(__WIN__)
+        pszExe = xrealloc(pszExe, strlen(pszExe) + sizeof(".exe"));
+        strcat(pszExe, ".exe");
+        if (!stat(pszExe, &st))
+            return pszExe;
+#endif
+        free(pszExe);
+        pszPath = pszEnd ? pszEnd + 1 : NULL;
+    }
+    return NULL;
+}
+
+
 /**
  * Compares two path strings to see if they are identical.
  *
@@ -572,6 +677,64 @@ static int RenameFileInDir(const char *pszOldName, const char *pszNewName, const
 }
 
 
+/**
+ * Replaces a file in a directory with a temporary file.
+ *
+ * This is atomic where the host allows it, so that concurrent readers will
+ * see either the old or the new file but never a partially written one.
+ *
+ * @returns 0 on success, -1 and errno on failure.
+ * @param   pszTmpName  The name of the temporary file with the new content.
+ * @param   pszName     The name of the file to replace.
+ * @param   pszDir      The directory path.
+ */
+static int ReplaceFileInDir(const char *pszTmpName, const char *pszName, const char *pszDir)
+{
+    char *pszTmpPath = MakePathFromDirAndFile(pszTmpName, pszDir);
+    char *pszPath = MakePathFromDirAndFile(pszName, pszDir);
+    int rc = 0;
+#if defined(__WIN__)
+    /* Readers may have the file open for a short while, so retry sharing violations. */
+    unsigned cTries = 0;
+    while (!MoveFileExA(pszTmpPath, pszPath, MOVEFILE_REPLACE_EXISTING))
+    {
+        DWORD dwErr = GetLastError();
+        if (    (dwErr != ERROR_SHARING_VIOLATION && dwErr != ERROR_ACCESS_DENIED)
+            ||  ++cTries > 64)
+        {
+            errno = dwErr == ERROR_PATH_NOT_FOUND || dwErr == ERROR_FILE_NOT_FOUND ? ENOENT : EACCES;
+            rc = -1;
+            break;
+        }
+        Sleep(cTries);
+    }
+#else
+# if defined(__OS2__)
+    unlink(pszPath); /* not atomic, readers may see a missing file which is just a miss. */
+# endif
+    rc = rename(pszTmpPath, pszPath);
+#endif
+    free(pszTmpPath);
+    free(pszPath);
+    return rc;
+}
+
+
+/**
+ * Makes a process specific temporary name for a file.
+ *
+ * @returns Pointer to the name (heap).
+ * @param   pszName     The name of the file.
+ */
+static char *MakeTempName(const char *pszName)
+{
+    size_t cch = strlen(pszName);
+    char *psz = xmalloc(cch + 32);
+    sprintf(psz, "%s.%ld.tmp", pszName, (long)getpid());
+    return psz;
+}
+
+
 /**
  * Check if a (regular) file exists in a directory.
  *
@@ -621,6 +784,7 @@ static void *ReadFileInDir(const char *pszName, const char *pszDir, size_t *pcbF
                 if (read(fd, pb, cbFile) == cbFile)
                 {
                     close(fd);
+                    free(pszPath);
                     pb[cbFile] = '\0';
                     *pcbFile = (size_t)cbFile;
                     return pb;
@@ -1076,6 +1240,7 @@ kOCDepConsumer(PKOCDEP pDepState, const char *pszInput, size_t cchInput)
 
                     off++;
                 }
+                break;
             }
 
             case kOCDepState_Invalid:
@@ -1130,6 +1295,11 @@ static void kOCDepWriteToFile(PKOCDEP pDepState, const char *pszFilename, const
 }
 
 
+/** Pointer to a checksum thread instance (KOCSUMTHRD). */
+typedef struct KOCSUMTHRD *PKOCSUMTHRD;
+static void kOCSumThrdSync(PKOCSUMTHRD pThrd);
+
+
 /**
  * Preprocessor output reader state.
  */
@@ -1172,6 +1342,8 @@ typedef struct KOCCPPRD
 
     /** Set if we should work the dependency generator as well. */
     PKOCDEP pDepState;
+    /** The checksum thread working on the output, NULL if none. */
+    PKOCSUMTHRD pSumThrd;
 } KOCCPPRD;
 /** Pointer to a preprocessor reader state. */
 typedef KOCCPPRD *PKOCCPPRD;
@@ -1212,6 +1384,7 @@ static void kOCCppRdInit(PKOCCPPRD pCppRd, size_t cbOldCpp, int fOptimize, PKOCD
     pCppRd->cbLineBuf = 0;
 
     pCppRd->pDepState = pDepState;
+    pCppRd->pSumThrd = NULL;
 }
 
 
@@ -1235,6 +1408,8 @@ static void kOCCppRdDelete(PKOCCPPRD pCppRd)
  */
 static size_t kOCCppRdGrowBuffer(PKOCCPPRD pCppRd)
 {
+    if (pCppRd->pSumThrd)
+        kOCSumThrdSync(pCppRd->pSumThrd);
     pCppRd->cbBufAlloc += KOC_BUF_INCR;
     pCppRd->pszBuf = xrealloc(pCppRd->pszBuf, pCppRd->cbBufAlloc);
 
@@ -1784,6 +1959,210 @@ typedef KOCSUM *PKOCSUM;
 typedef const KOCSUM *PCKOCSUM;
 
 
+/**
+ * Fast 128-bit hash state.
+ *
+ * This is a non-cryptographic streaming hash in the style of xxHash64: four
+ * independent 64-bit lanes eat 32 byte stripes (which compilers vectorize
+ * well) and a 128-bit finalization mixes them.  Used for the checksums
+ * instead of CRC32 + MD5 when g_fFastHash is set.
+ */
+typedef struct KOCHASH128
+{
+    /** The lane accumulators. */
+    uint64_t au64Acc[4];
+    /** Partial stripe buffer. */
+    unsigned char abBuf[32];
+    /** Number of bytes in abBuf. */
+    unsigned cbBuf;
+    /** Total number of bytes hashed. */
+    uint64_t cbTotal;
+} KOCHASH128;
+/** Pointer to a fast hash state. */
+typedef KOCHASH128 *PKOCHASH128;
+
+
+/**
+ * Reads a little endian 64-bit value.
+ */
+static uint64_t kOCHash128Read64(const unsigned char *pb)
+{
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_AMD64) \
+ || (defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    uint64_t u;
+    memcpy(&u, pb, sizeof(u));
+    return u;
+#else
+    return (uint64_t)pb[0]         | ((uint64_t)pb[1] <<  8) | ((uint64_t)pb[2] << 16) | ((uint64_t)pb[3] << 24)
+        | ((uint64_t)pb[4] << 32) | ((uint64_t)pb[5] << 40) | ((uint64_t)pb[6] << 48) | ((uint64_t)pb[7] << 56);
+#endif
+}
+
+
+/**
+ * Mixes one input value into a lane.
+ */
+static uint64_t kOCHash128Round(uint64_t uAcc, uint64_t uInput)
+{
+    uAcc += uInput * KOC_H128_PRIME2;
+    uAcc  = KOC_ROTL64(uAcc, 31);
+    return uAcc * KOC_H128_PRIME1;
+}
+
+
+/**
+ * Final avalanche.
+ */
+static uint64_t kOCHash128Avalanche(uint64_t u)
+{
+    u ^= u >> 33;
+    u *= KOC_H128_PRIME2;
+    u ^= u >> 29;
+    u *= KOC_H128_PRIME3;
+    u ^= u >> 32;
+    return u;
+}
+
+
+/**
+ * Initializes a fast hash calculation.
+ *
+ * @param   pHash   The hash state.
+ */
+static void kOCHash128Init(PKOCHASH128 pHash)
+{
+    pHash->au64Acc[0] = KOC_H128_PRIME1 + KOC_H128_PRIME2;
+    pHash->au64Acc[1] = KOC_H128_PRIME2;
+    pHash->au64Acc[2] = 0;
+    pHash->au64Acc[3] = 0 - KOC_H128_PRIME1;
+    pHash->cbBuf = 0;
+    pHash->cbTotal = 0;
+}
+
+
+/**
+ * Hashes whole 32 byte stripes.
+ *
+ * @param   pHash       The hash state.
+ * @param   pb          The stripes.
+ * @param   cStripes    The number of stripes.
+ */
+static void kOCHash128Stripes(PKOCHASH128 pHash, const unsigned char *pb, size_t cStripes)
+{
+    uint64_t u0 = pHash->au64Acc[0];
+    uint64_t u1 = pHash->au64Acc[1];
+    uint64_t u2 = pHash->au64Acc[2];
+    uint64_t u3 = pHash->au64Acc[3];
+    while (cStripes-- > 0)
+    {
+        u0 = kOCHash128Round(u0, kOCHash128Read64(pb));
+        u1 = kOCHash128Round(u1, kOCHash128Read64(pb + 8));
+        u2 = kOCHash128Round(u2, kOCHash128Read64(pb + 16));
+        u3 = kOCHash128Round(u3, kOCHash128Read64(pb + 24));
+        pb += 32;
+    }
+    pHash->au64Acc[0] = u0;
+    pHash->au64Acc[1] = u1;
+    pHash->au64Acc[2] = u2;
+    pHash->au64Acc[3] = u3;
+}
+
+
+/**
+ * Updates a fast hash calculation.
+ *
+ * @param   pHash   The hash state.
+ * @param   pvBuf   The input data to hash.
+ * @param   cbBuf   The size of the input data.
+ */
+static void kOCHash128Update(PKOCHASH128 pHash, const void *pvBuf, size_t cbBuf)
+{
+    const unsigned char *pb = (const unsigned char *)pvBuf;
+    pHash->cbTotal += cbBuf;
+
+    if (pHash->cbBuf)
+    {
+        size_t cbCopy = sizeof(pHash->abBuf) - pHash->cbBuf;
+        if (cbCopy > cbBuf)
+            cbCopy = cbBuf;
+        memcpy(&pHash->abBuf[pHash->cbBuf], pb, cbCopy);
+        pHash->cbBuf += (unsigned)cbCopy;
+        pb += cbCopy;
+        cbBuf -= cbCopy;
+        if (pHash->cbBuf < sizeof(pHash->abBuf))
+            return;
+        kOCHash128Stripes(pHash, pHash->abBuf, 1);
+        pHash->cbBuf = 0;
+    }
+
+    if (cbBuf >= 32)
+    {
+        kOCHash128Stripes(pHash, pb, cbBuf / 32);
+        pb += cbBuf & ~(size_t)31;
+        cbBuf &= 31;
+    }
+
+    if (cbBuf)
+    {
+        memcpy(pHash->abBuf, pb, cbBuf);
+        pHash->cbBuf = (unsigned)cbBuf;
+    }
+}
+
+
+/**
+ * Finalizes a fast hash calculation.
+ *
+ * @param   pHash       The hash state.
+ * @param   pabDigest   Where to return the 128-bit digest.
+ */
+static void kOCHash128Final(PKOCHASH128 pHash, unsigned char pabDigest[16])
+{
+    const uint64_t *pau64 = pHash->au64Acc;
+    const unsigned char *pb = pHash->abBuf;
+    unsigned cb = pHash->cbBuf;
+    uint64_t uLo;
+    uint64_t uHi;
+    unsigned i;
+
+    /* Merge the lanes, differently for each half. */
+    uLo = KOC_ROTL64(pau64[0], 1) + KOC_ROTL64(pau64[1], 7) + KOC_ROTL64(pau64[2], 12) + KOC_ROTL64(pau64[3], 18);
+    uHi = KOC_ROTL64(pau64[0], 41) ^ KOC_ROTL64(pau64[1], 29) ^ KOC_ROTL64(pau64[2], 23) ^ KOC_ROTL64(pau64[3], 5);
+    for (i = 0; i < 4; i++)
+    {
+        uLo = (uLo ^ kOCHash128Round(0, pau64[i])) * KOC_H128_PRIME1 + KOC_H128_PRIME4;
+        uHi = (uHi ^ kOCHash128Round(0, pau64[3 - i] ^ KOC_H128_PRIME5)) * KOC_H128_PRIME2 + KOC_H128_PRIME3;
+    }
+    uLo += pHash->cbTotal;
+    uHi ^= pHash->cbTotal * KOC_H128_PRIME5;
+
+    /* The tail. */
+    for (; cb >= 8; cb -= 8, pb += 8)
+    {
+        uint64_t const uK = kOCHash128Round(0, kOCHash128Read64(pb));
+        uLo ^= uK;
+        uLo  = KOC_ROTL64(uLo, 27) * KOC_H128_PRIME1 + KOC_H128_PRIME4;
+        uHi += uK * KOC_H128_PRIME3;
+        uHi  = KOC_ROTL64(uHi, 31) * KOC_H128_PRIME2;
+    }
+    for (; cb > 0; cb--, pb++)
+    {
+        uLo ^= *pb * KOC_H128_PRIME5;
+        uLo  = KOC_ROTL64(uLo, 11) * KOC_H128_PRIME1;
+        uHi += *pb * KOC_H128_PRIME1;
+        uHi  = KOC_ROTL64(uHi, 23) * KOC_H128_PRIME3;
+    }
+
+    uLo = kOCHash128Avalanche(uLo);
+    uHi = kOCHash128Avalanche(uHi + uLo);
+    for (i = 0; i < 8; i++)
+    {
+        pabDigest[i]     = (unsigned char)(uLo >> (i * 8));
+        pabDigest[i + 8] = (unsigned char)(uHi >> (i * 8));
+    }
+}
+
+
 /**
  * Temporary context record used when calculating the checksum of some data.
  */
@@ -1791,6 +2170,8 @@ typedef struct KOCSUMCTX
 {
     /** The MD5 context. */
     struct MD5Context MD5Ctx;
+    /** The fast hash state (g_fFastHash). */
+    KOCHASH128 Hash128;
 } KOCSUMCTX;
 /** Pointer to a check context record. */
 typedef KOCSUMCTX *PKOCSUMCTX;
@@ -1806,7 +2187,10 @@ typedef KOCSUMCTX *PKOCSUMCTX;
 static void kOCSumInitWithCtx(PKOCSUM pSum, PKOCSUMCTX pCtx)
 {
     memset(pSum, 0, sizeof(*pSum));
-    MD5Init(&pCtx->MD5Ctx);
+    if (g_fFastHash)
+        kOCHash128Init(&pCtx->Hash128);
+    else
+        MD5Init(&pCtx->MD5Ctx);
 }
 
 
@@ -1824,13 +2208,17 @@ static void kOCSumUpdate(PKOCSUM pSum, PKOCSUMCTX pCtx, const void *pvBuf, size_
      * Take in relativly small chunks to try keep it in the cache.
      */
     const unsigned char *pb = (const unsigned char *)pvBuf;
-    while (cbBuf > 0)
-    {
-        size_t cb = cbBuf >= 128*1024 ? 128*1024 : cbBuf;
-        pSum->crc32 = crc32(pSum->crc32, pb, cb);
-        MD5Update(&pCtx->MD5Ctx, pb, (unsigned)cb);
-        cbBuf -= cb;
-    }
+    if (g_fFastHash)
+        kOCHash128Update(&pCtx->Hash128, pb, cbBuf);
+    else
+        while (cbBuf > 0)
+        {
+            size_t cb = cbBuf >= 128*1024 ? 128*1024 : cbBuf;
+            pSum->crc32 = crc32(pSum->crc32, pb, cb);
+            MD5Update(&pCtx->MD5Ctx, pb, (unsigned)cb);
+            pb += cb;
+            cbBuf -= cb;
+        }
 }
 
 
@@ -1842,11 +2230,201 @@ static void kOCSumUpdate(PKOCSUM pSum, PKOCSUMCTX pCtx, const void *pvBuf, size_
  */
 static void kOCSumFinalize(PKOCSUM pSum, PKOCSUMCTX pCtx)
 {
-    MD5Final(&pSum->md5[0], &pCtx->MD5Ctx);
+    if (g_fFastHash)
+    {
+        /* The fast hash is 128-bit only, the crc32 field gets the top bits. */
+        kOCHash128Final(&pCtx->Hash128, &pSum->md5[0]);
+        pSum->crc32 = (uint32_t)pSum->md5[12]
+                    | ((uint32_t)pSum->md5[13] << 8)
+                    | ((uint32_t)pSum->md5[14] << 16)
+                    | ((uint32_t)pSum->md5[15] << 24);
+    }
+    else
+        MD5Final(&pSum->md5[0], &pCtx->MD5Ctx);
     pSum->fUsed = 1;
 }
 
 
+/**
+ * Checksums data on a separate thread as it is being produced, so the
+ * checksumming overlaps with reading the preprocessor pipe.
+ *
+ * The data lives in a buffer that only grows at the end; the producer calls
+ * kOCSumThrdFeed after appending and kOCSumThrdSync before reallocating it.
+ * Without threads the data is checksummed right away by kOCSumThrdFeed.
+ */
+typedef struct KOCSUMTHRD
+{
+    /** The checksum being calculated. */
+    PKOCSUM         pSum;
+    /** The checksum context. */
+    PKOCSUMCTX      pCtx;
+    /** The start of the data buffer. */
+    const char     *pchBuf;
+    /** The amount of final data in the buffer. */
+    size_t          cbAvail;
+    /** The amount of data checksummed so far. */
+    size_t          cbDone;
+#ifdef KOC_WITH_SUM_THREAD
+    /** Set if the thread is running. */
+    int             fThread;
+    /** Set when there will be no more data. */
+    int             fEnd;
+    /** The thread handle. */
+    pthread_t       hThread;
+    /** Protects the members above. */
+    pthread_mutex_t Mtx;
+    /** Signalled when there is more data or fEnd is set. */
+    pthread_cond_t  CondWork;
+    /** Signalled when cbDone catches up with cbAvail. */
+    pthread_cond_t  CondIdle;
+#endif
+} KOCSUMTHRD;
+
+
+#ifdef KOC_WITH_SUM_THREAD
+/**
+ * The checksumming thread.
+ *
+ * @returns NULL.
+ * @param   pvUser      The KOCSUMTHRD instance.
+ */
+static void *kOCSumThrdWorker(void *pvUser)
+{
+    PKOCSUMTHRD pThrd = (PKOCSUMTHRD)pvUser;
+    pthread_mutex_lock(&pThrd->Mtx);
+    for (;;)
+    {
+        const char *pch;
+        size_t cb;
+        while (pThrd->cbDone == pThrd->cbAvail && !pThrd->fEnd)
+            pthread_cond_wait(&pThrd->CondWork, &pThrd->Mtx);
+        if (pThrd->cbDone == pThrd->cbAvail)
+            break;
+
+        pch = pThrd->pchBuf + pThrd->cbDone;
+        cb  = pThrd->cbAvail - pThrd->cbDone;
+        if (cb > KOC_SUM_THRD_CHUNK)
+            cb = KOC_SUM_THRD_CHUNK;
+        pthread_mutex_unlock(&pThrd->Mtx);
+
+        kOCSumUpdate(pThrd->pSum, pThrd->pCtx, pch, cb);
+
+        pthread_mutex_lock(&pThrd->Mtx);
+        pThrd->cbDone += cb;
+        if (pThrd->cbDone == pThrd->cbAvail)
+            pthread_cond_signal(&pThrd->CondIdle);
+    }
+    pthread_mutex_unlock(&pThrd->Mtx);
+    return NULL;
+}
+#endif
+
+
+/**
+ * Starts checksumming data fed by kOCSumThrdFeed.
+ *
+ * @param   pThrd   The instance.
+ * @param   pSum    The checksum (initialized by kOCSumInitWithCtx).
+ * @param   pCtx    The checksum context.
+ */
+static void kOCSumThrdStart(PKOCSUMTHRD pThrd, PKOCSUM pSum, PKOCSUMCTX pCtx)
+{
+    pThrd->pSum    = pSum;
+    pThrd->pCtx    = pCtx;
+    pThrd->pchBuf  = NULL;
+    pThrd->cbAvail = 0;
+    pThrd->cbDone  = 0;
+#ifdef KOC_WITH_SUM_THREAD
+    pThrd->fEnd    = 0;
+    pThrd->fThread = 0;
+    pthread_mutex_init(&pThrd->Mtx, NULL);
+    pthread_cond_init(&pThrd->CondWork, NULL);
+    pthread_cond_init(&pThrd->CondIdle, NULL);
+    if (pthread_create(&pThrd->hThread, NULL, kOCSumThrdWorker, pThrd) == 0)
+        pThrd->fThread = 1;
+    else
+        InfoMsg(2, "pthread_create failed, checksumming synchronously\n");
+#endif
+}
+
+
+/**
+ * Makes more data available for checksumming.
+ *
+ * @param   pThrd   The instance.
+ * @param   pchBuf  The start of the data buffer (it may have been moved).
+ * @param   cbAvail The amount of final data in the buffer.
+ */
+static void kOCSumThrdFeed(PKOCSUMTHRD pThrd, const char *pchBuf, size_t cbAvail)
+{
+    assert(cbAvail >= pThrd->cbAvail);
+#ifdef KOC_WITH_SUM_THREAD
+    if (pThrd->fThread)
+    {
+        pthread_mutex_lock(&pThrd->Mtx);
+        pThrd->pchBuf  = pchBuf;
+        pThrd->cbAvail = cbAvail;
+        pthread_cond_signal(&pThrd->CondWork);
+        pthread_mutex_unlock(&pThrd->Mtx);
+        return;
+    }
+#endif
+    kOCSumUpdate(pThrd->pSum, pThrd->pCtx, pchBuf + pThrd->cbDone, cbAvail - pThrd->cbDone);
+    pThrd->pchBuf  = pchBuf;
+    pThrd->cbAvail = pThrd->cbDone = cbAvail;
+}
+
+
+/**
+ * Waits for the thread to checksum all the data fed to it, so the buffer
+ * can be reallocated.
+ *
+ * @param   pThrd   The instance.
+ */
+static void kOCSumThrdSync(PKOCSUMTHRD pThrd)
+{
+#ifdef KOC_WITH_SUM_THREAD
+    if (pThrd->fThread)
+    {
+        pthread_mutex_lock(&pThrd->Mtx);
+        while (pThrd->cbDone != pThrd->cbAvail)
+            pthread_cond_wait(&pThrd->CondIdle, &pThrd->Mtx);
+        pthread_mutex_unlock(&pThrd->Mtx);
+    }
+#else
+    (void)pThrd;
+#endif
+}
+
+
+/**
+ * Waits for all the data to be checksummed and stops the thread.
+ *
+ * The checksum still needs finalizing (kOCSumFinalize).
+ *
+ * @param   pThrd   The instance.
+ */
+static void kOCSumThrdEnd(PKOCSUMTHRD pThrd)
+{
+#ifdef KOC_WITH_SUM_THREAD
+    if (pThrd->fThread)
+    {
+        pthread_mutex_lock(&pThrd->Mtx);
+        pThrd->fEnd = 1;
+        pthread_cond_signal(&pThrd->CondWork);
+        pthread_mutex_unlock(&pThrd->Mtx);
+        pthread_join(pThrd->hThread, NULL);
+        pThrd->fThread = 0;
+    }
+    pthread_cond_destroy(&pThrd->CondIdle);
+    pthread_cond_destroy(&pThrd->CondWork);
+    pthread_mutex_destroy(&pThrd->Mtx);
+#endif
+    assert(pThrd->cbDone == pThrd->cbAvail);
+}
+
+
 /**
  * Init a check sum chain head.
  *
@@ -2069,50 +2647,291 @@ static int kOCSumIsEmpty(PCKOCSUM pSum)
 
 
 /**
- * The representation of a cache entry.
+ * Worker for kOCLzEmitSeq that encodes the remainder of a length.
+ *
+ * @returns Pointer to the byte following the encoded length.
+ * @param   pbOut       Where to encode it.
+ * @param   cb          The length remainder.
  */
-typedef struct KOCENTRY
+static unsigned char *kOCLzEmitLen(unsigned char *pbOut, size_t cb)
 {
-    /** The name of the cache entry. */
-    const char *pszName;
-    /** The dir that all other names are relative to. */
-    char *pszDir;
-    /** The absolute path. */
-    char *pszAbsPath;
-    /** Set if the object needs to be (re)compiled. */
-    unsigned fNeedCompiling;
-    /** Whether the preprocessor runs in piped mode. If clear it's file
-     * mode (it could be redirected stdout, but that's essentially the
-     * same from our point of view). */
-    unsigned fPipedPreComp;
-    /** Whether the compiler runs in piped mode (preprocessor output on stdin). */
-    unsigned fPipedCompile;
-    /** The name of the pipe that we're feeding the preprocessed output to the
-     *  compiler via.  This is a Windows thing. */
-    char *pszNmPipeCompile;
-    /** Name of the dependency file (generated from #line statements in the
-     * preprocessor output). */
-    char *pszMakeDepFilename;
-    /** Whether to fix the case of the make depedencies. */
-    int fMakeDepFixCase;
-    /** Whether to do the make dependencies quietly. */
-    int fMakeDepQuiet;
-    /** Whether to generate stubs for headers files. */
-    int fMakeDepGenStubs;
-    /** The dependency collector state.  */
-    KOCDEP DepState;
-    /** Whether the optimizations are enabled. */
-    int fOptimizeCpp;
-    /** Cache entry key that's used for some quick digest validation. */
-    uint32_t uKey;
+    while (cb >= 255)
+    {
+        *pbOut++ = 255;
+        cb -= 255;
+    }
+    *pbOut++ = (unsigned char)cb;
+    return pbOut;
+}
 
-    /** The file data. */
-    struct KOCENTRYDATA
+
+/**
+ * Worker for kOCLzCompress that encodes one sequence, i.e. a run of literals
+ * optionally followed by a match.
+ *
+ * @returns Pointer to the byte following the sequence.
+ * @param   pbOut       Where to encode it.
+ * @param   pbLit       The literals.
+ * @param   cbLit       The number of literals.
+ * @param   offMatch    The distance back to the match.
+ * @param   cbMatch     The match length, 0 for the final sequence.
+ */
+static unsigned char *kOCLzEmitSeq(unsigned char *pbOut, const unsigned char *pbLit, size_t cbLit,
+                                   size_t offMatch, size_t cbMatch)
+{
+    unsigned char *pbToken = pbOut++;
+    *pbToken = (unsigned char)((cbLit >= 15 ? 15 : cbLit) << 4);
+    if (cbLit >= 15)
+        pbOut = kOCLzEmitLen(pbOut, cbLit - 15);
+    memcpy(pbOut, pbLit, cbLit);
+    pbOut += cbLit;
+
+    if (cbMatch)
     {
-        /** The name of file containing the preprocessor output. */
-        char *pszCppName;
-        /** Pointer to the preprocessor output. */
-        char *pszCppMapping;
+        cbMatch -= KOC_LZ_MIN_MATCH;
+        *pbOut++ = (unsigned char)offMatch;
+        *pbOut++ = (unsigned char)(offMatch >> 8);
+        *pbToken |= (unsigned char)(cbMatch >= 15 ? 15 : cbMatch);
+        if (cbMatch >= 15)
+            pbOut = kOCLzEmitLen(pbOut, cbMatch - 15);
+    }
+    return pbOut;
+}
+
+
+/**
+ * Compresses preprocessor output.
+ *
+ * This is a simple and fast LZ77 variant in the style of LZ4: sequences of a
+ * token byte holding the literal count and match length nibbles, extra
+ * length bytes, the literals and a 16-bit match distance.  The last sequence
+ * has no match.  The stream is prefixed by KOC_LZ_MAGIC and the uncompressed
+ * size (host byte order, 32-bit each).
+ *
+ * @returns Pointer to the compressed data (heap), NULL if it doesn't pay off.
+ * @param   pbSrc       The data to compress.
+ * @param   cbSrc       The number of bytes to compress.
+ * @param   pcbDst      Where to return the size of the compressed data.
+ */
+static unsigned char *kOCLzCompress(const unsigned char *pbSrc, size_t cbSrc, size_t *pcbDst)
+{
+    size_t const offLimit = cbSrc > 12 ? cbSrc - 12 : 0;
+    uint32_t *paHash;
+    unsigned char *pbDst;
+    unsigned char *pbOut;
+    uint32_t u32;
+    size_t offAnchor = 0;
+    size_t off = 0;
+
+    if (cbSrc >= UINT32_MAX)
+        return NULL;
+    pbDst = xmalloc(8 + cbSrc + cbSrc / 255 + 16);
+    paHash = xmallocz(sizeof(paHash[0]) << KOC_LZ_HASH_BITS);
+    pbOut = pbDst + 8;
+    while (off < offLimit)
+    {
+        uint32_t offRef;
+        uint32_t iHash;
+        memcpy(&u32, &pbSrc[off], sizeof(u32));
+        iHash = (u32 * 2654435761U) >> (32 - KOC_LZ_HASH_BITS);
+        offRef = paHash[iHash];
+        paHash[iHash] = (uint32_t)off;
+        if (    offRef < off
+            &&  off - offRef <= 0xffff
+            &&  !memcmp(&pbSrc[offRef], &pbSrc[off], KOC_LZ_MIN_MATCH))
+        {
+            size_t const cbMax = cbSrc - 5 - off;
+            size_t cbMatch = KOC_LZ_MIN_MATCH;
+            while (cbMatch < cbMax && pbSrc[offRef + cbMatch] == pbSrc[off + cbMatch])
+                cbMatch++;
+            pbOut = kOCLzEmitSeq(pbOut, &pbSrc[offAnchor], off - offAnchor, off - offRef, cbMatch);
+            off += cbMatch;
+            offAnchor = off;
+        }
+        else
+            off++;
+    }
+    pbOut = kOCLzEmitSeq(pbOut, &pbSrc[offAnchor], cbSrc - offAnchor, 0, 0);
+    free(paHash);
+
+    *pcbDst = pbOut - pbDst;
+    if (*pcbDst >= cbSrc)
+    {
+        free(pbDst);
+        return NULL;
+    }
+    u32 = KOC_LZ_MAGIC;
+    memcpy(pbDst, &u32, sizeof(u32));
+    u32 = (uint32_t)cbSrc;
+    memcpy(pbDst + 4, &u32, sizeof(u32));
+    return pbDst;
+}
+
+
+/**
+ * Worker for kOCLzDecompress that decodes the remainder of a length.
+ *
+ * @returns 0 on success, -1 if the input is bad.
+ * @param   ppbSrc      Pointer to the input pointer.  Advanced.
+ * @param   pbEnd       The end of the input.
+ * @param   pcb         The length to add the remainder to.
+ */
+static int kOCLzReadLen(const unsigned char **ppbSrc, const unsigned char *pbEnd, size_t *pcb)
+{
+    const unsigned char *pbSrc = *ppbSrc;
+    unsigned char b;
+    do
+    {
+        if (pbSrc >= pbEnd)
+            return -1;
+        b = *pbSrc++;
+        *pcb += b;
+    } while (b == 255);
+    *ppbSrc = pbSrc;
+    return 0;
+}
+
+
+/**
+ * Decompresses data produced by kOCLzCompress.
+ *
+ * @returns 0 on success, -1 if the input is bad.
+ * @param   pbSrc       The compressed stream (following the size).
+ * @param   cbSrc       The size of the compressed stream.
+ * @param   pbDst       The output buffer.
+ * @param   cbDst       The uncompressed size.
+ */
+static int kOCLzDecompress(const unsigned char *pbSrc, size_t cbSrc, unsigned char *pbDst, size_t cbDst)
+{
+    const unsigned char *pbEnd = pbSrc + cbSrc;
+    size_t offDst = 0;
+    while (pbSrc < pbEnd)
+    {
+        unsigned bToken = *pbSrc++;
+        size_t offMatch;
+        size_t cb = bToken >> 4;
+        if (cb == 15 && kOCLzReadLen(&pbSrc, pbEnd, &cb))
+            return -1;
+        if (cb > (size_t)(pbEnd - pbSrc) || cb > cbDst - offDst)
+            return -1;
+        memcpy(&pbDst[offDst], pbSrc, cb);
+        pbSrc += cb;
+        offDst += cb;
+        if (pbSrc == pbEnd)
+            break;
+
+        if (pbEnd - pbSrc < 2)
+            return -1;
+        offMatch = pbSrc[0] | ((size_t)pbSrc[1] << 8);
+        pbSrc += 2;
+        cb = bToken & 15;
+        if (cb == 15 && kOCLzReadLen(&pbSrc, pbEnd, &cb))
+            return -1;
+        cb += KOC_LZ_MIN_MATCH;
+        if (!offMatch || offMatch > offDst || cb > cbDst - offDst)
+            return -1;
+        if (offMatch >= cb)
+            memcpy(&pbDst[offDst], &pbDst[offDst - offMatch], cb);
+        else
+        {
+            size_t i;
+            for (i = 0; i < cb; i++)
+                pbDst[offDst + i] = pbDst[offDst - offMatch + i];
+        }
+        offDst += cb;
+    }
+    return offDst == cbDst ? 0 : -1;
+}
+
+
+/**
+ * A file the preprocessor output was produced from (direct mode).
+ */
+typedef struct KOCDIRDEP
+{
+    /** Pointer to the next dependency. */
+    struct KOCDIRDEP *pNext;
+    /** The size of the file. */
+    unsigned long cbFile;
+    /** The modification time of the file.  0 if the content must always be
+     * checked because the file was too new when it was recorded. */
+    long tMTime;
+    /** The checksum of the file content. */
+    KOCSUM Sum;
+    /** The absolute path of the file. */
+    char szPath[1];
+} KOCDIRDEP;
+/** Pointer to a KOCDIRDEP. */
+typedef KOCDIRDEP *PKOCDIRDEP;
+/** Pointer to a const KOCDIRDEP. */
+typedef const KOCDIRDEP *PCKOCDIRDEP;
+
+/** Files modified less than this number of seconds before the preprocessor
+ * was started are not trusted by their size and modification time. */
+#define KOC_DIRECT_RACY_SECS    2
+/** The length of the longest predefined macro that expands differently on
+ * each run, see kOCDirDepHasTimeMacro. */
+#define KOC_TIME_MACRO_MAX      (sizeof("__TIMESTAMP__") - 1)
+
+
+/**
+ * The representation of a cache entry.
+ */
+typedef struct KOCENTRY
+{
+    /** The name of the cache entry. */
+    const char *pszName;
+    /** The dir that all other names are relative to. */
+    char *pszDir;
+    /** The absolute path. */
+    char *pszAbsPath;
+    /** Set if the object needs to be (re)compiled. */
+    unsigned fNeedCompiling;
+    /** Whether the preprocessor runs in piped mode. If clear it's file
+     * mode (it could be redirected stdout, but that's essentially the
+     * same from our point of view). */
+    unsigned fPipedPreComp;
+    /** Whether the compiler runs in piped mode (preprocessor output on stdin). */
+    unsigned fPipedCompile;
+    /** The name of the pipe that we're feeding the preprocessed output to the
+     *  compiler via.  This is a Windows thing. */
+    char *pszNmPipeCompile;
+    /** Name of the dependency file (generated from #line statements in the
+     * preprocessor output). */
+    char *pszMakeDepFilename;
+    /** Whether to fix the case of the make depedencies. */
+    int fMakeDepFixCase;
+    /** Whether to do the make dependencies quietly. */
+    int fMakeDepQuiet;
+    /** Whether to generate stubs for headers files. */
+    int fMakeDepGenStubs;
+    /** The dependency collector state.  */
+    KOCDEP DepState;
+    /** Whether the optimizations are enabled. */
+    int fOptimizeCpp;
+    /** Whether direct mode is enabled, i.e. whether the preprocessor can be
+     * skipped when none of the files it used have changed. */
+    int fDirectMode;
+    /** Whether to collect dependencies from the preprocessor output. */
+    int fCollectDeps;
+    /** The time the direct mode checks were started (racy file detection). */
+    long tDirectStart;
+    /** Whether to compress the preprocessor output file when the compiler
+     * doesn't need it. */
+    int fCompressCpp;
+    /** The number of bytes compression saved on the preprocessor output file
+     * written by this run. */
+    size_t cbCppSaved;
+    /** Cache entry key that's used for some quick digest validation. */
+    uint32_t uKey;
+
+    /** The file data. */
+    struct KOCENTRYDATA
+    {
+        /** The name of file containing the preprocessor output. */
+        char *pszCppName;
+        /** Pointer to the preprocessor output. */
+        char *pszCppMapping;
         /** The size of the preprocessor output. 0 if not determined. */
         size_t cbCpp;
         /** The preprocessor output checksums that will produce the cached object. */
@@ -2135,6 +2954,11 @@ typedef struct KOCENTRY
 
         /** The target os/arch identifier. */
         char *pszTarget;
+
+        /** The checksum of the preprocessor argument vector (direct mode). */
+        KOCSUM SumCppArgv;
+        /** The files the preprocessor output was produced from (direct mode). */
+        PKOCDIRDEP pDirDeps;
     }
     /** The old data.*/
             Old,
@@ -2147,6 +2971,171 @@ typedef KOCENTRY *PKOCENTRY;
 typedef const KOCENTRY *PCKOCENTRY;
 
 
+/**
+ * Allocates a direct mode dependency record.
+ *
+ * @returns Pointer to the new record, the checksum is uninitialized.
+ * @param   pszPath     The absolute path of the file.
+ * @param   cbFile      The size of the file.
+ * @param   tMTime      The modification time of the file.
+ */
+static PKOCDIRDEP kOCDirDepCreate(const char *pszPath, unsigned long cbFile, long tMTime)
+{
+    size_t cchPath = strlen(pszPath);
+    PKOCDIRDEP pDirDep = xmalloc(sizeof(*pDirDep) + cchPath);
+    pDirDep->pNext = NULL;
+    pDirDep->cbFile = cbFile;
+    pDirDep->tMTime = tMTime;
+    memcpy(pDirDep->szPath, pszPath, cchPath + 1);
+    return pDirDep;
+}
+
+
+/**
+ * Frees a list of direct mode dependency records.
+ *
+ * @param   ppHead      Pointer to the list head.  Set to NULL.
+ */
+static void kOCDirDepDeleteList(PKOCDIRDEP *ppHead)
+{
+    PKOCDIRDEP pDirDep = *ppHead;
+    *ppHead = NULL;
+    while (pDirDep)
+    {
+        PKOCDIRDEP pFree = pDirDep;
+        pDirDep = pDirDep->pNext;
+        free(pFree);
+    }
+}
+
+
+/**
+ * Checks whether the text mentions any of the predefined macros that expand
+ * differently on each run: __DATE__, __TIME__ and __TIMESTAMP__.
+ *
+ * @returns 1 if it does, 0 if it doesn't.
+ * @param   pch         The text.
+ * @param   cch         The length of the text.
+ */
+static int kOCDirDepHasTimeMacro(const char *pch, size_t cch)
+{
+    const char *pchEnd = pch + cch;
+    while ((pch = memchr(pch, '_', pchEnd - pch)) != NULL)
+    {
+        size_t cchLeft = pchEnd - pch;
+        if (cchLeft < sizeof("__DATE__") - 1)
+            break;
+        if (    pch[1] == '_'
+            &&  (   !memcmp(pch + 2, "DATE__", 6)
+                 || !memcmp(pch + 2, "TIME__", 6)
+                 || (   cchLeft >= KOC_TIME_MACRO_MAX
+                     && !memcmp(pch + 2, "TIMESTAMP__", 11))))
+            return 1;
+        pch++;
+    }
+    return 0;
+}
+
+
+/**
+ * Calculates the checksum of a file's content.
+ *
+ * @returns 0 on success, -1 on failure (errno set).
+ * @param   pszPath     The file.
+ * @param   pSum        Where to store the checksum.
+ * @param   pfTimeMacro Where to return whether the file mentions __DATE__,
+ *                      __TIME__ or __TIMESTAMP__, which makes the
+ *                      preprocessor output differ from run to run.
+ */
+static int kOCDirDepCalcSum(const char *pszPath, PKOCSUM pSum, int *pfTimeMacro)
+{
+    KOCSUMCTX Ctx;
+    char *pbBuf;
+    long cbRead;
+    size_t cbCarry = 0;
+    int fd = open(pszPath, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return -1;
+
+    /* The buffer starts with the tail of the previous read so we catch
+       macros straddling two reads. */
+    *pfTimeMacro = 0;
+    pbBuf = xmalloc(KOC_TIME_MACRO_MAX + 64*1024);
+    kOCSumInitWithCtx(pSum, &Ctx);
+    for (;;)
+    {
+        cbRead = read(fd, pbBuf + cbCarry, 64*1024);
+        if (cbRead > 0)
+        {
+            kOCSumUpdate(pSum, &Ctx, pbBuf + cbCarry, cbRead);
+            if (!*pfTimeMacro)
+            {
+                size_t cb = cbCarry + cbRead;
+                *pfTimeMacro = kOCDirDepHasTimeMacro(pbBuf, cb);
+                cbCarry = cb < KOC_TIME_MACRO_MAX - 1 ? cb : KOC_TIME_MACRO_MAX - 1;
+                memmove(pbBuf, pbBuf + cb - cbCarry, cbCarry);
+            }
+        }
+        else if (cbRead == 0)
+            break;
+        else if (errno != EINTR)
+        {
+            int iErr = errno;
+            kOCSumFinalize(pSum, &Ctx);
+            free(pbBuf);
+            close(fd);
+            errno = iErr;
+            return -1;
+        }
+    }
+    kOCSumFinalize(pSum, &Ctx);
+    free(pbBuf);
+    close(fd);
+    return 0;
+}
+
+
+/**
+ * Parses a 'direct-dep' cache entry value.
+ *
+ * The format is '<size>:<mtime>:<checksum>:<path>'.
+ *
+ * @returns Pointer to the new record, NULL on format error.
+ * @param   pszVal      The value string.  Modified.
+ */
+static PKOCDIRDEP kOCDirDepCreateFromString(char *pszVal)
+{
+    PKOCDIRDEP pDirDep;
+    unsigned long cbFile;
+    long tMTime;
+    char *pszSum;
+    char *pszPath;
+    KOCSUM Sum;
+
+    cbFile = strtoul(pszVal, &pszSum, 0);
+    if (*pszSum != ':')
+        return NULL;
+    tMTime = strtol(pszSum + 1, &pszSum, 0);
+    if (*pszSum != ':')
+        return NULL;
+    pszSum++;
+
+    pszPath = strchr(pszSum, ':');
+    if (!pszPath || strlen(pszPath) < 1 + sizeof(Sum.md5) * 2 + 2)
+        return NULL;
+    pszPath += 1 + sizeof(Sum.md5) * 2;
+    if (*pszPath != ':')
+        return NULL;
+    *pszPath++ = '\0';
+    if (kOCSumInitFromString(&Sum, pszSum))
+        return NULL;
+
+    pDirDep = kOCDirDepCreate(pszPath, cbFile, tMTime);
+    pDirDep->Sum = Sum;
+    return pDirDep;
+}
+
+
 /**
  * Creates a cache entry for the given cache file name.
  *
@@ -2171,6 +3160,9 @@ static PKOCENTRY kOCEntryCreate(const char *pszFilename)
     kOCSumInit(&pEntry->New.SumCompArgv);
     kOCSumInit(&pEntry->Old.SumCompArgv);
 
+    kOCSumInit(&pEntry->New.SumCppArgv);
+    kOCSumInit(&pEntry->Old.SumCppArgv);
+
     /*
      * Setup the directory and cache file name.
      */
@@ -2228,6 +3220,12 @@ static void kOCEntryDestroy(PKOCENTRY pEntry)
     free(pEntry->New.papszArgvCompile);
     free(pEntry->Old.papszArgvCompile);
 
+    kOCSumDeleteChain(&pEntry->New.SumCppArgv);
+    kOCSumDeleteChain(&pEntry->Old.SumCppArgv);
+
+    kOCDirDepDeleteList(&pEntry->New.pDirDeps);
+    kOCDirDepDeleteList(&pEntry->Old.pDirDeps);
+
     free(pEntry);
 }
 
@@ -2386,6 +3384,21 @@ static void kOCEntryRead(PKOCENTRY pEntry)
                     if ((fBad = pszNext && *pszNext))
                         break;
                 }
+                else if (!strcmp(g_szLine, "cpp-argv-sum"))
+                {
+                    if ((fBad = !kOCSumIsEmpty(&pEntry->Old.SumCppArgv)))
+                        break;
+                    if ((fBad = kOCSumInitFromString(&pEntry->Old.SumCppArgv, pszVal)))
+                        break;
+                }
+                else if (!strcmp(g_szLine, "direct-dep"))
+                {
+                    PKOCDIRDEP pDirDep = kOCDirDepCreateFromString(pszVal);
+                    if ((fBad = pDirDep == NULL))
+                        break;
+                    pDirDep->pNext = pEntry->Old.pDirDeps;
+                    pEntry->Old.pDirDeps = pDirDep;
+                }
                 else if (!strcmp(g_szLine, "target"))
                 {
                     if ((fBad = pEntry->Old.pszTarget != NULL))
@@ -2490,12 +3503,18 @@ static void kOCEntryWrite(PKOCENTRY pEntry)
     FILE *pFile;
     PCKOCSUM pSum;
     unsigned i;
+    char *pszTmpName;
 
+    /*
+     * Other processes may read the entry file without holding any lock, so
+     * it is written to a temporary file that then replaces the entry file.
+     */
     InfoMsg(4, "writing cache entry '%s'...\n", pEntry->pszName);
-    pFile = FOpenFileInDir(pEntry->pszName, pEntry->pszDir, "wb");
+    pszTmpName = MakeTempName(pEntry->pszName);
+    pFile = FOpenFileInDir(pszTmpName, pEntry->pszDir, "wb");
     if (!pFile)
         FatalDie("Failed to open '%s' in '%s': %s\n",
-                 pEntry->pszName, pEntry->pszDir, strerror(errno));
+                 pszTmpName, pEntry->pszDir, strerror(errno));
 
 #define CHECK_LEN(expr) \
         do { int cch = expr; if (cch >= KOBJCACHE_MAX_LINE_LEN) FatalDie("Line too long: %d (max %d)\nexpr: %s\n", cch, KOBJCACHE_MAX_LINE_LEN, #expr); } while (0)
@@ -2535,6 +3554,21 @@ static void kOCEntryWrite(PKOCENTRY pEntry)
         kOCSumFPrintf(pSum, pFile);
     }
 
+    if (pEntry->New.pDirDeps)
+    {
+        PCKOCDIRDEP pDirDep;
+        fprintf(pFile, "cpp-argv-sum=");
+        kOCSumFPrintf(&pEntry->New.SumCppArgv, pFile);
+        for (pDirDep = pEntry->New.pDirDeps; pDirDep; pDirDep = pDirDep->pNext)
+        {
+            CHECK_LEN(fprintf(pFile, "direct-dep=%lu:%ld:%#x:", pDirDep->cbFile, pDirDep->tMTime, pDirDep->Sum.crc32)
+                      + 32 + 1 + strlen(pDirDep->szPath) + 1);
+            for (i = 0; i < sizeof(pDirDep->Sum.md5); i++)
+                fprintf(pFile, "%02x", pDirDep->Sum.md5[i]);
+            fprintf(pFile, ":%s\n", pDirDep->szPath);
+        }
+    }
+
     fprintf(pFile, "the-end=fine\n");
 
 #undef CHECK_LEN
@@ -2550,11 +3584,38 @@ static void kOCEntryWrite(PKOCENTRY pEntry)
     {
         int iErr = errno;
         fclose(pFile);
+        UnlinkFileInDir(pszTmpName, pEntry->pszDir);
         UnlinkFileInDir(pEntry->pszName, pEntry->pszDir);
         FatalDie("Stream error occured while writing '%s' in '%s': %s\n",
-                 pEntry->pszName, pEntry->pszDir, strerror(iErr));
+                 pszTmpName, pEntry->pszDir, strerror(iErr));
     }
     fclose(pFile);
+    if (ReplaceFileInDir(pszTmpName, pEntry->pszName, pEntry->pszDir))
+    {
+        int iErr = errno;
+        UnlinkFileInDir(pszTmpName, pEntry->pszDir);
+        UnlinkFileInDir(pEntry->pszName, pEntry->pszDir);
+        FatalDie("Failed to rename '%s' to '%s' in '%s': %s\n",
+                 pszTmpName, pEntry->pszName, pEntry->pszDir, strerror(iErr));
+    }
+    free(pszTmpName);
+}
+
+
+/**
+ * Invalidates the cache entry file before the outputs are regenerated.
+ *
+ * Other processes may validate the entry and copy its object file without
+ * holding the cache lock, so the entry file must not vouch for an object
+ * file that is being rewritten.
+ *
+ * @param   pEntry      The cache entry.
+ */
+static void kOCEntryInvalidate(PKOCENTRY pEntry)
+{
+    if (    UnlinkFileInDir(pEntry->pszName, pEntry->pszDir) != 0
+        &&  errno != ENOENT)
+        FatalDie("Failed to remove '%s' in '%s': %s\n", pEntry->pszName, pEntry->pszDir, strerror(errno));
 }
 
 
@@ -2726,6 +3787,71 @@ static void kOCEntrySetOptimizations(PKOCENTRY pEntry, int fOptimizeCpp)
 }
 
 
+/**
+ * Configures the compression of the preprocessor output file.
+ *
+ * @param   pEntry                  The cache entry.
+ * @param   fCompressCpp            Whether to compress it.
+ */
+static void kOCEntrySetCompression(PKOCENTRY pEntry, int fCompressCpp)
+{
+    pEntry->fCompressCpp = fCompressCpp;
+}
+
+
+/**
+ * Configures direct mode and calculates the checksum of the preprocessor
+ * argument vector.
+ *
+ * The identity of the preprocessor executable (path, size and modification
+ * time) is included in the checksum, so upgrading the compiler doesn't give
+ * stale direct hits.
+ *
+ * @param   pEntry              The cache entry.
+ * @param   fDirectMode         Whether direct mode is enabled.
+ * @param   papszArgvPreComp    The argument vector for executing preprocessor.
+ * @param   cArgvPreComp        The number of arguments.
+ *
+ * @remark  Must call kOCEntrySetDepFilename before this function!
+ */
+static void kOCEntrySetDirectMode(PKOCENTRY pEntry, int fDirectMode, const char * const *papszArgvPreComp,
+                                  unsigned cArgvPreComp)
+{
+    pEntry->fDirectMode = fDirectMode;
+    pEntry->fCollectDeps = fDirectMode || pEntry->pszMakeDepFilename;
+    if (fDirectMode)
+    {
+        const char **papszArgv = xmalloc((cArgvPreComp + 2) * sizeof(papszArgv[0]));
+        char *pszExe = FindExecutable(papszArgvPreComp[0]);
+        char *pszId;
+        struct stat st;
+        if (!pszExe || stat(pszExe, &st))
+        {
+            InfoMsg(2, "direct mode: can't find '%s', disabled\n", papszArgvPreComp[0]);
+            pEntry->fDirectMode = 0;
+            pEntry->fCollectDeps = pEntry->pszMakeDepFilename != NULL;
+            free(pszExe);
+            free(papszArgv);
+            return;
+        }
+        pszId = xmalloc(strlen(pszExe) + 64);
+        sprintf(pszId, "%s:%lu:%ld", pszExe, (unsigned long)st.st_size, (long)st.st_mtime);
+        free(pszExe);
+
+        memcpy(papszArgv, papszArgvPreComp, cArgvPreComp * sizeof(papszArgv[0]));
+        papszArgv[cArgvPreComp] = pszId;
+        papszArgv[cArgvPreComp + 1] = NULL;
+
+        pEntry->tDirectStart = (long)time(NULL);
+        kOCEntryCalcArgvSum(pEntry, papszArgv, cArgvPreComp + 1, pEntry->New.pszCppName, NULL,
+                            &pEntry->New.SumCppArgv);
+        kOCSumInfo(&pEntry->New.SumCppArgv, 4, "cpp-argv");
+        free(pszId);
+        free(papszArgv);
+    }
+}
+
+
 /**
  * Spawns a child in a synchronous fashion.
  * Terminating on failure.
@@ -3122,6 +4248,34 @@ static int kOCEntryReadCppOutput(PKOCENTRY pEntry, struct KOCENTRYDATA *pWhich,
         return -1;
     }
 
+    if (pWhich->cbCpp >= 8)
+    {
+        uint32_t u32Magic;
+        uint32_t cbUncompressed;
+        memcpy(&u32Magic, pWhich->pszCppMapping, sizeof(u32Magic));
+        memcpy(&cbUncompressed, pWhich->pszCppMapping + 4, sizeof(cbUncompressed));
+        if (u32Magic == KOC_LZ_MAGIC)
+        {
+            char *pszCpp = xmalloc(cbUncompressed + 1);
+            if (kOCLzDecompress((const unsigned char *)pWhich->pszCppMapping + 8, pWhich->cbCpp - 8,
+                                (unsigned char *)pszCpp, cbUncompressed))
+            {
+                free(pszCpp);
+                free(pWhich->pszCppMapping);
+                pWhich->pszCppMapping = NULL;
+                pWhich->cbCpp = 0;
+                if (!fNonFatal)
+                    FatalDie("bad compressed file '%s' in '%s'\n", pWhich->pszCppName, pEntry->pszDir);
+                InfoMsg(2, "bad compressed file '%s' in '%s'\n", pWhich->pszCppName, pEntry->pszDir);
+                return -1;
+            }
+            pszCpp[cbUncompressed] = '\0';
+            free(pWhich->pszCppMapping);
+            pWhich->pszCppMapping = pszCpp;
+            pWhich->cbCpp = cbUncompressed;
+        }
+    }
+
     InfoMsg(3, "preprocessed file is %lu bytes long\n", (unsigned long)pWhich->cbCpp);
     return 0;
 }
@@ -3144,40 +4298,133 @@ static void kOCEntryCalcChecksum(PKOCENTRY pEntry)
 
 
 /**
- * This consumes the preprocessor output and checksums it.
+ * Records the files the preprocessor output was produced from for direct mode.
  *
- * @param   pEntry  The cache entry.
- * @param   fdIn    The preprocessor output pipe.
- * @param   fdOut   The compiler input pipe, -1 if no compiler.
+ * Nothing is recorded if any of the files cannot be checked, was modified
+ * so recently that a change could go unnoticed by its size and timestamp, or
+ * uses __DATE__, __TIME__ or __TIMESTAMP__.  Checksums (and thus the macro
+ * scan) are only reused from an entry made with the same preprocessor
+ * arguments and compiler, see kOCEntrySetDirectMode.
+ *
+ * @param   pEntry      The cache entry. New.pDirDeps will be set.
  */
-static void kOCEntryPreProcessConsumer(PKOCENTRY pEntry, int fdIn)
+static void kOCEntryRecordDirDeps(PKOCENTRY pEntry)
 {
-    KOCSUMCTX Ctx;
-    KOCCPPRD CppRd;
+    PKOCDIRDEP pHead = NULL;
+    PDEP pDep;
+    int fSameArgv = kOCSumIsEqual(&pEntry->New.SumCppArgv, &pEntry->Old.SumCppArgv);
 
-    kOCSumInitWithCtx(&pEntry->New.SumHead, &Ctx);
-    kOCCppRdInit(&CppRd, pEntry->Old.cbCpp, pEntry->fOptimizeCpp,
-                 pEntry->pszMakeDepFilename ? &pEntry->DepState : NULL);
-
-    for (;;)
+    for (pDep = depFirst(); pDep; pDep = pDep->pNext)
     {
-        /*
-         * Read data from the pipe.
-         */
-        const char *psz;
-        long cbRead = kOCCppRdRead(&CppRd, fdIn, &psz);
-        if (!cbRead)
+        PKOCDIRDEP pDirDep;
+        PCKOCDIRDEP pOld;
+        struct stat st;
+        int fTimeMacro;
+        char *pszPath = AbsPath(pDep->szFilename);
+        if (stat(pszPath, &st) != 0)
+        {
+            InfoMsg(2, "direct mode: failed to stat '%s': %s\n", pszPath, strerror(errno));
+            free(pszPath);
+            break;
+        }
+        if ((long)st.st_mtime >= pEntry->tDirectStart - KOC_DIRECT_RACY_SECS)
+        {
+            InfoMsg(2, "direct mode: '%s' is too new\n", pszPath);
+            free(pszPath);
             break;
+        }
 
-        /*
-         * Process the data.
-         */
-        kOCSumUpdate(&pEntry->New.SumHead, &Ctx, psz, cbRead);
-        if (pEntry->pszMakeDepFilename && !pEntry->fOptimizeCpp)
-            kOCDepConsumer(&pEntry->DepState, psz, cbRead);
+        pDirDep = kOCDirDepCreate(pszPath, (unsigned long)st.st_size, (long)st.st_mtime);
+        free(pszPath);
+        pDirDep->pNext = pHead;
+        pHead = pDirDep;
+
+        for (pOld = fSameArgv ? pEntry->Old.pDirDeps : NULL; pOld; pOld = pOld->pNext)
+            if (    pOld->tMTime == pDirDep->tMTime
+                &&  pOld->cbFile == pDirDep->cbFile
+                &&  !strcmp(pOld->szPath, pDirDep->szPath))
+                break;
+        if (pOld)
+            pDirDep->Sum = pOld->Sum;
+        else if (kOCDirDepCalcSum(pDirDep->szPath, &pDirDep->Sum, &fTimeMacro))
+        {
+            InfoMsg(2, "direct mode: failed to read '%s': %s\n", pDirDep->szPath, strerror(errno));
+            break;
+        }
+        else if (fTimeMacro)
+        {
+            InfoMsg(2, "direct mode: '%s' uses __DATE__, __TIME__ or __TIMESTAMP__\n", pDirDep->szPath);
+            break;
+        }
+    }
+
+    if (!pDep && pHead)
+    {
+        InfoMsg(3, "direct mode: recorded the dependencies\n");
+        pEntry->New.pDirDeps = pHead;
+    }
+    else
+        kOCDirDepDeleteList(&pHead);
+}
+
+
+/**
+ * Worker for kOCEntryPreProcess and kOCEntryPreProcessAndCompile that deals
+ * with the dependencies collected from the preprocessor output.
+ *
+ * @param   pEntry      The cache entry.
+ */
+static void kOCEntryProcessDeps(PKOCENTRY pEntry)
+{
+    if (pEntry->pszMakeDepFilename)
+        kOCDepWriteToFile(&pEntry->DepState, pEntry->pszMakeDepFilename, pEntry->New.pszObjName, pEntry->pszDir,
+                          pEntry->fMakeDepFixCase, pEntry->fMakeDepQuiet, pEntry->fMakeDepGenStubs);
+    else if (pEntry->fCollectDeps)
+        depOptimize(0 /*fFixCase*/, 1 /*fQuiet*/, NULL /*pszIgnoredExt*/);
+    if (pEntry->fDirectMode)
+        kOCEntryRecordDirDeps(pEntry);
+}
+
+
+/**
+ * This consumes the preprocessor output and checksums it.
+ *
+ * @param   pEntry  The cache entry.
+ * @param   fdIn    The preprocessor output pipe.
+ * @param   fdOut   The compiler input pipe, -1 if no compiler.
+ */
+static void kOCEntryPreProcessConsumer(PKOCENTRY pEntry, int fdIn)
+{
+    KOCSUMCTX  Ctx;
+    KOCSUMTHRD SumThrd;
+    KOCCPPRD   CppRd;
+
+    kOCSumInitWithCtx(&pEntry->New.SumHead, &Ctx);
+    kOCCppRdInit(&CppRd, pEntry->Old.cbCpp, pEntry->fOptimizeCpp,
+                 pEntry->fCollectDeps && pEntry->fOptimizeCpp ? &pEntry->DepState : NULL);
+    kOCSumThrdStart(&SumThrd, &pEntry->New.SumHead, &Ctx);
+    CppRd.pSumThrd = &SumThrd;
+
+    for (;;)
+    {
+        /*
+         * Read data from the pipe.
+         */
+        const char *psz;
+        long cbRead = kOCCppRdRead(&CppRd, fdIn, &psz);
+        if (!cbRead)
+            break;
+
+        /*
+         * Process the data.
+         */
+        kOCSumThrdFeed(&SumThrd, CppRd.pszBuf, psz + cbRead - CppRd.pszBuf);
+        if (pEntry->fCollectDeps && !pEntry->fOptimizeCpp)
+            kOCDepConsumer(&pEntry->DepState, psz, cbRead);
     }
 
     close(fdIn);
+    kOCSumThrdEnd(&SumThrd);
     kOCCppRdGrabOutput(&CppRd, &pEntry->New.pszCppMapping, &pEntry->New.cbCpp);
     kOCCppRdDelete(&CppRd);
     kOCSumFinalize(&pEntry->New.SumHead, &Ctx);
@@ -3233,13 +4480,11 @@ static void kOCEntryPreProcess(PKOCENTRY pEntry, const char * const *papszArgvPr
         kOCEntrySpawn(pEntry, &pEntry->New.cMsCpp, papszArgvPreComp, cArgvPreComp, "preprocess", NULL);
         kOCEntryReadCppOutput(pEntry, &pEntry->New, 0 /* fatal */);
         kOCEntryCalcChecksum(pEntry);
-        if (pEntry->pszMakeDepFilename)
+        if (pEntry->fCollectDeps)
             kOCDepConsumer(&pEntry->DepState, pEntry->New.pszCppMapping, pEntry->New.cbCpp);
     }
 
-    if (pEntry->pszMakeDepFilename)
-        kOCDepWriteToFile(&pEntry->DepState, pEntry->pszMakeDepFilename, pEntry->New.pszObjName, pEntry->pszDir,
-                          pEntry->fMakeDepFixCase, pEntry->fMakeDepQuiet, pEntry->fMakeDepGenStubs);
+    kOCEntryProcessDeps(pEntry);
 }
 
 
@@ -3267,6 +4512,7 @@ static void kOCEntryWriteCppOutput(PKOCENTRY pEntry, int fFreeIt)
     {
         long cbLeft;
         char *psz;
+        unsigned char *pbCompressed = NULL;
         int fd = OpenFileInDir(pEntry->New.pszCppName, pEntry->pszDir,
                                O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
         if (fd == -1)
@@ -3274,6 +4520,21 @@ static void kOCEntryWriteCppOutput(PKOCENTRY pEntry, int fFreeIt)
                      pEntry->New.pszCppName, pEntry->pszDir, strerror(errno));
         psz = pEntry->New.pszCppMapping;
         cbLeft = (long)pEntry->New.cbCpp;
+
+        /* Only compress it when the compiler doesn't read the file. */
+        if (pEntry->fCompressCpp && pEntry->fPipedCompile)
+        {
+            size_t cbCompressed;
+            pbCompressed = kOCLzCompress((const unsigned char *)psz, pEntry->New.cbCpp, &cbCompressed);
+            if (pbCompressed)
+            {
+                InfoMsg(3, "compressed preprocessor output: %lu -> %lu bytes\n",
+                        (unsigned long)pEntry->New.cbCpp, (unsigned long)cbCompressed);
+                pEntry->cbCppSaved = pEntry->New.cbCpp - cbCompressed;
+                psz = (char *)pbCompressed;
+                cbLeft = (long)cbCompressed;
+            }
+        }
         while (cbLeft > 0)
         {
             long cbWritten = write(fd, psz, cbLeft);
@@ -3292,6 +4553,7 @@ static void kOCEntryWriteCppOutput(PKOCENTRY pEntry, int fFreeIt)
             cbLeft -= cbWritten;
         }
         close(fd);
+        free(pbCompressed);
     }
 
     /*
@@ -3407,12 +4669,15 @@ static void kOCEntryTeeConsumer(PKOCENTRY pEntry, int fdIn, int fdOut)
 #ifdef __WIN__
     unsigned fConnectedToCompiler = fdOut == -1 || pEntry->pszNmPipeCompile == NULL;
 #endif
-    KOCSUMCTX Ctx;
-    KOCCPPRD  CppRd;
+    KOCSUMCTX  Ctx;
+    KOCSUMTHRD SumThrd;
+    KOCCPPRD   CppRd;
 
     kOCSumInitWithCtx(&pEntry->New.SumHead, &Ctx);
     kOCCppRdInit(&CppRd, pEntry->Old.cbCpp, pEntry->fOptimizeCpp,
-                 pEntry->pszMakeDepFilename ? &pEntry->DepState : NULL);
+                 pEntry->fCollectDeps && pEntry->fOptimizeCpp ? &pEntry->DepState : NULL);
+    kOCSumThrdStart(&SumThrd, &pEntry->New.SumHead, &Ctx);
+    CppRd.pSumThrd = &SumThrd;
     InfoMsg(3, "preprocessor|compile - starting passhtru...\n");
     for (;;)
     {
@@ -3428,8 +4693,8 @@ static void kOCEntryTeeConsumer(PKOCENTRY pEntry, int fdIn, int fdOut)
         /*
          * Process the data.
          */
-        kOCSumUpdate(&pEntry->New.SumHead, &Ctx, psz, cbRead);
-        if (pEntry->pszMakeDepFilename && !pEntry->fOptimizeCpp)
+        kOCSumThrdFeed(&SumThrd, CppRd.pszBuf, psz + cbRead - CppRd.pszBuf);
+        if (pEntry->fCollectDeps && !pEntry->fOptimizeCpp)
             kOCDepConsumer(&pEntry->DepState, psz, cbRead);
 
 #ifdef __WIN__
@@ -3455,6 +4720,7 @@ static void kOCEntryTeeConsumer(PKOCENTRY pEntry, int fdIn, int fdOut)
 
     close(fdIn);
     close(fdOut);
+    kOCSumThrdEnd(&SumThrd);
     kOCCppRdGrabOutput(&CppRd, &pEntry->New.pszCppMapping, &pEntry->New.cbCpp);
     kOCCppRdDelete(&CppRd);
     kOCSumFinalize(&pEntry->New.SumHead, &Ctx);
@@ -3499,9 +4765,7 @@ static void kOCEntryPreProcessAndCompile(PKOCENTRY pEntry, const char * const *p
         kOCEntrySpawnTee(pEntry, papszArgvPreComp, cArgvPreComp,
                          (const char * const *)pEntry->New.papszArgvCompile, pEntry->New.cArgvCompile,
                          "preprocess|compile", kOCEntryTeeConsumer);
-        if (pEntry->pszMakeDepFilename)
-            kOCDepWriteToFile(&pEntry->DepState, pEntry->pszMakeDepFilename,  pEntry->New.pszObjName, pEntry->pszDir,
-                              pEntry->fMakeDepFixCase, pEntry->fMakeDepQuiet, pEntry->fMakeDepGenStubs);
+        kOCEntryProcessDeps(pEntry);
     }
     else
     {
@@ -3866,6 +5130,101 @@ static void kOCEntryCalcRecompile(PKOCENTRY pEntry)
 }
 
 
+/**
+ * Checks whether the object can be reused without running the preprocessor.
+ *
+ * This is the case when the entry is otherwise valid, the preprocessor
+ * arguments are unchanged and none of the files the preprocessor output was
+ * produced from have changed.  Files with a new timestamp are checked by
+ * content.  On success New.pDirDeps is set to the refreshed dependency list.
+ *
+ * @returns 1 if it's a direct hit, 0 if not.
+ * @param   pEntry      The cache entry.
+ */
+static int kOCEntryIsDirectHit(PKOCENTRY pEntry)
+{
+    PKOCDIRDEP pHead = NULL;
+    PCKOCDIRDEP pOld;
+    struct stat st;
+
+    if (    !pEntry->fDirectMode
+        ||  pEntry->fNeedCompiling
+        ||  !pEntry->Old.pDirDeps)
+        return 0;
+    if (!kOCSumIsEqual(&pEntry->New.SumCppArgv, &pEntry->Old.SumCppArgv))
+    {
+        InfoMsg(2, "direct mode: preprocessor args differs\n");
+        return 0;
+    }
+    if (strcmp(pEntry->New.pszCppName, pEntry->Old.pszCppName))
+    {
+        InfoMsg(2, "direct mode: preprocessor output name differs\n");
+        return 0;
+    }
+    if (    pEntry->pszMakeDepFilename
+        &&  stat(pEntry->pszMakeDepFilename, &st) != 0)
+    {
+        InfoMsg(2, "direct mode: dependency file doesn't exist\n");
+        return 0;
+    }
+
+    for (pOld = pEntry->Old.pDirDeps; pOld; pOld = pOld->pNext)
+    {
+        PKOCDIRDEP pDirDep;
+        if (stat(pOld->szPath, &st) != 0)
+        {
+            InfoMsg(2, "direct mode: failed to stat '%s': %s\n", pOld->szPath, strerror(errno));
+            break;
+        }
+        if ((unsigned long)st.st_size != pOld->cbFile)
+        {
+            InfoMsg(2, "direct mode: '%s' changed size\n", pOld->szPath);
+            break;
+        }
+
+        pDirDep = kOCDirDepCreate(pOld->szPath, pOld->cbFile, (long)st.st_mtime);
+        pDirDep->Sum = pOld->Sum;
+        pDirDep->pNext = pHead;
+        pHead = pDirDep;
+        if (    !pOld->tMTime
+            ||  pOld->tMTime != pDirDep->tMTime)
+        {
+            KOCSUM Sum;
+            int fTimeMacro;
+            if (kOCDirDepCalcSum(pOld->szPath, &Sum, &fTimeMacro))
+            {
+                InfoMsg(2, "direct mode: failed to read '%s': %s\n", pOld->szPath, strerror(errno));
+                break;
+            }
+            if (fTimeMacro)
+            {
+                InfoMsg(2, "direct mode: '%s' uses __DATE__, __TIME__ or __TIMESTAMP__\n", pOld->szPath);
+                break;
+            }
+            if (!kOCSumIsEqual(&Sum, &pOld->Sum))
+            {
+                InfoMsg(2, "direct mode: '%s' changed\n", pOld->szPath);
+                break;
+            }
+            if (pDirDep->tMTime >= pEntry->tDirectStart - KOC_DIRECT_RACY_SECS)
+                pDirDep->tMTime = 0;
+        }
+    }
+    if (pOld)
+    {
+        kOCDirDepDeleteList(&pHead);
+        return 0;
+    }
+
+    /* Carry over what the entry file would otherwise lose. */
+    pEntry->New.pDirDeps = pHead;
+    pEntry->New.cbCpp = pEntry->Old.cbCpp;
+    pEntry->New.cMsCpp = pEntry->Old.cMsCpp;
+    pEntry->New.cMsCompile = pEntry->Old.cMsCompile;
+    return 1;
+}
+
+
 /**
  * Does this cache entry need compiling or what?
  *
@@ -4044,6 +5403,11 @@ typedef struct KOCDIGEST
     KOCSUM SumCompArgv;
     /** The list of preprocessor output checksums that's . */
     KOCSUM SumHead;
+    /** The time (seconds) the entry was last inserted or hit. */
+    uint32_t tLastHit;
+    /** The number of bytes the entry's object and preprocessor output
+     * files take up (size accounting). */
+    uint32_t cbEntry;
 } KOCDIGEST;
 /** Pointer to a file digest. */
 typedef KOCDIGEST *PKOCDIGEST;
@@ -4063,6 +5427,34 @@ static void kOCDigestInit(PKOCDIGEST pDigest)
 }
 
 
+/**
+ * Calculates how much disk space the object and preprocessor output files of
+ * an entry take up.
+ *
+ * @returns Number of bytes (saturated).
+ * @param   pEntry      The entry.
+ */
+static uint32_t kOCEntryCalcDiskUsage(PCKOCENTRY pEntry)
+{
+    const char *apszNames[2];
+    uint64_t cbTotal = 0;
+    unsigned i;
+
+    apszNames[0] = pEntry->New.pszObjName ? pEntry->New.pszObjName : pEntry->Old.pszObjName;
+    apszNames[1] = pEntry->New.pszCppName ? pEntry->New.pszCppName : pEntry->Old.pszCppName;
+    for (i = 0; i < 2; i++)
+        if (apszNames[i])
+        {
+            struct stat st;
+            char *pszPath = MakePathFromDirAndFile(apszNames[i], pEntry->pszDir);
+            if (!stat(pszPath, &st))
+                cbTotal += st.st_size;
+            free(pszPath);
+        }
+    return cbTotal < UINT32_MAX ? (uint32_t)cbTotal : UINT32_MAX;
+}
+
+
 /**
  * Initializes the digest for the specified entry.
  *
@@ -4091,6 +5483,9 @@ static void kOCDigestInitFromEntry(PKOCDIGEST pDigest, PCKOCENTRY pEntry)
     /** @todo implement selective relative path support. */
     pDigest->pszRelPath = NULL;
     pDigest->pszAbsPath = xstrdup(kOCEntryAbsPath(pEntry));
+
+    pDigest->tLastHit = (uint32_t)time(NULL);
+    pDigest->cbEntry = kOCEntryCalcDiskUsage(pEntry);
 }
 
 
@@ -4170,8 +5565,225 @@ static int kOCDigestIsValid(PCKOCDIGEST pDigest, PCKOCENTRY pEntry)
 
 
 
+/**
+ * Shard file header.
+ *
+ * A shard file is a binary snapshot of the digests in one shard of the cache:
+ * this header, a key table sorted by hash, the digest records (KOCSHARDREC)
+ * and finally KOC_SHARD_END_MAGIC.  All in host byte order.
+ */
+typedef struct KOCSHARDHDR
+{
+    /** KOC_SHARD_MAGIC. */
+    uint32_t u32Magic;
+    /** The shard generation, incremented on every write. */
+    uint32_t uGeneration;
+    /** The next valid key. */
+    uint32_t uNextKey;
+    /** The number of digest records. */
+    uint32_t cDigests;
+    /** The number of entries in the key table following the header. */
+    uint32_t cKeys;
+    /** The size of the file, trailer included. */
+    uint32_t cbFile;
+    /** The number of cache lookups that found a matching entry. */
+    uint32_t cHits;
+    /** The number of cache lookups that didn't. */
+    uint32_t cMisses;
+    /** The number of digests evicted to stay within the size limit. */
+    uint32_t cEvictions;
+    /** Explicit padding. */
+    uint32_t u32Padding;
+    /** The number of bytes compression saved on preprocessor output files. */
+    uint64_t cbCppSaved;
+} KOCSHARDHDR;
+
+/**
+ * Shard file key table entry.
+ * There is one for each preprocessor output checksum of each digest.
+ */
+typedef struct KOCSHARDKEY
+{
+    /** KOC_SHARD_HASH() of the compiler argument and preprocessor checksums. */
+    uint32_t uHash;
+    /** The file offset of the digest record. */
+    uint32_t offDigest;
+} KOCSHARDKEY;
+
+/**
+ * A checksum in a shard file.
+ */
+typedef struct KOCSHARDSUM
+{
+    /** The crc32 checksum. */
+    uint32_t crc32;
+    /** The MD5 digest. */
+    unsigned char md5[16];
+} KOCSHARDSUM;
+
+/**
+ * A digest record in a shard file.
+ */
+typedef struct KOCSHARDREC
+{
+    /** The record size, including the strings and alignment padding. */
+    uint32_t cbRec;
+    /** The entry key. */
+    uint32_t uKey;
+    /** The number of preprocessor output checksums in aSums. */
+    uint32_t cSums;
+    /** The length of the target name. */
+    uint16_t cchTarget;
+    /** The length of the absolute entry path. */
+    uint16_t cchAbsPath;
+    /** KOCDIGEST::tLastHit. */
+    uint32_t tLastHit;
+    /** KOCDIGEST::cbEntry. */
+    uint32_t cbEntry;
+    /** The checksum of the compile argument vector. */
+    KOCSHARDSUM SumCompArgv;
+    /** The preprocessor output checksums, followed by the zero terminated
+     * target name and absolute entry path. */
+    KOCSHARDSUM aSums[1];
+} KOCSHARDREC;
+
+
+/**
+ * Calculates the size of the shard record for a digest.
+ *
+ * @returns Record size (aligned).
+ * @param   pDigest     The digest.
+ * @param   pszAbsPath  The absolute path of the entry.
+ * @param   pcSums      Where to return the number of checksums.
+ */
+static size_t kOCDigestCalcRecSize(PCKOCDIGEST pDigest, const char *pszAbsPath, unsigned *pcSums)
+{
+    PCKOCSUM pSum;
+    unsigned cSums = 0;
+    for (pSum = &pDigest->SumHead; pSum; pSum = pSum->pNext)
+        cSums++;
+    *pcSums = cSums;
+    return (  offsetof(KOCSHARDREC, aSums[cSums])
+            + strlen(pDigest->pszTarget) + 1
+            + strlen(pszAbsPath) + 1
+            + 3) & ~(size_t)3;
+}
+
+
+/**
+ * Stores a digest in a (zeroed) shard file record.
+ *
+ * @param   pDigest     The digest.
+ * @param   pszAbsPath  The absolute path of the entry.
+ * @param   pRec        The record, kOCDigestCalcRecSize() bytes.
+ */
+static void kOCDigestToRec(PCKOCDIGEST pDigest, const char *pszAbsPath, KOCSHARDREC *pRec)
+{
+    size_t cchTarget = strlen(pDigest->pszTarget);
+    size_t cchAbsPath = strlen(pszAbsPath);
+    unsigned cSums;
+    char *pszStr;
+    PCKOCSUM pSum;
+
+    if (cchTarget > 0xffff || cchAbsPath > 0xffff)
+        FatalDie("digest path or target too long: %s\n", pszAbsPath);
+    pRec->cbRec      = (uint32_t)kOCDigestCalcRecSize(pDigest, pszAbsPath, &cSums);
+    pRec->uKey       = pDigest->uKey;
+    pRec->cSums      = cSums;
+    pRec->cchTarget  = (uint16_t)cchTarget;
+    pRec->cchAbsPath = (uint16_t)cchAbsPath;
+    pRec->tLastHit   = pDigest->tLastHit;
+    pRec->cbEntry    = pDigest->cbEntry;
+    pRec->SumCompArgv.crc32 = pDigest->SumCompArgv.crc32;
+    memcpy(pRec->SumCompArgv.md5, pDigest->SumCompArgv.md5, sizeof(pRec->SumCompArgv.md5));
+    for (cSums = 0, pSum = &pDigest->SumHead; pSum; pSum = pSum->pNext, cSums++)
+    {
+        pRec->aSums[cSums].crc32 = pSum->crc32;
+        memcpy(pRec->aSums[cSums].md5, pSum->md5, sizeof(pSum->md5));
+    }
+    pszStr = (char *)&pRec->aSums[cSums];
+    memcpy(pszStr, pDigest->pszTarget, cchTarget + 1);
+    memcpy(pszStr + cchTarget + 1, pszAbsPath, cchAbsPath + 1);
+}
+
+
+/**
+ * Initializes a digest from a shard file record.
+ *
+ * @returns 0 on success, -1 if the record is bad.
+ * @param   pDigest     The (uninitialized) digest.
+ * @param   pRec        The record.
+ * @param   cbMax       The max record size (bytes left in the file).
+ */
+static int kOCDigestInitFromRec(PKOCDIGEST pDigest, const KOCSHARDREC *pRec, size_t cbMax)
+{
+    const char *pszTarget;
+    const char *pszAbsPath;
+    KOCSUM      Sum;
+    unsigned    i;
+
+    kOCDigestInit(pDigest);
+    if (    cbMax < offsetof(KOCSHARDREC, aSums)
+        ||  pRec->cbRec > cbMax
+        ||  (pRec->cbRec & 3)
+        ||  pRec->cSums == 0
+        ||  pRec->cSums > cbMax / sizeof(pRec->aSums[0])
+        ||  offsetof(KOCSHARDREC, aSums[pRec->cSums]) + pRec->cchTarget + 1 + pRec->cchAbsPath + 1 > pRec->cbRec
+        ||  pRec->uKey == 0)
+        return -1;
+    pszTarget  = (const char *)&pRec->aSums[pRec->cSums];
+    pszAbsPath = pszTarget + pRec->cchTarget + 1;
+    if (pszTarget[pRec->cchTarget] != '\0' || pszAbsPath[pRec->cchAbsPath] != '\0')
+        return -1;
+
+    pDigest->uKey = pRec->uKey;
+    pDigest->pszTarget = xstrdup(pszTarget);
+    pDigest->pszAbsPath = xstrdup(pszAbsPath);
+    pDigest->tLastHit = pRec->tLastHit;
+    pDigest->cbEntry = pRec->cbEntry;
+
+    memset(&Sum, 0, sizeof(Sum));
+    Sum.crc32 = pRec->SumCompArgv.crc32;
+    memcpy(Sum.md5, pRec->SumCompArgv.md5, sizeof(Sum.md5));
+    kOCSumAdd(&pDigest->SumCompArgv, &Sum);
+    for (i = 0; i < pRec->cSums; i++)
+    {
+        Sum.crc32 = pRec->aSums[i].crc32;
+        memcpy(Sum.md5, pRec->aSums[i].md5, sizeof(Sum.md5));
+        kOCSumAdd(&pDigest->SumHead, &Sum);
+    }
+    return 0;
+}
+
+
+
+
+
+/**
+ * Cache statistics, kept in the shard file headers.
+ */
+typedef struct KOCSTATS
+{
+    /** The number of cache lookups that found a matching entry. */
+    uint32_t cHits;
+    /** The number of cache lookups that didn't. */
+    uint32_t cMisses;
+    /** The number of digests evicted to stay within the size limit. */
+    uint32_t cEvictions;
+    /** The number of bytes compression saved on preprocessor output files. */
+    uint64_t cbCppSaved;
+} KOCSTATS;
+/** Pointer to cache statistics. */
+typedef KOCSTATS *PKOCSTATS;
+
+
 /**
  * The structure for the central cache entry.
+ *
+ * The cache is split into KOC_CACHE_SHARDS shard files named after the cache
+ * file with a hex digit suffix, each holding the digests with a particular
+ * compiler argument checksum.  The cache file itself is only used for
+ * locking, each shard has its own byte range lock on it.
  */
 typedef struct KOBJCACHE
 {
@@ -4182,27 +5794,55 @@ typedef struct KOBJCACHE
     /** The absolute path. */
     char *pszAbsPath;
 
-    /** The cache file descriptor. */
+    /** The cache (lock) file descriptor. */
     int fd;
-    /** The stream associated with fd. */
-    FILE *pFile;
     /** Whether it's currently locked or not. */
     unsigned fLocked;
-    /** Whether the cache file is dirty and needs writing back. */
+    /** Whether the shard is dirty and needs writing back. */
     unsigned fDirty;
-    /** Whether this is a new cache or not. */
+    /** Whether this is a new cache (shard) or not. */
     unsigned fNewCache;
 
-    /** The cache file generation. */
+    /** The shard we're working on. */
+    unsigned iShard;
+    /** The shard file name (in pszDir). */
+    char *pszShardName;
+    /** The shard file content, NULL if empty / not read. */
+    unsigned char *pbShard;
+    /** The size of the shard file content. */
+    size_t cbShard;
+
+    /** The shard file generation. */
     uint32_t uGeneration;
     /** The next valid key. (Determin at load time.) */
     uint32_t uNextKey;
 
+    /** Set when paDigests has been loaded from pbShard. */
+    unsigned fDigestsLoaded;
     /** Number of digests in paDigests. */
     unsigned cDigests;
-    /** Array of digests for the KOCENTRY objects in the cache. */
+    /** Array of digests for the KOCENTRY objects in the shard. */
     PKOCDIGEST paDigests;
 
+    /** The statistics from the shard file. */
+    KOCSTATS Stats;
+    /** Statistics to be added to the shard file when it's written next. */
+    KOCSTATS StatsPending;
+    /** The key of the digest of the entry that was hit, 0 if none. */
+    uint32_t uHitKey;
+    /** The absolute path of the entry that was hit. */
+    char *pszHitPath;
+    /** The size limit of a shard, 0 if unlimited. */
+    uint64_t cbMaxShard;
+
+#ifdef KOC_WITH_SERVER
+    /** The cache server connection, -1 if not connected. */
+    int fdServer;
+    /** Set by kObjCacheLock when the updates go to the cache server. */
+    unsigned fSrvLocked;
+    /** The entry to insert when the updates are committed to the server. */
+    PKOCENTRY pSrvEntry;
+#endif
 } KOBJCACHE;
 /** Pointer to a cache. */
 typedef KOBJCACHE *PKOBJCACHE;
@@ -4228,6 +5868,9 @@ static PKOBJCACHE kObjCacheCreate(const char *pszCacheFile)
      */
     pCache = xmallocz(sizeof(*pCache));
     pCache->fd = -1;
+#ifdef KOC_WITH_SERVER
+    pCache->fdServer = -1;
+#endif
 
     /*
      * Setup the directory and cache file name.
@@ -4245,6 +5888,27 @@ static PKOBJCACHE kObjCacheCreate(const char *pszCacheFile)
 }
 
 
+/**
+ * Purges the data in the cache object.
+ *
+ * @param   pCache      The cache object.
+ */
+static void kObjCachePurge(PKOBJCACHE pCache)
+{
+    while (pCache->cDigests > 0)
+        kOCDigestPurge(&pCache->paDigests[--pCache->cDigests]);
+    free(pCache->paDigests);
+    pCache->paDigests = NULL;
+    pCache->fDigestsLoaded = 0;
+    free(pCache->pbShard);
+    pCache->pbShard = NULL;
+    pCache->cbShard = 0;
+    pCache->uGeneration = 0;
+    pCache->uNextKey = 0;
+    memset(&pCache->Stats, 0, sizeof(pCache->Stats));
+}
+
+
 /**
  * Destroys the cache - closing any open files, freeing up heap memory and such.
  *
@@ -4252,638 +5916,1947 @@ static PKOBJCACHE kObjCacheCreate(const char *pszCacheFile)
  */
 static void kObjCacheDestroy(PKOBJCACHE pCache)
 {
-    if (pCache->pFile)
+    if (pCache->fd >= 0)
     {
-        errno = 0;
-        if (fclose(pCache->pFile) != 0)
-            FatalMsg("fclose failed: %s\n", strerror(errno));
-        pCache->pFile = NULL;
+        if (close(pCache->fd) != 0)
+            FatalMsg("close failed: %s\n", strerror(errno));
         pCache->fd = -1;
     }
-    free(pCache->paDigests);
+#ifdef KOC_WITH_SERVER
+    if (pCache->fdServer >= 0)
+    {
+        close(pCache->fdServer);
+        pCache->fdServer = -1;
+    }
+#endif
+    kObjCachePurge(pCache);
+    free(pCache->pszHitPath);
+    free(pCache->pszShardName);
     free(pCache->pszAbsPath);
     free(pCache->pszDir);
     free(pCache);
 }
 
 
+static void kObjCacheSelectShardNo(PKOBJCACHE pCache, unsigned iShard);
+
+
 /**
- * Purges the data in the cache object.
+ * Selects the shard to work on.
  *
- * @param   pCache      The cache object.
+ * A lookup requires an exact compiler argument checksum match, so that is
+ * what picks the shard.
+ *
+ * @param   pCache          The cache.
+ * @param   pSumCompArgv    The compiler argument checksum.
  */
-static void kObjCachePurge(PKOBJCACHE pCache)
+static void kObjCacheSelectShard(PKOBJCACHE pCache, PCKOCSUM pSumCompArgv)
 {
-    while (pCache->cDigests > 0)
-        kOCDigestPurge(&pCache->paDigests[--pCache->cDigests]);
-    free(pCache->paDigests);
-    pCache->paDigests = NULL;
-    pCache->uGeneration = 0;
-    pCache->uNextKey = 0;
+    kObjCacheSelectShardNo(pCache, pSumCompArgv->md5[0] & (KOC_CACHE_SHARDS - 1));
 }
 
 
 /**
- * (Re-)reads the file.
+ * Selects the shard to work on by number.
  *
- * @param   pCache      The cache to (re)-read.
+ * @param   pCache          The cache.
+ * @param   iShard          The shard number.
  */
-static void kObjCacheRead(PKOBJCACHE pCache)
+static void kObjCacheSelectShardNo(PKOBJCACHE pCache, unsigned iShard)
 {
-    unsigned i;
-    char szBuf[8192];
-    int fBad = 0;
+    size_t cchName = strlen(pCache->pszName);
+    assert(!pCache->fLocked);
+    assert(iShard < KOC_CACHE_SHARDS);
+
+    kObjCachePurge(pCache);
+    pCache->iShard = iShard;
+    free(pCache->pszShardName);
+    pCache->pszShardName = xmalloc(cchName + 4);
+    sprintf(pCache->pszShardName, "%s.%x", pCache->pszName, pCache->iShard);
+    InfoMsg(4, "shard %s\n", pCache->pszShardName);
+}
 
-    InfoMsg(4, "reading cache file...\n");
 
-    /*
-     * Rewind the file & stream, and associate a temporary buffer
-     * with the stream to speed up reading.
-     */
-    if (lseek(pCache->fd, 0, SEEK_SET) == -1)
-        FatalDie("lseek(cache-fd) failed: %s\n", strerror(errno));
-    rewind(pCache->pFile);
-    if (setvbuf(pCache->pFile, szBuf, _IOFBF, sizeof(szBuf)) != 0)
-        FatalDie("fdopen(cache-fd,rb) failed: %s\n", strerror(errno));
+#ifdef KOC_WITH_SERVER
 
-    /*
-     * Read magic and generation.
-     */
-    if (    !fgets(g_szLine, sizeof(g_szLine), pCache->pFile)
-        ||  strcmp(g_szLine, "magic=kObjCache-v0.1.0\n"))
-    {
-        InfoMsg(2, "bad cache file (magic)\n");
-        fBad = 1;
-    }
-    else if (    !fgets(g_szLine, sizeof(g_szLine), pCache->pFile)
-             ||  strncmp(g_szLine, "generation=", sizeof("generation=") - 1))
-    {
-        InfoMsg(2, "bad cache file (generation)\n");
-        fBad = 1;
-    }
-    else if (   pCache->uGeneration
-             && (long)pCache->uGeneration == atol(&g_szLine[sizeof("generation=") - 1]))
-    {
-        InfoMsg(3, "drop re-read unmodified cache file\n");
-        fBad = 0;
-    }
-    else
-    {
-        int fBadBeforeMissing;
+static void kObjCacheRead(PKOBJCACHE pCache);
+static void kObjCacheLock(PKOBJCACHE pCache);
 
-        /*
-         * Read everything (anew).
-         */
-        kObjCachePurge(pCache);
-        do
-        {
-            PKOCDIGEST pDigest;
-            char *pszNl;
-            char *pszVal;
-            char *psz;
-
-            /* Split the line and drop the trailing newline. */
-            pszVal = strchr(g_szLine, '=');
-            if ((fBad = pszVal == NULL))
-                break;
-            *pszVal++ = '\0';
 
-            pszNl = strchr(pszVal, '\n');
-            if (pszNl)
-                *pszNl = '\0';
+/**
+ * Cache server message header.
+ *
+ * Requests and replies are a header followed by cbMsg bytes of payload,
+ * which is shard file records (KOCSHARDREC) for most requests.  The server
+ * replies to every request, echoing the type and shard number.  All in host
+ * byte order since the server is always local.
+ */
+typedef struct KOCSRVMSG
+{
+    /** KOC_SRV_MAGIC. */
+    uint32_t u32Magic;
+    /** The request type (KOC_SRV_XXX). */
+    uint32_t uType;
+    /** The shard number. */
+    uint32_t iShard;
+    /** The request / reply value. */
+    uint32_t uValue;
+    /** The size of the payload following the header. */
+    uint32_t cbMsg;
+} KOCSRVMSG;
+
+/** The KOC_SRV_STATS payload, followed by the path of the entry that was hit. */
+typedef struct KOCSRVSTATS
+{
+    uint32_t cHits;
+    uint32_t cMisses;
+    uint32_t uHitKey;
+    uint32_t u32Padding;
+    uint64_t cbCppSaved;
+} KOCSRVSTATS;
+
+/** The KOCSRVMSG magic ('KOS1'). */
+#define KOC_SRV_MAGIC           0x4b4f5331
+/** The max message payload size. */
+#define KOC_SRV_MAX_MSG         (1024*1024)
+/** The number of seconds without requests before the server exits. */
+#define KOC_SRV_IDLE_SECS       600
+/** The number of updates after which the server writes the shards back
+ * even if it isn't idle. */
+#define KOC_SRV_FLUSH_UPDATES   64
+
+/** @name Cache server requests (KOCSRVMSG::uType).
+ * @{ */
+/** Reply value: the number of digests in the shard. */
+#define KOC_SRV_READ            1
+/** Payload: the entry record. Reply value: 1 if the shard has an up to date
+ * digest for it, 0 if not. */
+#define KOC_SRV_HAS_VALID       2
+/** Payload: the entry record. Reply: the records of the candidate digests
+ * (see kObjCacheFindMatchingEntry). */
+#define KOC_SRV_FIND            3
+/** Payload: a record from a KOC_SRV_FIND reply that turned out to be bad. */
+#define KOC_SRV_DROP            4
+/** Payload: the entry record.  Removes the digests for its path. */
+#define KOC_SRV_REMOVE          5
+/** Reply value: a new key. */
+#define KOC_SRV_NEW_KEY         6
+/** Payload: KOCSRVSTATS + the path of the entry hit. */
+#define KOC_SRV_STATS           7
+/** Payload: the entry record.  Replaces the digests for its path. */
+#define KOC_SRV_INSERT          8
+/** Writes all the shards back to the shard files (--stats). */
+#define KOC_SRV_FLUSH           9
+/** @} */
 
-            /* digest '#'? */
-            psz = strchr(g_szLine, '#');
-            if (psz)
-            {
-                char *pszNext;
-                i = strtoul(++psz, &pszNext, 0);
-                if ((fBad = pszNext && *pszNext))
-                    break;
-                if ((fBad = i >= pCache->cDigests))
-                    break;
-                pDigest = &pCache->paDigests[i];
-                *psz = '\0';
-            }
-            else
-                pDigest = NULL;
 
+/**
+ * Writes to a cache server socket.
+ *
+ * @returns 0 on success, -1 on failure.
+ * @param   fd      The socket.
+ * @param   pv      What to write.
+ * @param   cb      How much to write.
+ */
+static int kOCSrvWrite(int fd, const void *pv, size_t cb)
+{
+    const char *pch = (const char *)pv;
+    while (cb > 0)
+    {
+        ssize_t cbDone = send(fd, pch, cb, MSG_NOSIGNAL);
+        if (cbDone < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pch += cbDone;
+        cb -= cbDone;
+    }
+    return 0;
+}
 
-            /* string case on value name. */
-            if (!strcmp(g_szLine, "sum-#"))
-            {
-                KOCSUM Sum;
-                if ((fBad = kOCSumInitFromString(&Sum, pszVal) != 0))
-                    break;
-                kOCSumAdd(&pDigest->SumHead, &Sum);
-            }
-            else if (!strcmp(g_szLine, "digest-abs-#"))
-            {
-                if ((fBad = pDigest->pszAbsPath != NULL))
-                    break;
-                pDigest->pszAbsPath = xstrdup(pszVal);
-            }
-            else if (!strcmp(g_szLine, "digest-rel-#"))
-            {
-                if ((fBad = pDigest->pszRelPath != NULL))
-                    break;
-                pDigest->pszRelPath = xstrdup(pszVal);
-            }
-            else if (!strcmp(g_szLine, "key-#"))
-            {
-                if ((fBad = pDigest->uKey != 0))
-                    break;
-                pDigest->uKey = strtoul(pszVal, &psz, 0);
-                if ((fBad = psz && *psz))
-                    break;
-                if (pDigest->uKey >= pCache->uNextKey)
-                    pCache->uNextKey = pDigest->uKey + 1;
-            }
-            else if (!strcmp(g_szLine, "comp-argv-sum-#"))
-            {
-                if ((fBad = !kOCSumIsEmpty(&pDigest->SumCompArgv)))
-                    break;
-                if ((fBad = kOCSumInitFromString(&pDigest->SumCompArgv, pszVal) != 0))
-                    break;
-            }
-            else if (!strcmp(g_szLine, "target-#"))
-            {
-                if ((fBad = pDigest->pszTarget != NULL))
-                    break;
-                pDigest->pszTarget = xstrdup(pszVal);
-            }
-            else if (!strcmp(g_szLine, "digests"))
-            {
-                if ((fBad = pCache->paDigests != NULL))
-                    break;
-                pCache->cDigests = strtoul(pszVal, &psz, 0);
-                if ((fBad = psz && *psz))
-                    break;
-                i = (pCache->cDigests + 4) & ~3;
-                pCache->paDigests = xmalloc(i * sizeof(pCache->paDigests[0]));
-                for (i = 0; i < pCache->cDigests; i++)
-                    kOCDigestInit(&pCache->paDigests[i]);
-            }
-            else if (!strcmp(g_szLine, "generation"))
-            {
-                if ((fBad = pCache->uGeneration != 0))
-                    break;
-                pCache->uGeneration = strtoul(pszVal, &psz, 0);
-                if ((fBad = psz && *psz))
-                    break;
-            }
-            else if (!strcmp(g_szLine, "the-end"))
-            {
-                fBad = strcmp(pszVal, "fine");
-                break;
-            }
+
+/**
+ * Reads from a cache server socket.
+ *
+ * @returns 0 on success, -1 on failure or end of file.
+ * @param   fd      The socket.
+ * @param   pv      Where to put what's read.
+ * @param   cb      How much to read.
+ */
+static int kOCSrvRead(int fd, void *pv, size_t cb)
+{
+    char *pch = (char *)pv;
+    while (cb > 0)
+    {
+        ssize_t cbDone = recv(fd, pch, cb, 0);
+        if (cbDone <= 0)
+        {
+            if (cbDone < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        pch += cbDone;
+        cb -= cbDone;
+    }
+    return 0;
+}
+
+
+/**
+ * Sends a cache server message.
+ *
+ * @returns 0 on success, -1 on failure.
+ * @param   fd      The socket.
+ * @param   uType   The request type (KOC_SRV_XXX).
+ * @param   iShard  The shard number.
+ * @param   uValue  The request / reply value.
+ * @param   pv      The payload. NULL if none.
+ * @param   cb      The payload size.
+ */
+static int kOCSrvSendMsg(int fd, uint32_t uType, uint32_t iShard, uint32_t uValue, const void *pv, size_t cb)
+{
+    KOCSRVMSG Hdr;
+    Hdr.u32Magic = KOC_SRV_MAGIC;
+    Hdr.uType    = uType;
+    Hdr.iShard   = iShard;
+    Hdr.uValue   = uValue;
+    Hdr.cbMsg    = (uint32_t)cb;
+    if (kOCSrvWrite(fd, &Hdr, sizeof(Hdr)) != 0)
+        return -1;
+    return cb ? kOCSrvWrite(fd, pv, cb) : 0;
+}
+
+
+/**
+ * Receives a cache server message.
+ *
+ * @returns 0 on success, -1 on failure.
+ * @param   fd      The socket.
+ * @param   pHdr    Where to return the message header.
+ * @param   ppv     Where to return the payload, NULL if none.  The payload
+ *                  is followed by a terminator byte.  Free it.
+ */
+static int kOCSrvRecvMsg(int fd, KOCSRVMSG *pHdr, void **ppv)
+{
+    char *pch;
+    *ppv = NULL;
+    if (    kOCSrvRead(fd, pHdr, sizeof(*pHdr)) != 0
+        ||  pHdr->u32Magic != KOC_SRV_MAGIC
+        ||  pHdr->cbMsg > KOC_SRV_MAX_MSG)
+        return -1;
+    if (!pHdr->cbMsg)
+        return 0;
+    pch = xmalloc(pHdr->cbMsg + 1);
+    if (kOCSrvRead(fd, pch, pHdr->cbMsg) != 0)
+    {
+        free(pch);
+        return -1;
+    }
+    pch[pHdr->cbMsg] = '\0';
+    *ppv = pch;
+    return 0;
+}
+
+
+/**
+ * Gets the address of the cache server socket, which lives next to the cache
+ * file.
+ *
+ * @returns 0 on success, -1 if the path is too long.
+ * @param   pCache      The cache.
+ * @param   pAddr       Where to return the address.
+ */
+static int kObjCacheSrvAddr(PCKOBJCACHE pCache, struct sockaddr_un *pAddr)
+{
+    size_t cch = strlen(pCache->pszAbsPath);
+    if (cch + sizeof(".sock") > sizeof(pAddr->sun_path))
+        return -1;
+    memset(pAddr, 0, sizeof(*pAddr));
+    pAddr->sun_family = AF_UNIX;
+    memcpy(pAddr->sun_path, pCache->pszAbsPath, cch);
+    memcpy(&pAddr->sun_path[cch], ".sock", sizeof(".sock"));
+    return 0;
+}
+
+
+/**
+ * Connects to the cache server, if one is running.
+ *
+ * @param   pCache      The cache.
+ */
+static void kObjCacheConnect(PKOBJCACHE pCache)
+{
+    struct sockaddr_un Addr;
+    struct timeval Timeout;
+    int fd;
+
+    if (kObjCacheSrvAddr(pCache, &Addr) != 0)
+        return;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return;
+    if (connect(fd, (struct sockaddr *)&Addr, sizeof(Addr)) != 0)
+    {
+        InfoMsg(3, "no cache server (%s)\n", strerror(errno));
+        close(fd);
+        return;
+    }
+
+    /* The compilers we spawn shouldn't inherit it, nor should a hung server
+       hang the build. */
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Timeout.tv_sec = 30;
+    Timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+# ifdef SO_NOSIGPIPE
+    {
+        int fOn = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &fOn, sizeof(fOn));
+    }
+# endif
+    InfoMsg(3, "connected to the cache server\n");
+    pCache->fdServer = fd;
+}
+
+
+/**
+ * Drops the cache server connection after a failure and falls back on
+ * accessing the shard files directly.
+ *
+ * If kObjCacheLock was called, the shard is now locked for real.
+ *
+ * @param   pCache      The cache.
+ */
+static void kObjCacheSrvFailed(PKOBJCACHE pCache)
+{
+    InfoMsg(1, "lost the cache server, accessing the cache directly\n");
+    close(pCache->fdServer);
+    pCache->fdServer = -1;
+    if (pCache->fSrvLocked)
+    {
+        pCache->fSrvLocked = 0;
+        kObjCacheLock(pCache);
+    }
+    else
+        kObjCacheRead(pCache);
+}
+
+
+/**
+ * Sends a request to the cache server and receives the reply.
+ *
+ * On failure kObjCacheSrvFailed is called, so the caller can just continue
+ * with accessing the shard files.
+ *
+ * @returns 0 on success, -1 on failure.
+ * @param   pCache      The cache.
+ * @param   uType       The request type (KOC_SRV_XXX).
+ * @param   pv          The payload. NULL if none.
+ * @param   cb          The payload size.
+ * @param   puValue     Where to return the reply value. Optional.
+ * @param   ppvReply    Where to return the reply payload (free it). Optional.
+ * @param   pcbReply    Where to return the reply payload size. Optional.
+ */
+static int kObjCacheSrvRequest(PKOBJCACHE pCache, uint32_t uType, const void *pv, size_t cb,
+                               uint32_t *puValue, void **ppvReply, size_t *pcbReply)
+{
+    KOCSRVMSG Reply;
+    void *pvReply;
+    if (    kOCSrvSendMsg(pCache->fdServer, uType, pCache->iShard, 0, pv, cb) == 0
+        &&  kOCSrvRecvMsg(pCache->fdServer, &Reply, &pvReply) == 0)
+    {
+        if (    Reply.uType == uType
+            &&  Reply.iShard == pCache->iShard)
+        {
+            if (puValue)
+                *puValue = Reply.uValue;
+            if (ppvReply)
+                *ppvReply = pvReply;
             else
+                free(pvReply);
+            if (pcbReply)
+                *pcbReply = Reply.cbMsg;
+            return 0;
+        }
+        free(pvReply);
+    }
+    kObjCacheSrvFailed(pCache);
+    return -1;
+}
+
+
+/**
+ * Creates the shard file record of the digest of an entry for sending it to
+ * the cache server.
+ *
+ * @returns The record, free it.
+ * @param   pEntry      The entry.
+ * @param   pcbRec      Where to return the record size.
+ */
+static KOCSHARDREC *kObjCacheSrvEntryRec(PCKOCENTRY pEntry, size_t *pcbRec)
+{
+    KOCSHARDREC *pRec;
+    KOCDIGEST Digest;
+    unsigned cSums;
+
+    kOCDigestInitFromEntry(&Digest, pEntry);
+    if (!Digest.uKey)
+        Digest.uKey = UINT32_MAX; /* records must have a key, it's ignored where it doesn't matter. */
+    *pcbRec = kOCDigestCalcRecSize(&Digest, Digest.pszAbsPath, &cSums);
+    pRec = xmallocz(*pcbRec);
+    kOCDigestToRec(&Digest, Digest.pszAbsPath, pRec);
+    kOCDigestPurge(&Digest);
+    return pRec;
+}
+
+
+/**
+ * Sends a request with the record of the entry to the cache server.
+ *
+ * @returns 0 on success, -1 on failure (see kObjCacheSrvRequest).
+ * @param   pCache      The cache.
+ * @param   uType       The request type (KOC_SRV_XXX).
+ * @param   pEntry      The entry.
+ * @param   puValue     Where to return the reply value. Optional.
+ * @param   ppvReply    Where to return the reply payload (free it). Optional.
+ * @param   pcbReply    Where to return the reply payload size. Optional.
+ */
+static int kObjCacheSrvEntryRequest(PKOBJCACHE pCache, uint32_t uType, PCKOCENTRY pEntry,
+                                    uint32_t *puValue, void **ppvReply, size_t *pcbReply)
+{
+    size_t cbRec;
+    KOCSHARDREC *pRec = kObjCacheSrvEntryRec(pEntry, &cbRec);
+    int rc = kObjCacheSrvRequest(pCache, uType, pRec, cbRec, puValue, ppvReply, pcbReply);
+    free(pRec);
+    return rc;
+}
+
+
+/**
+ * Finds a matching cache entry using the cache server.
+ *
+ * The server only matches the checksums, the candidates are validated here
+ * like in kObjCacheFindMatchingEntry and the bad ones dropped.
+ *
+ * @returns 0 on success, -1 on failure (see kObjCacheSrvRequest).
+ * @param   pCache      The cache.
+ * @param   pEntry      The entry.
+ * @param   ppRetEntry  Where to return the matching entry, NULL if none.
+ */
+static int kObjCacheSrvFindMatchingEntry(PKOBJCACHE pCache, PCKOCENTRY pEntry, PKOCENTRY *ppRetEntry)
+{
+    unsigned char *pbReply;
+    size_t cbReply;
+    size_t off;
+
+    *ppRetEntry = NULL;
+    if (kObjCacheSrvEntryRequest(pCache, KOC_SRV_FIND, pEntry, NULL, (void **)&pbReply, &cbReply) != 0)
+        return -1;
+
+    for (off = 0; off < cbReply && !*ppRetEntry; )
+    {
+        const KOCSHARDREC *pRec = (const KOCSHARDREC *)(pbReply + off);
+        PKOCENTRY pRetEntry;
+        KOCDIGEST Digest;
+        if (kOCDigestInitFromRec(&Digest, pRec, cbReply - off) != 0)
+        {
+            kOCDigestPurge(&Digest);
+            break;
+        }
+
+        pRetEntry = kOCEntryCreate(Digest.pszAbsPath);
+        kOCEntryRead(pRetEntry);
+        if (    kOCEntryCheck(pRetEntry)
+            &&  kOCDigestIsValid(&Digest, pRetEntry))
+            *ppRetEntry = pRetEntry;
+        else
+        {
+            kOCEntryDestroy(pRetEntry);
+            InfoMsg(3, "removing bad digest '%s'\n", Digest.pszAbsPath);
+            if (kObjCacheSrvRequest(pCache, KOC_SRV_DROP, pRec, pRec->cbRec, NULL, NULL, NULL) != 0)
             {
-                fBad = 1;
+                kOCDigestPurge(&Digest);
                 break;
             }
-        } while (fgets(g_szLine, sizeof(g_szLine), pCache->pFile));
+        }
+        kOCDigestPurge(&Digest);
+        off += pRec->cbRec;
+    }
+    free(pbReply);
+    return 0;
+}
+
+
+/**
+ * Commits the updates done since kObjCacheLock to the cache server.
+ *
+ * @returns 0 on success, -1 on failure (see kObjCacheSrvRequest).
+ * @param   pCache      The cache.
+ */
+static int kObjCacheSrvCommit(PKOBJCACHE pCache)
+{
+    PKOCSTATS pPending = &pCache->StatsPending;
+    assert(pCache->fSrvLocked);
+
+    if (pPending->cHits || pPending->cMisses || pPending->cbCppSaved)
+    {
+        size_t cchPath = pCache->uHitKey ? strlen(pCache->pszHitPath) : 0;
+        KOCSRVSTATS *pStats = xmallocz(sizeof(*pStats) + cchPath + 1);
+        int rc;
+        pStats->cHits      = pPending->cHits;
+        pStats->cMisses    = pPending->cMisses;
+        pStats->uHitKey    = pCache->uHitKey;
+        pStats->cbCppSaved = pPending->cbCppSaved;
+        memcpy(pStats + 1, pCache->uHitKey ? pCache->pszHitPath : "", cchPath + 1);
+        rc = kObjCacheSrvRequest(pCache, KOC_SRV_STATS, pStats, sizeof(*pStats) + cchPath + 1, NULL, NULL, NULL);
+        free(pStats);
+        if (rc != 0)
+            return -1;
+        memset(pPending, 0, sizeof(*pPending));
+        pCache->uHitKey = 0;
+    }
 
+    if (pCache->pSrvEntry)
+    {
+        if (kObjCacheSrvEntryRequest(pCache, KOC_SRV_INSERT, pCache->pSrvEntry, NULL, NULL, NULL) != 0)
+            return -1;
+        pCache->pSrvEntry = NULL;
+    }
+
+    pCache->fSrvLocked = 0;
+    return 0;
+}
+
+
+/**
+ * Has a running cache server write the shards back to the shard files, so
+ * the statistics read from them include what the server has in memory.
+ *
+ * The connection is closed again since the statistics are read from the
+ * shard files.
+ *
+ * @param   pCache      The cache.
+ */
+static void kObjCacheSrvSync(PKOBJCACHE pCache)
+{
+    KOCSRVMSG Reply;
+    void *pvReply;
+
+    kObjCacheConnect(pCache);
+    if (pCache->fdServer < 0)
+        return;
+    if (    kOCSrvSendMsg(pCache->fdServer, KOC_SRV_FLUSH, 0, 0, NULL, 0) == 0
+        &&  kOCSrvRecvMsg(pCache->fdServer, &Reply, &pvReply) == 0)
+        free(pvReply);
+    else
+        InfoMsg(1, "the cache server didn't write back the shards, the statistics may be stale\n");
+    close(pCache->fdServer);
+    pCache->fdServer = -1;
+}
+
+#endif /* KOC_WITH_SERVER */
+
+
+/**
+ * (Re-)reads the shard file.
+ *
+ * Only the header, key table and trailer are checked here, the digests are
+ * loaded on demand by kObjCacheLoadDigests.
+ *
+ * This does not require the cache lock since shard files are never modified,
+ * only replaced (see kObjCacheWrite).  The result is a snapshot which may be
+ * outdated by the time it is used, so any updates must be done on a shard
+ * re-read by kObjCacheLock.
+ *
+ * @param   pCache      The cache to (re)-read.
+ */
+static void kObjCacheRead(PKOBJCACHE pCache)
+{
+    const KOCSHARDHDR *pHdr;
+    unsigned char *pb = NULL;
+    size_t cb = 0;
+    struct stat st;
+    int fd;
+
+#ifdef KOC_WITH_SERVER
+    if (pCache->fdServer >= 0)
+    {
+        uint32_t cDigests;
+        if (!kObjCacheSrvRequest(pCache, KOC_SRV_READ, NULL, 0, &cDigests, NULL, NULL))
+        {
+            pCache->fNewCache = cDigests == 0;
+            return;
+        }
+    }
+#endif
+
+    InfoMsg(4, "reading cache shard...\n");
+    fd = OpenFileInDir(pCache->pszShardName, pCache->pszDir, O_RDONLY | O_BINARY, 0);
+    if (fd >= 0)
+    {
         /*
-         * Did we find everything?
+         * Skip it if the generation is unchanged (the common case when
+         * re-reading it, since the header is all that has to be read).
          */
-        fBadBeforeMissing = fBad;
-        if (    !fBad
-            &&  !pCache->uGeneration)
-            fBad = 1;
-        if (!fBad)
-            for (i = 0; i < pCache->cDigests; i++)
+        if (pCache->pbShard)
+        {
+            KOCSHARDHDR Hdr;
+            if (    read(fd, &Hdr, sizeof(Hdr)) == sizeof(Hdr)
+                &&  Hdr.u32Magic == KOC_SHARD_MAGIC
+                &&  Hdr.uGeneration == pCache->uGeneration
+                &&  Hdr.cbFile == pCache->cbShard)
             {
-                if ((fBad = kOCSumIsEmpty(&pCache->paDigests[i].SumCompArgv)))
-                    break;
-                if ((fBad = kOCSumIsEmpty(&pCache->paDigests[i].SumHead)))
-                    break;
-                if ((fBad = pCache->paDigests[i].uKey == 0))
-                    break;
-                if ((fBad = pCache->paDigests[i].pszAbsPath == NULL
-                         && pCache->paDigests[i].pszRelPath == NULL))
-                    break;
-                if ((fBad = pCache->paDigests[i].pszTarget == NULL))
-                    break;
-                InfoMsg(4, "digest-%u: %s\n", i, pCache->paDigests[i].pszAbsPath
-                        ? pCache->paDigests[i].pszAbsPath : pCache->paDigests[i].pszRelPath);
+                InfoMsg(3, "drop re-read unmodified cache shard\n");
+                close(fd);
+                return;
             }
-        if (fBad)
-            InfoMsg(2, "bad cache file (%s)\n", fBadBeforeMissing ? g_szLine : "missing stuff");
-        else if (ferror(pCache->pFile))
+            lseek(fd, 0, SEEK_SET);
+        }
+
+        if (    !fstat(fd, &st)
+            &&  st.st_size > 0
+            &&  st.st_size < 0x7fffffff)
+        {
+            cb = st.st_size;
+            pb = xmalloc(cb);
+            if (read(fd, pb, cb) != (ssize_t)cb)
+            {
+                free(pb);
+                pb = NULL;
+                cb = 0;
+            }
+        }
+        close(fd);
+    }
+    if (!pb)
+    {
+        InfoMsg(2, "the cache shard is empty\n");
+        kObjCachePurge(pCache);
+        pCache->fNewCache = 1;
+        return;
+    }
+
+    pHdr = (const KOCSHARDHDR *)pb;
+    if (    cb < sizeof(*pHdr) + sizeof(uint32_t)
+        ||  pHdr->u32Magic != KOC_SHARD_MAGIC
+        ||  pHdr->cbFile != cb
+        ||  pHdr->cKeys > (cb - sizeof(*pHdr)) / sizeof(KOCSHARDKEY)
+        ||  pHdr->uGeneration == 0
+        ||  *(const uint32_t *)(pb + cb - sizeof(uint32_t)) != KOC_SHARD_END_MAGIC)
+    {
+        InfoMsg(2, "bad cache shard\n");
+        free(pb);
+        kObjCachePurge(pCache);
+        pCache->fNewCache = 1;
+        return;
+    }
+
+    kObjCachePurge(pCache);
+    pCache->pbShard     = pb;
+    pCache->cbShard     = cb;
+    pCache->uGeneration = pHdr->uGeneration;
+    pCache->uNextKey    = pHdr->uNextKey;
+    pCache->fNewCache   = pHdr->cDigests == 0;
+    pCache->Stats.cHits      = pHdr->cHits;
+    pCache->Stats.cMisses    = pHdr->cMisses;
+    pCache->Stats.cEvictions = pHdr->cEvictions;
+    pCache->Stats.cbCppSaved = pHdr->cbCppSaved;
+}
+
+
+/**
+ * Loads the digests from the shard file content, if not already done.
+ *
+ * A bad shard is treated like an empty one.
+ *
+ * @param   pCache      The cache.
+ */
+static void kObjCacheLoadDigests(PKOBJCACHE pCache)
+{
+    const KOCSHARDHDR *pHdr = (const KOCSHARDHDR *)pCache->pbShard;
+    size_t   off;
+    size_t   cbEnd;
+    unsigned i;
+
+    if (pCache->fDigestsLoaded)
+        return;
+    pCache->fDigestsLoaded = 1;
+    if (!pHdr || !pHdr->cDigests)
+        return;
+
+    off   = sizeof(*pHdr) + pHdr->cKeys * sizeof(KOCSHARDKEY);
+    cbEnd = pCache->cbShard - sizeof(uint32_t);
+    pCache->paDigests = xmalloc(((pHdr->cDigests + 4) & ~3) * sizeof(pCache->paDigests[0]));
+    for (i = 0; i < pHdr->cDigests; i++)
+    {
+        const KOCSHARDREC *pRec = (const KOCSHARDREC *)(pCache->pbShard + off);
+        PKOCDIGEST pDigest = &pCache->paDigests[pCache->cDigests];
+        if (    off > cbEnd
+            ||  kOCDigestInitFromRec(pDigest, pRec, cbEnd - off) != 0)
+        {
+            InfoMsg(2, "bad cache shard (digest #%u)\n", i);
+            kOCDigestPurge(pDigest);
+            while (pCache->cDigests > 0)
+                kOCDigestPurge(&pCache->paDigests[--pCache->cDigests]);
+            pCache->fNewCache = 1;
+            pCache->fDirty = 1;
+            return;
+        }
+        pCache->cDigests++;
+        if (pDigest->uKey >= pCache->uNextKey)
+            pCache->uNextKey = pDigest->uKey + 1;
+        InfoMsg(4, "digest-%u: %s\n", i, pDigest->pszAbsPath);
+        off += pRec->cbRec;
+    }
+}
+
+
+/**
+ * qsort callback for sorting the shard key table.
+ */
+static int kObjCacheCompareKeys(const void *pv1, const void *pv2)
+{
+    const KOCSHARDKEY *pKey1 = (const KOCSHARDKEY *)pv1;
+    const KOCSHARDKEY *pKey2 = (const KOCSHARDKEY *)pv2;
+    if (pKey1->uHash != pKey2->uHash)
+        return pKey1->uHash < pKey2->uHash ? -1 : 1;
+    return pKey1->offDigest < pKey2->offDigest ? -1 : pKey1->offDigest > pKey2->offDigest;
+}
+
+
+/**
+ * Re-writes the shard file.
+ *
+ * @param   pCache      The cache to commit.
+ */
+static void kObjCacheWrite(PKOBJCACHE pCache)
+{
+    KOCSHARDHDR *pHdr;
+    KOCSHARDKEY *paKeys;
+    unsigned char *pb;
+    size_t   cb;
+    size_t   off;
+    unsigned cKeys;
+    unsigned cSums;
+    unsigned i;
+    int      fd;
+    char    *pszTmpName;
+    assert(pCache->fLocked);
+    assert(pCache->fDirty);
+    assert(pCache->fDigestsLoaded);
+
+    /*
+     * Calculate the size and allocate a zeroed buffer for it.
+     */
+    cb = sizeof(*pHdr) + sizeof(uint32_t);
+    cKeys = 0;
+    for (i = 0; i < pCache->cDigests; i++)
+    {
+        cb += kOCDigestCalcRecSize(&pCache->paDigests[i],
+                                   kOCDigestAbsPath(&pCache->paDigests[i], pCache->pszDir), &cSums);
+        cKeys += cSums;
+    }
+    cb += cKeys * sizeof(KOCSHARDKEY);
+    if (cb >= UINT32_MAX)
+        FatalDie("cache shard '%s' is too big: %lu bytes\n", pCache->pszShardName, (unsigned long)cb);
+    pb = xmallocz(cb);
+
+    /*
+     * The header and digest records, collecting keys as we go.
+     */
+    pCache->uGeneration++;
+    if (!pCache->uGeneration)
+        pCache->uGeneration++;
+    pHdr = (KOCSHARDHDR *)pb;
+    pHdr->u32Magic    = KOC_SHARD_MAGIC;
+    pHdr->uGeneration = pCache->uGeneration;
+    pHdr->uNextKey    = pCache->uNextKey;
+    pHdr->cDigests    = pCache->cDigests;
+    pHdr->cKeys       = cKeys;
+    pHdr->cbFile      = (uint32_t)cb;
+    pHdr->cHits       = pCache->Stats.cHits      += pCache->StatsPending.cHits;
+    pHdr->cMisses     = pCache->Stats.cMisses    += pCache->StatsPending.cMisses;
+    pHdr->cEvictions  = pCache->Stats.cEvictions += pCache->StatsPending.cEvictions;
+    pHdr->cbCppSaved  = pCache->Stats.cbCppSaved += pCache->StatsPending.cbCppSaved;
+    memset(&pCache->StatsPending, 0, sizeof(pCache->StatsPending));
+    paKeys = (KOCSHARDKEY *)(pHdr + 1);
+
+    cKeys = 0;
+    off = sizeof(*pHdr) + pHdr->cKeys * sizeof(KOCSHARDKEY);
+    for (i = 0; i < pCache->cDigests; i++)
+    {
+        PCKOCDIGEST pDigest = &pCache->paDigests[i];
+        KOCSHARDREC *pRec = (KOCSHARDREC *)(pb + off);
+        PCKOCSUM pSum;
+
+        kOCDigestToRec(pDigest, kOCDigestAbsPath(pDigest, pCache->pszDir), pRec);
+        for (pSum = &pDigest->SumHead; pSum; pSum = pSum->pNext)
+        {
+            paKeys[cKeys].uHash = KOC_SHARD_HASH(&pDigest->SumCompArgv, pSum);
+            paKeys[cKeys].offDigest = (uint32_t)off;
+            cKeys++;
+        }
+        off += pRec->cbRec;
+    }
+    assert(off + sizeof(uint32_t) == cb);
+    *(uint32_t *)(pb + off) = KOC_SHARD_END_MAGIC;
+    qsort(paKeys, cKeys, sizeof(paKeys[0]), kObjCacheCompareKeys);
+
+    /*
+     * Write it to a temporary file and replace the shard file with it, so
+     * that lookups without the lock always see a complete shard.
+     */
+    pszTmpName = MakeTempName(pCache->pszShardName);
+    fd = OpenFileInDir(pszTmpName, pCache->pszDir, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0666);
+    if (fd == -1)
+        FatalDie("Failed to open '%s' in '%s': %s\n", pszTmpName, pCache->pszDir, strerror(errno));
+    errno = 0;
+    if (write(fd, pb, cb) != (ssize_t)cb)
+    {
+        int iErr = errno;
+        close(fd);
+        UnlinkFileInDir(pszTmpName, pCache->pszDir);
+        FatalDie("Error writing '%s' in '%s': %s\n", pszTmpName, pCache->pszDir, strerror(iErr));
+    }
+    if (close(fd) != 0)
+        FatalDie("close failed on '%s': %s\n", pszTmpName, strerror(errno));
+    if (ReplaceFileInDir(pszTmpName, pCache->pszShardName, pCache->pszDir) != 0)
+    {
+        int iErr = errno;
+        UnlinkFileInDir(pszTmpName, pCache->pszDir);
+        FatalDie("Failed to rename '%s' to '%s' in '%s': %s\n",
+                 pszTmpName, pCache->pszShardName, pCache->pszDir, strerror(iErr));
+    }
+    free(pszTmpName);
+    InfoMsg(4, "wrote '%s' in '%s', %lu bytes\n", pCache->pszShardName, pCache->pszDir, (unsigned long)cb);
+
+    free(pCache->pbShard);
+    pCache->pbShard = pb;
+    pCache->cbShard = cb;
+}
+
+
+/**
+ * Removes the specified digest from the shard.
+ *
+ * @param   pCache      The cache.
+ * @param   i           The digest index.
+ */
+static void kObjCacheRemoveDigest(PKOBJCACHE pCache, unsigned i)
+{
+    PKOCDIGEST pDigest = &pCache->paDigests[i];
+    unsigned cLeft;
+    kOCDigestPurge(pDigest);
+
+    pCache->cDigests--;
+    cLeft = pCache->cDigests - i;
+    if (cLeft)
+        memmove(pDigest, pDigest + 1, cLeft * sizeof(*pDigest));
+
+    pCache->fDirty = 1;
+}
+
+
+/**
+ * Removes the digests of the entry with the given path from the shard.
+ *
+ * @param   pCache      The cache.
+ * @param   pszAbsPath  The absolute path of the entry.
+ */
+static void kObjCacheRemovePath(PKOBJCACHE pCache, const char *pszAbsPath)
+{
+    unsigned i;
+    kObjCacheLoadDigests(pCache);
+    i = pCache->cDigests;
+    while (i-- > 0)
+    {
+        PKOCDIGEST pDigest = &pCache->paDigests[i];
+        if (ArePathsIdentical(kOCDigestAbsPath(pDigest, pCache->pszDir), pszAbsPath))
+        {
+            kObjCacheRemoveDigest(pCache, i);
+            InfoMsg(3, "removing entry '%s'; %d left.\n", pszAbsPath, pCache->cDigests);
+        }
+    }
+}
+
+
+/**
+ * Allocates a new key, one that no digest in the shard has.
+ *
+ * @returns The key.
+ * @param   pCache      The cache.
+ */
+static uint32_t kObjCacheAllocKey(PKOBJCACHE pCache)
+{
+    uint32_t uKey;
+    unsigned i;
+
+    kObjCacheLoadDigests(pCache);
+    uKey = pCache->uNextKey++;
+    if (!uKey)
+        uKey = pCache->uNextKey++;
+    i = pCache->cDigests;
+    while (i-- > 0)
+        if (pCache->paDigests[i].uKey == uKey)
+        {
+            uKey = pCache->uNextKey++;
+            if (!uKey)
+                uKey = pCache->uNextKey++;
+            i = pCache->cDigests;
+        }
+    return uKey;
+}
+
+
+/**
+ * Inserts a digest into the shard.
+ *
+ * @param   pCache      The cache.
+ * @param   pDigest     The digest.  The shard takes over its resources.
+ */
+static void kObjCacheInsertDigest(PKOBJCACHE pCache, PKOCDIGEST pDigest)
+{
+    kObjCacheLoadDigests(pCache);
+
+    /*
+     * Reallocate the digest array?
+     */
+    if (    !(pCache->cDigests & 3)
+        &&  (pCache->cDigests || !pCache->paDigests))
+        pCache->paDigests = xrealloc(pCache->paDigests, sizeof(pCache->paDigests[0]) * (pCache->cDigests + 4));
+
+    pCache->paDigests[pCache->cDigests] = *pDigest;
+    pCache->cDigests++;
+    InfoMsg(4, "Inserted digest #%u: %s\n", pCache->cDigests - 1, kOCDigestAbsPath(pDigest, pCache->pszDir));
+
+    pCache->fDirty = 1;
+}
+
+
+/**
+ * Refreshes the last hit time of the digest recorded by kObjCacheRecordHit.
+ *
+ * @param   pCache      The cache.
+ */
+static void kObjCacheTouchHit(PKOBJCACHE pCache)
+{
+    unsigned i;
+    if (!pCache->uHitKey)
+        return;
+    kObjCacheLoadDigests(pCache);
+    for (i = 0; i < pCache->cDigests; i++)
+        if (    pCache->paDigests[i].uKey == pCache->uHitKey
+            &&  ArePathsIdentical(kOCDigestAbsPath(&pCache->paDigests[i], pCache->pszDir), pCache->pszHitPath))
+        {
+            pCache->paDigests[i].tLastHit = (uint32_t)time(NULL);
+            pCache->fDirty = 1;
+            break;
+        }
+}
+
+
+/**
+ * Evicts the least recently hit digests until the shard is within the size
+ * limit.
+ *
+ * Only the digests are dropped, the entries and their files belong to the
+ * build trees they are in (that's kmk clean's job).  The most recent digest
+ * is always kept.
+ *
+ * @param   pCache      The cache.
+ */
+static void kObjCacheEvict(PKOBJCACHE pCache)
+{
+    uint64_t cbTotal = 0;
+    unsigned i;
+    if (!pCache->cbMaxShard)
+        return;
+    kObjCacheLoadDigests(pCache);
+    for (i = 0; i < pCache->cDigests; i++)
+        cbTotal += pCache->paDigests[i].cbEntry;
+
+    while (cbTotal > pCache->cbMaxShard && pCache->cDigests > 1)
+    {
+        unsigned iOldest = 0;
+        for (i = 1; i < pCache->cDigests; i++)
+            if (pCache->paDigests[i].tLastHit < pCache->paDigests[iOldest].tLastHit)
+                iOldest = i;
+        InfoMsg(3, "evicting digest '%s'\n", kOCDigestAbsPath(&pCache->paDigests[iOldest], pCache->pszDir));
+        cbTotal -= pCache->paDigests[iOldest].cbEntry;
+        kObjCacheRemoveDigest(pCache, iOldest);
+        pCache->StatsPending.cEvictions++;
+    }
+}
+
+
+/**
+ * Cleans out all invalid digests.s
+ *
+ * This is done periodically from the unlock routine to make
+ * sure we don't accidentally accumulate stale digests.
+ *
+ * @param   pCache      The cache to chek.
+ */
+static void kObjCacheClean(PKOBJCACHE pCache)
+{
+    unsigned i;
+    kObjCacheLoadDigests(pCache);
+    i = pCache->cDigests;
+    while (i-- > 0)
+    {
+        /*
+         * Try open it and purge it if it's bad.
+         * (We don't kill the entry file because that's kmk clean's job.)
+         */
+        PCKOCDIGEST pDigest = &pCache->paDigests[i];
+        PKOCENTRY pEntry = kOCEntryCreate(kOCDigestAbsPath(pDigest, pCache->pszDir));
+        kOCEntryRead(pEntry);
+        if (    !kOCEntryCheck(pEntry)
+            ||  !kOCDigestIsValid(pDigest, pEntry))
+            kObjCacheRemoveDigest(pCache, i);
+        kOCEntryDestroy(pEntry);
+    }
+}
+
+
+/**
+ * Locks the byte range of the current shard in the cache file.
+ *
+ * This will open the cache file if necessary and lock the byte range of the
+ * shard using the best suitable platform API (tricky).
+ *
+ * @param   pCache      The cache to lock.
+ */
+static void kObjCacheLockFile(PKOBJCACHE pCache)
+{
+#if defined(__WIN__)
+    OVERLAPPED OverLapped;
+#endif
+
+    assert(!pCache->fLocked);
+    assert(pCache->pszShardName);
+
+    /*
+     * Open it?
+     */
+    if (pCache->fd < 0)
+    {
+        pCache->fd = OpenFileInDir(pCache->pszName, pCache->pszDir, O_CREAT | O_RDWR | O_BINARY, 0666);
+        if (pCache->fd == -1)
+        {
+            MakePath(pCache->pszDir);
+            pCache->fd = OpenFileInDir(pCache->pszName, pCache->pszDir, O_CREAT | O_RDWR | O_BINARY, 0666);
+            if (pCache->fd == -1)
+                FatalDie("Failed to create '%s' in '%s': %s\n", pCache->pszName, pCache->pszDir, strerror(errno));
+        }
+    }
+
+    /*
+     * Lock it.
+     */
+#if defined(__WIN__)
+    memset(&OverLapped, 0, sizeof(OverLapped));
+    OverLapped.Offset = pCache->iShard;
+    if (!LockFileEx((HANDLE)_get_osfhandle(pCache->fd), LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &OverLapped))
+        FatalDie("Failed to lock the cache file: Windows Error %d\n", GetLastError());
+#elif defined(__OS2__)
+    if (flock(pCache->fd, LOCK_EX) != 0)
+        FatalDie("Failed to lock the cache file: %s\n", strerror(errno));
+#else
+    {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_whence = SEEK_SET;
+        fl.l_start = pCache->iShard;
+        fl.l_len = 1;
+        fl.l_type = F_WRLCK;
+        while (fcntl(pCache->fd, F_SETLKW, &fl) != 0)
+            if (errno != EINTR)
+                FatalDie("Failed to lock the cache file: %s\n", strerror(errno));
+    }
+#endif
+    pCache->fLocked = 1;
+}
+
+
+/**
+ * Locks the current shard of the cache for exclusive access and reads it.
+ *
+ * When talking to a cache server this just starts collecting the updates,
+ * kObjCacheUnlock sends them.
+ *
+ * @param   pCache      The cache to lock.
+ */
+static void kObjCacheLock(PKOBJCACHE pCache)
+{
+#ifdef KOC_WITH_SERVER
+    if (pCache->fdServer >= 0)
+    {
+        pCache->fSrvLocked = 1;
+        return;
+    }
+#endif
+    kObjCacheLockFile(pCache);
+
+    /*
+     * Read the shard.  There is no point in initializing a new shard until
+     * we've finished compiling and has something to put into it.
+     */
+    kObjCacheRead(pCache);
+}
+
+
+/**
+ * Unlocks the cache shard (writing it back if dirty).
+ *
+ * @param   pCache      The cache to unlock.
+ */
+static void kObjCacheUnlock(PKOBJCACHE pCache)
+{
+#if defined(__WIN__)
+    OVERLAPPED OverLapped;
+#endif
+#ifdef KOC_WITH_SERVER
+    if (pCache->fSrvLocked)
+    {
+        if (!kObjCacheSrvCommit(pCache))
+            return;
+
+        /* The shard file is locked now, redo the insertion the server missed. */
+        if (pCache->pSrvEntry)
         {
-            InfoMsg(2, "cache file read error\n");
-            fBad = 1;
+            KOCDIGEST Digest;
+            kObjCacheRemovePath(pCache, kOCEntryAbsPath(pCache->pSrvEntry));
+            kOCDigestInitFromEntry(&Digest, pCache->pSrvEntry);
+            kObjCacheInsertDigest(pCache, &Digest);
+            pCache->pSrvEntry = NULL;
         }
     }
-    if (fBad)
+#endif
+    assert(pCache->fLocked);
+
+    /*
+     * Write it back if it's dirty.
+     */
+    kObjCacheTouchHit(pCache);
+    if (pCache->fDirty)
     {
-        kObjCachePurge(pCache);
-        pCache->fNewCache = 1;
+        kObjCacheEvict(pCache);
+        if (    pCache->cDigests >= 16
+            &&  (pCache->uGeneration % 19) == 19)
+            kObjCacheClean(pCache);
+        kObjCacheWrite(pCache);
+        pCache->fDirty = 0;
     }
 
     /*
-     * Disassociate the buffer from the stream changing
-     * it to non-buffered mode.
+     * Lock it.
      */
-    if (setvbuf(pCache->pFile, NULL, _IONBF, 0) != 0)
-        FatalDie("setvbuf(,0,,0) failed: %s\n", strerror(errno));
+#if defined(__WIN__)
+    memset(&OverLapped, 0, sizeof(OverLapped));
+    OverLapped.Offset = pCache->iShard;
+    if (!UnlockFileEx((HANDLE)_get_osfhandle(pCache->fd), 0, 1, 0, &OverLapped))
+        FatalDie("Failed to unlock the cache file: Windows Error %d\n", GetLastError());
+#elif defined(__OS2__)
+    if (flock(pCache->fd, LOCK_UN) != 0)
+        FatalDie("Failed to unlock the cache file: %s\n", strerror(errno));
+#else
+    {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_whence = SEEK_SET;
+        fl.l_start = pCache->iShard;
+        fl.l_len = 1;
+        fl.l_type = F_UNLCK;
+        if (fcntl(pCache->fd, F_SETLK, &fl) != 0)
+            FatalDie("Failed to unlock the cache file: %s\n", strerror(errno));
+    }
+#endif
+    pCache->fLocked = 0;
 }
 
 
 /**
- * Re-writes the cache file.
+ * Removes the entry from the cache.
  *
- * @param   pCache      The cache to commit and unlock.
+ * The entry doesn't need to be in the cache.
+ * The cache entry (file) itself is not touched.
+ *
+ * @param   pCache      The cache.
+ * @param   pEntry      The entry.
  */
-static void kObjCacheWrite(PKOBJCACHE pCache)
+static void kObjCacheRemoveEntry(PKOBJCACHE pCache, PCKOCENTRY pEntry)
 {
-    unsigned i;
-    off_t cb;
-    char szBuf[8192];
-    assert(pCache->fLocked);
-    assert(pCache->fDirty);
+#ifdef KOC_WITH_SERVER
+    if (    pCache->fdServer >= 0
+        &&  !kObjCacheSrvEntryRequest(pCache, KOC_SRV_REMOVE, pEntry, NULL, NULL, NULL))
+        return;
+#endif
+    kObjCacheRemovePath(pCache, kOCEntryAbsPath(pEntry));
+}
 
-    /*
-     * Rewind the file & stream, and associate a temporary buffer
-     * with the stream to speed up the writing.
-     */
-    if (lseek(pCache->fd, 0, SEEK_SET) == -1)
-        FatalDie("lseek(cache-fd) failed: %s\n", strerror(errno));
-    rewind(pCache->pFile);
-    if (setvbuf(pCache->pFile, szBuf, _IOFBF, sizeof(szBuf)) != 0)
-        FatalDie("setvbuf failed: %s\n", strerror(errno));
 
-    /*
-     * Write the header.
-     */
-    pCache->uGeneration++;
-    fprintf(pCache->pFile,
-            "magic=kObjCache-v0.1.0\n"
-            "generation=%d\n"
-            "digests=%d\n",
-            pCache->uGeneration,
-            pCache->cDigests);
+/**
+ * Inserts the entry into the cache.
+ *
+ * The cache entry (file) itself is not touched by this operation,
+ * the pEntry object otoh is.
+ *
+ * @param   pCache      The cache.
+ * @param   pEntry      The entry.
+ */
+static void kObjCacheInsertEntry(PKOBJCACHE pCache, PKOCENTRY pEntry)
+{
+    KOCDIGEST Digest;
 
+#ifdef KOC_WITH_SERVER
     /*
-     * Write the digests.
+     * The server inserts the digest when the updates are committed, so
+     * lookups don't find it before the entry file has been written.
      */
-    for (i = 0; i < pCache->cDigests; i++)
+    if (pCache->fdServer >= 0)
     {
-        PCKOCDIGEST pDigest = &pCache->paDigests[i];
-        PKOCSUM pSum;
-
-        if (pDigest->pszAbsPath)
-            fprintf(pCache->pFile, "digest-abs-#%u=%s\n", i, pDigest->pszAbsPath);
-        if (pDigest->pszRelPath)
-            fprintf(pCache->pFile, "digest-rel-#%u=%s\n", i, pDigest->pszRelPath);
-        fprintf(pCache->pFile, "key-#%u=%u\n", i, pDigest->uKey);
-        fprintf(pCache->pFile, "target-#%u=%s\n", i, pDigest->pszTarget);
-        fprintf(pCache->pFile, "comp-argv-sum-#%u=", i);
-        kOCSumFPrintf(&pDigest->SumCompArgv, pCache->pFile);
-        for (pSum = &pDigest->SumHead; pSum; pSum = pSum->pNext)
+        uint32_t uKey;
+        if (!kObjCacheSrvRequest(pCache, KOC_SRV_NEW_KEY, NULL, 0, &uKey, NULL, NULL))
         {
-            fprintf(pCache->pFile, "sum-#%u=", i);
-            kOCSumFPrintf(pSum, pCache->pFile);
+            pEntry->uKey = uKey;
+            pCache->pSrvEntry = pEntry;
+            return;
         }
+        kObjCacheRemovePath(pCache, kOCEntryAbsPath(pEntry));
     }
+#endif
 
-    /*
-     * Close the stream and unlock fhe file.
-     * (Closing the stream shouldn't close the file handle IIRC...)
-     */
-    fprintf(pCache->pFile, "the-end=fine\n");
-    errno = 0;
-    if (    fflush(pCache->pFile) < 0
-        ||  ferror(pCache->pFile))
+    pEntry->uKey = kObjCacheAllocKey(pCache);
+    kOCDigestInitFromEntry(&Digest, pEntry);
+    kObjCacheInsertDigest(pCache, &Digest);
+}
+
+
+/**
+ * Finds the first key table entry with the given hash.
+ *
+ * @returns Index of the first matching key, cKeys if not found.
+ * @param   pCache      The cache.
+ * @param   uHash       The KOC_SHARD_HASH() value.
+ */
+static unsigned kObjCacheFindFirstKey(PCKOBJCACHE pCache, uint32_t uHash)
+{
+    const KOCSHARDHDR *pHdr = (const KOCSHARDHDR *)pCache->pbShard;
+    const KOCSHARDKEY *paKeys = (const KOCSHARDKEY *)(pHdr + 1);
+    unsigned iLo = 0;
+    unsigned iHi = pHdr->cKeys;
+    while (iLo < iHi)
     {
-        int iErr = errno;
-        fclose(pCache->pFile);
-        UnlinkFileInDir(pCache->pszName, pCache->pszDir);
-        FatalDie("Stream error occured while writing '%s' in '%s': %s\n",
-                 pCache->pszName, pCache->pszDir, strerror(iErr));
+        unsigned i = iLo + (iHi - iLo) / 2;
+        if (paKeys[i].uHash < uHash)
+            iLo = i + 1;
+        else
+            iHi = i;
     }
-    if (setvbuf(pCache->pFile, NULL, _IONBF, 0) != 0)
-        FatalDie("setvbuf(,0,,0) failed: %s\n", strerror(errno));
+    return iLo < pHdr->cKeys && paKeys[iLo].uHash == uHash ? iLo : pHdr->cKeys;
+}
 
-    cb = lseek(pCache->fd, 0, SEEK_CUR);
-    if (cb == -1)
-        FatalDie("lseek(cache-file,0,CUR) failed: %s\n", strerror(errno));
-#if defined(__WIN__)
-    if (_chsize(pCache->fd, cb) == -1)
-#else
-    if (ftruncate(pCache->fd, cb) == -1)
+
+/**
+ * Decodes the digest record referenced by a key table entry.
+ *
+ * @returns 0 on success, -1 if the shard is bad.
+ * @param   pCache      The cache.
+ * @param   iKey        The key table index.
+ * @param   pDigest     Where to return the digest, purge it when done.
+ */
+static int kObjCacheGetKeyDigest(PCKOBJCACHE pCache, unsigned iKey, PKOCDIGEST pDigest)
+{
+    const KOCSHARDHDR *pHdr = (const KOCSHARDHDR *)pCache->pbShard;
+    uint32_t off = ((const KOCSHARDKEY *)(pHdr + 1))[iKey].offDigest;
+    size_t cbEnd = pCache->cbShard - sizeof(uint32_t);
+    if (    off < sizeof(*pHdr)
+        ||  off >= cbEnd
+        ||  (off & 3)
+        ||  kOCDigestInitFromRec(pDigest, (const KOCSHARDREC *)(pCache->pbShard + off), cbEnd - off) != 0)
+    {
+        InfoMsg(2, "bad cache shard (key #%u)\n", iKey);
+        kOCDigestPurge(pDigest);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Checks if the cache has an up to date digest for the entry, i.e. if
+ * updating the cache can be skipped.
+ *
+ * A digest that hasn't been hit for KOC_LRU_TOUCH_SECS doesn't count, so that
+ * its last hit time gets refreshed.
+ *
+ * @returns 1 if it has, 0 if not.
+ * @param   pCache      The cache.
+ * @param   pEntry      The entry.
+ */
+static int kObjCacheHasValidDigest(PKOBJCACHE pCache, PCKOCENTRY pEntry)
+{
+    const KOCSHARDHDR *pHdr;
+    const KOCSHARDKEY *paKeys;
+    PCKOCSUM pSumHead;
+    uint32_t uHash;
+    unsigned i;
+
+#ifdef KOC_WITH_SERVER
+    if (pCache->fdServer >= 0)
+    {
+        uint32_t fValid;
+        if (!kObjCacheSrvEntryRequest(pCache, KOC_SRV_HAS_VALID, pEntry, &fValid, NULL, NULL))
+            return fValid != 0;
+    }
 #endif
-        FatalDie("file truncation failed: %s\n", strerror(errno));
-    InfoMsg(4, "wrote '%s' in '%s', %d bytes\n", pCache->pszName, pCache->pszDir, cb);
+
+    /* The preprocessor doesn't run on a direct hit, so use the old checksum. */
+    pHdr = (const KOCSHARDHDR *)pCache->pbShard;
+    pSumHead = kOCSumIsEmpty(&pEntry->New.SumHead) ? &pEntry->Old.SumHead : &pEntry->New.SumHead;
+    if (    !pHdr
+        ||  kOCSumIsEmpty(&pEntry->New.SumCompArgv)
+        ||  kOCSumIsEmpty(pSumHead))
+        return 0;
+    paKeys = (const KOCSHARDKEY *)(pHdr + 1);
+
+    uHash = KOC_SHARD_HASH(&pEntry->New.SumCompArgv, pSumHead);
+    for (i = kObjCacheFindFirstKey(pCache, uHash); i < pHdr->cKeys && paKeys[i].uHash == uHash; i++)
+    {
+        KOCDIGEST Digest;
+        int fValid;
+        if (kObjCacheGetKeyDigest(pCache, i, &Digest) != 0)
+            break;
+        fValid = ArePathsIdentical(Digest.pszAbsPath, kOCEntryAbsPath(pEntry))
+              && kOCDigestIsValid(&Digest, pEntry);
+        if (fValid && (uint32_t)time(NULL) - Digest.tLastHit >= KOC_LRU_TOUCH_SECS)
+        {
+            InfoMsg(3, "refreshing the last hit time\n");
+            fValid = 0;
+        }
+        kOCDigestPurge(&Digest);
+        if (fValid)
+            return 1;
+    }
+    return 0;
 }
 
 
 /**
- * Cleans out all invalid digests.s
+ * Find a matching cache entry.
  *
- * This is done periodically from the unlock routine to make
- * sure we don't accidentally accumulate stale digests.
+ * This looks up the compiler argument and preprocessor output checksums in
+ * the key table of the shard file, so only the candidate digest records are
+ * decoded.  Our own entry is skipped.
  *
- * @param   pCache      The cache to chek.
+ * The cache does not need to be locked.  Bad digests are dropped from the
+ * in-memory shard, which is only written back if the shard is unchanged
+ * when the lock is taken.
  */
-static void kObjCacheClean(PKOBJCACHE pCache)
+static PKOCENTRY kObjCacheFindMatchingEntry(PKOBJCACHE pCache, PCKOCENTRY pEntry)
 {
-    unsigned i = pCache->cDigests;
-    while (i-- > 0)
+    const KOCSHARDHDR *pHdr = (const KOCSHARDHDR *)pCache->pbShard;
+    const KOCSHARDKEY *paKeys;
+    uint32_t uHash;
+    unsigned i;
+
+    assert(pEntry->fNeedCompiling);
+    assert(!kOCSumIsEmpty(&pEntry->New.SumCompArgv));
+    assert(!kOCSumIsEmpty(&pEntry->New.SumHead));
+
+#ifdef KOC_WITH_SERVER
+    if (pCache->fdServer >= 0)
+    {
+        PKOCENTRY pRetEntry;
+        if (!kObjCacheSrvFindMatchingEntry(pCache, pEntry, &pRetEntry))
+            return pRetEntry;
+        pHdr = (const KOCSHARDHDR *)pCache->pbShard;
+    }
+#endif
+
+    if (!pHdr || !pHdr->cKeys)
+        return NULL;
+    paKeys = (const KOCSHARDKEY *)(pHdr + 1);
+
+    uHash = KOC_SHARD_HASH(&pEntry->New.SumCompArgv, &pEntry->New.SumHead);
+    for (i = kObjCacheFindFirstKey(pCache, uHash); i < pHdr->cKeys && paKeys[i].uHash == uHash; i++)
     {
         /*
-         * Try open it and purge it if it's bad.
-         * (We don't kill the entry file because that's kmk clean's job.)
+         * Matching?
          */
-        PCKOCDIGEST pDigest = &pCache->paDigests[i];
-        PKOCENTRY pEntry = kOCEntryCreate(kOCDigestAbsPath(pDigest, pCache->pszDir));
-        kOCEntryRead(pEntry);
-        if (    !kOCEntryCheck(pEntry)
-            ||  !kOCDigestIsValid(pDigest, pEntry))
+        KOCDIGEST Digest;
+        if (kObjCacheGetKeyDigest(pCache, i, &Digest) != 0)
+            break;
+        if (    kOCSumIsEqual(&Digest.SumCompArgv, &pEntry->New.SumCompArgv)
+            &&  kOCSumHasEqualInChain(&Digest.SumHead, &pEntry->New.SumHead)
+            &&  !ArePathsIdentical(Digest.pszAbsPath, kOCEntryAbsPath(pEntry)))
         {
-            unsigned cLeft;
-            kOCDigestPurge(pDigest);
+            /*
+             * Try open it.
+             */
+            unsigned j;
+            PKOCENTRY pRetEntry = kOCEntryCreate(Digest.pszAbsPath);
+            kOCEntryRead(pRetEntry);
+            if (    kOCEntryCheck(pRetEntry)
+                &&  kOCDigestIsValid(&Digest, pRetEntry))
+            {
+                kOCDigestPurge(&Digest);
+                return pRetEntry;
+            }
+            kOCEntryDestroy(pRetEntry);
+
+            /* bad entry, purge it. */
+            InfoMsg(3, "removing bad digest '%s'\n", Digest.pszAbsPath);
+            kObjCacheLoadDigests(pCache);
+            for (j = 0; j < pCache->cDigests; j++)
+                if (    pCache->paDigests[j].uKey == Digest.uKey
+                    &&  ArePathsIdentical(kOCDigestAbsPath(&pCache->paDigests[j], pCache->pszDir), Digest.pszAbsPath))
+                {
+                    kObjCacheRemoveDigest(pCache, j);
+                    break;
+                }
+        }
+        kOCDigestPurge(&Digest);
+    }
 
-            pCache->cDigests--;
-            cLeft = pCache->cDigests - i;
-            if (cLeft)
-                memmove(pDigest, pDigest + 1, cLeft * sizeof(*pDigest));
+    return NULL;
+}
 
-            pCache->fDirty = 1;
+
+/**
+ * Records a cache hit, refreshing the last hit time of the entry used when
+ * the shard is written.
+ *
+ * @param   pCache      The cache.
+ * @param   pUseEntry   The entry that was hit.
+ */
+static void kObjCacheRecordHit(PKOBJCACHE pCache, PCKOCENTRY pUseEntry)
+{
+    pCache->StatsPending.cHits++;
+    pCache->uHitKey = pUseEntry->uKey;
+    free(pCache->pszHitPath);
+    pCache->pszHitPath = xstrdup(kOCEntryAbsPath(pUseEntry));
+}
+
+
+/**
+ * Records a cache miss.
+ *
+ * @param   pCache      The cache.
+ */
+static void kObjCacheRecordMiss(PKOBJCACHE pCache)
+{
+    pCache->StatsPending.cMisses++;
+}
+
+
+/**
+ * Records the bytes compression saved on the preprocessor output of an entry.
+ *
+ * @param   pCache      The cache.
+ * @param   pEntry      The entry.
+ */
+static void kObjCacheRecordCompression(PKOBJCACHE pCache, PCKOCENTRY pEntry)
+{
+    pCache->StatsPending.cbCppSaved += pEntry->cbCppSaved;
+}
+
+
+/**
+ * Sets the size limit of the cache.
+ *
+ * The limit is split evenly between the shards since they are maintained
+ * independently of each other.
+ *
+ * @param   pCache      The cache.
+ * @param   cbMax       The size limit in bytes, 0 for unlimited.
+ */
+static void kObjCacheSetMaxSize(PKOBJCACHE pCache, uint64_t cbMax)
+{
+    pCache->cbMaxShard = cbMax / KOC_CACHE_SHARDS;
+    if (cbMax && !pCache->cbMaxShard)
+        pCache->cbMaxShard = 1;
+}
+
+
+/**
+ * Prints the statistics of all the shards of the cache.
+ *
+ * @returns 0.
+ * @param   pCache      The cache.
+ * @param   pOut        The output stream.
+ */
+static int kObjCachePrintStats(PKOBJCACHE pCache, FILE *pOut)
+{
+    KOCSTATS Stats;
+    uint64_t cbTotal = 0;
+    unsigned cDigests = 0;
+    unsigned cLookups;
+    unsigned iShard;
+    unsigned i;
+
+    memset(&Stats, 0, sizeof(Stats));
+    for (iShard = 0; iShard < KOC_CACHE_SHARDS; iShard++)
+    {
+        kObjCacheSelectShardNo(pCache, iShard);
+        kObjCacheRead(pCache);
+        kObjCacheLoadDigests(pCache);
+        for (i = 0; i < pCache->cDigests; i++)
+            cbTotal += pCache->paDigests[i].cbEntry;
+        cDigests += pCache->cDigests;
+        Stats.cHits      += pCache->Stats.cHits;
+        Stats.cMisses    += pCache->Stats.cMisses;
+        Stats.cEvictions += pCache->Stats.cEvictions;
+        Stats.cbCppSaved += pCache->Stats.cbCppSaved;
+    }
+
+    cLookups = Stats.cHits + Stats.cMisses;
+    fprintf(pOut, "cache:      %s\n", pCache->pszAbsPath);
+    fprintf(pOut, "entries:    %u\n", cDigests);
+    fprintf(pOut, "size:       %lu KB", (unsigned long)(cbTotal / 1024));
+    if (pCache->cbMaxShard)
+        fprintf(pOut, " (limit %lu KB)", (unsigned long)(pCache->cbMaxShard * KOC_CACHE_SHARDS / 1024));
+    fprintf(pOut, "\n");
+    fprintf(pOut, "hits:       %u\n", Stats.cHits);
+    fprintf(pOut, "misses:     %u\n", Stats.cMisses);
+    fprintf(pOut, "hit rate:   %u%%\n", cLookups ? (unsigned)((uint64_t)Stats.cHits * 100 / cLookups) : 0);
+    fprintf(pOut, "evictions:  %u\n", Stats.cEvictions);
+    fprintf(pOut, "compressed: %lu KB saved\n", (unsigned long)(Stats.cbCppSaved / 1024));
+    return 0;
+}
+
+
+/**
+ * Is this a new cache?
+ *
+ * @returns 1 if new, 0 if not new.
+ * @param   pEntry      The entry.
+ */
+static int kObjCacheIsNew(PKOBJCACHE pCache)
+{
+    return pCache->fNewCache;
+}
+
+
+#ifdef KOC_WITH_SERVER
+
+/** Set by the signal handler to stop the cache server. */
+static volatile sig_atomic_t g_fSrvStop = 0;
+
+
+/**
+ * Signal handler stopping the cache server.
+ */
+static void kObjCacheSrvSignal(int iSig)
+{
+    (void)iSig;
+    g_fSrvStop = 1;
+}
+
+
+/**
+ * Checks if the cache server has an up to date digest for an entry, see
+ * kObjCacheHasValidDigest.
+ *
+ * @returns 1 if it has, 0 if not.
+ * @param   pCache      The cache shard.
+ * @param   pEntryDigest The digest of the entry.
+ */
+static int kObjCacheSrvHasValidDigest(PKOBJCACHE pCache, PCKOCDIGEST pEntryDigest)
+{
+    uint32_t tNow = (uint32_t)time(NULL);
+    unsigned i;
+    for (i = 0; i < pCache->cDigests; i++)
+    {
+        PCKOCDIGEST pDigest = &pCache->paDigests[i];
+        PCKOCSUM pSum;
+        if (    pDigest->uKey != pEntryDigest->uKey
+            ||  !kOCSumIsEqual(&pDigest->SumCompArgv, &pEntryDigest->SumCompArgv)
+            ||  strcmp(pDigest->pszTarget, pEntryDigest->pszTarget)
+            ||  !ArePathsIdentical(kOCDigestAbsPath(pDigest, pCache->pszDir), pEntryDigest->pszAbsPath))
+            continue;
+        for (pSum = &pDigest->SumHead; pSum; pSum = pSum->pNext)
+            if (!kOCSumHasEqualInChain(&pEntryDigest->SumHead, pSum))
+                break;
+        if (!pSum)
+            return tNow - pDigest->tLastHit < KOC_LRU_TOUCH_SECS;
+    }
+    return 0;
+}
+
+
+/**
+ * Collects the records of the candidate digests for a KOC_SRV_FIND request,
+ * see kObjCacheFindMatchingEntry.
+ *
+ * @returns Number of candidates.
+ * @param   pCache      The cache shard.
+ * @param   pEntryDigest The digest of the entry.
+ * @param   ppbReply    Where to return the records (free it).
+ * @param   pcbReply    Where to return the size of the records.
+ */
+static uint32_t kObjCacheSrvFind(PKOBJCACHE pCache, PCKOCDIGEST pEntryDigest, unsigned char **ppbReply, size_t *pcbReply)
+{
+    uint32_t cFound = 0;
+    unsigned i;
+    for (i = 0; i < pCache->cDigests; i++)
+    {
+        PCKOCDIGEST pDigest = &pCache->paDigests[i];
+        const char *pszAbsPath = kOCDigestAbsPath(pDigest, pCache->pszDir);
+        if (    kOCSumIsEqual(&pDigest->SumCompArgv, &pEntryDigest->SumCompArgv)
+            &&  kOCSumHasEqualInChain(&pDigest->SumHead, &pEntryDigest->SumHead)
+            &&  !ArePathsIdentical(pszAbsPath, pEntryDigest->pszAbsPath))
+        {
+            unsigned cSums;
+            size_t cbRec = kOCDigestCalcRecSize(pDigest, pszAbsPath, &cSums);
+            if (*pcbReply + cbRec > KOC_SRV_MAX_MSG)
+                break;
+            *ppbReply = xrealloc(*ppbReply, *pcbReply + cbRec);
+            memset(*ppbReply + *pcbReply, 0, cbRec);
+            kOCDigestToRec(pDigest, pszAbsPath, (KOCSHARDREC *)(*ppbReply + *pcbReply));
+            *pcbReply += cbRec;
+            cFound++;
         }
-        kOCEntryDestroy(pEntry);
     }
+    return cFound;
 }
 
 
 /**
- * Locks the cache for exclusive access.
+ * Writes the updates of a shard back to the shard file.
  *
- * This will open the file if necessary and lock the entire file
- * using the best suitable platform API (tricky).
+ * kObjCache instances not using the server may have updated the shard file
+ * meanwhile, so the digests of entries we don't know about are merged from
+ * it first.
  *
- * @param   pCache      The cache to lock.
+ * @param   pCache      The cache shard.
  */
-static void kObjCacheLock(PKOBJCACHE pCache)
+static void kObjCacheSrvFlush(PKOBJCACHE pCache)
 {
-    struct stat st;
-#if defined(__WIN__)
-    OVERLAPPED OverLapped;
-#endif
-
-    assert(!pCache->fLocked);
+    PKOBJCACHE pDisk;
+    unsigned i;
+    if (!pCache->fDirty)
+        return;
 
-    /*
-     * Open it?
-     */
-    if (pCache->fd < 0)
+    kObjCacheLockFile(pCache);
+    pDisk = kObjCacheCreate(pCache->pszAbsPath);
+    kObjCacheSelectShardNo(pDisk, pCache->iShard);
+    kObjCacheRead(pDisk);
+    if (pDisk->uGeneration != pCache->uGeneration)
     {
-        pCache->fd = OpenFileInDir(pCache->pszName, pCache->pszDir, O_CREAT | O_RDWR | O_BINARY, 0666);
-        if (pCache->fd == -1)
+        kObjCacheLoadDigests(pDisk);
+        for (i = 0; i < pDisk->cDigests; i++)
         {
-            MakePath(pCache->pszDir);
-            pCache->fd = OpenFileInDir(pCache->pszName, pCache->pszDir, O_CREAT | O_RDWR | O_BINARY, 0666);
-            if (pCache->fd == -1)
-                FatalDie("Failed to create '%s' in '%s': %s\n", pCache->pszName, pCache->pszDir, strerror(errno));
+            PKOCDIGEST pDigest = &pDisk->paDigests[i];
+            unsigned j = pCache->cDigests;
+            while (j-- > 0)
+                if (ArePathsIdentical(kOCDigestAbsPath(&pCache->paDigests[j], pCache->pszDir), pDigest->pszAbsPath))
+                    break;
+            if (j == ~0U)
+            {
+                InfoMsg(3, "merging digest '%s'\n", pDigest->pszAbsPath);
+                kObjCacheInsertDigest(pCache, pDigest);
+                kOCDigestInit(pDigest);
+            }
         }
-
-        pCache->pFile = fdopen(pCache->fd, "r+b");
-        if (!pCache->pFile)
-            FatalDie("fdopen failed: %s\n", strerror(errno));
-        if (setvbuf(pCache->pFile, NULL, _IONBF, 0) != 0)
-            FatalDie("setvbuf(,0,,0) failed: %s\n", strerror(errno));
-    }
-
-    /*
-     * Lock it.
-     */
-#if defined(__WIN__)
-    memset(&OverLapped, 0, sizeof(OverLapped));
-    if (!LockFileEx((HANDLE)_get_osfhandle(pCache->fd), LOCKFILE_EXCLUSIVE_LOCK, 0, ~0, 0, &OverLapped))
-        FatalDie("Failed to lock the cache file: Windows Error %d\n", GetLastError());
-#elif defined(__sun__)
-    {
-        struct flock fl;
-        fl.l_whence = 0;
-        fl.l_start = 0;
-        fl.l_len = 0;
-        fl.l_type = F_WRLCK;
-        if (fcntl(pCache->fd, F_SETLKW, &fl) != 0)
-            FatalDie("Failed to lock the cache file: %s\n", strerror(errno));
-    }
-#else
-    if (flock(pCache->fd, LOCK_EX) != 0)
-        FatalDie("Failed to lock the cache file: %s\n", strerror(errno));
-#endif
-    pCache->fLocked = 1;
-
-    /*
-     * Check for new cache and read it it's an existing cache.
-     *
-     * There is no point in initializing a new cache until we've finished
-     * compiling and has something to put into it, so we'll leave it as a
-     * 0 byte file.
-     */
-    if (fstat(pCache->fd, &st) == -1)
-        FatalDie("fstat(cache-fd) failed: %s\n", strerror(errno));
-    if (st.st_size)
-        kObjCacheRead(pCache);
-    else
-    {
-        pCache->fNewCache = 1;
-        InfoMsg(2, "the cache file is empty\n");
+        if (pDisk->uNextKey > pCache->uNextKey)
+            pCache->uNextKey = pDisk->uNextKey;
+        pCache->Stats = pDisk->Stats;
+        pCache->uGeneration = pDisk->uGeneration;
     }
+    kObjCacheDestroy(pDisk);
+    kObjCacheUnlock(pCache);
 }
 
 
 /**
- * Unlocks the cache (without writing anything back).
+ * Serves one request from a cache server client.
  *
- * @param   pCache      The cache to unlock.
+ * @returns 0 on success, -1 if the connection should be closed.
+ * @param   papShards   The cache shards.
+ * @param   fd          The client socket.
+ * @param   pcUpdates   The update counter.
  */
-static void kObjCacheUnlock(PKOBJCACHE pCache)
+static int kObjCacheSrvServe(PKOBJCACHE *papShards, int fd, unsigned *pcUpdates)
 {
-#if defined(__WIN__)
-    OVERLAPPED OverLapped;
-#endif
-    assert(pCache->fLocked);
+    PKOBJCACHE pCache;
+    KOCSRVMSG Msg;
+    KOCDIGEST Digest;
+    unsigned char *pbReply = NULL;
+    size_t cbReply = 0;
+    uint32_t uValue = 0;
+    void *pv;
+    unsigned i;
+    int rc;
 
-    /*
-     * Write it back if it's dirty.
-     */
-    if (pCache->fDirty)
+    if (kOCSrvRecvMsg(fd, &Msg, &pv) != 0)
+        return -1;
+    if (Msg.iShard >= KOC_CACHE_SHARDS)
     {
-        if (    pCache->cDigests >= 16
-            &&  (pCache->uGeneration % 19) == 19)
-            kObjCacheClean(pCache);
-        kObjCacheWrite(pCache);
-        pCache->fDirty = 0;
+        free(pv);
+        return -1;
     }
-
-    /*
-     * Lock it.
-     */
-#if defined(__WIN__)
-    memset(&OverLapped, 0, sizeof(OverLapped));
-    if (!UnlockFileEx((HANDLE)_get_osfhandle(pCache->fd), 0, ~0U, 0, &OverLapped))
-        FatalDie("Failed to unlock the cache file: Windows Error %d\n", GetLastError());
-#elif defined(__sun__)
+    pCache = papShards[Msg.iShard];
+
+    kOCDigestInit(&Digest);
+    if (    Msg.uType == KOC_SRV_HAS_VALID
+        ||  Msg.uType == KOC_SRV_FIND
+        ||  Msg.uType == KOC_SRV_DROP
+        ||  Msg.uType == KOC_SRV_REMOVE
+        ||  Msg.uType == KOC_SRV_INSERT)
     {
-        struct flock fl;
-        fl.l_whence = 0;
-        fl.l_start = 0;
-        fl.l_len = 0;
-        fl.l_type = F_UNLCK;
-        if (fcntl(pCache->fd, F_SETLKW, &fl) != 0)
-            FatalDie("Failed to lock the cache file: %s\n", strerror(errno));
+        if (    !pv
+            ||  kOCDigestInitFromRec(&Digest, (const KOCSHARDREC *)pv, Msg.cbMsg) != 0)
+        {
+            kOCDigestPurge(&Digest);
+            free(pv);
+            return -1;
+        }
     }
-#else
-    if (flock(pCache->fd, LOCK_UN) != 0)
-        FatalDie("Failed to unlock the cache file: %s\n", strerror(errno));
-#endif
-    pCache->fLocked = 0;
-}
-
 
-/**
- * Removes the entry from the cache.
- *
- * The entry doesn't need to be in the cache.
- * The cache entry (file) itself is not touched.
- *
- * @param   pCache      The cache.
- * @param   pEntry      The entry.
- */
-static void kObjCacheRemoveEntry(PKOBJCACHE pCache, PCKOCENTRY pEntry)
-{
-    unsigned i = pCache->cDigests;
-    while (i-- > 0)
+    switch (Msg.uType)
     {
-        PKOCDIGEST pDigest = &pCache->paDigests[i];
-        if (ArePathsIdentical(kOCDigestAbsPath(pDigest, pCache->pszDir),
-                              kOCEntryAbsPath(pEntry)))
-        {
-            unsigned cLeft;
-            kOCDigestPurge(pDigest);
+        case KOC_SRV_READ:
+            uValue = pCache->cDigests;
+            break;
+
+        case KOC_SRV_HAS_VALID:
+            uValue = kObjCacheSrvHasValidDigest(pCache, &Digest);
+            break;
+
+        case KOC_SRV_FIND:
+            uValue = kObjCacheSrvFind(pCache, &Digest, &pbReply, &cbReply);
+            break;
+
+        case KOC_SRV_DROP:
+            for (i = 0; i < pCache->cDigests; i++)
+                if (    pCache->paDigests[i].uKey == Digest.uKey
+                    &&  ArePathsIdentical(kOCDigestAbsPath(&pCache->paDigests[i], pCache->pszDir), Digest.pszAbsPath))
+                {
+                    InfoMsg(3, "removing bad digest '%s'\n", Digest.pszAbsPath);
+                    kObjCacheRemoveDigest(pCache, i);
+                    (*pcUpdates)++;
+                    break;
+                }
+            break;
 
-            pCache->cDigests--;
-            cLeft = pCache->cDigests - i;
-            if (cLeft)
-                memmove(pDigest, pDigest + 1, cLeft * sizeof(*pDigest));
+        case KOC_SRV_REMOVE:
+            kObjCacheRemovePath(pCache, Digest.pszAbsPath);
+            (*pcUpdates)++;
+            break;
+
+        case KOC_SRV_NEW_KEY:
+            uValue = kObjCacheAllocKey(pCache);
+            break;
 
+        case KOC_SRV_STATS:
+        {
+            KOCSRVSTATS Stats;
+            if (Msg.cbMsg < sizeof(Stats))
+            {
+                free(pv);
+                return -1;
+            }
+            memcpy(&Stats, pv, sizeof(Stats));
+            pCache->StatsPending.cHits      += Stats.cHits;
+            pCache->StatsPending.cMisses    += Stats.cMisses;
+            pCache->StatsPending.cbCppSaved += Stats.cbCppSaved;
+            if (Stats.uHitKey)
+            {
+                pCache->uHitKey = Stats.uHitKey;
+                free(pCache->pszHitPath);
+                pCache->pszHitPath = xstrdup((const char *)pv + sizeof(Stats));
+                kObjCacheTouchHit(pCache);
+                pCache->uHitKey = 0;
+            }
             pCache->fDirty = 1;
-            InfoMsg(3, "removing entry '%s'; %d left.\n", kOCEntryAbsPath(pEntry), pCache->cDigests);
+            (*pcUpdates)++;
+            break;
         }
+
+        case KOC_SRV_INSERT:
+            kObjCacheRemovePath(pCache, Digest.pszAbsPath);
+            kObjCacheInsertDigest(pCache, &Digest);
+            kOCDigestInit(&Digest);
+            kObjCacheEvict(pCache);
+            (*pcUpdates)++;
+            break;
+
+        case KOC_SRV_FLUSH:
+            for (i = 0; i < KOC_CACHE_SHARDS; i++)
+                kObjCacheSrvFlush(papShards[i]);
+            *pcUpdates = 0;
+            break;
+
+        default:
+            InfoMsg(1, "bad request %u\n", Msg.uType);
+            free(pv);
+            return -1;
     }
+    kOCDigestPurge(&Digest);
+    free(pv);
+
+    rc = kOCSrvSendMsg(fd, Msg.uType, Msg.iShard, uValue, pbReply, cbReply);
+    free(pbReply);
+    return rc;
 }
 
 
 /**
- * Inserts the entry into the cache.
+ * The cache server.
  *
- * The cache entry (file) itself is not touched by this operation,
- * the pEntry object otoh is.
+ * Keeps all the shards of the cache in memory and serves the kObjCache
+ * instances compiling with it over a unix socket next to the cache file.  The
+ * shard files are written back when idle, every KOC_SRV_FLUSH_UPDATES
+ * updates, when --stats asks for it (KOC_SRV_FLUSH) and on exit.
  *
- * @param   pCache      The cache.
- * @param   pEntry      The entry.
+ * @returns Exit code.
+ * @param   pszCacheFile    The cache file.
+ * @param   cbMaxSize       The size limit of the cache, 0 if unlimited.
  */
-static void kObjCacheInsertEntry(PKOBJCACHE pCache, PKOCENTRY pEntry)
+static int kObjCacheServe(const char *pszCacheFile, uint64_t cbMaxSize)
 {
+    PKOBJCACHE apShards[KOC_CACHE_SHARDS];
+    struct sockaddr_un Addr;
+    struct sigaction SigAct;
+    struct pollfd *paFds;
+    unsigned cFds;
+    unsigned cUpdates = 0;
+    time_t tLastRequest = time(NULL);
     unsigned i;
+    int fd;
 
     /*
-     * Find a new key.
+     * Load the shards.
      */
-    pEntry->uKey = pCache->uNextKey++;
-    if (!pEntry->uKey)
-        pEntry->uKey = pCache->uNextKey++;
-    i = pCache->cDigests;
-    while (i-- > 0)
-        if (pCache->paDigests[i].uKey == pEntry->uKey)
-        {
-            pEntry->uKey = pCache->uNextKey++;
-            if (!pEntry->uKey)
-                pEntry->uKey = pCache->uNextKey++;
-            i = pCache->cDigests;
-        }
+    for (i = 0; i < KOC_CACHE_SHARDS; i++)
+    {
+        apShards[i] = kObjCacheCreate(pszCacheFile);
+        kObjCacheSetMaxSize(apShards[i], cbMaxSize);
+        kObjCacheSelectShardNo(apShards[i], i);
+        kObjCacheRead(apShards[i]);
+        kObjCacheLoadDigests(apShards[i]);
+    }
 
     /*
-     * Reallocate the digest array?
+     * Create the socket, making sure there isn't a server already.
      */
-    if (    !(pCache->cDigests & 3)
-        &&  (pCache->cDigests || !pCache->paDigests))
-        pCache->paDigests = xrealloc(pCache->paDigests, sizeof(pCache->paDigests[0]) * (pCache->cDigests + 4));
+    if (kObjCacheSrvAddr(apShards[0], &Addr) != 0)
+        FatalDie("The cache path is too long for a socket: %s\n", apShards[0]->pszAbsPath);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        FatalDie("socket failed: %s\n", strerror(errno));
+    if (!connect(fd, (struct sockaddr *)&Addr, sizeof(Addr)))
+        FatalDie("There is already a server for '%s'\n", apShards[0]->pszAbsPath);
+    close(fd);
+
+    MakePath(apShards[0]->pszDir);
+    unlink(Addr.sun_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        FatalDie("socket failed: %s\n", strerror(errno));
+    if (bind(fd, (struct sockaddr *)&Addr, sizeof(Addr)) != 0)
+        FatalDie("Failed to bind '%s': %s\n", Addr.sun_path, strerror(errno));
+    if (listen(fd, 64) != 0)
+        FatalDie("listen failed: %s\n", strerror(errno));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&SigAct, 0, sizeof(SigAct));
+    SigAct.sa_handler = kObjCacheSrvSignal;
+    sigemptyset(&SigAct.sa_mask);
+    sigaction(SIGTERM, &SigAct, NULL);
+    sigaction(SIGINT, &SigAct, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    InfoMsg(1, "serving '%s'\n", apShards[0]->pszAbsPath);
 
     /*
-     * Create a new digest.
+     * The server loop.
      */
-    kOCDigestInitFromEntry(&pCache->paDigests[pCache->cDigests], pEntry);
-    pCache->cDigests++;
-    InfoMsg(4, "Inserted digest #%u: %s\n", pCache->cDigests - 1, kOCEntryAbsPath(pEntry));
-
-    pCache->fDirty = 1;
-}
-
-
-/**
- * Find a matching cache entry.
- */
-static PKOCENTRY kObjCacheFindMatchingEntry(PKOBJCACHE pCache, PCKOCENTRY pEntry)
-{
-    unsigned i = pCache->cDigests;
-
-    assert(pEntry->fNeedCompiling);
-    assert(!kOCSumIsEmpty(&pEntry->New.SumCompArgv));
-    assert(!kOCSumIsEmpty(&pEntry->New.SumHead));
-
-    while (i-- > 0)
+    cFds = 1;
+    paFds = xmalloc(16 * sizeof(paFds[0]));
+    paFds[0].fd = fd;
+    paFds[0].events = POLLIN;
+    while (!g_fSrvStop)
     {
-        /*
-         * Matching?
-         */
-        PCKOCDIGEST pDigest = &pCache->paDigests[i];
-        if (    kOCSumIsEqual(&pDigest->SumCompArgv, &pEntry->New.SumCompArgv)
-            &&  kOCSumHasEqualInChain(&pDigest->SumHead, &pEntry->New.SumHead))
+        int rc = poll(paFds, cFds, 1000);
+        if (rc < 0)
         {
-            /*
-             * Try open it.
-             */
-            unsigned cLeft;
-            PKOCENTRY pRetEntry = kOCEntryCreate(kOCDigestAbsPath(pDigest, pCache->pszDir));
-            kOCEntryRead(pRetEntry);
-            if (    kOCEntryCheck(pRetEntry)
-                &&  kOCDigestIsValid(pDigest, pRetEntry))
-                return pRetEntry;
-            kOCEntryDestroy(pRetEntry);
+            if (errno == EINTR)
+                continue;
+            FatalDie("poll failed: %s\n", strerror(errno));
+        }
+        if (rc == 0)
+        {
+            for (i = 0; i < KOC_CACHE_SHARDS; i++)
+                kObjCacheSrvFlush(apShards[i]);
+            cUpdates = 0;
+            if (    cFds == 1
+                &&  time(NULL) - tLastRequest >= KOC_SRV_IDLE_SECS)
+            {
+                InfoMsg(1, "idle, exiting\n");
+                break;
+            }
+            continue;
+        }
+        tLastRequest = time(NULL);
 
-            /* bad entry, purge it. */
-            InfoMsg(3, "removing bad digest '%s'\n", kOCDigestAbsPath(pDigest, pCache->pszDir));
-            kOCDigestPurge(pDigest);
+        /* Requests. */
+        i = cFds;
+        while (i-- > 1)
+            if (    paFds[i].revents
+                &&  kObjCacheSrvServe(apShards, paFds[i].fd, &cUpdates) != 0)
+            {
+                close(paFds[i].fd);
+                paFds[i] = paFds[--cFds];
+            }
 
-            pCache->cDigests--;
-            cLeft = pCache->cDigests - i;
-            if (cLeft)
-                memmove(pDigest, pDigest + 1, cLeft * sizeof(*pDigest));
+        /* New clients. */
+        if (paFds[0].revents & POLLIN)
+        {
+            int fdClient = accept(fd, NULL, NULL);
+            if (fdClient >= 0)
+            {
+                struct timeval Timeout;
+                Timeout.tv_sec = 10;
+                Timeout.tv_usec = 0;
+                setsockopt(fdClient, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+                fcntl(fdClient, F_SETFD, FD_CLOEXEC);
+                if (!(cFds % 16))
+                    paFds = xrealloc(paFds, (cFds + 16) * sizeof(paFds[0]));
+                paFds[cFds].fd = fdClient;
+                paFds[cFds].events = POLLIN;
+                paFds[cFds].revents = 0;
+                cFds++;
+            }
+        }
 
-            pCache->fDirty = 1;
+        if (cUpdates >= KOC_SRV_FLUSH_UPDATES)
+        {
+            for (i = 0; i < KOC_CACHE_SHARDS; i++)
+                kObjCacheSrvFlush(apShards[i]);
+            cUpdates = 0;
         }
     }
 
-    return NULL;
+    /*
+     * Clean up.
+     */
+    unlink(Addr.sun_path);
+    while (cFds-- > 0)
+        close(paFds[cFds].fd);
+    free(paFds);
+    for (i = 0; i < KOC_CACHE_SHARDS; i++)
+    {
+        kObjCacheSrvFlush(apShards[i]);
+        kObjCacheDestroy(apShards[i]);
+    }
+    return 0;
 }
 
-
-/**
- * Is this a new cache?
- *
- * @returns 1 if new, 0 if not new.
- * @param   pEntry      The entry.
- */
-static int kObjCacheIsNew(PKOBJCACHE pCache)
-{
-    return pCache->fNewCache;
-}
+#endif /* KOC_WITH_SERVER */
 
 
 /**
@@ -4917,12 +7890,17 @@ static int usage(FILE *pOut)
             "            <-f|--file <local-cache-file>>\n"
             "            <-t|--target <target-name>>\n"
             "            [-r|--redir-stdout] [-p|--passthru] [--named-pipe-compile <pipename>]\n"
+            "            [--hash <md5|fast>] [--direct] [--compress] [--max-size <size>]\n"
+            "            [--no-server]\n"
             "            --kObjCache-cpp <filename> <preprocessor + args>\n"
             "            --kObjCache-cc <object> <compiler + args>\n"
             "            [--kObjCache-both [args]]\n"
             );
     fprintf(pOut,
             "            [--kObjCache-cpp|--kObjCache-cc [more args]]\n"
+            "        kObjCache --stats <-c <cache-file> | -d <cache-dir> -n <name>>\n"
+            "        kObjCache --server <-c <cache-file> | -d <cache-dir> -n <name>>\n"
+            "            [--max-size <size>]\n"
             "        kObjCache <-V|--version>\n"
             "        kObjCache [-?|/?|-h|/h|--help|/help]\n"
             "\n"
@@ -4930,6 +7908,28 @@ static int usage(FILE *pOut)
             "The env.var. KOBJCACHE_OPTS allow you to specifie additional options\n"
             "without having to mess with the makefiles. These are appended with "
             "a --kObjCache-options between them and the command args.\n"
+            "\n"
+            "--hash selects the checksum of the preprocessor output: CRC32 + MD5\n"
+            "(md5, the default) or a fast 128-bit non-cryptographic hash (fast).\n"
+            "Cache entries made with one never match the other.\n"
+            "\n"
+            "--direct records the files the preprocessor output depends on and\n"
+            "skips the preprocessor when none of them nor the preprocessor\n"
+            "arguments have changed.\n"
+            "\n"
+            "--compress compresses the preprocessor output kept for comparison\n"
+            "when the compiler reads it from a pipe.\n"
+            "\n"
+            "--max-size limits the size (K, M or G suffix) of the object and\n"
+            "preprocessor output files the cache refers to.  The least recently\n"
+            "hit entries are dropped from the cache when it is exceeded.\n"
+            "\n"
+            "--server keeps the cache in memory and serves the kObjCache instances\n"
+            "using it over a unix socket next to the cache file, so they don't have\n"
+            "to lock and read the cache files.  They use it when it is running,\n"
+            "unless given --no-server.  It writes the cache files back when idle\n"
+            "and exits after 10 minutes without requests.  The size limit of the\n"
+            "server applies.  (Not available on Windows and OS/2.)\n"
             "\n");
     return 0;
 }
@@ -4961,6 +7961,13 @@ int main(int argc, char **argv)
     int fMakeDepGenStubs = 0;
     int fMakeDepQuiet = 0;
     int fOptimizePreprocessorOutput = 0;
+    int fDirectMode = 0;
+    int fCompressCpp = 0;
+    int fStats = 0;
+    int fServer = 0;
+    int fNoServer = 0;
+    uint64_t cbMaxSize = 0;
+    int fUpToDate = 0;
 
     const char *pszTarget = NULL;
 
@@ -5082,6 +8089,43 @@ int main(int argc, char **argv)
             fOptimizePreprocessorOutput = 1;
         else if (!strcmp(argv[i], "-O2") || !strcmp(argv[i], "--optimize-2"))
             fOptimizePreprocessorOutput = 1 | 2;
+        else if (!strcmp(argv[i], "--direct"))
+            fDirectMode = 1;
+        else if (!strcmp(argv[i], "--compress"))
+            fCompressCpp = 1;
+        else if (!strcmp(argv[i], "--max-size"))
+        {
+            char *pszNext;
+            if (i + 1 >= argc)
+                return SyntaxError("%s requires a size!\n", argv[i]);
+            cbMaxSize = strtoul(argv[++i], &pszNext, 0);
+            if (*pszNext == 'K' || *pszNext == 'k')
+                cbMaxSize <<= 10, pszNext++;
+            else if (*pszNext == 'M' || *pszNext == 'm')
+                cbMaxSize <<= 20, pszNext++;
+            else if (*pszNext == 'G' || *pszNext == 'g')
+                cbMaxSize <<= 30, pszNext++;
+            if (*pszNext)
+                return SyntaxError("Invalid size '%s'!\n", argv[i]);
+        }
+        else if (!strcmp(argv[i], "--stats"))
+            fStats = 1;
+        else if (!strcmp(argv[i], "--server"))
+            fServer = 1;
+        else if (!strcmp(argv[i], "--no-server"))
+            fNoServer = 1;
+        else if (!strcmp(argv[i], "--hash"))
+        {
+            if (i + 1 >= argc)
+                return SyntaxError("%s requires an algorithm name!\n", argv[i]);
+            i++;
+            if (!strcmp(argv[i], "md5"))
+                g_fFastHash = 0;
+            else if (!strcmp(argv[i], "fast"))
+                g_fFastHash = 1;
+            else
+                return SyntaxError("Unknown hash algorithm '%s' (md5 or fast)!\n", argv[i]);
+        }
         else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--passthru"))
             fRedirPreCompStdOut = fRedirCompileStdIn = 1;
         else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--redir-stdout"))
@@ -5106,6 +8150,38 @@ int main(int argc, char **argv)
         else
             return SyntaxError("Doesn't grok '%s'!\n", argv[i]);
     }
+    if (fStats || fServer)
+    {
+        if (!pszCacheFile)
+        {
+            if (!pszCacheDir || !pszCacheName)
+                return SyntaxError("%s requires a cache filename (-c) or a cache dir and name (-d, -n)!\n",
+                                   fServer ? "--server" : "--stats");
+            pszCacheFile = MakePathFromDirAndFile(pszCacheName, pszCacheDir);
+        }
+        if (fServer)
+        {
+#ifdef KOC_WITH_SERVER
+            SetErrorPrefix("kObjCache server - %s", FindFilenameInPath(pszCacheFile));
+            return kObjCacheServe(pszCacheFile, cbMaxSize);
+#else
+            return SyntaxError("--server is not supported on this platform!\n");
+#endif
+        }
+
+        /*
+         * Just print the cache statistics.
+         */
+        pCache = kObjCacheCreate(pszCacheFile);
+        kObjCacheSetMaxSize(pCache, cbMaxSize);
+#ifdef KOC_WITH_SERVER
+        if (!fNoServer)
+            kObjCacheSrvSync(pCache);
+#endif
+        kObjCachePrintStats(pCache, stdout);
+        kObjCacheDestroy(pCache);
+        return 0;
+    }
     if (!pszEntryFile)
         return SyntaxError("No cache entry filename (-f)!\n");
     if (!pszTarget)
@@ -5147,6 +8223,11 @@ int main(int argc, char **argv)
      */
     SetErrorPrefix("kObjCache - %s", FindFilenameInPath(pszCacheFile));
     pCache = kObjCacheCreate(pszCacheFile);
+    kObjCacheSetMaxSize(pCache, cbMaxSize);
+#ifdef KOC_WITH_SERVER
+    if (!fNoServer)
+        kObjCacheConnect(pCache);
+#endif
 
     pEntry = kOCEntryCreate(pszEntryFile);
     kOCEntryRead(pEntry);
@@ -5157,69 +8238,92 @@ int main(int argc, char **argv)
     kOCEntrySetPipedMode(pEntry, fRedirPreCompStdOut, fRedirCompileStdIn, pszNmPipeCompile);
     kOCEntrySetDepFilename(pEntry, pszMakeDepFilename, fMakeDepFixCase, fMakeDepQuiet, fMakeDepGenStubs);
     kOCEntrySetOptimizations(pEntry, fOptimizePreprocessorOutput);
+    kOCEntrySetDirectMode(pEntry, fDirectMode, papszArgvPreComp, cArgvPreComp);
+    kOCEntrySetCompression(pEntry, fCompressCpp);
+    kObjCacheSelectShard(pCache, &pEntry->New.SumCompArgv);
 
     /*
-     * Open (& lock) the two files and do validity checks and such.
+     * Read the cache shard and do validity checks and such.
+     *
+     * Shard files are replaced atomically, so lookups are done without
+     * locking the cache.  The lock is only taken for updating the shard.
      */
-    kObjCacheLock(pCache);
-    if (    kObjCacheIsNew(pCache)
-        &&  kOCEntryNeedsCompiling(pEntry))
+    kObjCacheRead(pCache);
+    if (kOCEntryIsDirectHit(pEntry))
+    {
+        /*
+         * None of the files the preprocessor used have changed, so the
+         * preprocessor output and thus the object would be the same.
+         */
+        InfoMsg(1, "no need to preprocess or recompile (direct)\n");
+        fUpToDate = kObjCacheHasValidDigest(pCache, pEntry);
+    }
+    else if (    kObjCacheIsNew(pCache)
+             &&  kOCEntryNeedsCompiling(pEntry))
     {
         /*
          * Both files are missing/invalid.
          * Optimize this path as it is frequently used when making a clean build.
          */
-        kObjCacheUnlock(pCache);
         InfoMsg(1, "doing full compile\n");
+        kObjCacheRecordMiss(pCache);
+        kOCEntryInvalidate(pEntry);
         kOCEntryPreProcessAndCompile(pEntry, papszArgvPreComp, cArgvPreComp);
-        kObjCacheLock(pCache);
     }
     else
     {
         /*
-         * Do the preprocess (don't need to lock the cache file for this).
+         * Do the preprocess.
          */
-        kObjCacheUnlock(pCache);
         kOCEntryPreProcess(pEntry, papszArgvPreComp, cArgvPreComp);
 
         /*
          * Check if we need to recompile. If we do, try see if the is a cache entry first.
          */
         kOCEntryCalcRecompile(pEntry);
+        kObjCacheRead(pCache);
         if (kOCEntryNeedsCompiling(pEntry))
         {
-            PKOCENTRY pUseEntry;
-            kObjCacheLock(pCache);
-            kObjCacheRemoveEntry(pCache, pEntry);
-            pUseEntry = kObjCacheFindMatchingEntry(pCache, pEntry);
+            PKOCENTRY pUseEntry = kObjCacheFindMatchingEntry(pCache, pEntry);
             if (pUseEntry)
             {
                 InfoMsg(1, "using cache entry '%s'\n", kOCEntryAbsPath(pUseEntry));
+                kObjCacheRecordHit(pCache, pUseEntry);
+                kOCEntryInvalidate(pEntry);
                 kOCEntryCopy(pEntry, pUseEntry);
                 kOCEntryDestroy(pUseEntry);
             }
             else
             {
-                kObjCacheUnlock(pCache);
                 InfoMsg(1, "recompiling\n");
+                kObjCacheRecordMiss(pCache);
+                kOCEntryInvalidate(pEntry);
                 kOCEntryCompileIt(pEntry);
-                kObjCacheLock(pCache);
             }
         }
         else
         {
             InfoMsg(1, "no need to recompile\n");
-            kObjCacheLock(pCache);
+            fUpToDate = kObjCacheHasValidDigest(pCache, pEntry);
         }
     }
 
     /*
      * Update the cache files.
+     * The entry file is written while holding the lock because the shard
+     * may only refer to it once it has the new key.
      */
-    kObjCacheRemoveEntry(pCache, pEntry);
-    kObjCacheInsertEntry(pCache, pEntry);
-    kOCEntryWrite(pEntry);
-    kObjCacheUnlock(pCache);
+    if (!fUpToDate)
+    {
+        kObjCacheRecordCompression(pCache, pEntry);
+        kObjCacheLock(pCache);
+        kObjCacheRemoveEntry(pCache, pEntry);
+        kObjCacheInsertEntry(pCache, pEntry);
+        kOCEntryWrite(pEntry);
+        kObjCacheUnlock(pCache);
+    }
+    else
+        kOCEntryWrite(pEntry);
     kObjCacheDestroy(pCache);
     if (fOptimizePreprocessorOutput)
     {
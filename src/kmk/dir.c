@@ -51,6 +51,10 @@ const char *vmsify (const char *name, int type);
 #ifdef CONFIG_WITH_STRCACHE2
 # include <stddef.h>
 #endif
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+# include <fcntl.h>
+# include <sys/mman.h>
+#endif
 
 /* In GNU systems, <dirent.h> defines this macro for us.  */
 #ifdef _D_NAMLEN
@@ -254,6 +258,10 @@ struct directory_contents
 #endif /* WINDOWS32 */
     struct hash_table dirfiles;	/* Files in this directory.  */
     DIR *dirstream;		/* Stream reading this directory.  */
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+    struct timespec mtim;	/* Timestamps of the directory when it was  */
+    struct timespec ctim;	/* opened, for validating cached listings.  */
+#endif
   };
 
 static unsigned long
@@ -459,6 +467,392 @@ dirfile_hash_cmp (const void *xv, const void *yv)
 struct alloccache dirfile_cache;
 #endif
 
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+/* Persistent directory cache (--dir-cache).
+
+   Complete directory listings are appended to a file shared by a make, its
+   sub-makes and later runs.  A listing is only used if the device, inode,
+   mtime and ctime of the directory still match those it was read with.
+   Directories changed during the last couple of seconds aren't recorded,
+   so a change within the timestamp granularity cannot go unnoticed.
+
+   The file is mapped read-only and its records indexed by device and inode,
+   later records overriding earlier ones.  Records are appended with a single
+   O_APPEND write, so no locking is needed.  When a lookup misses we check
+   whether the file has grown and index the new records.  The top-level make
+   drops superseded records when it exits.  */
+
+# define DIR_CACHE_MAGIC        0x3143444bU /* 'KDC1' */
+# define DIR_CACHE_MIN_AGE      2           /* Seconds.  */
+
+struct dir_cache_rec
+  {
+    unsigned int magic;         /* DIR_CACHE_MAGIC.  */
+    unsigned int cb;            /* Record size including names, 8-aligned.  */
+    unsigned long long dev;     /* Device and inode of the directory.  */
+    unsigned long long ino;
+    long long mtime_sec;        /* Its timestamps when it was read.  */
+    long long ctime_sec;
+    unsigned int mtime_nsec;
+    unsigned int ctime_nsec;
+    unsigned int names;         /* Number of names following.  */
+    unsigned int cb_names;      /* Size of the zero terminated names.  */
+  };
+
+/* Index entry, refers to the latest record for a directory.  */
+
+struct dir_cache_ent
+  {
+    unsigned long long dev;
+    unsigned long long ino;
+    size_t off;                 /* Offset of the record in the file.  */
+  };
+
+static struct hash_table dir_cache_index;
+
+static const char *dir_cache_path;  /* The cache file, NULL if none.  */
+static int dir_cache_fd = -1;       /* Read + append descriptor for it.  */
+static const char *dir_cache_map;   /* The mapping of it.  */
+static size_t dir_cache_mapped;     /* The size of the mapping.  */
+static size_t dir_cache_indexed;    /* Bytes of it that have been indexed.  */
+static size_t dir_cache_live;       /* Bytes of it in indexed records.  */
+static size_t dir_cache_appended;   /* Bytes we've appended since mapping it.  */
+
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+static unsigned long dir_cache_hits;      /* Listings taken from the cache.  */
+static unsigned long dir_cache_stale;     /* Listings that were out of date.  */
+static unsigned long dir_cache_misses;    /* Directories not in the cache.  */
+static unsigned long dir_cache_written;   /* Listings appended to the cache.  */
+static unsigned long dir_cache_remaps;    /* Times the file was re-mapped.  */
+# endif
+
+static unsigned long
+dir_cache_ent_hash_1 (const void *key)
+{
+  struct dir_cache_ent const *ent = key;
+  return (unsigned long) (ent->ino ^ (ent->dev << 11) ^ (ent->ino >> 32));
+}
+
+static unsigned long
+dir_cache_ent_hash_2 (const void *key)
+{
+  struct dir_cache_ent const *ent = key;
+  return (unsigned long) (ent->ino * 2 + 1);
+}
+
+static int
+dir_cache_ent_hash_cmp (const void *xv, const void *yv)
+{
+  struct dir_cache_ent const *x = xv;
+  struct dir_cache_ent const *y = yv;
+  if (x->ino != y->ino)
+    return x->ino < y->ino ? -1 : 1;
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  return 0;
+}
+
+/* Returns the record at OFF if it's sane, otherwise NULL.  */
+
+static const struct dir_cache_rec *
+dir_cache_rec_at (size_t off, size_t size)
+{
+  const struct dir_cache_rec *rec;
+  const char *names, *end;
+  unsigned int count = 0;
+
+  if (size - off < sizeof (*rec))
+    return NULL;
+  rec = (const struct dir_cache_rec *) (dir_cache_map + off);
+  if (   rec->magic != DIR_CACHE_MAGIC
+      || (rec->cb & 7)
+      || rec->cb > size - off
+      || rec->cb < sizeof (*rec) + rec->cb_names)
+    return NULL;
+
+  names = (const char *) (rec + 1);
+  end = names + rec->cb_names;
+  if (names != end && end[-1] != '\0')
+    return NULL;
+  while (names < end)
+    {
+      names += strlen (names) + 1;
+      count++;
+    }
+  return count == rec->names ? rec : NULL;
+}
+
+/* Indexes the records we haven't seen yet, up to SIZE.  Stops at the first
+   garbled one (disk full or something), the rest is dropped on compaction.  */
+
+static void
+dir_cache_index_records (size_t size)
+{
+  while (dir_cache_indexed < size)
+    {
+      const struct dir_cache_rec *rec = dir_cache_rec_at (dir_cache_indexed, size);
+      struct dir_cache_ent key;
+      struct dir_cache_ent **slot;
+
+      if (!rec)
+        break;
+
+      key.dev = rec->dev;
+      key.ino = rec->ino;
+      slot = (struct dir_cache_ent **) hash_find_slot (&dir_cache_index, &key);
+      if (HASH_VACANT (*slot))
+        {
+          struct dir_cache_ent *ent = xmalloc (sizeof (*ent));
+          *ent = key;
+          ent->off = dir_cache_indexed;
+          hash_insert_at (&dir_cache_index, ent, slot);
+        }
+      else
+        {
+          dir_cache_live -= ((const struct dir_cache_rec *) (dir_cache_map + (*slot)->off))->cb;
+          (*slot)->off = dir_cache_indexed;
+        }
+      dir_cache_live += rec->cb;
+      dir_cache_indexed += rec->cb;
+    }
+}
+
+/* Maps the whole cache file if it has grown and indexes the new records.
+   Unless FORCED, growth caused by our own records doesn't count, we don't
+   need to look those up again.  */
+
+static void
+dir_cache_remap (int forced)
+{
+  struct stat st;
+  void *map;
+
+  if (   fstat (dir_cache_fd, &st) != 0
+      || (size_t) st.st_size <= dir_cache_mapped + (forced ? 0 : dir_cache_appended))
+    return;
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, dir_cache_fd, 0);
+  if (map == MAP_FAILED)
+    return;
+  if (dir_cache_map)
+    munmap ((void *) dir_cache_map, dir_cache_mapped);
+  dir_cache_map = map;
+  dir_cache_mapped = st.st_size;
+  dir_cache_appended = 0;
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  dir_cache_remaps++;
+# endif
+
+  dir_cache_index_records (dir_cache_mapped);
+}
+
+/* Returns the cached listing for the directory ST belongs to, or NULL if
+   there isn't an up to date one.  */
+
+static const struct dir_cache_rec *
+dir_cache_find (const struct stat *st)
+{
+  const struct dir_cache_rec *rec;
+  struct dir_cache_ent key;
+  struct dir_cache_ent *ent;
+
+  if (dir_cache_fd < 0)
+    return NULL;
+
+  key.dev = st->st_dev;
+  key.ino = st->st_ino;
+  ent = hash_find_item (&dir_cache_index, &key);
+  if (!ent)
+    {
+      /* Maybe a sub-make or a sibling just added it.  */
+      dir_cache_remap (0);
+      ent = hash_find_item (&dir_cache_index, &key);
+      if (!ent)
+        {
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+          dir_cache_misses++;
+# endif
+          return NULL;
+        }
+    }
+
+  rec = (const struct dir_cache_rec *) (dir_cache_map + ent->off);
+  if (   rec->mtime_sec  != st->st_mtim.tv_sec
+      || rec->mtime_nsec != st->st_mtim.tv_nsec
+      || rec->ctime_sec  != st->st_ctim.tv_sec
+      || rec->ctime_nsec != st->st_ctim.tv_nsec)
+    {
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+      dir_cache_stale++;
+# endif
+      return NULL;
+    }
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  dir_cache_hits++;
+# endif
+  return rec;
+}
+
+/* Enters the names of the cached listing REC into DC, which is then fully
+   read.  */
+
+static void
+dir_cache_fill (struct directory_contents *dc, const struct dir_cache_rec *rec)
+{
+  const char *name = (const char *) (rec + 1);
+  unsigned int i;
+
+  for (i = 0; i < rec->names; i++)
+    {
+      unsigned int len = strlen (name);
+      struct dirfile dirfile_key;
+      struct dirfile **dirfile_slot;
+      struct dirfile *df;
+
+      dirfile_key.name = strcache_add_len (name, len);
+      dirfile_key.length = len;
+      dirfile_slot = (struct dirfile **) hash_find_slot_strcached (&dc->dirfiles, &dirfile_key);
+# ifndef CONFIG_WITH_ALLOC_CACHES
+      df = xmalloc (sizeof (struct dirfile));
+# else
+      df = alloccache_alloc (&dirfile_cache);
+# endif
+      df->name = dirfile_key.name;
+      df->length = len;
+      df->impossible = 0;
+      hash_insert_at (&dc->dirfiles, df, dirfile_slot);
+
+      name += len + 1;
+    }
+  dc->dirstream = 0;
+}
+
+/* Appends the listing of the fully read directory DC to the cache, unless
+   it changed too recently to be trusted.  */
+
+static void
+dir_cache_record (struct directory_contents *dc)
+{
+  struct dirfile **slot = (struct dirfile **) dc->dirfiles.ht_vec;
+  struct dirfile **end = slot + dc->dirfiles.ht_size;
+  struct dir_cache_rec *rec;
+  unsigned int cb_names = 0;
+  unsigned int names = 0;
+  unsigned int cb;
+  char *psz;
+  time_t now;
+  int r;
+
+  if (dir_cache_fd < 0)
+    return;
+  now = time (NULL);
+  if (   dc->mtim.tv_sec > now - DIR_CACHE_MIN_AGE
+      || dc->ctim.tv_sec > now - DIR_CACHE_MIN_AGE)
+    return;
+
+  for (; slot < end; slot++)
+    if (!HASH_VACANT (*slot) && !(*slot)->impossible)
+      {
+        cb_names += (*slot)->length + 1;
+        names++;
+      }
+
+  cb = (sizeof (*rec) + cb_names + 7) & ~7U;
+  rec = xcalloc (cb);
+  rec->magic = DIR_CACHE_MAGIC;
+  rec->cb = cb;
+  rec->dev = dc->dev;
+  rec->ino = dc->ino;
+  rec->mtime_sec = dc->mtim.tv_sec;
+  rec->mtime_nsec = dc->mtim.tv_nsec;
+  rec->ctime_sec = dc->ctim.tv_sec;
+  rec->ctime_nsec = dc->ctim.tv_nsec;
+  rec->names = names;
+  rec->cb_names = cb_names;
+
+  psz = (char *) (rec + 1);
+  for (slot = (struct dirfile **) dc->dirfiles.ht_vec; slot < end; slot++)
+    if (!HASH_VACANT (*slot) && !(*slot)->impossible)
+      {
+        memcpy (psz, (*slot)->name, (*slot)->length);
+        psz += (*slot)->length + 1;
+      }
+
+  EINTRLOOP (r, write (dir_cache_fd, rec, cb));
+  if (r == (int) cb)
+    {
+      dir_cache_appended += cb;
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+      dir_cache_written++;
+# endif
+    }
+  free (rec);
+}
+
+/* Opens and maps the directory cache file PATH (absolute).  Called by main
+   after the switches have been decoded.  */
+
+void
+dir_cache_init (const char *path)
+{
+  hash_init (&dir_cache_index, DIRECTORY_BUCKETS, dir_cache_ent_hash_1,
+             dir_cache_ent_hash_2, dir_cache_ent_hash_cmp);
+
+  dir_cache_fd = open (path, O_RDWR | O_APPEND | O_CREAT, 0666);
+  if (dir_cache_fd < 0)
+    {
+      perror_with_name (_("cannot open directory cache: "), path);
+      return;
+    }
+  fcntl (dir_cache_fd, F_SETFD, FD_CLOEXEC);
+  dir_cache_path = path;
+  dir_cache_remap (1);
+}
+
+/* Closes the directory cache.  The top-level make rewrites it without the
+   superseded records when they've started to dominate, or without the
+   garbage that keeps us from seeing the records after it.  */
+
+void
+dir_cache_term (void)
+{
+  if (dir_cache_fd < 0)
+    return;
+
+  if (makelevel == 0)
+    {
+      /* Pick up what the sub-makes have added.  */
+      dir_cache_remap (1);
+      if (   dir_cache_mapped > dir_cache_live * 2 + 65536
+          || dir_cache_indexed < dir_cache_mapped)
+        {
+          char *tmp = xstrdup (concat (2, dir_cache_path, ".tmp"));
+          FILE *f = fopen (tmp, "wb");
+          if (f)
+            {
+              struct dir_cache_ent **slot = (struct dir_cache_ent **) dir_cache_index.ht_vec;
+              struct dir_cache_ent **end = slot + dir_cache_index.ht_size;
+
+              for (; slot < end; slot++)
+                if (!HASH_VACANT (*slot))
+                  fwrite (dir_cache_map + (*slot)->off,
+                          ((const struct dir_cache_rec *) (dir_cache_map + (*slot)->off))->cb,
+                          1, f);
+              if (fclose (f) != 0 || rename (tmp, dir_cache_path) != 0)
+                {
+                  perror_with_name (_("cannot compact directory cache: "), tmp);
+                  unlink (tmp);
+                }
+            }
+          free (tmp);
+        }
+    }
+
+  close (dir_cache_fd);
+  dir_cache_fd = -1;
+}
+#endif /* CONFIG_WITH_PERSISTENT_DIR_CACHE */
+
 
 static int dir_contents_file_exists_p (struct directory_contents *dir,
                                        const char *filename);
@@ -566,6 +960,9 @@ find_directory (const char *name)
 	  struct directory_contents *dc;
 	  struct directory_contents **dc_slot;
 	  struct directory_contents dc_key;
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+	  const struct dir_cache_rec *dc_rec;
+#endif
 
 	  dc_key.dev = st.st_dev;
 #ifdef WINDOWS32
@@ -663,8 +1060,19 @@ find_directory (const char *name)
 # endif
 #endif /* WINDOWS32 */
 	      hash_insert_at (&directory_contents, dc, dc_slot);
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+              dc->mtim = st.st_mtim;
+              dc->ctim = st.st_ctim;
+              dc->dirstream = 0;
+              dc_rec = dir_cache_find (&st);
+              if (!dc_rec)
+#endif
 	      ENULLLOOP (dc->dirstream, opendir (name));
-	      if (dc->dirstream == 0)
+	      if (dc->dirstream == 0
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+                  && !dc_rec
+#endif
+                 )
                 /* Couldn't open the directory.  Mark this by setting the
                    `files' member to a nil pointer.  */
                 dc->dirfiles.ht_vec = 0;
@@ -685,6 +1093,13 @@ find_directory (const char *name)
                                        &file_strcache,
                                        offsetof (struct dirfile, name));
 # endif /* CONFIG_WITH_STRCACHE2 */
+#endif
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+                  if (dc_rec)
+                    /* We've got an up to date listing, no need to read it.  */
+                    dir_cache_fill (dc, dc_rec);
+                  else
+                    {
 #endif
 		  /* Keep track of how many directories are open.  */
 		  ++open_directories;
@@ -692,6 +1107,9 @@ find_directory (const char *name)
 		    /* We have too many directories open already.
 		       Read the entire directory and then close it.  */
 		    dir_contents_file_exists_p (dc, 0);
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+                    }
+#endif
 		}
 	    }
 
@@ -927,6 +1345,9 @@ dir_contents_file_exists_p (struct directory_contents *dir,
       --open_directories;
       closedir (dir->dirstream);
       dir->dirstream = 0;
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+      dir_cache_record (dir);
+#endif
     }
 #ifdef KMK
   return ret;
@@ -1335,6 +1756,16 @@ print_dir_data_base (void)
 void print_dir_stats (void)
 {
   /** @todo normal dir stats.  */
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+  if (dir_cache_path)
+    {
+      printf (_("\n# dir-cache: %lu hits, %lu stale, %lu misses, %lu listings written\n"),
+              dir_cache_hits, dir_cache_stale, dir_cache_misses, dir_cache_written);
+      printf (_("#            %lu directories in %lu bytes (%lu live), mapped %lu times\n"),
+              dir_cache_index.ht_fill, (unsigned long) dir_cache_mapped,
+              (unsigned long) dir_cache_live, dir_cache_remaps);
+    }
+#endif
 }
 #endif
 
@@ -35,7 +35,7 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 #ifdef KMK_HELPERS
 # include "kbuild.h"
 #endif
-#ifdef CONFIG_WITH_PRINTF
+#if defined (CONFIG_WITH_PRINTF) || defined (CONFIG_WITH_KMK_BUILTIN)
 # include "kmkbuiltin.h"
 #endif
 #ifdef CONFIG_WITH_XARGS /* bird */
@@ -5487,6 +5487,9 @@ func_dircache_ctl (char *o, char **argv UNUSED, const char *funcname UNUSED)
     }
   else
     error (reading_file, "Unknown $(dircache-ctl ) command: '%s'", cmd);
+# elif defined (CONFIG_WITH_KMK_BUILTIN)
+  /* All there is here is the kmk_builtin_mkdir -p cache.  */
+  kBuiltinMkDirCacheInvalidate ();
 # endif
   return o;
 }
@@ -35,6 +35,22 @@ this program.  If not, see <http://www.gnu.org/licenses/>.  */
 
 
 #include <string.h>
+#ifdef CONFIG_WITH_JOBSERVER_PSELECT
+# include <sys/select.h>
+#endif
+#ifdef CONFIG_WITH_POSIX_SPAWN_JOBS
+# include <spawn.h>
+#endif
+#if defined (CONFIG_WITH_POSIX_SPAWN_JOBS) || defined (CONFIG_WITH_MEMORY_THROTTLING)
+# include "hash.h"
+#endif
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+# include <sys/epoll.h>
+# include <sys/syscall.h>
+# ifndef __NR_pidfd_open
+#  define __NR_pidfd_open 434   /* Same on all arches but alpha.  */
+# endif
+#endif
 
 /* Default shell to use.  */
 #ifdef WINDOWS32
@@ -140,6 +156,17 @@ extern int wait3 ();
 int wait ();
 #endif
 
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+/* Use wait3 so we learn the peak memory use of each child.  */
+# include <sys/resource.h>
+static struct rusage reap_rusage;
+# undef WAIT_NOHANG
+# define WAIT_NOHANG(status)	wait3 ((status), WNOHANG, &reap_rusage)
+# define WAIT_BLOCKING(status)	wait3 ((status), 0, &reap_rusage)
+#else
+# define WAIT_BLOCKING(status)	wait (status)
+#endif
+
 #ifndef	HAVE_UNION_WAIT
 
 # define WAIT_T int
@@ -227,6 +254,16 @@ static int start_waiting_job (struct child *);
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
 static void print_job_time (struct child *);
 #endif
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+static void job_watch_child (struct child *);
+static void job_unwatch_child (struct child *);
+#endif
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+static int memory_too_high (struct child *);
+static void job_memory_reserve (struct child *);
+static void job_memory_release (struct child *);
+static void job_memory_note (struct child *, unsigned long);
+#endif
 
 /* Chain of all live (or recently deceased) children.  */
 
@@ -255,6 +292,57 @@ unsigned long job_counter = 0;
 /* Number of jobserver tokens this instance is currently using.  */
 
 unsigned int jobserver_tokens = 0;
+
+#ifdef CONFIG_WITH_JOBSERVER_PSELECT
+/* Private, non-blocking read descriptor for the jobserver pipe.  This is a
+   separate open file description (not a dup), so O_NONBLOCK doesn't leak to
+   other makes sharing the pipe.  -2 if not yet initialized, -1 if not
+   available (fall back on the dup+SIGCHLD trick).  */
+
+static int job_nb_rfd = -2;
+#endif
+
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+/* Epoll set containing the pidfds of all running children and the private
+   jobserver descriptor, so a single epoll_pwait covers both child deaths and
+   token availability.  -2 if not yet initialized, -1 if not available.  */
+
+static int job_epoll_fd = -2;
+
+/* Nonzero if job_nb_rfd has been added to job_epoll_fd.  */
+
+static int job_epoll_has_rfd = 0;
+
+/* Number of running children we couldn't get a pidfd for.  As long as there
+   are any we have to rely on SIGCHLD and use the pselect wait.  */
+
+static unsigned int job_unwatched_children = 0;
+
+/* When epoll last reported dead children, -1 if they've been reaped.  */
+
+static big_int reap_wakeup_ts = -1;
+#endif
+
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+/* Child reaping statistics.  */
+
+static unsigned long reap_passes;           /* reap_children calls reaping any.  */
+static unsigned long reap_children_total;   /* Children reaped in total.  */
+static unsigned int reap_max_batch;         /* Most children reaped in one pass.  */
+# ifdef CONFIG_WITH_PIDFD_EPOLL
+static unsigned long reap_latency_count;    /* Reaps with a known wakeup time.  */
+static big_int reap_latency_ns;             /* Total wakeup to reap latency.  */
+static big_int reap_max_latency_ns;         /* Worst wakeup to reap latency.  */
+# endif
+
+/* Jobserver token statistics.  */
+
+static unsigned long jobserver_acquired;    /* Tokens read from the pipe.  */
+static unsigned long jobserver_waits;       /* Times we had to sleep for one.  */
+static unsigned long jobserver_wakeups;     /* Sleeps that didn't yield one.  */
+static big_int jobserver_wait_ns;           /* Total time spent acquiring.  */
+static big_int jobserver_max_wait_ns;       /* Longest single acquisition.  */
+#endif
 
 #ifdef WINDOWS32
 /*
@@ -513,10 +601,20 @@ child_error (const char *target_name,
 
 static unsigned int dead_children = 0;
 
+#ifdef CONFIG_WITH_JOBSERVER_PSELECT
+/* Incremented on every SIGCHLD and never decremented, so that the pselect
+   based token wait can detect children dying while it wasn't looking.  */
+
+static volatile sig_atomic_t sigchld_generation = 0;
+#endif
+
 RETSIGTYPE
 child_handler (int sig UNUSED)
 {
   ++dead_children;
+#ifdef CONFIG_WITH_JOBSERVER_PSELECT
+  ++sigchld_generation;
+#endif
 
   if (job_rfd >= 0)
     {
@@ -536,6 +634,53 @@ child_handler (int sig UNUSED)
 
 extern int shell_function_pid, shell_function_completed;
 
+#ifdef CONFIG_WITH_APPEND_BUFFERING
+/* The child whose kmk_builtin_append may have left its file open and
+   buffered, and thus the one to blame if writing it out fails.  */
+
+static struct child *append_buffer_owner = NULL;
+#endif
+
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+/* Sequence number for the made up PIDs of builtins running on the worker
+   thread.  They are above PID_MAX_LIMIT, so they can't clash with (or get
+   a kill sent to) a real process.  */
+
+static unsigned int job_builtin_seq = 0;
+# define JOB_BUILTIN_PID_FLAG 0x40000000
+
+/* Blocking wait for either a child process or a builtin running on the
+   worker thread, which wait() knows nothing about.  The worker raises
+   SIGCHLD when it is done, so check for completions with SIGCHLD blocked
+   and sleep in sigsuspend().  Returns the PID of a dead child process, 0 if
+   a builtin completed, -1 if the wait failed.  */
+
+static pid_t
+reap_wait_child_or_builtin (WAIT_T *status)
+{
+  sigset_t chld_set, old_set, wait_set;
+  pid_t pid;
+
+  sigemptyset (&chld_set);
+  sigaddset (&chld_set, SIGCHLD);
+  sigprocmask (SIG_BLOCK, &chld_set, &old_set);
+  wait_set = old_set;
+  sigdelset (&wait_set, SIGCHLD);
+  for (;;)
+    {
+      EINTRLOOP (pid, WAIT_NOHANG (status));
+      if (pid > 0 || (pid < 0 && errno != ECHILD))
+        break;
+      pid = 0;
+      if (kmk_builtin_completed ())
+        break;
+      sigsuspend (&wait_set);
+    }
+  sigprocmask (SIG_SETMASK, &old_set, NULL);
+  return pid;
+}
+#endif /* CONFIG_WITH_KMK_BUILTIN_THREADS */
+
 /* Reap all dead children, storing the returned status and the new command
    state (`cs_finished') in the `file' member of the `struct child' for the
    dead child, and removing the child from the chain.  In addition, if BLOCK
@@ -551,6 +696,9 @@ reap_children (int block, int err)
   /* Initially, assume we have some.  */
   int reap_more = 1;
 #endif
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  unsigned int reaped = 0;
+#endif
 
 #ifdef WAIT_NOHANG
 # define REAP_MORE reap_more
@@ -579,6 +727,9 @@ reap_children (int block, int err)
 #ifdef CONFIG_WITH_KMK_BUILTIN
       struct child *completed_child = NULL;
 #endif
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+      reap_rusage.ru_maxrss = 0;
+#endif
 
       if (err && block)
 	{
@@ -612,6 +763,19 @@ reap_children (int block, int err)
       if (dead_children > 0)
 	--dead_children;
 
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+      /* Pick up the builtins the worker thread has completed, they're
+         reaped below just like the ones run synchronously.  */
+      {
+        int rc;
+        while ((c = kmk_builtin_reap (&rc)) != 0)
+          {
+            c->status = rc << 8;
+            c->has_status = 1;
+          }
+      }
+#endif
+
       any_remote = 0;
       any_local = shell_function_pid != 0;
       for (c = children; c != 0; c = c->next)
@@ -659,6 +823,11 @@ reap_children (int block, int err)
           if (completed_child)
             {
               pid = completed_child->pid;
+# ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+              /* Queued builtins count as started jobs.  */
+              if ((pid & JOB_BUILTIN_PID_FLAG) && job_counter)
+                --job_counter;
+# endif
 # if defined(WINDOWS32)
               exit_code = completed_child->status;
               exit_sig = 0;
@@ -681,12 +850,39 @@ reap_children (int block, int err)
 		pid = WAIT_NOHANG (&status);
 	      else
 #endif
-		EINTRLOOP(pid, wait (&status));
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+              if (kmk_builtin_pending ())
+                {
+# ifdef CONFIG_WITH_PIDFD_EPOLL
+                  reap_wakeup_ts = -1;
+# endif
+                  pid = reap_wait_child_or_builtin (&status);
+                  if (pid == 0)
+                    /* A builtin completed, collect it at the top.  */
+                    continue;
+                }
+              else
+#endif
+#ifndef CONFIG_WITH_PIDFD_EPOLL
+		EINTRLOOP(pid, WAIT_BLOCKING (&status));
+#else
+                {
+                  /* Deaths we block for here weren't reported by epoll,
+                     don't attribute the wait to the reap latency.  */
+                  reap_wakeup_ts = -1;
+                  EINTRLOOP(pid, WAIT_BLOCKING (&status));
+                }
+#endif
 #endif /* !VMS */
 	    }
 	  else
 	    pid = 0;
 
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+          /* No child processes, only builtins on the worker thread.  */
+          if (pid < 0 && errno == ECHILD && kmk_builtin_pending ())
+            pid = 0;
+#endif
 	  if (pid < 0)
 	    {
               /* The wait*() failed miserably.  Punt.  */
@@ -827,6 +1023,30 @@ reap_children (int block, int err)
         /* An unknown child died.
            Ignore it; it was inherited from our invoker.  */
         continue;
+#ifdef CONFIG_WITH_KMK_BUILTIN
+      c->has_status = 0;
+#endif
+
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+      reaped++;
+# ifdef CONFIG_WITH_PIDFD_EPOLL
+      if (reap_wakeup_ts != -1 && c->pidfd >= 0)
+        {
+          big_int latency = nano_timestamp () - reap_wakeup_ts;
+          reap_latency_ns += latency;
+          if (latency > reap_max_latency_ns)
+            reap_max_latency_ns = latency;
+          reap_latency_count++;
+        }
+# endif
+#endif
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+      job_unwatch_child (c);
+#endif
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+      if (!remote)
+        job_memory_note (c, reap_rusage.ru_maxrss);
+#endif
 
       DB (DB_JOBS, (child_failed
                     ? _("Reaping losing child %p PID %s %s\n")
@@ -981,9 +1201,91 @@ reap_children (int block, int err)
       block = 0;
     }
 
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  if (reaped)
+    {
+      reap_passes++;
+      reap_children_total += reaped;
+      if (reaped > reap_max_batch)
+        reap_max_batch = reaped;
+    }
+#endif
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+  /* Everything epoll told us about has been reaped by now.  */
+  reap_wakeup_ts = -1;
+#endif
   return;
 }
 
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+/* Gets a pidfd for the process running CHILD's current command and adds it
+   to the epoll set, so that we don't need SIGCHLD to notice its death while
+   waiting for a jobserver token.  */
+
+static void
+job_watch_child (struct child *child)
+{
+  struct epoll_event ev;
+  int fd;
+
+  child->pidfd = -1;
+  if (job_epoll_fd == -2)
+    {
+      job_epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+      if (job_epoll_fd < 0)
+        DB (DB_JOBS, (_("epoll_create1 failed: %s\n"), strerror (errno)));
+    }
+  if (job_epoll_fd >= 0)
+    {
+      fd = (int) syscall (__NR_pidfd_open, child->pid, 0);
+      if (fd >= 0)
+        {
+          CLOSE_ON_EXEC (fd);
+          memset (&ev, 0, sizeof (ev));
+          ev.events = EPOLLIN;
+          ev.data.ptr = child;
+          if (epoll_ctl (job_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+            {
+              child->pidfd = fd;
+              return;
+            }
+          close (fd);
+        }
+      else if (errno == ENOSYS)
+        {
+          /* Old kernel, don't bother with epoll at all.  */
+          DB (DB_JOBS, (_("pidfd_open not supported, not using epoll.\n")));
+          close (job_epoll_fd);
+          job_epoll_fd = -1;
+        }
+    }
+
+  DB (DB_JOBS, (_("No pidfd for child %p PID %s\n"),
+                (void *)child, pid2str (child->pid)));
+  child->unwatched = 1;
+  job_unwatched_children++;
+}
+
+/* Stops watching CHILD's process after it has been reaped.  Closing the
+   pidfd removes it from the epoll set.  */
+
+static void
+job_unwatch_child (struct child *child)
+{
+  if (child->pidfd >= 0)
+    {
+      close (child->pidfd);
+      child->pidfd = -1;
+    }
+  else if (child->unwatched)
+    {
+      child->unwatched = 0;
+      assert (job_unwatched_children > 0);
+      job_unwatched_children--;
+    }
+}
+#endif /* CONFIG_WITH_PIDFD_EPOLL */
+
 /* Free the storage allocated for CHILD.  */
 
 static void
@@ -1016,6 +1318,21 @@ free_child (struct child *child)
 
   --jobserver_tokens;
 
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+  job_unwatch_child (child);
+#endif
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+  job_memory_release (child);
+#endif
+#ifdef CONFIG_WITH_APPEND_BUFFERING
+  /* Died before getting to the end of the recipe, e.g. a failing append. */
+  if (child == append_buffer_owner)
+    {
+      append_buffer_owner = NULL;
+      kmk_builtin_append_flush ();
+    }
+#endif
+
   if (handling_fatal_signal) /* Don't bother free'ing if about to die.  */
     return;
 
@@ -1115,8 +1432,462 @@ set_child_handler_action_flags (int set_handler, int set_alarm)
     }
 #endif
 }
-#endif
 
+#ifdef CONFIG_WITH_JOBSERVER_PSELECT
+/* Opens a second, non-blocking read descriptor for the jobserver pipe.
+
+   Using /proc/self/fd/N gives us a new open file description for the same
+   pipe, so we can set O_NONBLOCK on it without affecting the parent make or
+   any foreign make sharing the pipe (they still do blocking reads on the
+   original descriptor).  Returns -1 if this isn't possible.  */
+
+static int
+jobserver_open_nb_rfd (void)
+{
+  char path[64];
+  struct stat st_new, st_org;
+  int fd;
+
+  sprintf (path, "/proc/self/fd/%d", job_fds[0]);
+  EINTRLOOP (fd, open (path, O_RDONLY | O_NONBLOCK));
+  if (fd < 0)
+    {
+      DB (DB_JOBS, (_("Cannot reopen jobserver pipe via %s: %s\n"),
+                    path, strerror (errno)));
+      return -1;
+    }
+
+  if (   fstat (fd, &st_new) != 0
+      || fstat (job_fds[0], &st_org) != 0
+      || st_new.st_ino != st_org.st_ino
+      || st_new.st_dev != st_org.st_dev)
+    {
+      DB (DB_JOBS, (_("Reopened jobserver pipe doesn't match, not using it.\n")));
+      close (fd);
+      return -1;
+    }
+
+  CLOSE_ON_EXEC (fd);
+  DB (DB_JOBS, (_("Jobserver using non-blocking fd %d for pipe fds %d,%d\n"),
+                fd, job_fds[0], job_fds[1]));
+  return fd;
+}
+
+# ifdef CONFIG_WITH_PIDFD_EPOLL
+/* Waits for a jobserver token or child deaths with a single epoll_pwait on
+   the private jobserver descriptor and the pidfds of all running children.
+
+   pidfds stay readable until the child is reaped, so unlike the SIGCHLD
+   approach there is no window to close.  SIGCHLD is kept blocked while we
+   sleep so each batch of deaths costs one wakeup rather than one EINTR per
+   child.  If WAITING is set we wake up after a second to let the caller
+   reconsider the load.
+
+   Returns 1 if we got a token, 0 if the caller should reap and retry.  */
+
+static int
+jobserver_epoll_acquire_token (int waiting)
+{
+  struct epoll_event events[32];
+  sigset_t wait_set;
+  int dead = 0;
+  int token_ready = 0;
+  char token;
+  int i, r;
+
+  if (!job_epoll_has_rfd)
+    {
+      struct epoll_event ev;
+      memset (&ev, 0, sizeof (ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;
+      if (epoll_ctl (job_epoll_fd, EPOLL_CTL_ADD, job_nb_rfd, &ev) != 0)
+        pfatal_with_name (_("epoll_ctl jobs pipe"));
+      job_epoll_has_rfd = 1;
+    }
+
+  sigprocmask (SIG_BLOCK, NULL, &wait_set);
+  sigaddset (&wait_set, SIGCHLD);
+#  ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  jobserver_waits++;
+#  endif
+  r = epoll_pwait (job_epoll_fd, events, sizeof (events) / sizeof (events[0]),
+                   waiting ? 1000 : -1, &wait_set);
+  if (r < 0 && errno != EINTR)
+    pfatal_with_name (_("epoll_pwait"));
+
+  for (i = 0; i < r; i++)
+    if (events[i].data.ptr)
+      dead++;
+    else
+      token_ready = 1;
+
+  if (dead)
+    {
+      DB (DB_JOBS, (_("epoll reported %d dead children.\n"), dead));
+      if (reap_wakeup_ts == -1)
+        reap_wakeup_ts = nano_timestamp ();
+    }
+
+  if (token_ready)
+    {
+      /* The pipe is readable, but another make may beat us to it.  */
+      EINTRLOOP (r, read (job_nb_rfd, &token, 1));
+      if (r == 1)
+        return 1;
+      if (r < 0 && errno != EAGAIN)
+        pfatal_with_name (_("read jobs pipe"));
+    }
+
+#  ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  jobserver_wakeups++;
+#  endif
+  return 0;
+}
+# endif /* CONFIG_WITH_PIDFD_EPOLL */
+
+/* Waits for a jobserver token to become available or a child to die.
+
+   GENERATION is the sigchld_generation value sampled before the caller last
+   reaped children.  SIGCHLD is blocked while we check it and only unblocked
+   atomically by pselect, so a child dying at any point after the sampling
+   makes us return promptly instead of sleeping on the pipe.  If WAITING is
+   set we wake up after a second to let the caller reconsider the load.
+
+   Returns 1 if we got a token, 0 if the caller should reap and retry.  */
+
+static int
+jobserver_acquire_token (sig_atomic_t generation, int waiting)
+{
+  sigset_t chld_set, old_set;
+  struct timespec timeout;
+  fd_set readfds;
+  char token;
+  int r;
+
+# ifdef CONFIG_WITH_PIDFD_EPOLL
+  if (job_epoll_fd >= 0 && !job_unwatched_children)
+    return jobserver_epoll_acquire_token (waiting);
+# endif
+
+  sigemptyset (&chld_set);
+  sigaddset (&chld_set, SIGCHLD);
+  sigprocmask (SIG_BLOCK, &chld_set, &old_set);
+
+  if (generation != sigchld_generation)
+    r = -1;
+  else
+    {
+      sigset_t wait_set = old_set;
+      sigdelset (&wait_set, SIGCHLD);
+
+      FD_ZERO (&readfds);
+      FD_SET (job_nb_rfd, &readfds);
+      timeout.tv_sec = 1;
+      timeout.tv_nsec = 0;
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+      jobserver_waits++;
+# endif
+      r = pselect (job_nb_rfd + 1, &readfds, NULL, NULL,
+                   waiting ? &timeout : NULL, &wait_set);
+      if (r < 0 && errno != EINTR)
+        pfatal_with_name (_("pselect jobs pipe"));
+    }
+
+  sigprocmask (SIG_SETMASK, &old_set, NULL);
+
+  if (r > 0)
+    {
+      /* The pipe is readable, but another make may beat us to it.  */
+      EINTRLOOP (r, read (job_nb_rfd, &token, 1));
+      if (r == 1)
+        return 1;
+      if (r < 0 && errno != EAGAIN)
+        pfatal_with_name (_("read jobs pipe"));
+    }
+
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  jobserver_wakeups++;
+# endif
+  return 0;
+}
+#endif /* CONFIG_WITH_JOBSERVER_PSELECT */
+#endif /* MAKE_JOBSERVER */
+
+
+#ifdef CONFIG_WITH_POSIX_SPAWN_JOBS
+/* Cache of PATH lookups done for posix_spawn.  Keyed by the command name;
+   an entry is only valid for the PATH value it was resolved with, since
+   target specific exports may change PATH.  Failed lookups aren't cached,
+   we leave those to execvp so the error reporting is the usual one.  */
+
+struct spawn_path
+  {
+    const char *name;           /* Command name (argv[0]), strcache'ed.  */
+    const char *path_var;       /* PATH it was resolved with, strcache'ed.  */
+    char *exe;                  /* The resolved executable.  */
+  };
+
+static struct hash_table spawn_paths;
+
+/* Spawn statistics.  */
+
+static unsigned long spawn_count;           /* Children started by posix_spawn.  */
+static unsigned long spawn_fallbacks;       /* Children left to vfork+execvp.  */
+static unsigned long spawn_path_hits;       /* PATH lookups served by the cache.  */
+static unsigned long spawn_path_misses;     /* PATH lookups done the hard way.  */
+static big_int spawn_first_ts = -1;         /* When the first child was started.  */
+
+static unsigned long
+spawn_path_hash_1 (const void *key)
+{
+  return_STRING_HASH_1 (((struct spawn_path const *) key)->name);
+}
+
+static unsigned long
+spawn_path_hash_2 (const void *key)
+{
+  return_STRING_HASH_2 (((struct spawn_path const *) key)->name);
+}
+
+static int
+spawn_path_hash_cmp (const void *x, const void *y)
+{
+  return_STRING_COMPARE (((struct spawn_path const *) x)->name,
+                         ((struct spawn_path const *) y)->name);
+}
+
+/* Searches PATH_VAR for NAME the way execvp would.
+   Returns the full path in a xmalloc'ed buffer, or NULL if not found.  */
+
+static char *
+spawn_search_path (const char *name, const char *path_var)
+{
+  size_t name_len = strlen (name);
+  const char *p = path_var;
+
+  for (;;)
+    {
+      const char *end = strchr (p, PATH_SEPARATOR_CHAR);
+      size_t dir_len = end ? (size_t)(end - p) : strlen (p);
+      struct stat st;
+      char *exe;
+
+      /* An empty component means the current directory.  */
+      exe = xmalloc (dir_len + 1 + name_len + 1);
+      if (dir_len)
+        {
+          memcpy (exe, p, dir_len);
+          exe[dir_len] = '/';
+          memcpy (&exe[dir_len + 1], name, name_len + 1);
+        }
+      else
+        memcpy (exe, name, name_len + 1);
+
+      if (   stat (exe, &st) == 0
+          && S_ISREG (st.st_mode)
+          && access (exe, X_OK) == 0)
+        return exe;
+      free (exe);
+
+      if (!end)
+        return NULL;
+      p = end + 1;
+    }
+}
+
+/* Finds the executable for ARGV0 using the PATH from ENVP.
+   Returns NULL if it wasn't found.  Also used by kmk_builtin_redirect.  */
+
+const char *
+spawn_resolve_program (const char *argv0, char **envp)
+{
+  struct spawn_path key;
+  struct spawn_path *entry;
+  struct spawn_path **slot;
+  const char *path_var = NULL;
+  char **ep;
+
+  /* Commands with a slash aren't subject to PATH searching.  */
+  if (strchr (argv0, '/'))
+    return argv0;
+
+  for (ep = envp; *ep; ep++)
+    if (!strncmp (*ep, "PATH=", 5))
+      {
+        path_var = *ep + 5;
+        break;
+      }
+  if (!path_var)
+    return NULL;  /* execvp has a default path, let it deal with it.  */
+
+  if (!spawn_paths.ht_vec)
+    hash_init (&spawn_paths, 64, spawn_path_hash_1, spawn_path_hash_2,
+               spawn_path_hash_cmp);
+
+  key.name = argv0;
+  slot = (struct spawn_path **) hash_find_slot (&spawn_paths, &key);
+  entry = *slot;
+  if (!HASH_VACANT (entry))
+    {
+      if (!strcmp (entry->path_var, path_var))
+        {
+          spawn_path_hits++;
+          return entry->exe;
+        }
+    }
+  else
+    entry = NULL;
+
+  spawn_path_misses++;
+  key.exe = spawn_search_path (argv0, path_var);
+  if (!key.exe)
+    return NULL;
+
+  if (!entry)
+    {
+      entry = xmalloc (sizeof (*entry));
+      entry->name = strcache_add (argv0);
+      hash_insert_at (&spawn_paths, entry, slot);
+    }
+  else
+    free (entry->exe);
+  entry->path_var = strcache_add (path_var);
+  entry->exe = key.exe;
+  return entry->exe;
+}
+
+/* Tries to start CHILD's command ARGV using posix_spawn with STDIN_FD as
+   standard input.  This does the same setup as the vfork child code in
+   start_job_command, but without running any code in the child and with
+   a cached PATH lookup instead of execvp walking PATH every time.
+
+   Returns the pid of the new process, or 0 if the caller should do the
+   vfork + execvp dance instead (unusual cases and all failures).  */
+
+static pid_t
+job_posix_spawn (struct child *child, char **argv, int stdin_fd, int flags)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t empty;
+  const char *exe;
+  pid_t pid = 0;
+  int rc;
+# ifdef SET_STACK_SIZE
+  struct rlimit saved_stack;
+# endif
+
+  exe = spawn_resolve_program (argv[0], child->environment);
+  if (!exe)
+    {
+      spawn_fallbacks++;
+      return 0;
+    }
+
+  rc = posix_spawn_file_actions_init (&actions);
+  if (rc == 0)
+    {
+      if (stdin_fd != 0)
+        rc = posix_spawn_file_actions_adddup2 (&actions, stdin_fd, 0);
+      if (rc == 0 && !(flags & COMMANDS_RECURSE) && job_fds[0] >= 0)
+        {
+          rc = posix_spawn_file_actions_addclose (&actions, job_fds[0]);
+          if (rc == 0)
+            rc = posix_spawn_file_actions_addclose (&actions, job_fds[1]);
+        }
+      if (rc == 0 && job_rfd >= 0)
+        rc = posix_spawn_file_actions_addclose (&actions, job_rfd);
+
+      if (rc == 0 && (rc = posix_spawnattr_init (&attr)) == 0)
+        {
+          /* The vfork child calls unblock_sigs().  */
+          sigemptyset (&empty);
+          rc = posix_spawnattr_setsigmask (&attr, &empty);
+          if (rc == 0)
+            rc = posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK
+# ifdef POSIX_SPAWN_USEVFORK
+                                           | POSIX_SPAWN_USEVFORK
+# endif
+                                           );
+          if (rc == 0)
+            {
+# ifdef SET_STACK_SIZE
+              /* The child must get the original stack limit back, and since
+                 we can't run code in it we lower ours while spawning.  */
+              if (stack_limit.rlim_cur)
+                {
+                  getrlimit (RLIMIT_STACK, &saved_stack);
+                  setrlimit (RLIMIT_STACK, &stack_limit);
+                }
+# endif
+              rc = posix_spawn (&pid, exe, &actions, &attr, argv,
+                                child->environment);
+# ifdef SET_STACK_SIZE
+              if (stack_limit.rlim_cur)
+                setrlimit (RLIMIT_STACK, &saved_stack);
+# endif
+            }
+          posix_spawnattr_destroy (&attr);
+        }
+      posix_spawn_file_actions_destroy (&actions);
+    }
+
+  if (rc != 0)
+    {
+      /* ENOEXEC (script without #!) and friends are best handled by
+         exec_command.  */
+      DB (DB_JOBS, (_("posix_spawn of %s failed (%s), falling back on vfork\n"),
+                    exe, strerror (rc)));
+      spawn_fallbacks++;
+      return 0;
+    }
+
+  if (spawn_first_ts == -1)
+    spawn_first_ts = nano_timestamp ();
+  spawn_count++;
+  return pid;
+}
+#endif /* CONFIG_WITH_POSIX_SPAWN_JOBS */
+
+#ifdef CONFIG_WITH_APPEND_BUFFERING
+/* Write out what kmk_builtin_append has kept buffered before CHILD runs
+   CMD, unless CMD is another append by the same child which can carry on
+   with the buffer.  CMD is NULL for anything that isn't a kmk builtin and
+   at the end of the recipe.  A write failure is charged to the child that
+   did the appends, which may not be CHILD under -j; that child fails the
+   next time it gets here, the same way as for a failing builtin, and
+   nonzero is returned.  */
+
+static int
+flush_append_buffer (struct child *child, const char *cmd)
+{
+  int is_append = cmd
+      && !strncmp (cmd, "kmk_builtin_append", sizeof ("kmk_builtin_append") - 1)
+      && (cmd[sizeof ("kmk_builtin_append") - 1] == '\0'
+          || isblank ((unsigned char) cmd[sizeof ("kmk_builtin_append") - 1]));
+
+  if (append_buffer_owner && (!is_append || append_buffer_owner != child))
+    {
+      struct child *owner = append_buffer_owner;
+      append_buffer_owner = NULL;
+      if (kmk_builtin_append_flush () != 0)
+        owner->append_failed = 1;
+    }
+  if (!child->append_failed)
+    {
+      if (is_append)
+        append_buffer_owner = child;
+      return 0;
+    }
+  child->append_failed = 0;
+  set_command_state (child->file, cs_running);
+  child->pid = (pid_t)42424242;
+  child->status = 1 << 8;
+  child->has_status = 1;
+  return 1;
+}
+#endif /* CONFIG_WITH_APPEND_BUFFERING */
 
 /* Start a job to run the commands specified in CHILD.
    CHILD is updated to reflect the commands and ID of the child process.
@@ -1259,6 +2030,13 @@ start_job_command (struct child *child)
 	{
 	  /* No more commands.  Make sure we're "running"; we might not be if
              (e.g.) all commands were skipped due to -n.  */
+#ifdef CONFIG_WITH_APPEND_BUFFERING
+          if (flush_append_buffer (child, NULL))
+            {
+              unblock_sigs ();
+              return;
+            }
+#endif
           set_command_state (child->file, cs_running);
 	  child->file->update_status = 0;
 	  notice_finished_file (child->file);
@@ -1344,6 +2122,36 @@ start_job_command (struct child *child)
       set_command_state (child->file, cs_running);
       child->deleted = 0;
       child->pid = 0;
+# ifdef CONFIG_WITH_APPEND_BUFFERING
+      if (flush_append_buffer (child, *p2))
+        {
+#  ifndef VMS
+          free (argv[0]);
+          free ((char *) argv);
+#  endif
+          unblock_sigs ();
+          return;
+        }
+# endif
+# ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+      /* With parallel jobs, let the worker thread run the builtins that
+         only deal with files so we can get on with starting other jobs.
+         reap_children() collects the result like for a real child.  */
+      if (   job_slots != 1
+          && kmk_builtin_is_threadable (*p2)
+          && kmk_builtin_queue (child, argv, p2 != argv ? *p2 : NULL) == 0)
+        {
+          child->pid = (pid_t) (JOB_BUILTIN_PID_FLAG | (++job_builtin_seq & 0x3fffffff));
+          /* It keeps a CPU busy like any child process.  */
+          ++job_counter;
+#  ifdef CONFIG_WITH_PIDFD_EPOLL
+          /* No process to get a pidfd for, token waits must use SIGCHLD.  */
+          child->unwatched = 1;
+          job_unwatched_children++;
+#  endif
+          return;
+        }
+# endif
       if (p2 != argv)
         rc = kmk_builtin_command (*p2, child, &argv_spawn, &child->pid);
       else
@@ -1364,6 +2172,9 @@ start_job_command (struct child *child)
           /* spawned a child? */
           if (child->pid)
             {
+# ifdef CONFIG_WITH_PIDFD_EPOLL
+              job_watch_child (child);
+# endif
               ++job_counter;
               return;
             }
@@ -1388,6 +2199,19 @@ start_job_command (struct child *child)
     }
 #endif /* CONFIG_WITH_KMK_BUILTIN */
 
+#ifdef CONFIG_WITH_APPEND_BUFFERING
+  /* The command may well want to read what the appends wrote.  */
+  if (flush_append_buffer (child, NULL))
+    {
+# ifndef VMS
+      free (argv[0]);
+      free ((char *) argv);
+# endif
+      unblock_sigs ();
+      return;
+    }
+#endif
+
   /* Flush the output streams so they won't have things written twice.  */
 
   fflush (stdout);
@@ -1519,6 +2343,11 @@ start_job_command (struct child *child)
       volatile_argv  = argv;            /* shut up gcc */
       volatile_flags = flags;           /* ditto */
 
+#ifdef CONFIG_WITH_POSIX_SPAWN_JOBS
+      child->pid = job_posix_spawn (child, argv,
+                                    child->good_stdin ? 0 : bad_stdin, flags);
+      if (child->pid == 0)
+#endif
       child->pid = vfork ();
       environ = parent_environ;	/* Restore value child may have clobbered.  */
       argv = volatile_argv;             /* shut up gcc */
@@ -1553,6 +2382,10 @@ start_job_command (struct child *child)
 	  perror_with_name ("vfork", "");
 	  goto error;
 	}
+# ifdef CONFIG_WITH_PIDFD_EPOLL
+      else
+        job_watch_child (child);
+# endif
 # endif  /* !__EMX__ */
 #endif /* !VMS */
     }
@@ -1725,6 +2558,9 @@ start_waiting_job (struct child *c)
 #else
       && ((job_slots_used > 0 && load_too_high ())
 #endif
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+	  || (job_slots_used > 0 && memory_too_high (c))
+#endif
 #ifdef WINDOWS32
 	  || (process_used_slots () >= MAXIMUM_WAIT_OBJECTS)
 #endif
@@ -1758,6 +2594,11 @@ start_waiting_job (struct child *c)
       return 0;
     }
 
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+  /* Count its expected memory use against the budget while it runs.  */
+  job_memory_reserve (c);
+#endif
+
   /* Start the first command; reap_children will run later command lines.  */
   start_job_command (c);
 
@@ -1801,6 +2642,9 @@ new_job (struct file *file)
   struct child *c;
   char **lines;
   unsigned int i;
+#if defined (MAKE_JOBSERVER) && defined (CONFIG_WITH_PRINT_STATS_SWITCH)
+  big_int token_start_ts = -1;
+#endif
 
   /* Let any previously decided-upon jobs that are waiting
      for the load to go down start before this new one.  */
@@ -1927,6 +2771,9 @@ new_job (struct file *file)
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
   c->start_ts = -1;
 #endif
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+  c->pidfd = -1;
+#endif
 
   /* Cache dontcare flag because file->dontcare can be changed once we
      return. Check dontcare inheritance mechanism for details.  */
@@ -1961,6 +2808,9 @@ new_job (struct file *file)
         char token;
 	int got_token;
 	int saved_errno;
+# ifdef CONFIG_WITH_JOBSERVER_PSELECT
+        sig_atomic_t generation;
+# endif
 
         DB (DB_JOBS, ("Need a job token; we %shave children\n",
                       children ? "" : "don't "));
@@ -1969,6 +2819,40 @@ new_job (struct file *file)
         if (!jobserver_tokens)
           break;
 
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+        if (token_start_ts == -1 && print_stats_flag)
+          token_start_ts = nano_timestamp ();
+# endif
+# ifdef CONFIG_WITH_JOBSERVER_PSELECT
+        /* Wait with pselect on a private non-blocking descriptor if we can.
+           This avoids the dup, the signal action juggling and the alarm of
+           the classic scheme below, while the tokens are still plain bytes
+           in the same pipe so foreign makes can share it.  */
+        if (job_nb_rfd == -2)
+          job_nb_rfd = jobserver_open_nb_rfd ();
+        if (job_nb_rfd >= 0)
+          {
+            generation = sigchld_generation;
+            reap_children (0, 0);
+            start_waiting_jobs ();
+            if (!jobserver_tokens)
+              break;
+            if (!children)
+              fatal (NILF, "INTERNAL: no children as we go to sleep on read\n");
+
+            if (jobserver_acquire_token (generation, waiting_jobs != NULL))
+              {
+#  ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+                jobserver_acquired++;
+#  endif
+                DB (DB_JOBS, (_("Obtained token for child %p (%s).\n"),
+                              (void *)c, c->file->name));
+                break;
+              }
+            continue;
+          }
+# endif /* CONFIG_WITH_JOBSERVER_PSELECT */
+
         /* Read a token.  As long as there's no token available we'll block.
            We enable interruptible system calls before the read(2) so that if
            we get a SIGCHLD while we're waiting, we'll return with EINTR and
@@ -2024,6 +2908,9 @@ new_job (struct file *file)
         /* If we got one, we're done here.  */
 	if (got_token == 1)
           {
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+            jobserver_acquired++;
+# endif
             DB (DB_JOBS, (_("Obtained token for child %p (%s).\n"),
                           (void *)c, c->file->name));
             break;
@@ -2037,6 +2924,16 @@ new_job (struct file *file)
         if (errno == EBADF)
           DB (DB_JOBS, ("Read returned EBADF.\n"));
       }
+
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  if (token_start_ts != -1)
+    {
+      big_int elapsed = nano_timestamp () - token_start_ts;
+      jobserver_wait_ns += elapsed;
+      if (elapsed > jobserver_max_wait_ns)
+        jobserver_max_wait_ns = elapsed;
+    }
+# endif
 #endif
 
   ++jobserver_tokens;
@@ -2210,6 +3107,365 @@ load_too_high (void)
 #endif
 }
 
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+/* Memory aware job throttling (--max-memory).
+
+   The peak RSS of every job is picked up from wait3 and remembered by the
+   absolute name of its target, across runs if --memory-history is given.
+   A job is held back if the expected peaks of the running jobs plus its own
+   would exceed the budget, or if its own expected peak doesn't fit in what
+   the system has available.  Targets we know nothing about are expected to
+   need the average of the peaks seen so far in this run.
+
+   The history file is a list of "<peak-KB> <target>" lines where later lines
+   override earlier ones.  Lines are appended with a single O_APPEND write, so
+   sub-makes can share the file without locking.  The top-level make
+   compacts it when it exits.  */
+
+struct job_mem_hist
+  {
+    const char *key;            /* Absolute target name.  */
+    unsigned long peak_kb;      /* Peak RSS of its most recent job, KB.  */
+  };
+
+static struct hash_table job_mem_hists;
+
+static const char *job_mem_hist_path;       /* The history file, NULL if none.  */
+static int job_mem_hist_fd = -1;            /* Append descriptor for it.  */
+static unsigned long job_mem_hist_lines;    /* Lines read from it.  */
+
+static unsigned long job_mem_reserved_kb;   /* Expected peak of running jobs.  */
+static unsigned long job_mem_observed_kb;   /* Sum of the peaks reaped so far.  */
+static unsigned long job_mem_observed;      /* Number of peaks reaped so far.  */
+static unsigned long job_mem_avail_kb;      /* MemAvailable at the last sample.  */
+static unsigned long job_mem_started_kb;    /* Expected peak of jobs started since.  */
+static time_t job_mem_avail_ts;             /* When MemAvailable was sampled.  */
+
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+static unsigned long job_mem_deferred;      /* Times a job was held back.  */
+static unsigned long job_mem_hist_hits;     /* Jobs started with a known peak.  */
+static unsigned long job_mem_hist_misses;   /* Jobs started with a guessed peak.  */
+static unsigned long job_mem_max_reserved_kb; /* Highest job_mem_reserved_kb.  */
+# endif
+
+static unsigned long
+job_mem_hist_hash_1 (const void *key)
+{
+  return_STRING_HASH_1 (((struct job_mem_hist const *) key)->key);
+}
+
+static unsigned long
+job_mem_hist_hash_2 (const void *key)
+{
+  return_STRING_HASH_2 (((struct job_mem_hist const *) key)->key);
+}
+
+static int
+job_mem_hist_hash_cmp (const void *x, const void *y)
+{
+  return_STRING_COMPARE (((struct job_mem_hist const *) x)->key,
+                         ((struct job_mem_hist const *) y)->key);
+}
+
+/* Returns the history key of FILE, its absolute name.  This may be the
+   static concat buffer.  */
+
+static const char *
+job_mem_key (struct file *file)
+{
+  if (file->name[0] == '/' || starting_directory == 0)
+    return file->name;
+  return concat (3, starting_directory, "/", file->name);
+}
+
+/* Sets the recorded peak for KEY.  */
+
+static void
+job_mem_update (const char *key, unsigned long peak_kb)
+{
+  struct job_mem_hist key_hist;
+  struct job_mem_hist **slot;
+
+  key_hist.key = key;
+  slot = (struct job_mem_hist **) hash_find_slot (&job_mem_hists, &key_hist);
+  if (HASH_VACANT (*slot))
+    {
+      struct job_mem_hist *hist = xmalloc (sizeof (*hist));
+      hist->key = xstrdup (key);
+      hist->peak_kb = peak_kb;
+      hash_insert_at (&job_mem_hists, hist, slot);
+    }
+  else
+    (*slot)->peak_kb = peak_kb;
+}
+
+/* Reads the history file into job_mem_hists.  Torn or garbled lines are
+   skipped, the file is only a hint.  */
+
+static void
+job_mem_load (void)
+{
+  char line[GET_PATH_MAX + 32];
+  FILE *f;
+
+  job_mem_hist_lines = 0;
+  f = fopen (job_mem_hist_path, "r");
+  if (!f)
+    return;
+
+  while (fgets (line, sizeof (line), f))
+    {
+      char *end;
+      unsigned long peak_kb;
+      size_t len;
+
+      job_mem_hist_lines++;
+      peak_kb = strtoul (line, &end, 10);
+      if (end == line || *end != ' ')
+        continue;
+      end++;
+      len = strlen (end);
+      if (len < 2 || end[len - 1] != '\n')
+        continue;
+      end[len - 1] = '\0';
+      job_mem_update (end, peak_kb);
+    }
+
+  fclose (f);
+}
+
+/* Sets up the memory accounting and loads HISTORY_FILE (absolute) if not
+   NULL.  Called by main after the switches have been decoded.  */
+
+void
+job_memory_init (const char *history_file)
+{
+  if (!max_memory_mb && !history_file)
+    return;
+
+  hash_init (&job_mem_hists, 1024, job_mem_hist_hash_1, job_mem_hist_hash_2,
+             job_mem_hist_hash_cmp);
+
+  if (!history_file)
+    return;
+  job_mem_hist_path = history_file;
+  job_mem_load ();
+
+  job_mem_hist_fd = open (history_file, O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if (job_mem_hist_fd < 0)
+    perror_with_name (_("cannot record memory history: "), history_file);
+  else
+    CLOSE_ON_EXEC (job_mem_hist_fd);
+}
+
+/* Closes the history file.  The top-level make rewrites it without the
+   stale lines if they've started to dominate.  (Lines appended by unrelated
+   makes while we're at it may get lost, which costs us a guess next time.)  */
+
+void
+job_memory_term (void)
+{
+  if (job_mem_hist_fd < 0)
+    return;
+  close (job_mem_hist_fd);
+  job_mem_hist_fd = -1;
+
+  if (makelevel != 0)
+    return;
+
+  /* Pick up what the sub-makes have appended.  */
+  job_mem_load ();
+  if (job_mem_hist_lines > job_mem_hists.ht_fill * 2 + 64)
+    {
+      char *tmp = xstrdup (concat (2, job_mem_hist_path, ".tmp"));
+      FILE *f = fopen (tmp, "w");
+      if (f)
+        {
+          struct job_mem_hist **slot = (struct job_mem_hist **) job_mem_hists.ht_vec;
+          struct job_mem_hist **end = slot + job_mem_hists.ht_size;
+
+          for (; slot < end; slot++)
+            if (!HASH_VACANT (*slot))
+              fprintf (f, "%lu %s\n", (*slot)->peak_kb, (*slot)->key);
+          if (fclose (f) != 0 || rename (tmp, job_mem_hist_path) != 0)
+            {
+              perror_with_name (_("cannot compact memory history: "), tmp);
+              unlink (tmp);
+            }
+        }
+      free (tmp);
+    }
+}
+
+/* Returns the peak memory use we expect from C's job in KB.  Sets *KNOWN
+   to nonzero if it comes from the history rather than being a guess.  */
+
+static unsigned long
+job_memory_expected (struct child *c, int *known)
+{
+  struct job_mem_hist key_hist;
+  struct job_mem_hist *hist;
+
+  *known = 0;
+
+  /* Sub-makes keep their own jobs in check.  */
+  if (c->file->cmds->any_recurse)
+    return 0;
+
+  key_hist.key = job_mem_key (c->file);
+  hist = hash_find_item (&job_mem_hists, &key_hist);
+  if (hist)
+    {
+      *known = 1;
+      return hist->peak_kb;
+    }
+  return job_mem_observed ? job_mem_observed_kb / job_mem_observed : 0;
+}
+
+/* Returns MemAvailable from /proc/meminfo less the expected peaks of the
+   jobs started after it was sampled, in KB.  It's sampled at most once a
+   second.  Returns ULONG_MAX if unknown.  */
+
+static unsigned long
+job_memory_available (void)
+{
+  time_t now = time (NULL);
+
+  if (now != job_mem_avail_ts)
+    {
+      char buf[4096];
+      ssize_t cb;
+      int fd;
+
+      job_mem_avail_ts = now;
+      job_mem_avail_kb = ULONG_MAX;
+      job_mem_started_kb = 0;
+
+      fd = open ("/proc/meminfo", O_RDONLY);
+      if (fd >= 0)
+        {
+          EINTRLOOP (cb, read (fd, buf, sizeof (buf) - 1));
+          close (fd);
+          if (cb > 0)
+            {
+              const char *psz;
+
+              buf[cb] = '\0';
+              psz = strstr (buf, "MemAvailable:");
+              if (psz)
+                job_mem_avail_kb = strtoul (psz + sizeof ("MemAvailable:") - 1,
+                                            NULL, 10);
+            }
+        }
+    }
+
+  if (job_mem_avail_kb == ULONG_MAX)
+    return ULONG_MAX;
+  return job_mem_avail_kb > job_mem_started_kb
+       ? job_mem_avail_kb - job_mem_started_kb : 0;
+}
+
+/* Returns nonzero if starting C's job now would likely exceed the memory
+   budget or the memory available.  */
+
+static int
+memory_too_high (struct child *c)
+{
+  unsigned long expected_kb;
+  unsigned long avail_kb;
+  int known;
+
+  if (!max_memory_mb)
+    return 0;
+
+  expected_kb = job_memory_expected (c, &known);
+  if (!expected_kb)
+    return 0;
+
+  avail_kb = job_memory_available ();
+  if (   job_mem_reserved_kb + expected_kb <= (unsigned long) max_memory_mb * 1024
+      && (avail_kb == ULONG_MAX || expected_kb <= avail_kb))
+    return 0;
+
+  DB (DB_JOBS, (_("Holding back `%s': expecting %lu KB (%s), %lu KB reserved, %lu KB available\n"),
+                c->file->name, expected_kb, known ? _("known") : _("guessed"),
+                job_mem_reserved_kb, avail_kb));
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  job_mem_deferred++;
+# endif
+  return 1;
+}
+
+/* Counts the expected peak of C's job against the budget.  */
+
+static void
+job_memory_reserve (struct child *c)
+{
+  int known;
+
+  if (!max_memory_mb)
+    return;
+
+  c->mem_reserved_kb = job_memory_expected (c, &known);
+  job_mem_reserved_kb += c->mem_reserved_kb;
+  job_mem_started_kb += c->mem_reserved_kb;
+# ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+  if (known)
+    job_mem_hist_hits++;
+  else
+    job_mem_hist_misses++;
+  if (job_mem_reserved_kb > job_mem_max_reserved_kb)
+    job_mem_max_reserved_kb = job_mem_reserved_kb;
+# endif
+}
+
+/* Notes the peak memory use of one of C's commands.  PEAK_KB is ru_maxrss,
+   which Linux reports in KB.  */
+
+static void
+job_memory_note (struct child *c, unsigned long peak_kb)
+{
+  if (peak_kb > c->mem_peak_kb)
+    c->mem_peak_kb = peak_kb;
+}
+
+/* Takes C's job off the budget and records the peak of its commands for
+   the target.  */
+
+static void
+job_memory_release (struct child *c)
+{
+  unsigned long peak_kb = c->mem_peak_kb;
+  const char *key;
+
+  job_mem_reserved_kb -= c->mem_reserved_kb;
+  c->mem_reserved_kb = 0;
+  c->mem_peak_kb = 0;
+
+  if (   !job_mem_hists.ht_vec
+      || !peak_kb
+      || handling_fatal_signal
+      || c->file->cmds->any_recurse)
+    return;
+
+  job_mem_observed_kb += peak_kb;
+  job_mem_observed++;
+
+  key = job_mem_key (c->file);
+  job_mem_update (key, peak_kb);
+
+  if (job_mem_hist_fd >= 0)
+    {
+      char *line = xmalloc (strlen (key) + 32);
+      int len = sprintf (line, "%lu %s\n", peak_kb, key);
+      int r;
+
+      EINTRLOOP (r, write (job_mem_hist_fd, line, len));
+      free (line);
+    }
+}
+#endif /* CONFIG_WITH_MEMORY_THROTTLING */
+
 /* Start jobs that are waiting for the load to be lower.  */
 
 void
@@ -3601,6 +4857,36 @@ construct_command_argv (char *line, char **restp, struct file *file,
   argv = construct_command_argv_internal (line, restp, shell, shellflags, ifs,
                                           cmd_flags, batch_filename_ptr);
 
+#ifdef CONFIG_WITH_KMK_BUILTIN
+  /* Quotes and other shell characters get us a shell invocation, which
+     kmk_builtin_command() would have to split a second time when the job
+     is started.  Hand over the split argument vector right away instead.
+     Syntax errors are left for kmk_builtin_command() to report.  This is
+     only done for recipe lines (FILE != NULL), $(shell ) must keep the
+     shell.  */
+  if (   argv
+      && file
+      && line
+      && !strncmp (line, "kmk_builtin_", sizeof("kmk_builtin_") - 1)
+      && strncmp (argv[0], "kmk_builtin_", sizeof("kmk_builtin_") - 1))
+    {
+      char **p2 = argv;
+      while (*p2 && strncmp (*p2, "kmk_builtin_", sizeof("kmk_builtin_") - 1))
+        p2++;
+      if (*p2)
+        {
+          int argc;
+          char **argv_split = kmk_builtin_split_command (*p2, &argc, 1);
+          if (argv_split)
+            {
+              free (argv[0]);
+              free (argv);
+              argv = argv_split;
+            }
+        }
+    }
+#endif /* CONFIG_WITH_KMK_BUILTIN */
+
   free (shell);
   free (shellflags);
   free (ifs);
@@ -3627,6 +4913,94 @@ dup2 (int old, int new)
 }
 #endif /* !HAVE_DUP2 && !_AMIGA */
 
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+/* Print job and jobserver statistics. */
+void
+print_job_stats (void)
+{
+  char buf[64];
+
+  printf (_("\n# reaping: %lu children in %lu passes, %u max per pass\n"),
+          reap_children_total, reap_passes, reap_max_batch);
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+  printf (_("#          child deaths noticed via %s\n"),
+          job_epoll_fd >= 0 ? _("pidfd + epoll") : _("SIGCHLD"));
+  if (reap_latency_count)
+    {
+      format_elapsed_nano (buf, sizeof (buf), reap_latency_ns / reap_latency_count);
+      printf (_("#          %s average wakeup to reap latency"), buf);
+      format_elapsed_nano (buf, sizeof (buf), reap_max_latency_ns);
+      printf (_(", %s max (%lu samples)\n"), buf, reap_latency_count);
+    }
+#endif
+
+#ifdef CONFIG_WITH_POSIX_SPAWN_JOBS
+  printf (_("\n# spawning: %lu children via posix_spawn, %lu via vfork+execvp\n"),
+          spawn_count, spawn_fallbacks);
+  printf (_("#           %lu PATH cache hits, %lu misses\n"),
+          spawn_path_hits, spawn_path_misses);
+  if (spawn_count && spawn_first_ts != -1)
+    {
+      big_int elapsed = nano_timestamp () - spawn_first_ts;
+      if (elapsed > 0)
+        printf (_("#           %lu jobs started per second\n"),
+                (unsigned long)((spawn_count + spawn_fallbacks)
+                                * BIG_INT_C(1000000000) / elapsed));
+    }
+  if (spawn_paths.ht_vec)
+    {
+      fputs (_("# spawn PATH cache hash-table stats:\n# "), stdout);
+      hash_print_stats (&spawn_paths, stdout);
+      fputs ("\n", stdout);
+    }
+#endif
+
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+  if (job_mem_hists.ht_vec)
+    {
+      if (max_memory_mb)
+        printf (_("\n# memory: %lu KB max-memory, %lu KB most reserved at once, %lu jobs held back\n"),
+                (unsigned long) max_memory_mb * 1024, job_mem_max_reserved_kb,
+                job_mem_deferred);
+      else
+        fputs (_("\n# memory: no max-memory, only recording peaks\n"), stdout);
+      printf (_("#         %lu jobs with a known peak, %lu guessed, %lu KB average peak\n"),
+              job_mem_hist_hits, job_mem_hist_misses,
+              job_mem_observed ? job_mem_observed_kb / job_mem_observed : 0);
+      printf (_("#         %lu targets in the history"), job_mem_hists.ht_fill);
+      if (job_mem_hist_path)
+        printf (_(" (%s)"), job_mem_hist_path);
+      fputs ("\n", stdout);
+    }
+#endif
+
+#ifdef MAKE_JOBSERVER
+  if (job_fds[0] < 0)
+    return;
+
+  printf (_("\n# jobserver: %lu tokens acquired, %lu waits, %lu wakeups without a token\n"),
+          jobserver_acquired, jobserver_waits, jobserver_wakeups);
+# ifdef CONFIG_WITH_JOBSERVER_PSELECT
+  printf (_("#            acquiring via %s\n"),
+          job_nb_rfd < 0 ? _("blocking read on a dup'ed fd")
+#  ifdef CONFIG_WITH_PIDFD_EPOLL
+          : job_epoll_has_rfd ? _("epoll_pwait on a private non-blocking fd")
+#  endif
+          : _("pselect on a private non-blocking fd"));
+# endif
+  format_elapsed_nano (buf, sizeof (buf), jobserver_wait_ns);
+  printf (_("#            %s total acquire latency"), buf);
+  if (jobserver_acquired)
+    {
+      format_elapsed_nano (buf, sizeof (buf), jobserver_wait_ns / jobserver_acquired);
+      printf (_(", %s average"), buf);
+    }
+  format_elapsed_nano (buf, sizeof (buf), jobserver_max_wait_ns);
+  printf (_(", %s max\n"), buf);
+#endif /* MAKE_JOBSERVER */
+}
+#endif /* CONFIG_WITH_PRINT_STATS_SWITCH */
+
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
 /* Prints the time elapsed while executing the commands for the given job. */
 void print_job_time (struct child *c)
@@ -70,6 +70,17 @@ struct child
     unsigned int dontcare:1;    /* Saved dontcare flag.  */
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
     big_int start_ts;           /* nano_timestamp of the first command.  */
+#endif
+#ifdef CONFIG_WITH_PIDFD_EPOLL
+    int pidfd;                  /* pidfd of the running process, -1 if none.  */
+    unsigned int unwatched:1;   /* Nonzero if we failed to get a pidfd.  */
+#endif
+#ifdef CONFIG_WITH_APPEND_BUFFERING
+    unsigned int append_failed:1; /* Writing out its buffered appends failed.  */
+#endif
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+    unsigned long mem_reserved_kb; /* Expected peak counted against --max-memory.  */
+    unsigned long mem_peak_kb;  /* Peak RSS of the commands so far, KB.  */
 #endif
   };
 
@@ -79,6 +90,13 @@ int is_bourne_compatible_shell(const char *path);
 void new_job (struct file *file);
 void reap_children (int block, int err);
 void start_waiting_jobs (void);
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+void job_memory_init (const char *history_file);
+void job_memory_term (void);
+#endif
+#ifdef CONFIG_WITH_POSIX_SPAWN_JOBS
+const char *spawn_resolve_program (const char *argv0, char **envp);
+#endif
 
 char **construct_command_argv (char *line, char **restp, struct file *file,
                                int cmd_flags, char** batch_file);
@@ -35,6 +35,11 @@
 #ifdef _MSC_VER
 # include <io.h>
 #endif
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+# include <pthread.h>
+# include <signal.h>
+# include <unistd.h>
+#endif
 #include "kmkbuiltin/err.h"
 #include "kmkbuiltin.h"
 
@@ -42,8 +47,221 @@
 extern char **environ;
 #endif
 
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/** @name KMKBUILTINENTRY::fFlags
+ * @{ */
+/** Takes the child and may spawn a process on its behalf, uses pfnChild. */
+#define KMKBUILTIN_F_NEEDS_CHILD    0x01
+/** May hand back an argument vector to spawn, uses pfnSpawn. */
+#define KMKBUILTIN_F_MAY_SPAWN      0x02
+/** Only deals with files and the standard handles, so it can be run on the
+ * worker thread.  These are always run holding the builtin lock. */
+#define KMKBUILTIN_F_THREAD_SAFE    0x04
+/** @} */
+
+/** The size of the builtin name hash table (power of two). */
+#define KMKBUILTIN_HASH_SIZE        64
+/** Hashes a builtin name (without prefix).  There are no collisions for the
+ * current set of names; should that change, the lookup probes linearly. */
+#define KMKBUILTIN_HASH(a_pszName, a_cchName) \
+    (  (  (unsigned)(a_cchName) \
+        + (unsigned char)(a_pszName)[0] * 6 \
+        + (unsigned char)(a_pszName)[(a_cchName) - 1] * 4) \
+     & (KMKBUILTIN_HASH_SIZE - 1) )
 
-int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapszArgvToSpawn, pid_t *pPidSpawned)
+/** Registry entry for a builtin using the plain main() signature. */
+#define KMKBUILTIN_MAIN(a_Name, a_fFlags) \
+    { #a_Name, sizeof(#a_Name) - 1, (a_fFlags), kmk_builtin_##a_Name, NULL, NULL }
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/**
+ * Builtin command registry entry.
+ */
+typedef struct KMKBUILTINENTRY
+{
+    /** The command name without the kmk_builtin_ prefix. */
+    const char     *pszName;
+    /** The length of the name. */
+    unsigned char   cchName;
+    /** KMKBUILTIN_F_XXX. */
+    unsigned char   fFlags;
+    /** The entry point, one of these depending on fFlags. */
+    int           (*pfnMain)(int argc, char **argv, char **envp);
+    int           (*pfnChild)(int argc, char **argv, char **envp, struct child *pChild, pid_t *pPidSpawned);
+    int           (*pfnSpawn)(int argc, char **argv, char **envp, char ***ppapszArgvToSpawn);
+} KMKBUILTINENTRY;
+typedef const KMKBUILTINENTRY *PCKMKBUILTINENTRY;
+
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+/**
+ * A builtin command queued for the worker thread.
+ */
+typedef struct KMKBUILTINJOB
+{
+    /** Next job in the queue or completion list. */
+    struct KMKBUILTINJOB   *pNext;
+    /** The make child this command belongs to. */
+    struct child           *pChild;
+    /** The argument vector, papszArgs[0] is the string buffer.  Owned. */
+    char                  **papszArgs;
+    /** The unparsed command line (within papszArgs[0]), NULL if parsed. */
+    const char             *pszCmd;
+    /** The exit code. */
+    int                     rc;
+} KMKBUILTINJOB;
+typedef KMKBUILTINJOB *PKMKBUILTINJOB;
+#endif
+
+
+/*******************************************************************************
+*   Internal Functions                                                         *
+*******************************************************************************/
+#ifndef KBUILD_OS_WINDOWS
+static int kmk_builtin_dircache_noop(int argc, char **argv, char **envp);
+#endif
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+extern mode_t bsd_getumask(void);
+#endif
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/** The builtin command registry. */
+static const KMKBUILTINENTRY g_aBuiltins[] =
+{
+    KMKBUILTIN_MAIN(append,     0),
+    KMKBUILTIN_MAIN(cat,        KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(chmod,      KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(cmp,        KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(cp,         KMKBUILTIN_F_THREAD_SAFE),
+#ifdef KBUILD_OS_WINDOWS
+    KMKBUILTIN_MAIN(dircache,   0),
+#else
+    { "dircache", 8, 0, kmk_builtin_dircache_noop, NULL, NULL },
+#endif
+    KMKBUILTIN_MAIN(echo,       KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(expr,       KMKBUILTIN_F_THREAD_SAFE),
+    /* Forks strip and waits for it, so it must stay on the main thread. */
+    KMKBUILTIN_MAIN(install,    0),
+    KMKBUILTIN_MAIN(kDepIDB,    KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(kDepObj,    KMKBUILTIN_F_THREAD_SAFE),
+#ifdef KBUILD_OS_WINDOWS
+    { "kSubmit", 7, KMKBUILTIN_F_NEEDS_CHILD, NULL, kmk_builtin_kSubmit, NULL },
+#endif
+    KMKBUILTIN_MAIN(ln,         KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(md5sum,     KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(mkdir,      KMKBUILTIN_F_THREAD_SAFE),
+    /* Forks cp and rm when moving directories across devices and waits for them. */
+    KMKBUILTIN_MAIN(mv,         0),
+    /* Shares its globals with the $(printf ) function. */
+    KMKBUILTIN_MAIN(printf,     0),
+    { "redirect", 8, KMKBUILTIN_F_NEEDS_CHILD, NULL, kmk_builtin_redirect, NULL },
+    KMKBUILTIN_MAIN(rm,         KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(rmdir,      KMKBUILTIN_F_THREAD_SAFE),
+    KMKBUILTIN_MAIN(sleep,      KMKBUILTIN_F_THREAD_SAFE),
+    { "test",     4, KMKBUILTIN_F_MAY_SPAWN,   NULL, NULL, kmk_builtin_test },
+    KMKBUILTIN_MAIN(touch,      KMKBUILTIN_F_THREAD_SAFE),
+};
+
+/** Hash table indexing g_aBuiltins, entries are index + 1 and 0 is free.
+ * Filled by the first lookup, which happens on the main thread before any
+ * worker thread exists. */
+static unsigned char g_abBuiltinHash[KMKBUILTIN_HASH_SIZE];
+/** Set when g_abBuiltinHash has been filled. */
+static int g_fBuiltinHashInitialized = 0;
+
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+/** Serializes the execution of the builtins that may run on the worker
+ * thread, as they share getopt and have static state, and keeps them off
+ * while kmk_builtin_redirect changes the current directory or standard
+ * handles of the process.  The main thread only builtins don't use getopt
+ * and don't take it. */
+static pthread_mutex_t  g_BuiltinMtx = PTHREAD_MUTEX_INITIALIZER;
+/** Protects the queue and completion list below. */
+static pthread_mutex_t  g_QueueMtx = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when something is added to the queue. */
+static pthread_cond_t   g_QueueCond = PTHREAD_COND_INITIALIZER;
+/** The queue head and tail. */
+static PKMKBUILTINJOB   g_pQueueHead, g_pQueueTail;
+/** The completion list head and tail. */
+static PKMKBUILTINJOB   g_pDoneHead, g_pDoneTail;
+/** Whether the worker thread has been created. */
+static int              g_fWorkerStarted = 0;
+/** Number of jobs queued and not yet reaped (main thread only). */
+static unsigned         g_cPending = 0;
+#endif
+
+
+#ifndef KBUILD_OS_WINDOWS
+/** kmk_builtin_dircache: The directory cache is a Windows thing, but any
+ *  command invalidates the mkdir -p cache here. */
+static int kmk_builtin_dircache_noop(int argc, char **argv, char **envp)
+{
+    (void)argc; (void)argv; (void)envp;
+    if (argc >= 2)
+        kBuiltinMkDirCacheInvalidate();
+    return 0;
+}
+#endif
+
+
+/**
+ * Looks up a builtin command in the registry.
+ *
+ * @returns Pointer to the registry entry, NULL if not found.
+ * @param   pszName     The command name without the kmk_builtin_ prefix.
+ *                      Need not be terminated.
+ * @param   cchName     The length of the name.
+ */
+static PCKMKBUILTINENTRY kmk_builtin_lookup(const char *pszName, size_t cchName)
+{
+    unsigned iHash;
+    unsigned i;
+
+    if (!g_fBuiltinHashInitialized)
+    {
+        for (i = 0; i < sizeof(g_aBuiltins) / sizeof(g_aBuiltins[0]); i++)
+        {
+            iHash = KMKBUILTIN_HASH(g_aBuiltins[i].pszName, g_aBuiltins[i].cchName);
+            while (g_abBuiltinHash[iHash])
+                iHash = (iHash + 1) & (KMKBUILTIN_HASH_SIZE - 1);
+            g_abBuiltinHash[iHash] = (unsigned char)(i + 1);
+        }
+        g_fBuiltinHashInitialized = 1;
+    }
+
+    if (cchName == 0 || cchName > 255)
+        return NULL;
+    iHash = KMKBUILTIN_HASH(pszName, cchName);
+    while ((i = g_abBuiltinHash[iHash]) != 0)
+    {
+        PCKMKBUILTINENTRY pEntry = &g_aBuiltins[i - 1];
+        if (   pEntry->cchName == cchName
+            && !memcmp(pEntry->pszName, pszName, cchName))
+            return pEntry;
+        iHash = (iHash + 1) & (KMKBUILTIN_HASH_SIZE - 1);
+    }
+    return NULL;
+}
+
+
+
+/**
+ * Splits a builtin command line into an argument vector, bourne shell style.
+ *
+ * @returns The argument vector, NULL on failure.  All the strings live in the
+ *          papszArgs[0] buffer, so free that and then the vector.
+ * @param   pszCmd      The command line.
+ * @param   pcArgs      Where to return the argument count.
+ * @param   fQuiet      Whether to keep quiet about syntax errors.
+ */
+char **kmk_builtin_split_command(const char *pszCmd, int *pcArgs, int fQuiet)
 {
     int         argc;
     char      **argv;
@@ -52,18 +270,6 @@ int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapsz
     char       *pszDst;
     int         fOldStyle = 0;
 
-    /*
-     * Check and skip the prefix.
-     */
-    if (strncmp(pszCmd, "kmk_builtin_", sizeof("kmk_builtin_") - 1))
-    {
-        fprintf(stderr, "kmk_builtin: Invalid command prefix '%s'!\n", pszCmd);
-        return 1;
-    }
-
-    /*
-     * Parse arguments.
-     */
     rc      = 0;
     argc    = 0;
     argv    = NULL;
@@ -71,7 +277,7 @@ int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapsz
     if (!pszDst)
     {
         fprintf(stderr, "kmk_builtin: out of memory. argc=%d\n", argc);
-        return 1;
+        return NULL;
     }
     do
     {
@@ -121,8 +327,9 @@ int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapsz
                                     *pszDst++ = ch;
                                 else
                                 {
-                                    fprintf(stderr, "kmk_builtin: Incomplete escape sequence in argument %d: %s\n",
-                                            argc, pszSrcStart);
+                                    if (!fQuiet)
+                                        fprintf(stderr, "kmk_builtin: Incomplete escape sequence in argument %d: %s\n",
+                                                argc, pszSrcStart);
                                     rc = 1;
                                     break;
                                 }
@@ -155,7 +362,8 @@ int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapsz
                         }
                         else
                         {
-                            fprintf(stderr, "kmk_builtin: Unbalanced quote in argument %d: %s\n", argc, pszSrcStart);
+                            if (!fQuiet)
+                                fprintf(stderr, "kmk_builtin: Unbalanced quote in argument %d: %s\n", argc, pszSrcStart);
                             rc = 1;
                             break;
                         }
@@ -185,7 +393,8 @@ int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapsz
                     char *pszEnd = strchr(pszCmd, chQuote);
                     if (pszEnd)
                     {
-                        fprintf(stderr, "kmk_builtin: Unbalanced quote in argument %d: %s\n", argc, pszSrcStart);
+                        if (!fQuiet)
+                            fprintf(stderr, "kmk_builtin: Unbalanced quote in argument %d: %s\n", argc, pszSrcStart);
                         rc = 1;
                         break;
                     }
@@ -209,24 +418,53 @@ int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapsz
             break;
     } while (rc == 0);
 
+    if (rc != 0)
+    {
+        free(argv);
+        free(pszzCmd);
+        return NULL;
+    }
+    assert(argv[0] == pszzCmd);
+    *pcArgs = argc;
+    return argv;
+}
+
+
+int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapszArgvToSpawn, pid_t *pPidSpawned)
+{
+    int         argc;
+    char      **argv;
+    int         rc;
+
     /*
-     * Execute the command if parsing was successful.
+     * Check and skip the prefix.
      */
-    if (rc == 0)
-        rc = kmk_builtin_command_parsed(argc, argv, pChild, ppapszArgvToSpawn, pPidSpawned);
+    if (strncmp(pszCmd, "kmk_builtin_", sizeof("kmk_builtin_") - 1))
+    {
+        fprintf(stderr, "kmk_builtin: Invalid command prefix '%s'!\n", pszCmd);
+        return 1;
+    }
+
+    /*
+     * Parse arguments and execute the command if successful.
+     */
+    argv = kmk_builtin_split_command(pszCmd, &argc, 0 /*fQuiet*/);
+    if (!argv)
+        return 1;
+    rc = kmk_builtin_command_parsed(argc, argv, pChild, ppapszArgvToSpawn, pPidSpawned);
 
     /* clean up and return. */
+    free(argv[0]);
     free(argv);
-    free(pszzCmd);
     return rc;
 }
 
 
 int kmk_builtin_command_parsed(int argc, char **argv, struct child *pChild, char ***ppapszArgvToSpawn, pid_t *pPidSpawned)
 {
-    const char *pszCmd = argv[0];
-    int         iUmask;
-    int         rc;
+    const char         *pszCmd = argv[0];
+    PCKMKBUILTINENTRY   pEntry;
+    int                 rc;
 
     /*
      * Check and skip the prefix.
@@ -239,74 +477,33 @@ int kmk_builtin_command_parsed(int argc, char **argv, struct child *pChild, char
     pszCmd += sizeof("kmk_builtin_") - 1;
 
     /*
-     * String switch on the command (frequent stuff at the top).
+     * Look up the command and call it.
      */
-    iUmask = umask(0);
-    umask(iUmask);
-    if (!strcmp(pszCmd, "append"))
-        rc = kmk_builtin_append(argc, argv, environ);
-    else if (!strcmp(pszCmd, "printf"))
-        rc = kmk_builtin_printf(argc, argv, environ);
-    else if (!strcmp(pszCmd, "echo"))
-        rc = kmk_builtin_echo(argc, argv, environ);
-    else if (!strcmp(pszCmd, "install"))
-        rc = kmk_builtin_install(argc, argv, environ);
-    else if (!strcmp(pszCmd, "kDepIDB"))
-        rc = kmk_builtin_kDepIDB(argc, argv, environ);
-#ifdef KBUILD_OS_WINDOWS
-    else if (!strcmp(pszCmd, "kSubmit"))
-        rc = kmk_builtin_kSubmit(argc, argv, environ, pChild, pPidSpawned);
-#endif
-    else if (!strcmp(pszCmd, "mkdir"))
-        rc = kmk_builtin_mkdir(argc, argv, environ);
-    else if (!strcmp(pszCmd, "mv"))
-        rc = kmk_builtin_mv(argc, argv, environ);
-    else if (!strcmp(pszCmd, "redirect"))
-        rc = kmk_builtin_redirect(argc, argv, environ, pChild, pPidSpawned);
-    else if (!strcmp(pszCmd, "rm"))
-        rc = kmk_builtin_rm(argc, argv, environ);
-    else if (!strcmp(pszCmd, "rmdir"))
-        rc = kmk_builtin_rmdir(argc, argv, environ);
-    else if (!strcmp(pszCmd, "test"))
-        rc = kmk_builtin_test(argc, argv, environ, ppapszArgvToSpawn);
-    /* rarely used commands: */
-    else if (!strcmp(pszCmd, "kDepObj"))
-        rc = kmk_builtin_kDepObj(argc, argv, environ);
-    else if (!strcmp(pszCmd, "chmod"))
-        rc = kmk_builtin_chmod(argc, argv, environ);
-    else if (!strcmp(pszCmd, "cp"))
-        rc = kmk_builtin_cp(argc, argv, environ);
-    else if (!strcmp(pszCmd, "expr"))
-        rc = kmk_builtin_expr(argc, argv, environ);
-    else if (!strcmp(pszCmd, "ln"))
-        rc = kmk_builtin_ln(argc, argv, environ);
-    else if (!strcmp(pszCmd, "md5sum"))
-        rc = kmk_builtin_md5sum(argc, argv, environ);
-    else if (!strcmp(pszCmd, "cmp"))
-        rc = kmk_builtin_cmp(argc, argv, environ);
-    else if (!strcmp(pszCmd, "cat"))
-        rc = kmk_builtin_cat(argc, argv, environ);
-    else if (!strcmp(pszCmd, "touch"))
-        rc = kmk_builtin_touch(argc, argv, environ);
-    else if (!strcmp(pszCmd, "sleep"))
-        rc = kmk_builtin_sleep(argc, argv, environ);
-    else if (!strcmp(pszCmd, "dircache"))
-#ifdef KBUILD_OS_WINDOWS
-        rc = kmk_builtin_dircache(argc, argv, environ);
-#else
-        rc = 0;
-#endif
-    else
+    pEntry = kmk_builtin_lookup(pszCmd, strlen(pszCmd));
+    if (!pEntry)
     {
         fprintf(stderr, "kmk_builtin: Unknown command '%s'!\n", pszCmd);
         return 1;
     }
+    if (pEntry->fFlags & KMKBUILTIN_F_NEEDS_CHILD)
+        rc = pEntry->pfnChild(argc, argv, environ, pChild, pPidSpawned);
+    else if (pEntry->fFlags & KMKBUILTIN_F_MAY_SPAWN)
+        rc = pEntry->pfnSpawn(argc, argv, environ, ppapszArgvToSpawn);
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+    else if (pEntry->fFlags & KMKBUILTIN_F_THREAD_SAFE)
+    {
+        pthread_mutex_lock(&g_BuiltinMtx);
+        rc = pEntry->pfnMain(argc, argv, environ);
+        pthread_mutex_unlock(&g_BuiltinMtx);
+    }
+#endif
+    else
+        rc = pEntry->pfnMain(argc, argv, environ);
 
     /*
      * Cleanup.
      */
     g_progname = "kmk";                 /* paranoia, make sure it's not pointing at a freed argv[0]. */
-    umask(iUmask);
 
 
     /*
@@ -337,3 +534,257 @@ int kmk_builtin_command_parsed(int argc, char **argv, struct child *pChild, char
     return rc;
 }
 
+
+/**
+ * Gets the entry point of a builtin command with the plain main() signature,
+ * so another builtin (kmk_builtin_redirect) can run it in-process.
+ *
+ * The caller must hold the builtin lock while calling it, see
+ * kmk_builtin_lock().
+ *
+ * @returns The entry point, NULL if not a builtin or if it is one needing the
+ *          child or one that may spawn a process.
+ * @param   pszCmd      The command, including the kmk_builtin_ prefix.
+ */
+FNKMKBUILTINMAIN *kmk_builtin_get_main(const char *pszCmd)
+{
+    PCKMKBUILTINENTRY pEntry;
+
+    if (strncmp(pszCmd, "kmk_builtin_", sizeof("kmk_builtin_") - 1))
+        return NULL;
+    pszCmd += sizeof("kmk_builtin_") - 1;
+    pEntry = kmk_builtin_lookup(pszCmd, strlen(pszCmd));
+    if (   pEntry
+        && !(pEntry->fFlags & (KMKBUILTIN_F_NEEDS_CHILD | KMKBUILTIN_F_MAY_SPAWN)))
+        return pEntry->pfnMain;
+    return NULL;
+}
+
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+
+/**
+ * Takes the builtin lock.
+ *
+ * This keeps the builtins on the worker thread off while a main thread
+ * builtin runs another builtin in-process or changes the current directory
+ * or the standard handles of the process.
+ */
+void kmk_builtin_lock(void)
+{
+    pthread_mutex_lock(&g_BuiltinMtx);
+}
+
+
+/**
+ * Releases the builtin lock taken by kmk_builtin_lock().
+ */
+void kmk_builtin_unlock(void)
+{
+    pthread_mutex_unlock(&g_BuiltinMtx);
+}
+
+
+/**
+ * Checks if a builtin command can be run on the worker thread.
+ *
+ * @returns 1 if threadable, 0 if not.
+ * @param   pszCmd      The command, starting with the kmk_builtin_ prefix.
+ *                      Anything following the name is ignored.
+ */
+int kmk_builtin_is_threadable(const char *pszCmd)
+{
+    PCKMKBUILTINENTRY pEntry;
+    size_t cchName;
+
+    if (strncmp(pszCmd, "kmk_builtin_", sizeof("kmk_builtin_") - 1))
+        return 0;
+    pszCmd += sizeof("kmk_builtin_") - 1;
+    cchName = 0;
+    while (pszCmd[cchName] && !isspace((unsigned char)pszCmd[cchName]))
+        cchName++;
+
+    pEntry = kmk_builtin_lookup(pszCmd, cchName);
+    return pEntry && (pEntry->fFlags & KMKBUILTIN_F_THREAD_SAFE);
+}
+
+
+/**
+ * The worker thread, runs queued builtins one by one.
+ *
+ * Completed jobs are put on the completion list and the main thread is
+ * woken up by a SIGCHLD, just like when a real child process dies.
+ */
+static void *kmk_builtin_worker(void *pvUser)
+{
+    (void)pvUser;
+    for (;;)
+    {
+        PKMKBUILTINJOB pJob;
+        char         **papszArgvToSpawn = NULL;
+        pid_t          pidSpawned = 0;
+
+        pthread_mutex_lock(&g_QueueMtx);
+        while (!g_pQueueHead)
+            pthread_cond_wait(&g_QueueCond, &g_QueueMtx);
+        pJob = g_pQueueHead;
+        g_pQueueHead = pJob->pNext;
+        if (!g_pQueueHead)
+            g_pQueueTail = NULL;
+        pthread_mutex_unlock(&g_QueueMtx);
+
+        if (pJob->pszCmd)
+            pJob->rc = kmk_builtin_command(pJob->pszCmd, pJob->pChild, &papszArgvToSpawn, &pidSpawned);
+        else
+        {
+            int argc = 1;
+            while (pJob->papszArgs[argc])
+                argc++;
+            pJob->rc = kmk_builtin_command_parsed(argc, pJob->papszArgs, pJob->pChild, &papszArgvToSpawn, &pidSpawned);
+        }
+        assert(!papszArgvToSpawn && !pidSpawned);
+        free(pJob->papszArgs[0]);
+        free(pJob->papszArgs);
+        pJob->papszArgs = NULL;
+        fflush(stdout);
+        fflush(stderr);
+
+        pthread_mutex_lock(&g_QueueMtx);
+        pJob->pNext = NULL;
+        if (g_pDoneTail)
+            g_pDoneTail->pNext = pJob;
+        else
+            g_pDoneHead = pJob;
+        g_pDoneTail = pJob;
+        pthread_mutex_unlock(&g_QueueMtx);
+
+        kill(getpid(), SIGCHLD);
+    }
+    return NULL;
+}
+
+
+/**
+ * Queues a builtin command for execution on the worker thread.
+ *
+ * @returns 0 on success, -1 if the worker thread couldn't be started, in
+ *          which case the caller must run the command itself.
+ * @param   pChild      The child the command belongs to.  Handed back by
+ *                      kmk_builtin_reap() when the command has completed.
+ * @param   papszArgs   The argument vector, the strings living in the
+ *                      papszArgs[0] buffer.  The worker frees it.
+ * @param   pszCmd      The unparsed command line when it's one of the
+ *                      arguments, NULL if papszArgs is the parsed command.
+ */
+int kmk_builtin_queue(struct child *pChild, char **papszArgs, const char *pszCmd)
+{
+    PKMKBUILTINJOB pJob;
+
+    if (!g_fWorkerStarted)
+    {
+        pthread_attr_t  Attr;
+        pthread_t       Thread;
+        sigset_t        SigSetAll, SigSetOld;
+        int             rc;
+
+        /* The builtins must not touch the umask once the worker is around,
+           processes spawned meanwhile would inherit it, so read it now. */
+        bsd_getumask();
+
+        /* The worker must never get our signals, so block them all while
+           creating it and let it inherit that. */
+        sigfillset(&SigSetAll);
+        pthread_sigmask(SIG_SETMASK, &SigSetAll, &SigSetOld);
+        pthread_attr_init(&Attr);
+        pthread_attr_setdetachstate(&Attr, PTHREAD_CREATE_DETACHED);
+        rc = pthread_create(&Thread, &Attr, kmk_builtin_worker, NULL);
+        pthread_attr_destroy(&Attr);
+        pthread_sigmask(SIG_SETMASK, &SigSetOld, NULL);
+        if (rc)
+            return -1;
+        g_fWorkerStarted = 1;
+    }
+
+    pJob = (PKMKBUILTINJOB)malloc(sizeof(*pJob));
+    if (!pJob)
+        return -1;
+    pJob->pNext     = NULL;
+    pJob->pChild    = pChild;
+    pJob->papszArgs = papszArgs;
+    pJob->pszCmd    = pszCmd;
+    pJob->rc        = 1;
+
+    pthread_mutex_lock(&g_QueueMtx);
+    if (g_pQueueTail)
+        g_pQueueTail->pNext = pJob;
+    else
+        g_pQueueHead = pJob;
+    g_pQueueTail = pJob;
+    pthread_cond_signal(&g_QueueCond);
+    pthread_mutex_unlock(&g_QueueMtx);
+
+    g_cPending++;
+    return 0;
+}
+
+
+/**
+ * Gets the next builtin command the worker thread has completed.
+ *
+ * @returns The child the command belongs to, NULL if none has completed.
+ * @param   prc         Where to return the exit code.
+ */
+struct child *kmk_builtin_reap(int *prc)
+{
+    PKMKBUILTINJOB  pJob;
+    struct child   *pChild = NULL;
+
+    if (!g_cPending)
+        return NULL;
+
+    pthread_mutex_lock(&g_QueueMtx);
+    pJob = g_pDoneHead;
+    if (pJob)
+    {
+        g_pDoneHead = pJob->pNext;
+        if (!g_pDoneHead)
+            g_pDoneTail = NULL;
+    }
+    pthread_mutex_unlock(&g_QueueMtx);
+
+    if (pJob)
+    {
+        g_cPending--;
+        pChild = pJob->pChild;
+        *prc = pJob->rc;
+        free(pJob);
+    }
+    return pChild;
+}
+
+
+/**
+ * Checks if the worker thread has completed commands waiting to be reaped.
+ *
+ * @returns 1 if kmk_builtin_reap() would return something, 0 if not.
+ */
+int kmk_builtin_completed(void)
+{
+    int fRet;
+    if (!g_cPending)
+        return 0;
+    pthread_mutex_lock(&g_QueueMtx);
+    fRet = g_pDoneHead != NULL;
+    pthread_mutex_unlock(&g_QueueMtx);
+    return fRet;
+}
+
+
+/**
+ * Gets the number of commands queued and not yet reaped.
+ */
+unsigned kmk_builtin_pending(void)
+{
+    return g_cPending;
+}
+
+#endif /* CONFIG_WITH_KMK_BUILTIN_THREADS */
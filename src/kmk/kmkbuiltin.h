@@ -52,8 +52,23 @@
 struct child;
 int kmk_builtin_command(const char *pszCmd, struct child *pChild, char ***ppapszArgvToSpawn, pid_t *pPidSpawned);
 int kmk_builtin_command_parsed(int argc, char **argv, struct child *pChild, char ***ppapszArgvToSpawn, pid_t *pPidSpawned);
+char **kmk_builtin_split_command(const char *pszCmd, int *pcArgs, int fQuiet);
+typedef int FNKMKBUILTINMAIN(int argc, char **argv, char **envp);
+FNKMKBUILTINMAIN *kmk_builtin_get_main(const char *pszCmd);
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+void kmk_builtin_lock(void);
+void kmk_builtin_unlock(void);
+int kmk_builtin_is_threadable(const char *pszCmd);
+int kmk_builtin_queue(struct child *pChild, char **papszArgs, const char *pszCmd);
+struct child *kmk_builtin_reap(int *prc);
+int kmk_builtin_completed(void);
+unsigned kmk_builtin_pending(void);
+#endif
 
 extern int kmk_builtin_append(int argc, char **argv, char **envp);
+#ifdef CONFIG_WITH_APPEND_BUFFERING
+extern int kmk_builtin_append_flush(void);
+#endif
 extern int kmk_builtin_cp(int argc, char **argv, char **envp);
 extern int kmk_builtin_cat(int argc, char **argv, char **envp);
 extern int kmk_builtin_chmod(int argc, char **argv, char **envp);
@@ -98,5 +113,13 @@ extern int kBuiltinOptEnvPrepend(char ***ppapszEnv, unsigned *pcEnvVars, unsigne
 extern int kBuiltinOptEnvUnset(char **papszEnv, unsigned *pcEnvVars, int cVerbosity, const char *pszVarToRemove);
 extern int kBuiltinOptChDir(char *pszCwd, size_t cbCwdBuf, const char *pszValue);
 
+#ifdef KMK
+/* mkdircache.c: */
+extern size_t kBuiltinMkDirCacheNormalize(const char *pszPath, char *pszBuf, size_t cbBuf);
+extern int  kBuiltinMkDirCacheLookup(const char *pchPath, size_t cchPath);
+extern void kBuiltinMkDirCacheAdd(const char *pchPath, size_t cchPath);
+extern void kBuiltinMkDirCacheInvalidate(void);
+#endif
+
 #endif
 
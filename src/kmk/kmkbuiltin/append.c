@@ -42,13 +42,39 @@
 #include "kmkbuiltin.h"
 
 
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+#if !defined(kmk_builtin_append) && defined(CONFIG_WITH_APPEND_BUFFERING)
+/** Keep the file open and buffered between appends to it. */
+# define APPEND_WITH_BUFFERING
+/** The size of the write-behind buffer. */
+# define APPEND_BUFFER_SIZE     (64*1024)
+#endif
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+#ifdef APPEND_WITH_BUFFERING
+/** The file the last append left open, NULL if none. */
+static FILE    *g_pAppendFile = NULL;
+/** The name g_pAppendFile was opened by (heap). */
+static char    *g_pszAppendFile = NULL;
+/** Whether the atexit callback has been registered. */
+static int      g_fAppendAtExit = 0;
+/** The write-behind buffer of g_pAppendFile. */
+static char     g_achAppendBuf[APPEND_BUFFER_SIZE];
+#endif
+
+
 /**
  * Prints the usage and return 1.
  */
 static int usage(FILE *pf)
 {
     fprintf(pf,
-            "usage: %s [-dcnNtv] file [string ...]\n"
+            "usage: %s [-dcfnNtv] file [string ...]\n"
             "   or: %s --version\n"
             "   or: %s --help\n"
             "\n"
@@ -56,6 +82,8 @@ static int usage(FILE *pf)
             "  -d  Enclose the output in define ... endef, taking the name from\n"
             "      the first argument following the file name.\n"
             "  -c  Output the command for specified target(s). [builtin only]\n"
+            "  -f  Flush the file right away instead of keeping it buffered for\n"
+            "      the next append to the same file. [builtin only]\n"
             "  -i  look for --insert-command=trg and --insert-variable=var. [builtin only]\n"
             "  -n  Insert a newline between the strings.\n"
             "  -N  Suppress the trailing newline.\n"
@@ -67,8 +95,55 @@ static int usage(FILE *pf)
 }
 
 
+#ifdef APPEND_WITH_BUFFERING
+
+/**
+ * Writes out and closes the file kept open by the previous append, if any.
+ *
+ * This must be called before anything else gets a chance to look at the file,
+ * i.e. before any command other than an append to the same file and when the
+ * recipe is done.
+ *
+ * @returns 0 on success, non-zero (error already reported) on write failure.
+ */
+int kmk_builtin_append_flush(void)
+{
+    int rc = 0;
+    FILE *pFile = g_pAppendFile;
+    if (pFile)
+    {
+        g_pAppendFile = NULL;
+        if (ferror(pFile))
+        {
+            fclose(pFile);
+            rc = errx(1, "error writing to '%s'!", g_pszAppendFile);
+        }
+        else if (fclose(pFile))
+            rc = err(1, "failed to fclose '%s'!", g_pszAppendFile);
+        free(g_pszAppendFile);
+        g_pszAppendFile = NULL;
+    }
+    return rc;
+}
+
+
+/**
+ * atexit callback making sure nothing is left in the buffer.
+ */
+static void append_atexit(void)
+{
+    kmk_builtin_append_flush();
+}
+
+#endif /* APPEND_WITH_BUFFERING */
+
+
 /**
  * Appends text to a textfile, creating the textfile if necessary.
+ *
+ * In the builtin version the file is left open with a write-behind buffer so
+ * that a series of appends to the same file in a recipe results in a single
+ * open and only a few writes.  See kmk_builtin_append_flush.
  */
 int kmk_builtin_append(int argc, char **argv, char **envp)
 {
@@ -83,6 +158,9 @@ int kmk_builtin_append(int argc, char **argv, char **envp)
     int fVariables = 0;
     int fCommands = 0;
     int fLookForInserts = 0;
+#ifdef APPEND_WITH_BUFFERING
+    int fFlush = 0;
+#endif
 
     g_progname = argv[0];
 
@@ -93,7 +171,7 @@ int kmk_builtin_append(int argc, char **argv, char **envp)
     while (i < argc
        &&  argv[i][0] == '-'
        &&  argv[i][1] != '\0' /* '-' is a file */
-       &&  strchr("-cdinNtv", argv[i][1]) /* valid option char */
+       &&  strchr("-cdfinNtv", argv[i][1]) /* valid option char */
        )
     {
         char *psz = &argv[i][1];
@@ -124,6 +202,12 @@ int kmk_builtin_append(int argc, char **argv, char **envp)
                         }
                         fDefine = 1;
                         break;
+                    case 'f':
+#ifdef APPEND_WITH_BUFFERING
+                        fFlush = 1;
+#endif
+                        /* else: the file is always closed when done. */
+                        break;
                     case 'i':
                         if (fVariables || fCommands)
                         {
@@ -190,9 +274,37 @@ int kmk_builtin_append(int argc, char **argv, char **envp)
      * Open the output file.
      */
     iFile = i;
+#ifdef APPEND_WITH_BUFFERING
+    if (   g_pAppendFile
+        && (fTruncate || strcmp(g_pszAppendFile, argv[i]) != 0))
+    {
+        int rc = kmk_builtin_append_flush();
+        if (rc)
+            return rc;
+    }
+    pFile = g_pAppendFile;
+    if (!pFile)
+    {
+        pFile = fopen(argv[i], fTruncate ? "w" : "a");
+        if (!pFile)
+            return err(1, "failed to open '%s'", argv[i]);
+        if (!fFlush)
+        {
+            g_pszAppendFile = strdup(argv[i]);
+            if (g_pszAppendFile)
+            {
+                setvbuf(pFile, g_achAppendBuf, _IOFBF, sizeof(g_achAppendBuf));
+                g_pAppendFile = pFile;
+                if (!g_fAppendAtExit)
+                    g_fAppendAtExit = atexit(append_atexit) == 0;
+            }
+        }
+    }
+#else
     pFile = fopen(argv[i], fTruncate ? "w" : "a");
     if (!pFile)
         return err(1, "failed to open '%s'", argv[i]);
+#endif
 
     /*
      * Start define?
@@ -295,9 +407,17 @@ int kmk_builtin_append(int argc, char **argv, char **envp)
              && fputc('\n', pFile) == EOF)
         ||  ferror(pFile))
     {
+#ifdef APPEND_WITH_BUFFERING
+        if (pFile == g_pAppendFile)
+            return kmk_builtin_append_flush();
+#endif
         fclose(pFile);
         return errx(1, "error writing to '%s'!", argv[iFile]);
     }
+#ifdef APPEND_WITH_BUFFERING
+    if (pFile == g_pAppendFile)
+        return fFlush ? kmk_builtin_append_flush() : 0;
+#endif
     if (fclose(pFile))
         return err(1, "failed to fclose '%s'!", argv[iFile]);
     return 0;
@@ -179,6 +179,10 @@ done:	argv += optind;
 		}
 	} else
 		fts_options = hflag ? FTS_PHYSICAL : FTS_LOGICAL;
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+	/* kmk: we may be on a worker thread, the cwd belongs to make. */
+	fts_options |= FTS_NOCHDIR;
+#endif
 
 	if (hflag)
 		change_mode = lchmod;
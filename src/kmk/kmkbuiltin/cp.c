@@ -80,10 +80,12 @@ __FBSDID("$FreeBSD: src/bin/cp/cp.c,v 1.50 2004/04/06 20:06:44 markm Exp $");
 #include "cp_extern.h"
 #include "kmkbuiltin.h"
 #include "kbuild_protection.h"
+#include "hashcache.h"
 
 #if defined(_MSC_VER) || defined(__gnu_linux__) || defined(__linux__)
 extern size_t strlcpy(char *, const char *, size_t);
 #endif
+extern mode_t bsd_getumask(void);
 
 
 #ifndef S_IFWHT
@@ -139,7 +141,8 @@ enum cp_arg {
     CP_OPT_ENABLE_PROTECTION,
     CP_OPT_ENABLE_FULL_PROTECTION,
     CP_OPT_DISABLE_FULL_PROTECTION,
-    CP_OPT_PROTECTION_DEPTH
+    CP_OPT_PROTECTION_DEPTH,
+    CP_OPT_HASH_CACHE
 };
 static struct option long_options[] =
 {
@@ -152,6 +155,7 @@ static struct option long_options[] =
     { "enable-full-protection",				no_argument, 0, CP_OPT_ENABLE_FULL_PROTECTION },
     { "disable-full-protection",			no_argument, 0, CP_OPT_DISABLE_FULL_PROTECTION },
     { "protection-depth",				required_argument, 0, CP_OPT_PROTECTION_DEPTH },
+    { "hash-cache",					required_argument, 0, CP_OPT_HASH_CACHE },
     { 0, 0,	0, 0 },
 };
 
@@ -170,6 +174,7 @@ kmk_builtin_cp(int argc, char *argv[], char **envp)
 	enum op type;
 	int Hflag, Lflag, Pflag, ch, fts_options, r, have_trailing_slash, rc;
 	char *target;
+	const char *hash_cache = NULL;
 
         /* init globals */
         cp_argv0 = argv[0];
@@ -258,6 +263,9 @@ kmk_builtin_cp(int argc, char *argv[], char **envp)
 				return 1;
 			}
 			break;
+		case CP_OPT_HASH_CACHE:
+			hash_cache = optarg;
+			break;
 		default:
 			kBuildProtectionTerm(&g_ProtData);
 		        return usage(stderr);
@@ -386,7 +394,10 @@ kmk_builtin_cp(int argc, char *argv[], char **envp)
 				     ? KBUILDPROTECTIONTYPE_RECURSIVE
 				     : KBUILDPROTECTIONTYPE_FULL,
 				     to.p_path)) {
+	    if (hash_cache && cp_changed_only)
+		kBuiltinHashCacheOpen(hash_cache);
 	    rc = copy(argv, type, fts_options);
+	    kBuiltinHashCacheClose();
 	}
 
 	kBuildProtectionTerm(&g_ProtData);
@@ -408,8 +419,7 @@ copy(char *argv[], enum op type, int fts_options)
 	 * Keep an inverted copy of the umask, for use in correcting
 	 * permissions on created directories when not using -p.
 	 */
-	mask = ~umask(0777);
-	umask(~mask);
+	mask = ~bsd_getumask();
 
 	if ((ftsp = fts_open(argv, fts_options, mastercmp)) == NULL)
 		return err(1, "fts_open");
@@ -698,6 +708,9 @@ usage(FILE *fp)
 "       Don't fail if the specified source file doesn't exist.\n"
 "   --changed\n"
 "       Only copy if changed (i.e. compare first).\n"
+"   --hash-cache=FILE\n"
+"       Keep content hashes keyed by inode, size and mtime in FILE so\n"
+"       --changed can tell unchanged files apart without reading them.\n"
 "   --disable-protection\n"
 "       Will disable the protection file protection applied with -R.\n"
 "   --enable-protection\n"
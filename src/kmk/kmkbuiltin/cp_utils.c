@@ -70,6 +70,8 @@ __FBSDID("$FreeBSD: src/bin/cp/utils.c,v 1.43 2004/04/06 20:06:44 markm Exp $");
 #endif
 #include "cp_extern.h"
 #include "cmp_extern.h"
+#include "fastcopy.h"
+#include "hashcache.h"
 
 #define	cp_pct(x,y)	(int)(100.0 * (double)(x) / (double)(y))
 
@@ -79,6 +81,9 @@ __FBSDID("$FreeBSD: src/bin/cp/utils.c,v 1.43 2004/04/06 20:06:44 markm Exp $");
 #ifndef O_BINARY
 # define O_BINARY 0
 #endif
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
 
 #ifndef S_ISVTX
 # define S_ISVTX 0
@@ -90,7 +95,8 @@ copy_file(const FTSENT *entp, int dne, int changed_only, int *pcopied)
 {
 	static char buf[MAXBSIZE];
 	struct stat *fs;
-	int ch, checkch, from_fd, rcount, rval, to_fd;
+	int ch, checkch, from_fd, rcount, rval, to_fd, fastrc, hashrc;
+	unsigned char hash[KBUILTIN_HASH_SIZE];
 	ssize_t wcount;
 	size_t wresid;
 	size_t wtotal;
@@ -101,7 +107,7 @@ copy_file(const FTSENT *entp, int dne, int changed_only, int *pcopied)
 
 	*pcopied = 0;
 
-	if ((from_fd = open(entp->fts_path, O_RDONLY | O_BINARY, 0)) == -1) {
+	if ((from_fd = open(entp->fts_path, O_RDONLY | O_BINARY | O_CLOEXEC, 0)) == -1) {
 		warn("open: %s", entp->fts_path);
 		return (1);
 	}
@@ -119,7 +125,14 @@ copy_file(const FTSENT *entp, int dne, int changed_only, int *pcopied)
 	if (!dne) {
 		/* compare the files first if requested */
 		if (changed_only) {
-                        if (cmp_fd_and_file(from_fd, entp->fts_path, to.p_path,
+			/* (size, mtime, ctime, hash) records spare us reading both files. */
+			hashrc = kBuiltinHashCacheCompare(from_fd, fs, to.p_path, hash);
+			if (hashrc == 1) {
+				close(from_fd);
+				return (0);
+			}
+			if (hashrc < 0
+			 && cmp_fd_and_file(from_fd, entp->fts_path, to.p_path,
 					    1 /* silent */, 0 /* lflag */,
 					    0 /* special */) == OK_EXIT) {
 				close(from_fd);
@@ -127,7 +140,7 @@ copy_file(const FTSENT *entp, int dne, int changed_only, int *pcopied)
 			}
 			if (lseek(from_fd, 0, SEEK_SET) != 0) {
     				close(from_fd);
-				if ((from_fd = open(entp->fts_path, O_RDONLY | O_BINARY, 0)) == -1) {
+				if ((from_fd = open(entp->fts_path, O_RDONLY | O_BINARY | O_CLOEXEC, 0)) == -1) {
 					warn("open: %s", entp->fts_path);
 					return (1);
 				}
@@ -156,13 +169,13 @@ copy_file(const FTSENT *entp, int dne, int changed_only, int *pcopied)
 		    /* remove existing destination file name,
 		     * create a new file  */
 		    (void)unlink(to.p_path);
-		    to_fd = open(to.p_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY,
+		    to_fd = open(to.p_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY | O_CLOEXEC,
 				 fs->st_mode & ~(S_ISUID | S_ISGID));
 		} else
 		    /* overwrite existing destination file name */
-		    to_fd = open(to.p_path, O_WRONLY | O_TRUNC | O_BINARY, 0);
+		    to_fd = open(to.p_path, O_WRONLY | O_TRUNC | O_BINARY | O_CLOEXEC, 0);
 	} else
-		to_fd = open(to.p_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY,
+		to_fd = open(to.p_path, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY | O_CLOEXEC,
 		    fs->st_mode & ~(S_ISUID | S_ISGID));
 
 	if (to_fd == -1) {
@@ -174,6 +187,16 @@ copy_file(const FTSENT *entp, int dne, int changed_only, int *pcopied)
 	rval = 0;
 	*pcopied = 1;
 
+	/*
+	 * Let the kernel do the copying (or just share the blocks) if it can.
+	 */
+	if (S_ISREG(fs->st_mode)
+	    && (fastrc = kBuiltinFastCopy(from_fd, to_fd, fs->st_size)) <= 0) {
+		if (fastrc < 0) {
+			warn("copy: %s -> %s", entp->fts_path, to.p_path);
+			rval = 1;
+		}
+	} else
 	/*
 	 * Mmap and write if less than 8M (the limit is so we don't totally
 	 * trash memory on big files.  This is really a minor hack, but it
@@ -254,11 +277,15 @@ copy_file(const FTSENT *entp, int dne, int changed_only, int *pcopied)
 
 	if (pflag && setfile(fs, to_fd))
 		rval = 1;
-	(void)close(from_fd);
 	if (close(to_fd)) {
 		warn("close: %s", to.p_path);
 		rval = 1;
 	}
+	/* Remember what we wrote so the next --changed run needn't read it. */
+	if (changed_only && !rval && S_ISREG(fs->st_mode)
+	 && !kBuiltinHashCacheGetFd(from_fd, fs, hash))
+		kBuiltinHashCacheRecord(to.p_path, hash);
+	(void)close(from_fd);
 	return (rval);
 }
 
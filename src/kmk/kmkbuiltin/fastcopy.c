@@ -0,0 +1,157 @@
+/* $Id$ */
+/** @file
+ * Fast file data copying for the cp and install builtins.
+ */
+
+/*
+ * Copyright (c) 2026 knut st. osmundsen <bird-kBuild-spamx@anduin.net>
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "config.h"
+#include <sys/types.h>
+#include <errno.h>
+#ifdef __linux__
+# include <unistd.h>
+# include <sys/ioctl.h>
+# include <sys/sendfile.h>
+# include <sys/syscall.h>
+#endif
+#include "fastcopy.h"
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+#ifdef __linux__
+/** Reflink ioctl from linux/fs.h, which doesn't mix well with glibc headers. */
+# ifndef FICLONE
+#  define FICLONE               _IOW(0x94, 9, int)
+# endif
+/** How much to ask copy_file_range / sendfile to do per call. */
+# define FAST_COPY_CHUNK        (64 * 1024 * 1024)
+#endif
+
+
+#ifdef __linux__
+/**
+ * Checks if the errno value means that the method isn't available for this
+ * pair of files (as opposed to a real I/O error).
+ */
+static int isUnsupportedError(int iErr)
+{
+    return iErr == ENOSYS
+        || iErr == EXDEV
+        || iErr == EINVAL
+        || iErr == EOPNOTSUPP
+# if defined(ENOTSUP) && ENOTSUP != EOPNOTSUPP
+        || iErr == ENOTSUP
+# endif
+        || iErr == ENOTTY
+        || iErr == EBADF
+        || iErr == EPERM;
+}
+#endif
+
+
+/**
+ * Copies the data of a regular file without dragging it thru user space
+ * buffers, if the OS lets us.
+ *
+ * Tries a reflink (FICLONE) first, which shares the data blocks on file
+ * systems supporting it (btrfs, xfs), then copy_file_range(), which may do
+ * server side or in-kernel copying, and finally sendfile().
+ *
+ * @returns 0 if all the data was copied.
+ * @returns -1 with errno set on I/O error.
+ * @returns 1 if none of the methods work for these files and nothing was
+ *          written, the caller should do a read/write copy instead.
+ * @param   fdSrc       The source file, opened for reading.  The file
+ *                      position isn't used or changed.
+ * @param   fdDst       The destination file, opened for writing and
+ *                      truncated.  The file position is undefined on return.
+ * @param   cbSrc       The size of the source file.
+ */
+int kBuiltinFastCopy(int fdSrc, int fdDst, off_t cbSrc)
+{
+#ifdef __linux__
+    off_t   offSrc = 0;
+    ssize_t cbDone;
+
+    if (cbSrc <= 0)
+        return 1; /* Empty, or something from /proc with a made up size. */
+
+    /*
+     * Reflink.
+     */
+    if (ioctl(fdDst, FICLONE, fdSrc) == 0)
+        return 0;
+
+    /*
+     * copy_file_range.  Older kernels return 0 right away when the source is
+     * on a file system that doesn't report real sizes, so we go on to
+     * sendfile if nothing was copied.
+     */
+# ifdef __NR_copy_file_range
+    for (;;)
+    {
+        loff_t offIn  = offSrc;
+        loff_t offOut = offSrc;
+        size_t cbChunk = cbSrc - offSrc > FAST_COPY_CHUNK ? FAST_COPY_CHUNK : (size_t)(cbSrc - offSrc);
+        if (cbChunk == 0)
+            cbChunk = FAST_COPY_CHUNK; /* grown since the stat, copy till EOF */
+        cbDone = syscall(__NR_copy_file_range, fdSrc, &offIn, fdDst, &offOut, cbChunk, 0);
+        if (cbDone > 0)
+            offSrc += cbDone;
+        else if (cbDone == 0 && offSrc > 0)
+            return 0;
+        else if (offSrc > 0)
+            return -1;
+        else if (cbDone < 0 && !isUnsupportedError(errno))
+            return -1;
+        else
+            break;
+    }
+# endif
+
+    /*
+     * sendfile.  This writes at the destination file position, which
+     * nobody has moved yet.
+     */
+    for (;;)
+    {
+        size_t cbChunk = cbSrc - offSrc > FAST_COPY_CHUNK ? FAST_COPY_CHUNK : (size_t)(cbSrc - offSrc);
+        if (cbChunk == 0)
+            cbChunk = FAST_COPY_CHUNK;
+        cbDone = sendfile(fdDst, fdSrc, &offSrc, cbChunk);
+        if (cbDone > 0)
+            continue;
+        if (cbDone == 0 && offSrc > 0)
+            return 0;
+        if (offSrc > 0 || (cbDone < 0 && !isUnsupportedError(errno)))
+            return -1;
+        return 1;
+    }
+#else
+    (void)fdSrc; (void)fdDst; (void)cbSrc;
+    return 1;
+#endif
+}
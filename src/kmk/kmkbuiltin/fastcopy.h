@@ -0,0 +1,33 @@
+/* $Id$ */
+/** @file
+ * Fast file data copying for the cp and install builtins.
+ */
+
+/*
+ * Copyright (c) 2026 knut st. osmundsen <bird-kBuild-spamx@anduin.net>
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#ifndef ___kmkbuiltin_fastcopy_h
+#define ___kmkbuiltin_fastcopy_h
+
+#include <sys/types.h>
+
+int kBuiltinFastCopy(int fdSrc, int fdDst, off_t cbSrc);
+
+#endif
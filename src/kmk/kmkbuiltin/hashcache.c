@@ -0,0 +1,585 @@
+/* $Id$ */
+/** @file
+ * Content hash cache for the copy-if-changed modes of cp and install.
+ *
+ * The cache is a text file with one line per file, giving the device, inode,
+ * size, modification time (ns) and change time (ns) of the file at the time
+ * it was hashed together with its MD5.  Lines are only ever appended (the
+ * last one for a file wins), so parallel cp and install processes can share
+ * a cache file without locking.  When a file's size and times still match
+ * the record, its content is known without reading it.  The change time
+ * catches rewrites that put back the old modification time (cp -p,
+ * touch -r, utime).
+ *
+ * Files modified within the last couple of seconds are neither recorded nor
+ * trusted, since a same-size rewrite within the timestamp granularity of the
+ * file system (whole seconds in some places) would otherwise go unnoticed.
+ */
+
+/*
+ * Copyright (c) 2026 knut st. osmundsen <bird-kBuild-spamx@anduin.net>
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "config.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _MSC_VER
+# include <io.h>
+# include "mscfakes.h"
+#else
+# include <unistd.h>
+#endif
+#include "err.h"
+#include "hashcache.h"
+#include "../../lib/md5.h"
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+
+/** Gets the nanosecond part of the modification and change times. */
+#ifdef ST_MTIM_NSEC
+# define HASHCACHE_MTIME_NSEC(a_pSt)    ((a_pSt)->st_mtim.ST_MTIM_NSEC)
+# define HASHCACHE_CTIME_NSEC(a_pSt)    ((a_pSt)->st_ctim.ST_MTIM_NSEC)
+#else
+# define HASHCACHE_MTIME_NSEC(a_pSt)    0
+# define HASHCACHE_CTIME_NSEC(a_pSt)    0
+#endif
+
+/** The read buffer size used when hashing files. */
+#define HASHCACHE_BUF_SIZE      (1024 * 1024)
+/** The maximum length of a cache line. */
+#define HASHCACHE_MAX_LINE      256
+/** Files modified less than this number of seconds ago are not recorded
+ * or trusted by their size and modification time. */
+#define HASHCACHE_RACY_SECS     2
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/**
+ * A cache entry.
+ */
+typedef struct HASHCACHEENTRY
+{
+    /** Next entry in the hash bucket. */
+    struct HASHCACHEENTRY  *pNext;
+    unsigned long long      uDev;
+    unsigned long long      uIno;
+    unsigned long long      cbFile;
+    long long               uMTimeSec;
+    long                    uMTimeNSec;
+    long long               uCTimeSec;
+    long                    uCTimeNSec;
+    unsigned char           abHash[KBUILTIN_HASH_SIZE];
+} HASHCACHEENTRY;
+typedef HASHCACHEENTRY *PHASHCACHEENTRY;
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/** The path of the cache file, NULL if none has been loaded. */
+static char            *g_pszHashCache = NULL;
+/** The cache file handle while open, -1 when closed. */
+static int              g_fdHashCache = -1;
+/** How far into the cache file we have loaded. */
+static off_t            g_offHashCacheLoaded = 0;
+/** The inode of the cache file we loaded, to notice compactions. */
+static unsigned long long g_uHashCacheIno = 0;
+/** The hash buckets. */
+static PHASHCACHEENTRY *g_papHashBuckets = NULL;
+/** Number of buckets (power of two). */
+static unsigned         g_cHashBuckets = 0;
+/** Number of entries. */
+static unsigned         g_cHashEntries = 0;
+/** Number of lines loaded from the file. */
+static unsigned         g_cHashLines = 0;
+
+
+/**
+ * Looks up the entry for a file, optionally creating it.
+ */
+static PHASHCACHEENTRY hashCacheLookup(unsigned long long uDev, unsigned long long uIno, int fCreate)
+{
+    PHASHCACHEENTRY pEntry;
+    unsigned        iBucket;
+
+    if (g_cHashBuckets)
+    {
+        iBucket = (unsigned)((uIno * 2654435761U) ^ uDev) & (g_cHashBuckets - 1);
+        for (pEntry = g_papHashBuckets[iBucket]; pEntry; pEntry = pEntry->pNext)
+            if (pEntry->uIno == uIno && pEntry->uDev == uDev)
+                return pEntry;
+    }
+    if (!fCreate)
+        return NULL;
+
+    /* Grow the table at 75% load. */
+    if (g_cHashEntries * 4 >= g_cHashBuckets * 3)
+    {
+        unsigned         cNew = g_cHashBuckets ? g_cHashBuckets * 2 : 1024;
+        PHASHCACHEENTRY *papNew = (PHASHCACHEENTRY *)calloc(cNew, sizeof(papNew[0]));
+        unsigned         i;
+        if (!papNew)
+            return NULL;
+        for (i = 0; i < g_cHashBuckets; i++)
+            while ((pEntry = g_papHashBuckets[i]) != NULL)
+            {
+                g_papHashBuckets[i] = pEntry->pNext;
+                iBucket = (unsigned)((pEntry->uIno * 2654435761U) ^ pEntry->uDev) & (cNew - 1);
+                pEntry->pNext = papNew[iBucket];
+                papNew[iBucket] = pEntry;
+            }
+        free(g_papHashBuckets);
+        g_papHashBuckets = papNew;
+        g_cHashBuckets = cNew;
+    }
+
+    pEntry = (PHASHCACHEENTRY)calloc(1, sizeof(*pEntry));
+    if (!pEntry)
+        return NULL;
+    pEntry->uDev = uDev;
+    pEntry->uIno = uIno;
+    iBucket = (unsigned)((uIno * 2654435761U) ^ uDev) & (g_cHashBuckets - 1);
+    pEntry->pNext = g_papHashBuckets[iBucket];
+    g_papHashBuckets[iBucket] = pEntry;
+    g_cHashEntries++;
+    return pEntry;
+}
+
+
+/**
+ * Drops all entries.
+ */
+static void hashCacheFlush(void)
+{
+    unsigned i;
+    for (i = 0; i < g_cHashBuckets; i++)
+    {
+        PHASHCACHEENTRY pEntry;
+        while ((pEntry = g_papHashBuckets[i]) != NULL)
+        {
+            g_papHashBuckets[i] = pEntry->pNext;
+            free(pEntry);
+        }
+    }
+    g_cHashEntries = 0;
+    g_cHashLines = 0;
+    g_offHashCacheLoaded = 0;
+}
+
+
+/**
+ * Formats a cache line for an entry.
+ *
+ * @returns The line length.
+ */
+static int hashCacheFormat(char *pszLine, PHASHCACHEENTRY pEntry)
+{
+    static const char s_szHex[] = "0123456789abcdef";
+    int off = sprintf(pszLine, "%llx %llx %llx %lld %ld %lld %ld ", pEntry->uDev, pEntry->uIno,
+                      pEntry->cbFile, pEntry->uMTimeSec, pEntry->uMTimeNSec,
+                      pEntry->uCTimeSec, pEntry->uCTimeNSec);
+    unsigned i;
+    for (i = 0; i < KBUILTIN_HASH_SIZE; i++)
+    {
+        pszLine[off++] = s_szHex[pEntry->abHash[i] >> 4];
+        pszLine[off++] = s_szHex[pEntry->abHash[i] & 15];
+    }
+    pszLine[off++] = '\n';
+    pszLine[off] = '\0';
+    return off;
+}
+
+
+/**
+ * Parses a cache line and enters it into the table.
+ */
+static void hashCacheParseLine(char *pszLine)
+{
+    unsigned long long uDev, uIno, cbFile;
+    long long          uMTimeSec;
+    long               uMTimeNSec;
+    long long          uCTimeSec;
+    long               uCTimeNSec;
+    char               szHash[KBUILTIN_HASH_SIZE * 2 + 1];
+    unsigned char      abHash[KBUILTIN_HASH_SIZE];
+    PHASHCACHEENTRY    pEntry;
+    unsigned           i;
+
+    if (sscanf(pszLine, "%llx %llx %llx %lld %ld %lld %ld %32s", &uDev, &uIno, &cbFile,
+               &uMTimeSec, &uMTimeNSec, &uCTimeSec, &uCTimeNSec, szHash) != 8)
+        return;
+    if (strlen(szHash) != KBUILTIN_HASH_SIZE * 2)
+        return;
+    for (i = 0; i < KBUILTIN_HASH_SIZE; i++)
+    {
+        unsigned uByte;
+        if (sscanf(&szHash[i * 2], "%2x", &uByte) != 1)
+            return;
+        abHash[i] = (unsigned char)uByte;
+    }
+
+    g_cHashLines++;
+    pEntry = hashCacheLookup(uDev, uIno, 1 /*fCreate*/);
+    if (pEntry)
+    {
+        pEntry->cbFile     = cbFile;
+        pEntry->uMTimeSec  = uMTimeSec;
+        pEntry->uMTimeNSec = uMTimeNSec;
+        pEntry->uCTimeSec  = uCTimeSec;
+        pEntry->uCTimeNSec = uCTimeNSec;
+        memcpy(pEntry->abHash, abHash, sizeof(abHash));
+    }
+}
+
+
+/**
+ * Loads whatever has been appended to the cache file since last time.
+ */
+static void hashCacheLoadTail(void)
+{
+    struct stat St;
+    char       *pchBuf;
+    size_t      cbToRead;
+    ssize_t     cbRead;
+    char       *pszLine;
+    char       *pszEol;
+
+    if (fstat(g_fdHashCache, &St) != 0)
+        return;
+
+    /* Rewritten (compacted) or truncated since we loaded it? */
+    if (   (unsigned long long)St.st_ino != g_uHashCacheIno
+        || St.st_size < g_offHashCacheLoaded)
+    {
+        hashCacheFlush();
+        g_uHashCacheIno = St.st_ino;
+    }
+    if (St.st_size == g_offHashCacheLoaded)
+        return;
+
+    cbToRead = (size_t)(St.st_size - g_offHashCacheLoaded);
+    pchBuf = (char *)malloc(cbToRead + 1);
+    if (!pchBuf)
+        return;
+    if (lseek(g_fdHashCache, g_offHashCacheLoaded, SEEK_SET) == g_offHashCacheLoaded)
+    {
+        cbRead = read(g_fdHashCache, pchBuf, cbToRead);
+        if (cbRead > 0)
+        {
+            pchBuf[cbRead] = '\0';
+            pszLine = pchBuf;
+            /* Stop at the last complete line, somebody might be appending. */
+            while ((pszEol = strchr(pszLine, '\n')) != NULL)
+            {
+                *pszEol = '\0';
+                hashCacheParseLine(pszLine);
+                pszLine = pszEol + 1;
+            }
+            g_offHashCacheLoaded += pszLine - pchBuf;
+        }
+    }
+    free(pchBuf);
+}
+
+
+/**
+ * Rewrites the cache file with just the live entries when it has gathered
+ * too many superseded lines.
+ */
+static void hashCacheCompact(void)
+{
+    char    szTmp[4096];
+    char    szLine[HASHCACHE_MAX_LINE];
+    FILE   *pFile;
+    unsigned i;
+    int     fOk;
+    int     fd;
+
+    if (g_cHashLines <= g_cHashEntries * 2 + 4096)
+        return;
+    if ((size_t)snprintf(szTmp, sizeof(szTmp), "%s.%ld.tmp", g_pszHashCache, (long)getpid()) >= sizeof(szTmp))
+        return;
+    fd = open(szTmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return;
+    pFile = fdopen(fd, "w");
+    if (!pFile)
+    {
+        close(fd);
+        unlink(szTmp);
+        return;
+    }
+
+    fOk = 1;
+    for (i = 0; i < g_cHashBuckets && fOk; i++)
+    {
+        PHASHCACHEENTRY pEntry;
+        for (pEntry = g_papHashBuckets[i]; pEntry && fOk; pEntry = pEntry->pNext)
+        {
+            int cch = hashCacheFormat(szLine, pEntry);
+            fOk = fwrite(szLine, 1, cch, pFile) == (size_t)cch;
+        }
+    }
+    if (fclose(pFile) != 0)
+        fOk = 0;
+    if (!fOk || rename(szTmp, g_pszHashCache) != 0)
+    {
+        unlink(szTmp);
+        return;
+    }
+
+    /* Reopen and reload the compacted file. */
+    close(g_fdHashCache);
+    g_fdHashCache = open(g_pszHashCache, O_RDWR | O_APPEND | O_CREAT | O_BINARY | O_CLOEXEC, 0666);
+    hashCacheFlush();
+    g_uHashCacheIno = 0;
+    if (g_fdHashCache >= 0)
+        hashCacheLoadTail();
+}
+
+
+/**
+ * Opens the hash cache for a cp or install invocation.
+ *
+ * The entries stay in memory after kBuiltinHashCacheClose(), so when kmk
+ * runs the builtins only what other processes have appended since the
+ * last invocation needs reading.
+ *
+ * @returns 0 on success, -1 on failure (warning given, caching disabled).
+ * @param   pszPath     The cache file, created if missing.
+ */
+int kBuiltinHashCacheOpen(const char *pszPath)
+{
+    kBuiltinHashCacheClose();
+
+    if (!g_pszHashCache || strcmp(g_pszHashCache, pszPath))
+    {
+        hashCacheFlush();
+        g_uHashCacheIno = 0;
+        free(g_pszHashCache);
+        g_pszHashCache = strdup(pszPath);
+        if (!g_pszHashCache)
+            return -1;
+    }
+
+    g_fdHashCache = open(pszPath, O_RDWR | O_APPEND | O_CREAT | O_BINARY | O_CLOEXEC, 0666);
+    if (g_fdHashCache < 0)
+    {
+        warn("hash cache: %s", pszPath);
+        return -1;
+    }
+    hashCacheLoadTail();
+    hashCacheCompact();
+    return g_fdHashCache >= 0 ? 0 : -1;
+}
+
+
+/**
+ * Closes the hash cache file.  Does nothing if not open.
+ */
+void kBuiltinHashCacheClose(void)
+{
+    if (g_fdHashCache >= 0)
+    {
+        close(g_fdHashCache);
+        g_fdHashCache = -1;
+    }
+}
+
+
+/**
+ * Checks if the modification time of a file is too recent to be trusted.
+ */
+static int hashCacheIsRacy(const struct stat *pSt)
+{
+    return (long long)pSt->st_mtime >= (long long)time(NULL) - HASHCACHE_RACY_SECS;
+}
+
+
+/**
+ * Enters the hash of a file into the table and appends it to the file.
+ */
+static void hashCacheRecordStat(const struct stat *pSt, const unsigned char pabHash[KBUILTIN_HASH_SIZE])
+{
+    PHASHCACHEENTRY pEntry;
+    char            szLine[HASHCACHE_MAX_LINE];
+    int             cch;
+
+    if (g_fdHashCache < 0 || pSt->st_ino == 0 || hashCacheIsRacy(pSt))
+        return;
+    pEntry = hashCacheLookup(pSt->st_dev, pSt->st_ino, 1 /*fCreate*/);
+    if (!pEntry)
+        return;
+    pEntry->cbFile     = pSt->st_size;
+    pEntry->uMTimeSec  = pSt->st_mtime;
+    pEntry->uMTimeNSec = HASHCACHE_MTIME_NSEC(pSt);
+    pEntry->uCTimeSec  = pSt->st_ctime;
+    pEntry->uCTimeNSec = HASHCACHE_CTIME_NSEC(pSt);
+    memcpy(pEntry->abHash, pabHash, KBUILTIN_HASH_SIZE);
+
+    /* One write per line so concurrent appenders don't interleave. */
+    cch = hashCacheFormat(szLine, pEntry);
+    if (write(g_fdHashCache, szLine, cch) == cch)
+        g_cHashLines++;
+}
+
+
+/**
+ * Looks up a valid entry for a file.
+ */
+static PHASHCACHEENTRY hashCacheLookupStat(const struct stat *pSt)
+{
+    PHASHCACHEENTRY pEntry;
+    if (g_fdHashCache < 0 || pSt->st_ino == 0 || hashCacheIsRacy(pSt))
+        return NULL;
+    pEntry = hashCacheLookup(pSt->st_dev, pSt->st_ino, 0 /*fCreate*/);
+    if (   pEntry
+        && pEntry->cbFile     == (unsigned long long)pSt->st_size
+        && pEntry->uMTimeSec  == (long long)pSt->st_mtime
+        && pEntry->uMTimeNSec == (long)HASHCACHE_MTIME_NSEC(pSt)
+        && pEntry->uCTimeSec  == (long long)pSt->st_ctime
+        && pEntry->uCTimeNSec == (long)HASHCACHE_CTIME_NSEC(pSt))
+        return pEntry;
+    return NULL;
+}
+
+
+/**
+ * Gets the content hash of an open file, from the cache if possible.
+ *
+ * Files that has to be read are entered into the cache.  The file position
+ * is restored.
+ *
+ * @returns 0 on success, -1 on failure or if no cache is open.
+ * @param   fd          The file.
+ * @param   pSt         The stat of the file.
+ * @param   pabHash     Where to return the hash.
+ */
+int kBuiltinHashCacheGetFd(int fd, const struct stat *pSt, unsigned char pabHash[KBUILTIN_HASH_SIZE])
+{
+    PHASHCACHEENTRY     pEntry;
+    struct MD5Context   Ctx;
+    unsigned char      *pbBuf;
+    off_t               offSaved;
+    ssize_t             cbRead;
+
+    if (g_fdHashCache < 0)
+        return -1;
+    pEntry = hashCacheLookupStat(pSt);
+    if (pEntry)
+    {
+        memcpy(pabHash, pEntry->abHash, KBUILTIN_HASH_SIZE);
+        return 0;
+    }
+
+    pbBuf = (unsigned char *)malloc(HASHCACHE_BUF_SIZE);
+    if (!pbBuf)
+        return -1;
+    offSaved = lseek(fd, 0, SEEK_CUR);
+    if (offSaved == -1 || lseek(fd, 0, SEEK_SET) != 0)
+    {
+        free(pbBuf);
+        return -1;
+    }
+    MD5Init(&Ctx);
+    while ((cbRead = read(fd, pbBuf, HASHCACHE_BUF_SIZE)) > 0)
+        MD5Update(&Ctx, pbBuf, (unsigned)cbRead);
+    MD5Final(pabHash, &Ctx);
+    free(pbBuf);
+    lseek(fd, offSaved, SEEK_SET);
+    if (cbRead < 0)
+        return -1;
+
+    hashCacheRecordStat(pSt, pabHash);
+    return 0;
+}
+
+
+/**
+ * Checks if the destination of a copy already has the source content.
+ *
+ * @returns 1 if same, 0 if different, -1 if it couldn't be determined (no
+ *          cache open, no destination, I/O error).
+ * @param   fdSrc       The source file.
+ * @param   pStSrc      The stat of the source file.
+ * @param   pszDst      The destination file.
+ * @param   pabSrcHash  Where to return the source hash for passing on to
+ *                      kBuiltinHashCacheRecord() after copying.  Valid when
+ *                      0 or 1 is returned.
+ */
+int kBuiltinHashCacheCompare(int fdSrc, const struct stat *pStSrc, const char *pszDst,
+                             unsigned char pabSrcHash[KBUILTIN_HASH_SIZE])
+{
+    unsigned char   abDstHash[KBUILTIN_HASH_SIZE];
+    struct stat     StDst;
+    int             fdDst;
+    int             rc;
+
+    if (kBuiltinHashCacheGetFd(fdSrc, pStSrc, pabSrcHash) != 0)
+        return -1;
+    if (stat(pszDst, &StDst) != 0)
+        return -1;
+    if (StDst.st_size != pStSrc->st_size)
+        return 0;
+    if (StDst.st_dev == pStSrc->st_dev && StDst.st_ino == pStSrc->st_ino && StDst.st_ino != 0)
+        return 1;
+
+    fdDst = open(pszDst, O_RDONLY | O_BINARY | O_CLOEXEC, 0);
+    if (fdDst < 0)
+        return -1;
+    rc = kBuiltinHashCacheGetFd(fdDst, &StDst, abDstHash);
+    close(fdDst);
+    if (rc != 0)
+        return -1;
+    return memcmp(pabSrcHash, abDstHash, KBUILTIN_HASH_SIZE) == 0;
+}
+
+
+/**
+ * Records the content hash of a file we have just written.
+ *
+ * @param   pszPath     The file.  Call this after setting times and such.
+ * @param   pabHash     The hash of what was written.
+ */
+void kBuiltinHashCacheRecord(const char *pszPath, const unsigned char pabHash[KBUILTIN_HASH_SIZE])
+{
+    struct stat St;
+    if (g_fdHashCache >= 0 && stat(pszPath, &St) == 0)
+        hashCacheRecordStat(&St, pabHash);
+}
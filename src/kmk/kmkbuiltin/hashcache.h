@@ -0,0 +1,42 @@
+/* $Id$ */
+/** @file
+ * Content hash cache for the copy-if-changed modes of cp and install.
+ */
+
+/*
+ * Copyright (c) 2026 knut st. osmundsen <bird-kBuild-spamx@anduin.net>
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#ifndef ___kmkbuiltin_hashcache_h
+#define ___kmkbuiltin_hashcache_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/** The size of the content hashes (MD5). */
+#define KBUILTIN_HASH_SIZE  16
+
+int  kBuiltinHashCacheOpen(const char *pszPath);
+void kBuiltinHashCacheClose(void);
+int  kBuiltinHashCacheGetFd(int fd, const struct stat *pSt, unsigned char pabHash[KBUILTIN_HASH_SIZE]);
+int  kBuiltinHashCacheCompare(int fdSrc, const struct stat *pStSrc, const char *pszDst,
+                              unsigned char pabSrcHash[KBUILTIN_HASH_SIZE]);
+void kBuiltinHashCacheRecord(const char *pszPath, const unsigned char pabHash[KBUILTIN_HASH_SIZE]);
+
+#endif
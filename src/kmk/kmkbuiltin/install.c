@@ -54,6 +54,10 @@ __FBSDID("$FreeBSD: src/usr.bin/xinstall/xinstall.c,v 1.66 2005/01/25 14:34:57 s
 # endif
 # include <sys/wait.h>
 # include <sys/time.h>
+# ifndef __EMX__
+#  include <sys/mman.h>
+#  define INSTALL_WITH_MMAP
+# endif
 #endif /* !_MSC_VER */
 #include <sys/stat.h>
 
@@ -91,6 +95,8 @@ __FBSDID("$FreeBSD: src/usr.bin/xinstall/xinstall.c,v 1.66 2005/01/25 14:34:57 s
 #include "kmkbuiltin.h"
 #include "k/kDefs.h"	/* for K_OS */
 #include "dos2unix.h"
+#include "fastcopy.h"
+#include "hashcache.h"
 
 
 extern void * bsd_setmode(const char *p);
@@ -100,7 +106,7 @@ extern mode_t bsd_getmode(const void *bbox, mode_t omode);
 # define MAXBSIZE 0x20000
 #endif
 
-#define MAX_CMP_SIZE	(16 * 1024 * 1024)
+#define CMP_BUF_SIZE	(1024 * 1024)
 
 #define	DIRECTORY	0x01		/* Tell install it's a directory. */
 #define	SETFLAGS	0x02		/* Tell install to set flags. */
@@ -110,6 +116,9 @@ extern mode_t bsd_getmode(const void *bbox, mode_t omode);
 #ifndef O_BINARY
 # define O_BINARY 0
 #endif
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
 
 #ifndef EFTYPE
 # define EFTYPE EINVAL
@@ -129,6 +138,7 @@ static const char *suffix = BACKUP_SUFFIX;
 static int ignore_perm_errors;
 static int hard_link_files_when_possible;
 static int dos2unix;
+static const char *hash_cache;
 
 static struct option long_options[] =
 {
@@ -140,6 +150,7 @@ static struct option long_options[] =
     { "no-hard-link-files-when-possible",		no_argument, 0, 266 },
     { "dos2unix",					no_argument, 0, 267 },
     { "unix2dos",					no_argument, 0, 268 },
+    { "hash-cache",					required_argument, 0, 269 },
     { 0, 0,	0, 0 },
 };
 
@@ -178,6 +189,7 @@ kmk_builtin_install(int argc, char *argv[], char ** envp)
 	ignore_perm_errors = geteuid() != 0;
 	hard_link_files_when_possible = 0;
 	dos2unix = 0;
+	hash_cache = NULL;
 
 	/* reset getopt and set progname. */
 	g_progname = argv[0];
@@ -267,6 +279,9 @@ kmk_builtin_install(int argc, char *argv[], char ** envp)
 		case 268:
 			dos2unix = -1;
 			break;
+		case 269:
+			hash_cache = optarg;
+			break;
 		case '?':
 		default:
 			return usage(stderr);
@@ -405,6 +420,8 @@ install(const char *from_name, const char *to_name, u_long fset, u_int flags)
 	struct timeval tvb[2];
 	int devnull, files_match, from_fd, serrno, target;
 	int tempcopy, temp_fd, to_fd;
+	int use_hash_cache, hashrc;
+	unsigned char hash[KBUILTIN_HASH_SIZE];
 	char backup[MAXPATHLEN], *p, pathbuf[MAXPATHLEN], tempfile[MAXPATHLEN];
 	int rc = EX_OK;
 
@@ -412,6 +429,7 @@ install(const char *from_name, const char *to_name, u_long fset, u_int flags)
 	from_fd = -1;
 	to_fd = -1;
 	temp_fd = -1;
+	use_hash_cache = 0;
 
 	/* If try to install NULL file to a directory, fails. */
 	if (flags & DIRECTORY
@@ -521,17 +539,24 @@ install(const char *from_name, const char *to_name, u_long fset, u_int flags)
 		/* Can't hard link or we failed, continue as nothing happend. */
 	}
 
-	if (!devnull && (from_fd = open(from_name, O_RDONLY | O_BINARY, 0)) < 0)
+	if (!devnull && (from_fd = open(from_name, O_RDONLY | O_BINARY | O_CLOEXEC, 0)) < 0)
 		return err(EX_OSERR, "%s", from_name);
 
+	/* The hash cache only knows about plain, unstripped and unconverted copies. */
+	if (hash_cache && docompare && !dostrip && !dos2unix && !devnull)
+		use_hash_cache = kBuiltinHashCacheOpen(hash_cache) == 0;
+
 	/* If we don't strip, we can compare first. */
 	if (docompare && !dostrip && target) {
-		if ((to_fd = open(to_name, O_RDONLY | O_BINARY, 0)) < 0) {
+		if ((to_fd = open(to_name, O_RDONLY | O_BINARY | O_CLOEXEC, 0)) < 0) {
 			rc = err(EX_OSERR, "%s", to_name);
 			goto l_done;
 		}
 		if (devnull)
 			files_match = to_sb.st_size == 0;
+		else if (use_hash_cache
+		      && (hashrc = kBuiltinHashCacheCompare(from_fd, &from_sb, to_name, hash)) >= 0)
+			files_match = hashrc;
 		else
 			files_match = !compare(from_fd, (size_t)from_sb.st_size,
 					       to_fd, (size_t)to_sb.st_size);
@@ -585,7 +610,7 @@ install(const char *from_name, const char *to_name, u_long fset, u_int flags)
 #if !defined(__EMX__) && !defined(_MSC_VER)
 		close(to_fd);
 #endif
-		to_fd = open(tempcopy ? tempfile : to_name, O_RDONLY | O_BINARY, 0);
+		to_fd = open(tempcopy ? tempfile : to_name, O_RDONLY | O_BINARY | O_CLOEXEC, 0);
 		if (to_fd < 0) {
 			rc = err(EX_OSERR, "stripping %s", to_name);
 			goto l_done;
@@ -599,7 +624,7 @@ install(const char *from_name, const char *to_name, u_long fset, u_int flags)
 		temp_fd = to_fd;
 
 		/* Re-open to_fd using the real target name. */
-		if ((to_fd = open(to_name, O_RDONLY | O_BINARY, 0)) < 0) {
+		if ((to_fd = open(to_name, O_RDONLY | O_BINARY | O_CLOEXEC, 0)) < 0) {
 			rc = err(EX_OSERR, "%s", to_name);
 			goto l_done;
 		}
@@ -680,7 +705,7 @@ install(const char *from_name, const char *to_name, u_long fset, u_int flags)
 
 		/* Re-open to_fd so we aren't hosed by the rename(2). */
 		(void) close(to_fd);
-		if ((to_fd = open(to_name, O_RDONLY | O_BINARY, 0)) < 0) {
+		if ((to_fd = open(to_name, O_RDONLY | O_BINARY | O_CLOEXEC, 0)) < 0) {
 			rc = err(EX_OSERR, "%s", to_name);
 			goto l_done;
 		}
@@ -780,6 +805,13 @@ l_done:
 		(void)close(to_fd);
 	if (temp_fd >= 0)
 		(void)close(temp_fd);
+	if (use_hash_cache) {
+		/* Remember what we wrote so the next -C run needn't read it. */
+		if (rc == EX_OK && !files_match
+		 && !kBuiltinHashCacheGetFd(from_fd, &from_sb, hash))
+			kBuiltinHashCacheRecord(to_name, hash);
+		kBuiltinHashCacheClose();
+	}
 	if (from_fd >= 0 && !devnull)
 		(void)close(from_fd);
 	return rc;
@@ -792,35 +824,66 @@ l_done:
 static int
 compare(int from_fd, size_t from_len, int to_fd, size_t to_len)
 {
-	char buf1[MAXBSIZE];
-	char buf2[MAXBSIZE];
+	char *buf1;
+	char *buf2;
 	int n1, n2;
 	int rv;
 
 	if (from_len != to_len)
 		return 1;
+	if (from_len == 0)
+		return 0;
 
-	if (from_len <= MAX_CMP_SIZE) {
-		rv = 0;
-		lseek(from_fd, 0, SEEK_SET);
-		lseek(to_fd, 0, SEEK_SET);
-		while (rv == 0) {
-			n1 = read(from_fd, buf1, sizeof(buf1));
-			if (n1 == 0)
-				break;		/* EOF */
-			else if (n1 > 0) {
-				n2 = read(to_fd, buf2, n1);
-				if (n2 == n1)
-					rv = memcmp(buf1, buf2, n1);
-				else
-					rv = 1;	/* out of sync */
-			} else
-				rv = 1;		/* read failure */
+#ifdef INSTALL_WITH_MMAP
+	/*
+	 * Map both files and compare them in one go, no copying.
+	 */
+	if (!nommap) {
+		char *p1, *p2;
+		p1 = mmap(NULL, from_len, PROT_READ, MAP_SHARED, from_fd, (off_t)0);
+		if (p1 != MAP_FAILED) {
+			p2 = mmap(NULL, to_len, PROT_READ, MAP_SHARED, to_fd, (off_t)0);
+			if (p2 != MAP_FAILED) {
+# ifdef MADV_SEQUENTIAL
+				madvise(p1, from_len, MADV_SEQUENTIAL);
+				madvise(p2, to_len, MADV_SEQUENTIAL);
+# endif
+				rv = memcmp(p1, p2, from_len) != 0;
+				munmap(p2, to_len);
+				munmap(p1, from_len);
+				return rv;
+			}
+			munmap(p1, from_len);
 		}
-		lseek(from_fd, 0, SEEK_SET);
-		lseek(to_fd, 0, SEEK_SET);
-	} else
-		rv = 1;	/* don't bother in this case */
+	}
+#endif
+
+	/*
+	 * Read and compare large blocks.
+	 */
+	buf1 = malloc(CMP_BUF_SIZE * 2);
+	if (!buf1)
+		return 1;
+	buf2 = buf1 + CMP_BUF_SIZE;
+	rv = 0;
+	lseek(from_fd, 0, SEEK_SET);
+	lseek(to_fd, 0, SEEK_SET);
+	while (rv == 0) {
+		n1 = read(from_fd, buf1, CMP_BUF_SIZE);
+		if (n1 == 0)
+			break;		/* EOF */
+		else if (n1 > 0) {
+			n2 = read(to_fd, buf2, n1);
+			if (n2 == n1)
+				rv = memcmp(buf1, buf2, n1);
+			else
+				rv = 1;	/* out of sync */
+		} else
+			rv = 1;		/* read failure */
+	}
+	lseek(from_fd, 0, SEEK_SET);
+	lseek(to_fd, 0, SEEK_SET);
+	free(buf1);
 
 	return rv;
 }
@@ -889,7 +952,7 @@ create_newfile(const char *path, int target, struct stat *sbp)
 				saved_errno = errno;
 	}
 
-	newfd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_BINARY, S_IRUSR | S_IWUSR);
+	newfd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_BINARY | O_CLOEXEC, S_IRUSR | S_IWUSR);
 	if (newfd < 0 && saved_errno != 0)
 		errno = saved_errno;
 	return newfd;
@@ -942,8 +1005,16 @@ copy(int from_fd, const char *from_name, int *ptr_to_fd, const char *to_name)
 
 	if (dos2unix == 0) {
 		/*
-		 * Copy bytes, no conversion.
+		 * Copy bytes, no conversion.  Let the kernel do it if it can.
 		 */
+		struct stat st;
+		if (fstat(from_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			int rc = kBuiltinFastCopy(from_fd, to_fd, st.st_size);
+			if (rc == 0)
+				return EX_OK;
+			if (rc < 0)
+				return write_error(ptr_to_fd, to_name, -1);
+		}
 		while ((nr = read(from_fd, buf, sizeof(buf))) > 0)
 			if ((nw = write(to_fd, buf, nr)) != nr)
 				return write_error(ptr_to_fd, to_name, nw);
@@ -1094,9 +1165,11 @@ usage(FILE *pf)
 	fprintf(pf,
 "usage: %s [-bCcpSsv] [--[no-]hard-link-files-when-possible]\n"
 "            [--[no-]ignore-perm-errors] [-B suffix] [-f flags] [-g group]\n"
-"            [-m mode] [-o owner] [--dos2unix|--unix2dos] file1 file2\n"
+"            [-m mode] [-o owner] [--dos2unix|--unix2dos] [--hash-cache=file]\n"
+"            file1 file2\n"
 "   or: %s [-bCcpSsv] [--[no-]ignore-perm-errors] [-B suffix] [-f flags]\n"
-"            [-g group] [-m mode] [-o owner] file1 ... fileN directory\n"
+"            [-g group] [-m mode] [-o owner] [--hash-cache=file]\n"
+"            file1 ... fileN directory\n"
 "   or: %s -d [-v] [-g group] [-m mode] [-o owner] directory ...\n"
 "   or: %s --help\n"
 "   or: %s --version\n",
@@ -1,6 +1,9 @@
 /* $Id: kDepObj.c 3064 2017-09-30 11:38:48Z bird $ */
 /** @file
  * kDepObj - Extract dependency information from an object file.
+ *
+ * Supported formats: OMF (Watcom/IBM), COFF with CodeView 8 debug info
+ * (Visual C++) and ELF with DWARF 2 thru 5 line number info (.debug_line).
  */
 
 /*
@@ -70,6 +73,42 @@
 #define KDEPOMF_LINNUM32        0x95
 /** @} */
 
+/** @name ELF defines
+ * @{ */
+#define KDEPELF_SHN_XINDEX      0xffff
+#define KDEPELF_SHT_SYMTAB      2
+#define KDEPELF_SHT_RELA        4
+#define KDEPELF_SHT_REL         9
+#define KDEPELF_SHF_COMPRESSED  0x800
+/** @} */
+
+/** @name DWARF defines (line number program header subset)
+ * @{ */
+#define KDEPDW_FORM_block2      0x03
+#define KDEPDW_FORM_block4      0x04
+#define KDEPDW_FORM_data2       0x05
+#define KDEPDW_FORM_data4       0x06
+#define KDEPDW_FORM_data8       0x07
+#define KDEPDW_FORM_string      0x08
+#define KDEPDW_FORM_block       0x09
+#define KDEPDW_FORM_block1      0x0a
+#define KDEPDW_FORM_data1       0x0b
+#define KDEPDW_FORM_flag        0x0c
+#define KDEPDW_FORM_sdata       0x0d
+#define KDEPDW_FORM_strp        0x0e
+#define KDEPDW_FORM_udata       0x0f
+#define KDEPDW_FORM_sec_offset  0x17
+#define KDEPDW_FORM_strx        0x1a
+#define KDEPDW_FORM_data16      0x1e
+#define KDEPDW_FORM_line_strp   0x1f
+#define KDEPDW_FORM_strx1       0x25
+#define KDEPDW_FORM_strx2       0x26
+#define KDEPDW_FORM_strx3       0x27
+#define KDEPDW_FORM_strx4       0x28
+#define KDEPDW_LNCT_path        0x1
+#define KDEPDW_LNCT_directory_index 0x2
+/** @} */
+
 
 /*******************************************************************************
 *   Structures and Typedefs                                                    *
@@ -165,6 +204,89 @@ typedef const KDEPCV8SYMHDR *PCKDEPCV8SYMHDR;
 /** @} */
 
 
+/** @name ELF Structures
+ * @{ */
+
+/** The bits of an ELF section header we care about, in host endian. */
+typedef struct KDEPELFSECT
+{
+    KU32        offName;
+    KU32        uType;
+    KU64        fFlags;
+    KU64        off;
+    KU64        cb;
+    KU32        uLink;
+    KU32        uInfo;
+    KU64        cbEntry;
+} KDEPELFSECT;
+typedef KDEPELFSECT *PKDEPELFSECT;
+
+/** ELF object parsing state. */
+typedef struct KDEPELF
+{
+    /** The file mapping. */
+    const KU8  *pbFile;
+    /** The file size. */
+    KSIZE       cbFile;
+    /** Set if ELFCLASS64. */
+    KBOOL       f64Bit;
+    /** Set if ELFDATA2MSB. */
+    KBOOL       fBigEndian;
+    /** The section header table offset. */
+    KU64        offShdrs;
+    /** The size of a section header. */
+    KU32        cbShdr;
+    /** The number of section headers. */
+    KU32        cShdrs;
+    /** The section name string table. */
+    const char *pchShStrTab;
+    /** The size of the section name string table. */
+    KSIZE       cbShStrTab;
+    /** .debug_str, NULL if not present. */
+    const char *pchStr;
+    /** The size of .debug_str. */
+    KSIZE       cbStr;
+    /** .debug_line_str, NULL if not present. */
+    const char *pchLineStr;
+    /** The size of .debug_line_str. */
+    KSIZE       cbLineStr;
+
+    /** The .debug_line section being parsed. */
+    const KU8  *pbLine;
+    /** The size of the .debug_line section being parsed. */
+    KSIZE       cbLine;
+    /** The RELA relocations for it, NULL if none (or REL). */
+    const KU8  *pbRelocs;
+    /** The number of relocations. */
+    KSIZE       cRelocs;
+    /** The size of a relocation entry. */
+    KSIZE       cbReloc;
+    /** Where to start looking for the next relocation. */
+    KSIZE       iRelocHint;
+    /** The symbol table the relocations refer to. */
+    const KU8  *pbSyms;
+    /** The number of symbols. */
+    KSIZE       cSyms;
+} KDEPELF;
+typedef KDEPELF *PKDEPELF;
+
+/** DWARF reader cursor. */
+typedef struct KDEPDWCUR
+{
+    /** The current position. */
+    const KU8  *pb;
+    /** The end of the data. */
+    const KU8  *pbEnd;
+    /** Set when trying to read past pbEnd. */
+    KBOOL       fOverflow;
+    /** The ELF object (endianness, relocations, string sections). */
+    PKDEPELF    pElf;
+} KDEPDWCUR;
+typedef KDEPDWCUR *PKDEPDWCUR;
+
+/** @} */
+
+
 /*******************************************************************************
 *   Global Variables                                                           *
 *******************************************************************************/
@@ -942,6 +1064,884 @@ KBOOL kDepObjCOFFTest(const KU8 *pbFile, KSIZE cbFile)
 }
 
 
+/**
+ * Reads an unsigned integer from the ELF image.
+ *
+ * @returns The value in host endian.
+ * @param   pElf        The ELF object (for the endianness).
+ * @param   pb          Where to read.
+ * @param   cb          The size of the integer, 1 thru 8.
+ */
+static KU64 kDepObjElfReadU(PKDEPELF pElf, const KU8 *pb, unsigned cb)
+{
+    KU64        u = 0;
+    unsigned    i;
+    if (pElf->fBigEndian)
+        for (i = 0; i < cb; i++)
+            u = (u << 8) | pb[i];
+    else
+        for (i = cb; i-- > 0;)
+            u = (u << 8) | pb[i];
+    return u;
+}
+
+
+/**
+ * Gets the interesting bits of a section header.
+ *
+ * @param   pElf        The ELF object.
+ * @param   iSect       The section index, must be valid.
+ * @param   pSect       Where to return the section info.
+ */
+static void kDepObjElfGetSect(PKDEPELF pElf, KU32 iSect, PKDEPELFSECT pSect)
+{
+    const KU8 *pb = pElf->pbFile + pElf->offShdrs + (KSIZE)iSect * pElf->cbShdr;
+    pSect->offName = (KU32)kDepObjElfReadU(pElf, pb, 4);
+    pSect->uType   = (KU32)kDepObjElfReadU(pElf, pb + 4, 4);
+    if (pElf->f64Bit)
+    {
+        pSect->fFlags  =       kDepObjElfReadU(pElf, pb +  8, 8);
+        pSect->off     =       kDepObjElfReadU(pElf, pb + 24, 8);
+        pSect->cb      =       kDepObjElfReadU(pElf, pb + 32, 8);
+        pSect->uLink   = (KU32)kDepObjElfReadU(pElf, pb + 40, 4);
+        pSect->uInfo   = (KU32)kDepObjElfReadU(pElf, pb + 44, 4);
+        pSect->cbEntry =       kDepObjElfReadU(pElf, pb + 56, 8);
+    }
+    else
+    {
+        pSect->fFlags  =       kDepObjElfReadU(pElf, pb +  8, 4);
+        pSect->off     =       kDepObjElfReadU(pElf, pb + 16, 4);
+        pSect->cb      =       kDepObjElfReadU(pElf, pb + 20, 4);
+        pSect->uLink   = (KU32)kDepObjElfReadU(pElf, pb + 24, 4);
+        pSect->uInfo   = (KU32)kDepObjElfReadU(pElf, pb + 28, 4);
+        pSect->cbEntry =       kDepObjElfReadU(pElf, pb + 36, 4);
+    }
+}
+
+
+/**
+ * Gets the name of a section.
+ *
+ * @returns Pointer to the name, "" if invalid.
+ * @param   pElf        The ELF object.
+ * @param   pSect       The section.
+ */
+static const char *kDepObjElfSectName(PKDEPELF pElf, PKDEPELFSECT pSect)
+{
+    if (    pSect->offName < pElf->cbShStrTab
+        &&  memchr(pElf->pchShStrTab + pSect->offName, '\0', pElf->cbShStrTab - pSect->offName))
+        return pElf->pchShStrTab + pSect->offName;
+    return "";
+}
+
+
+/**
+ * Gets the data of a section, complaining if it's not usable.
+ *
+ * @returns Pointer to the section data, NULL on failure.
+ * @param   pElf        The ELF object.
+ * @param   pSect       The section.
+ * @param   pszName     The section name (for messages).
+ * @param   pcb         Where to return the section size.
+ */
+static const KU8 *kDepObjElfSectData(PKDEPELF pElf, PKDEPELFSECT pSect, const char *pszName, KSIZE *pcb)
+{
+    if (    pSect->off > pElf->cbFile
+        ||  pSect->cb  > pElf->cbFile - pSect->off)
+    {
+        fprintf(stderr, "%s: error: ELF section '%s' is out of bounds.\n", argv0, pszName);
+        return NULL;
+    }
+    if (pSect->fFlags & KDEPELF_SHF_COMPRESSED)
+    {
+        fprintf(stderr, "%s: error: ELF section '%s' is compressed, which isn't supported (-gz=none).\n", argv0, pszName);
+        return NULL;
+    }
+    *pcb = (KSIZE)pSect->cb;
+    return pElf->pbFile + pSect->off;
+}
+
+
+/**
+ * Validates the ELF header and section table and initializes the parser state.
+ *
+ * @returns 0 on success, 1 if not a usable ELF object.
+ * @param   pElf        The parser state to initialize.
+ * @param   pbFile      The start of the file.
+ * @param   cbFile      The file size.
+ */
+static int kDepObjElfInit(PKDEPELF pElf, const KU8 *pbFile, KSIZE cbFile)
+{
+    KDEPELFSECT Sect;
+    KU32        iShStrTab;
+
+    memset(pElf, 0, sizeof(*pElf));
+    pElf->pbFile = pbFile;
+    pElf->cbFile = cbFile;
+
+    if (    cbFile < 52 /* sizeof(Elf32_Ehdr) */
+        ||  pbFile[0] != 0x7f
+        ||  pbFile[1] != 'E'
+        ||  pbFile[2] != 'L'
+        ||  pbFile[3] != 'F'
+        ||  (pbFile[4] != 1 && pbFile[4] != 2)  /* EI_CLASS */
+        ||  (pbFile[5] != 1 && pbFile[5] != 2)  /* EI_DATA */
+        ||  pbFile[6] != 1)                     /* EI_VERSION */
+        return 1;
+    pElf->f64Bit     = pbFile[4] == 2;
+    pElf->fBigEndian = pbFile[5] == 2;
+    if (pElf->f64Bit)
+    {
+        if (cbFile < 64 /* sizeof(Elf64_Ehdr) */)
+            return 1;
+        pElf->offShdrs  =       kDepObjElfReadU(pElf, pbFile + 40, 8);
+        pElf->cbShdr    = (KU32)kDepObjElfReadU(pElf, pbFile + 58, 2);
+        pElf->cShdrs    = (KU32)kDepObjElfReadU(pElf, pbFile + 60, 2);
+        iShStrTab       = (KU32)kDepObjElfReadU(pElf, pbFile + 62, 2);
+        if (pElf->cbShdr < 64)
+            return 1;
+    }
+    else
+    {
+        pElf->offShdrs  =       kDepObjElfReadU(pElf, pbFile + 32, 4);
+        pElf->cbShdr    = (KU32)kDepObjElfReadU(pElf, pbFile + 46, 2);
+        pElf->cShdrs    = (KU32)kDepObjElfReadU(pElf, pbFile + 48, 2);
+        iShStrTab       = (KU32)kDepObjElfReadU(pElf, pbFile + 50, 2);
+        if (pElf->cbShdr < 40)
+            return 1;
+    }
+    if (    !pElf->offShdrs
+        ||  pElf->offShdrs >= cbFile
+        ||  cbFile - pElf->offShdrs < pElf->cbShdr)
+        return 1;
+
+    /* Objects with lots of sections keep the real counts in section 0. */
+    kDepObjElfGetSect(pElf, 0, &Sect);
+    if (pElf->cShdrs == 0)
+        pElf->cShdrs = Sect.cb > KU32_MAX ? KU32_MAX : (KU32)Sect.cb;
+    if (iShStrTab == KDEPELF_SHN_XINDEX)
+        iShStrTab = Sect.uLink;
+    if (    pElf->cShdrs > (cbFile - pElf->offShdrs) / pElf->cbShdr
+        ||  iShStrTab >= pElf->cShdrs)
+        return 1;
+
+    kDepObjElfGetSect(pElf, iShStrTab, &Sect);
+    pElf->pchShStrTab = (const char *)kDepObjElfSectData(pElf, &Sect, ".shstrtab", &pElf->cbShStrTab);
+    if (!pElf->pchShStrTab)
+        return 1;
+    return 0;
+}
+
+
+/**
+ * Checks if this file is an ELF file or not.
+ *
+ * @returns K_TRUE if it's ELF, K_FALSE otherwise.
+ *
+ * @param   pb      The start of the file.
+ * @param   cb      The file size.
+ */
+KBOOL kDepObjElfTest(const KU8 *pbFile, KSIZE cbFile)
+{
+    KDEPELF Elf;
+    return kDepObjElfInit(&Elf, pbFile, cbFile) == 0;
+}
+
+
+/**
+ * Applies the RELA relocation (if any) for a field in the .debug_line section.
+ *
+ * In relocatable objects on RELA targets (x86-64 and others) the string
+ * offsets are zero in the section data and the real value is the addend.
+ *
+ * @returns The relocated value.
+ * @param   pElf        The ELF object.
+ * @param   pbField     The field in the .debug_line section.
+ * @param   uValue      The value read from the field.
+ */
+static KU64 kDepObjElfRelocate(PKDEPELF pElf, const KU8 *pbField, KU64 uValue)
+{
+    const unsigned  cbWord   = pElf->f64Bit ? 8 : 4;
+    const KU64      offField = (KU64)(pbField - pElf->pbLine);
+    KSIZE           i        = pElf->iRelocHint;
+    KSIZE           cLeft    = pElf->cRelocs;
+
+    /* The relocations are normally sorted, so start where the last one was found. */
+    while (cLeft-- > 0)
+    {
+        const KU8 *pbRel;
+        if (i >= pElf->cRelocs)
+            i = 0;
+        pbRel = pElf->pbRelocs + i * pElf->cbReloc;
+        if (kDepObjElfReadU(pElf, pbRel, cbWord) == offField)
+        {
+            KU64 uInfo   = kDepObjElfReadU(pElf, pbRel + cbWord, cbWord);
+            KU64 iSym    = pElf->f64Bit ? uInfo >> 32 : uInfo >> 8;
+            KU64 uAddend = kDepObjElfReadU(pElf, pbRel + cbWord * 2, cbWord);
+            KU64 uSym    = 0;
+            if (iSym < pElf->cSyms)
+                uSym = kDepObjElfReadU(pElf, pElf->pbSyms + iSym * (pElf->f64Bit ? 24 : 16) + (pElf->f64Bit ? 8 : 4), cbWord);
+            pElf->iRelocHint = i + 1;
+            return (uSym + uAddend) & (cbWord == 8 ? KU64_MAX : KU64_C(0xffffffff));
+        }
+        i++;
+    }
+    return uValue;
+}
+
+
+/**
+ * Reads an unsigned integer from the DWARF data.
+ *
+ * @returns The value, 0 on overflow.
+ * @param   pCur        The cursor.
+ * @param   cb          The size of the integer, 1 thru 8.
+ */
+static KU64 kDepObjDwReadU(PKDEPDWCUR pCur, unsigned cb)
+{
+    KU64 u;
+    if ((KSIZE)(pCur->pbEnd - pCur->pb) < cb)
+    {
+        pCur->fOverflow = K_TRUE;
+        pCur->pb = pCur->pbEnd;
+        return 0;
+    }
+    u = kDepObjElfReadU(pCur->pElf, pCur->pb, cb);
+    pCur->pb += cb;
+    return u;
+}
+
+
+/**
+ * Reads an unsigned LEB128 value from the DWARF data.
+ *
+ * @returns The value, 0 on overflow.
+ * @param   pCur        The cursor.
+ */
+static KU64 kDepObjDwReadULeb128(PKDEPDWCUR pCur)
+{
+    KU64        u      = 0;
+    unsigned    cShift = 0;
+    KU8         b;
+    do
+    {
+        if (pCur->pb >= pCur->pbEnd)
+        {
+            pCur->fOverflow = K_TRUE;
+            return 0;
+        }
+        b = *pCur->pb++;
+        if (cShift < 64)
+            u |= (KU64)(b & 0x7f) << cShift;
+        cShift += 7;
+    } while (b & 0x80);
+    return u;
+}
+
+
+/**
+ * Skips bytes in the DWARF data.
+ *
+ * @param   pCur        The cursor.
+ * @param   cb          The number of bytes to skip.
+ */
+static void kDepObjDwSkip(PKDEPDWCUR pCur, KU64 cb)
+{
+    if ((KU64)(pCur->pbEnd - pCur->pb) < cb)
+    {
+        pCur->fOverflow = K_TRUE;
+        pCur->pb = pCur->pbEnd;
+    }
+    else
+        pCur->pb += (KSIZE)cb;
+}
+
+
+/**
+ * Reads an inline zero terminated string from the DWARF data.
+ *
+ * @returns Pointer to the string, NULL on overflow.
+ * @param   pCur        The cursor.
+ */
+static const char *kDepObjDwReadStr(PKDEPDWCUR pCur)
+{
+    const char *psz  = (const char *)pCur->pb;
+    const KU8  *pbNul = (const KU8 *)memchr(pCur->pb, '\0', pCur->pbEnd - pCur->pb);
+    if (!pbNul)
+    {
+        pCur->fOverflow = K_TRUE;
+        pCur->pb = pCur->pbEnd;
+        return NULL;
+    }
+    pCur->pb = pbNul + 1;
+    return psz;
+}
+
+
+/**
+ * Reads a string attribute in one of the forms used by the line number
+ * program header.
+ *
+ * @returns Pointer to the string, NULL on failure (message displayed).
+ * @param   pCur        The cursor.
+ * @param   uForm       The DW_FORM_xxx.
+ * @param   f64Dwarf    Set if 64-bit DWARF.
+ */
+static const char *kDepObjDwReadFormStr(PKDEPDWCUR pCur, KU64 uForm, KBOOL f64Dwarf)
+{
+    PKDEPELF    pElf = pCur->pElf;
+    const char *pchSect;
+    KSIZE       cbSect;
+    const KU8  *pbField;
+    KU64        off;
+
+    switch (uForm)
+    {
+        case KDEPDW_FORM_string:
+            return kDepObjDwReadStr(pCur);
+        case KDEPDW_FORM_strp:
+            pchSect = pElf->pchStr;
+            cbSect  = pElf->cbStr;
+            break;
+        case KDEPDW_FORM_line_strp:
+            pchSect = pElf->pchLineStr;
+            cbSect  = pElf->cbLineStr;
+            break;
+        default:
+            fprintf(stderr, "%s: error: Unsupported DWARF form %#" KX64_PRI " for a path.\n", argv0, uForm);
+            return NULL;
+    }
+
+    pbField = pCur->pb;
+    off = kDepObjDwReadU(pCur, f64Dwarf ? 8 : 4);
+    if (pCur->fOverflow)
+        return NULL;
+    off = kDepObjElfRelocate(pElf, pbField, off);
+    if (!pchSect)
+    {
+        fprintf(stderr, "%s: error: The DWARF string section for form %#" KX64_PRI " is missing or compressed.\n", argv0, uForm);
+        return NULL;
+    }
+    if (    off >= cbSect
+        ||  !memchr(pchSect + off, '\0', cbSect - (KSIZE)off))
+    {
+        fprintf(stderr, "%s: error: DWARF string offset %#" KX64_PRI " is out of bounds.\n", argv0, off);
+        return NULL;
+    }
+    return pchSect + off;
+}
+
+
+/**
+ * Reads an unsigned integer attribute (DW_LNCT_directory_index).
+ *
+ * @returns The value, KU64_MAX if the form isn't supported.
+ * @param   pCur        The cursor.
+ * @param   uForm       The DW_FORM_xxx.
+ */
+static KU64 kDepObjDwReadFormUInt(PKDEPDWCUR pCur, KU64 uForm)
+{
+    switch (uForm)
+    {
+        case KDEPDW_FORM_data1: return kDepObjDwReadU(pCur, 1);
+        case KDEPDW_FORM_data2: return kDepObjDwReadU(pCur, 2);
+        case KDEPDW_FORM_data4: return kDepObjDwReadU(pCur, 4);
+        case KDEPDW_FORM_data8: return kDepObjDwReadU(pCur, 8);
+        case KDEPDW_FORM_udata: return kDepObjDwReadULeb128(pCur);
+        default:
+            fprintf(stderr, "%s: error: Unsupported DWARF form %#" KX64_PRI " for a directory index.\n", argv0, uForm);
+            return KU64_MAX;
+    }
+}
+
+
+/**
+ * Skips an attribute we don't care about.
+ *
+ * @returns 0 on success, 1 if the form isn't known (message displayed).
+ * @param   pCur        The cursor.
+ * @param   uForm       The DW_FORM_xxx.
+ * @param   f64Dwarf    Set if 64-bit DWARF.
+ */
+static int kDepObjDwSkipForm(PKDEPDWCUR pCur, KU64 uForm, KBOOL f64Dwarf)
+{
+    switch (uForm)
+    {
+        case KDEPDW_FORM_flag:
+        case KDEPDW_FORM_data1:
+        case KDEPDW_FORM_strx1:         kDepObjDwSkip(pCur, 1); break;
+        case KDEPDW_FORM_data2:
+        case KDEPDW_FORM_strx2:         kDepObjDwSkip(pCur, 2); break;
+        case KDEPDW_FORM_strx3:         kDepObjDwSkip(pCur, 3); break;
+        case KDEPDW_FORM_data4:
+        case KDEPDW_FORM_strx4:         kDepObjDwSkip(pCur, 4); break;
+        case KDEPDW_FORM_data8:         kDepObjDwSkip(pCur, 8); break;
+        case KDEPDW_FORM_data16:        kDepObjDwSkip(pCur, 16); break;
+        case KDEPDW_FORM_strp:
+        case KDEPDW_FORM_line_strp:
+        case KDEPDW_FORM_sec_offset:    kDepObjDwSkip(pCur, f64Dwarf ? 8 : 4); break;
+        case KDEPDW_FORM_udata:
+        case KDEPDW_FORM_sdata:
+        case KDEPDW_FORM_strx:          kDepObjDwReadULeb128(pCur); break;
+        case KDEPDW_FORM_string:        kDepObjDwReadStr(pCur); break;
+        case KDEPDW_FORM_block1:        kDepObjDwSkip(pCur, kDepObjDwReadU(pCur, 1)); break;
+        case KDEPDW_FORM_block2:        kDepObjDwSkip(pCur, kDepObjDwReadU(pCur, 2)); break;
+        case KDEPDW_FORM_block4:        kDepObjDwSkip(pCur, kDepObjDwReadU(pCur, 4)); break;
+        case KDEPDW_FORM_block:         kDepObjDwSkip(pCur, kDepObjDwReadULeb128(pCur)); break;
+        default:
+            fprintf(stderr, "%s: error: Unknown DWARF form %#" KX64_PRI " in the line number header.\n", argv0, uForm);
+            return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Checks if a path is absolute (DOS style paths included for cross builds).
+ */
+static KBOOL kDepObjIsAbsPath(const char *pszPath)
+{
+    return pszPath[0] == '/'
+        || pszPath[0] == '\\'
+        || (pszPath[0] && pszPath[1] == ':');
+}
+
+
+/**
+ * Adds a file from a line number program header to the dependency list.
+ *
+ * @param   pszCompDir  The compilation directory, NULL if not known.
+ * @param   pszDir      The directory of the file, NULL if none.
+ * @param   pszName     The file name.
+ */
+static void kDepObjDwAddFile(const char *pszCompDir, const char *pszDir, const char *pszName)
+{
+    KSIZE   cchName = strlen(pszName);
+    KSIZE   cchDir;
+    KSIZE   cchCompDir;
+    char   *pszPath;
+    char   *psz;
+
+    if (!pszDir || !*pszDir || kDepObjIsAbsPath(pszName))
+    {
+        depAdd(pszName, cchName);
+        return;
+    }
+    if (!pszCompDir || pszCompDir == pszDir || kDepObjIsAbsPath(pszDir))
+        pszCompDir = "";
+    cchCompDir = strlen(pszCompDir);
+    cchDir = strlen(pszDir);
+
+    psz = pszPath = (char *)malloc(cchCompDir + 1 + cchDir + 1 + cchName + 1);
+    if (!pszPath)
+    {
+        fprintf(stderr, "\nOut of memory!\n\n");
+        exit(1);
+    }
+    if (cchCompDir)
+    {
+        memcpy(psz, pszCompDir, cchCompDir);
+        psz += cchCompDir;
+        *psz++ = '/';
+    }
+    memcpy(psz, pszDir, cchDir);
+    psz += cchDir;
+    *psz++ = '/';
+    memcpy(psz, pszName, cchName);
+    psz += cchName;
+    *psz = '\0';
+
+    dprintf(("dwarf file: '%s'\n", pszPath));
+    depAdd(pszPath, psz - pszPath);
+    free(pszPath);
+}
+
+
+/**
+ * Parses the directory and file tables of a DWARF 2 thru 4 line number
+ * program header.
+ *
+ * Directory index 0 is the compilation directory, which is only recorded in
+ * .debug_info, so such files are added as they are.
+ *
+ * @returns 0 on success, 1 on failure, 2 if no files were found.
+ * @param   pCur        The cursor, positioned at include_directories.
+ */
+static int kDepObjDwParseLineTablesV2(PKDEPDWCUR pCur)
+{
+    const char **papszDirs;
+    KSIZE        cDirs   = 1;
+    KSIZE        cAlloc  = 16;
+    KU32         cFiles  = 0;
+
+    papszDirs = (const char **)malloc(cAlloc * sizeof(papszDirs[0]));
+    if (!papszDirs)
+        return 1;
+    papszDirs[0] = NULL;
+
+    for (;;)
+    {
+        const char *pszDir = kDepObjDwReadStr(pCur);
+        if (!pszDir || !*pszDir)
+            break;
+        if (cDirs >= cAlloc)
+        {
+            void *pvNew = realloc(papszDirs, (cAlloc *= 2) * sizeof(papszDirs[0]));
+            if (!pvNew)
+            {
+                free(papszDirs);
+                return 1;
+            }
+            papszDirs = (const char **)pvNew;
+        }
+        papszDirs[cDirs++] = pszDir;
+    }
+
+    while (!pCur->fOverflow)
+    {
+        KU64        iDir;
+        const char *pszName = kDepObjDwReadStr(pCur);
+        if (!pszName || !*pszName)
+            break;
+        iDir = kDepObjDwReadULeb128(pCur);
+        kDepObjDwReadULeb128(pCur);     /* modification time */
+        kDepObjDwReadULeb128(pCur);     /* file size */
+        if (pCur->fOverflow)
+            break;
+        kDepObjDwAddFile(NULL, iDir < cDirs ? papszDirs[iDir] : NULL, pszName);
+        cFiles++;
+    }
+
+    free(papszDirs);
+    if (pCur->fOverflow)
+    {
+        fprintf(stderr, "%s: error: Truncated DWARF line number header.\n", argv0);
+        return 1;
+    }
+    return cFiles ? 0 : 2;
+}
+
+
+/**
+ * Parses the directory and file tables of a DWARF 5 line number program
+ * header, which are described by entry format tables.
+ *
+ * @returns 0 on success, 1 on failure, 2 if no files were found.
+ * @param   pCur        The cursor, positioned at directory_entry_format_count.
+ * @param   f64Dwarf    Set if 64-bit DWARF.
+ */
+static int kDepObjDwParseLineTablesV5(PKDEPDWCUR pCur, KBOOL f64Dwarf)
+{
+    const char **papszDirs = NULL;
+    KDEPDWCUR    DirFmt;
+    KDEPDWCUR    FileFmt;
+    KDEPDWCUR    Fmt;
+    unsigned     cFmts;
+    unsigned     iFmt;
+    KU64         cDirs;
+    KU64         cFiles;
+    KU64         i;
+    int          rc = 1;
+
+    /*
+     * The directory table.
+     */
+    cFmts = (unsigned)kDepObjDwReadU(pCur, 1);
+    DirFmt = *pCur;
+    for (iFmt = 0; iFmt < cFmts * 2; iFmt++)
+        kDepObjDwReadULeb128(pCur);
+    cDirs = kDepObjDwReadULeb128(pCur);
+    if (pCur->fOverflow || cDirs > (KU64)(pCur->pbEnd - pCur->pb))
+        goto l_truncated;
+    papszDirs = (const char **)calloc(cDirs ? (KSIZE)cDirs : 1, sizeof(papszDirs[0]));
+    if (!papszDirs)
+        return 1;
+    for (i = 0; i < cDirs; i++)
+    {
+        Fmt = DirFmt;
+        for (iFmt = 0; iFmt < cFmts; iFmt++)
+        {
+            KU64 uContent = kDepObjDwReadULeb128(&Fmt);
+            KU64 uForm    = kDepObjDwReadULeb128(&Fmt);
+            if (uContent == KDEPDW_LNCT_path)
+            {
+                papszDirs[i] = kDepObjDwReadFormStr(pCur, uForm, f64Dwarf);
+                if (!papszDirs[i])
+                    goto l_done;
+            }
+            else if (kDepObjDwSkipForm(pCur, uForm, f64Dwarf))
+                goto l_done;
+        }
+        if (pCur->fOverflow)
+            goto l_truncated;
+    }
+
+    /*
+     * The file table.
+     */
+    cFmts = (unsigned)kDepObjDwReadU(pCur, 1);
+    FileFmt = *pCur;
+    for (iFmt = 0; iFmt < cFmts * 2; iFmt++)
+        kDepObjDwReadULeb128(pCur);
+    cFiles = kDepObjDwReadULeb128(pCur);
+    if (pCur->fOverflow)
+        goto l_truncated;
+    for (i = 0; i < cFiles; i++)
+    {
+        const char *pszName = NULL;
+        KU64        iDir    = 0;
+        Fmt = FileFmt;
+        for (iFmt = 0; iFmt < cFmts; iFmt++)
+        {
+            KU64 uContent = kDepObjDwReadULeb128(&Fmt);
+            KU64 uForm    = kDepObjDwReadULeb128(&Fmt);
+            if (uContent == KDEPDW_LNCT_path)
+            {
+                pszName = kDepObjDwReadFormStr(pCur, uForm, f64Dwarf);
+                if (!pszName)
+                    goto l_done;
+            }
+            else if (uContent == KDEPDW_LNCT_directory_index)
+            {
+                iDir = kDepObjDwReadFormUInt(pCur, uForm);
+                if (iDir == KU64_MAX)
+                    goto l_done;
+            }
+            else if (kDepObjDwSkipForm(pCur, uForm, f64Dwarf))
+                goto l_done;
+        }
+        if (pCur->fOverflow)
+            goto l_truncated;
+        if (pszName && *pszName)
+            kDepObjDwAddFile(cDirs ? papszDirs[0] : NULL, iDir < cDirs ? papszDirs[iDir] : NULL, pszName);
+    }
+    rc = cFiles ? 0 : 2;
+
+l_done:
+    free(papszDirs);
+    return rc;
+
+l_truncated:
+    fprintf(stderr, "%s: error: Truncated DWARF line number header.\n", argv0);
+    goto l_done;
+}
+
+
+/**
+ * Parses one line number program unit, adding the files it lists.
+ *
+ * Only the header is parsed, the line number program itself is skipped.
+ *
+ * @returns 0 on success, 1 on failure, 2 if no files were found.
+ * @param   pElf        The ELF object with the .debug_line section set up.
+ * @param   offUnit     The offset of the unit into .debug_line.
+ * @param   poffNext    Where to return the offset of the next unit.
+ */
+static int kDepObjDwParseLineUnit(PKDEPELF pElf, KSIZE offUnit, KSIZE *poffNext)
+{
+    KDEPDWCUR   Cur;
+    KU64        cbUnit;
+    KU64        cbHdr;
+    KBOOL       f64Dwarf = K_FALSE;
+    unsigned    uVer;
+    unsigned    bOpcodeBase;
+
+    Cur.pb        = pElf->pbLine + offUnit;
+    Cur.pbEnd     = pElf->pbLine + pElf->cbLine;
+    Cur.fOverflow = K_FALSE;
+    Cur.pElf      = pElf;
+
+    cbUnit = kDepObjDwReadU(&Cur, 4);
+    if (cbUnit == KU32_C(0xffffffff))
+    {
+        f64Dwarf = K_TRUE;
+        cbUnit = kDepObjDwReadU(&Cur, 8);
+    }
+    else if (cbUnit >= KU32_C(0xfffffff0))
+    {
+        fprintf(stderr, "%s: error: Reserved DWARF unit length %#" KX64_PRI " at %#" KSIZE_PRI " in .debug_line.\n",
+                argv0, cbUnit, offUnit);
+        return 1;
+    }
+    if (Cur.fOverflow || cbUnit > (KU64)(Cur.pbEnd - Cur.pb))
+    {
+        fprintf(stderr, "%s: error: DWARF line number unit at %#" KSIZE_PRI " is too long.\n", argv0, offUnit);
+        return 1;
+    }
+    Cur.pbEnd = Cur.pb + (KSIZE)cbUnit;
+    *poffNext = Cur.pbEnd - pElf->pbLine;
+
+    uVer = (unsigned)kDepObjDwReadU(&Cur, 2);
+    if (uVer < 2 || uVer > 5)
+    {
+        fprintf(stderr, "%s: warning: Skipping DWARF line number unit at %#" KSIZE_PRI " with unsupported version %u.\n",
+                argv0, offUnit, uVer);
+        return 2;
+    }
+    if (uVer >= 5)
+        kDepObjDwSkip(&Cur, 2);         /* address_size, segment_selector_size */
+    cbHdr = kDepObjDwReadU(&Cur, f64Dwarf ? 8 : 4);
+    if (Cur.fOverflow || cbHdr > (KU64)(Cur.pbEnd - Cur.pb))
+    {
+        fprintf(stderr, "%s: error: DWARF line number header at %#" KSIZE_PRI " is too long.\n", argv0, offUnit);
+        return 1;
+    }
+    Cur.pbEnd = Cur.pb + (KSIZE)cbHdr;
+
+    /* minimum_instruction_length, [maximum_operations_per_instruction,]
+       default_is_stmt, line_base, line_range, opcode_base and the
+       standard_opcode_lengths array. */
+    kDepObjDwSkip(&Cur, uVer >= 4 ? 5 : 4);
+    bOpcodeBase = (unsigned)kDepObjDwReadU(&Cur, 1);
+    kDepObjDwSkip(&Cur, bOpcodeBase ? bOpcodeBase - 1 : 0);
+    dprintf(("line unit at %#" KSIZE_PRI ": version=%u cbUnit=%#" KX64_PRI " cbHdr=%#" KX64_PRI "\n",
+             offUnit, uVer, cbUnit, cbHdr));
+
+    if (uVer < 5)
+        return kDepObjDwParseLineTablesV2(&Cur);
+    return kDepObjDwParseLineTablesV5(&Cur, f64Dwarf);
+}
+
+
+/**
+ * Parses a .debug_line section.
+ *
+ * @returns 0 on success, 1 on failure, 2 if no dependencies was found.
+ * @param   pElf        The ELF object.
+ * @param   iSect       The section index.
+ * @param   pSect       The section.
+ */
+static int kDepObjElfParseDebugLine(PKDEPELF pElf, KU32 iSect, PKDEPELFSECT pSect)
+{
+    KDEPELFSECT Sect;
+    KU32        iRelSect;
+    KSIZE       off;
+    KSIZE       cb;
+    int         rcRet = 2;
+    int         rc;
+
+    pElf->pbLine = kDepObjElfSectData(pElf, pSect, ".debug_line", &pElf->cbLine);
+    if (!pElf->pbLine)
+        return 1;
+
+    /*
+     * Look for RELA relocations applying to the section.  (With REL the
+     * addends are stored in the section data and there is nothing to do.)
+     */
+    pElf->pbRelocs   = NULL;
+    pElf->cRelocs    = 0;
+    pElf->iRelocHint = 0;
+    pElf->pbSyms     = NULL;
+    pElf->cSyms      = 0;
+    for (iRelSect = 1; iRelSect < pElf->cShdrs; iRelSect++)
+    {
+        kDepObjElfGetSect(pElf, iRelSect, &Sect);
+        if (    Sect.uType == KDEPELF_SHT_RELA
+            &&  Sect.uInfo == iSect)
+        {
+            if (    Sect.cbEntry < (pElf->f64Bit ? 24U : 12U)
+                ||  Sect.uLink >= pElf->cShdrs)
+            {
+                fprintf(stderr, "%s: error: Bad relocation section for .debug_line.\n", argv0);
+                return 1;
+            }
+            pElf->pbRelocs = kDepObjElfSectData(pElf, &Sect, ".rela.debug_line", &cb);
+            if (!pElf->pbRelocs)
+                return 1;
+            pElf->cbReloc = (KSIZE)Sect.cbEntry;
+            pElf->cRelocs = cb / pElf->cbReloc;
+
+            kDepObjElfGetSect(pElf, Sect.uLink, &Sect);
+            if (Sect.uType == KDEPELF_SHT_SYMTAB)
+            {
+                pElf->pbSyms = kDepObjElfSectData(pElf, &Sect, ".symtab", &cb);
+                if (!pElf->pbSyms)
+                    return 1;
+                pElf->cSyms = cb / (pElf->f64Bit ? 24 : 16);
+            }
+            break;
+        }
+    }
+
+    /*
+     * Walk the line number program units.
+     */
+    off = 0;
+    while (off < pElf->cbLine)
+    {
+        KSIZE offNext = pElf->cbLine;
+        rc = kDepObjDwParseLineUnit(pElf, off, &offNext);
+        if (rc == 1)
+            return 1;
+        if (rc == 0)
+            rcRet = 0;
+        off = offNext;
+    }
+    return rcRet;
+}
+
+
+/**
+ * Parses the ELF file, collecting the files listed in the DWARF line number
+ * program headers (.debug_line).
+ *
+ * Note that compilers only list the files which contributed code or were
+ * referenced by the debug info, unless macro info is generated (gcc -g3).
+ *
+ * @returns 0 on success, 1 on failure, 2 if no dependencies was found.
+ * @param   pbFile      The start of the file.
+ * @param   cbFile      The file size.
+ */
+int kDepObjElfParse(const KU8 *pbFile, KSIZE cbFile)
+{
+    KDEPELF     Elf;
+    KDEPELFSECT Sect;
+    KU32        iSect;
+    int         rcRet = 2;
+    int         rc;
+
+    if (kDepObjElfInit(&Elf, pbFile, cbFile))
+        return 1;
+    dprintf(("ELF file! 64-bit=%d big-endian=%d cShdrs=%u\n", Elf.f64Bit, Elf.fBigEndian, Elf.cShdrs));
+
+    /*
+     * Find the string sections the DWARF 5 headers may refer to.
+     */
+    for (iSect = 1; iSect < Elf.cShdrs; iSect++)
+    {
+        const char *pszName;
+        kDepObjElfGetSect(&Elf, iSect, &Sect);
+        pszName = kDepObjElfSectName(&Elf, &Sect);
+        if (Sect.fFlags & KDEPELF_SHF_COMPRESSED)
+            continue; /* complained about when used */
+        if (!strcmp(pszName, ".debug_line_str"))
+            Elf.pchLineStr = (const char *)kDepObjElfSectData(&Elf, &Sect, pszName, &Elf.cbLineStr);
+        else if (!strcmp(pszName, ".debug_str"))
+            Elf.pchStr = (const char *)kDepObjElfSectData(&Elf, &Sect, pszName, &Elf.cbStr);
+    }
+
+    /*
+     * Parse the line number sections.
+     */
+    for (iSect = 1; iSect < Elf.cShdrs; iSect++)
+    {
+        kDepObjElfGetSect(&Elf, iSect, &Sect);
+        if (!strcmp(kDepObjElfSectName(&Elf, &Sect), ".debug_line"))
+        {
+            rc = kDepObjElfParseDebugLine(&Elf, iSect, &Sect);
+            if (rc == 1)
+                return 1;
+            if (rc == 0)
+                rcRet = 0;
+        }
+    }
+
+    if (rcRet == 2)
+        fprintf(stderr, "%s: error: No DWARF line number information found (compile with -g).\n", argv0);
+    return rcRet;
+}
+
+
 /**
  * Read the file into memory and parse it.
  */
@@ -966,9 +1966,11 @@ static int kDepObjProcessFile(FILE *pInput)
         rc = kDepObjOMFParse(pbFile, cbFile);
     else if (kDepObjCOFFTest(pbFile, cbFile))
         rc = kDepObjCOFFParse(pbFile, cbFile);
+    else if (kDepObjElfTest(pbFile, cbFile))
+        rc = kDepObjElfParse(pbFile, cbFile);
     else
     {
-        fprintf(stderr, "%s: error: Doesn't recognize the header of the OMF/COFF file.\n", argv0);
+        fprintf(stderr, "%s: error: Doesn't recognize the header of the OMF/COFF/ELF file.\n", argv0);
         rc = 1;
     }
 
@@ -979,7 +1981,7 @@ static int kDepObjProcessFile(FILE *pInput)
 
 static void usage(const char *a_argv0)
 {
-    printf("usage: %s -o <output> -t <target> [-fqs] [-e <ignore-ext>] <OMF or COFF file>\n"
+    printf("usage: %s -o <output> -t <target> [-fqs] [-e <ignore-ext>] <OMF, COFF or ELF file>\n"
            "   or: %s --help\n"
            "   or: %s --version\n",
            a_argv0, a_argv0, a_argv0);
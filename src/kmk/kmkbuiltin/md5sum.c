@@ -40,10 +40,119 @@
 #include "err.h"
 #include "kmkbuiltin.h"
 #include "../../lib/md5.h"
+#include "../../lib/sha256.h"
 #include <k/kTypes.h>
 
 /*#define MD5SUM_USE_STDIO*/
 
+/* Hash several files at once on threads, and map big files into memory. */
+#if !defined(_MSC_VER) && !defined(__OS2__) && !defined(MD5SUM_USE_STDIO)
+# define MD5SUM_WITH_THREADS
+# define MD5SUM_WITH_MMAP
+# include <pthread.h>
+# include <signal.h>
+# include <sys/mman.h>
+#endif
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/** MD5 digest size. */
+#define MD5SUM_MD5_SIZE         16
+/** SHA-256 digest size. */
+#define MD5SUM_SHA256_SIZE      32
+/** The largest digest size. */
+#define MD5SUM_MAX_DIGEST       MD5SUM_SHA256_SIZE
+/** Gets the algorithm name for a digest size. */
+#define MD5SUM_ALGO_NAME(cbDigest) ((cbDigest) == MD5SUM_SHA256_SIZE ? "SHA-256" : "MD5")
+/** Files at least this big are hashed thru a mapping. */
+#define MD5SUM_MMAP_MIN         (256*1024)
+/** The max number of hashing threads. */
+#define MD5SUM_MAX_THREADS      16
+/** The max number of files to queue up before hashing and reporting. */
+#define MD5SUM_MAX_BATCH        4096
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/**
+ * Digest calculation context.
+ */
+typedef struct MD5SUMCTX
+{
+    /** The digest size, selects the algorithm. */
+    unsigned                cbDigest;
+    union
+    {
+        struct MD5Context   Md5;
+        struct SHA256Context Sha256;
+    } u;
+} MD5SUMCTX;
+typedef MD5SUMCTX *PMD5SUMCTX;
+
+/**
+ * A file to hash and report on.
+ */
+typedef struct MD5SUMJOB
+{
+    /** The file name. */
+    const char     *pszFilename;
+    /** Heap copy of the file name to free, NULL if it's from argv. */
+    char           *pszFree;
+    /** Whether to open the file in text mode. */
+    unsigned        fText;
+    /** Whether to check against abExpected rather than print the digest. */
+    unsigned        fCheck;
+    /** Whether to be quiet. */
+    unsigned        fQuiet;
+    /** Whether to print in kBuild fetch manifest format. */
+    unsigned        fManifest;
+    /** Whether to show the progress indicator. */
+    unsigned        fProgress;
+    /** Set if the file couldn't be opened, rc is the errno then. */
+    unsigned        fOpenFailed;
+    /** Set when the hashing is done (protected by the batch mutex). */
+    unsigned        fDone;
+    /** The digest size, selects the algorithm. */
+    unsigned        cbDigest;
+    /** The list file output, NULL if none. */
+    FILE           *pOutput;
+    /** 0 on success, errno on failure. */
+    int             rc;
+    /** The file size. */
+    KU64            cbFile;
+    /** The expected digest when checking. */
+    unsigned char   abExpected[MD5SUM_MAX_DIGEST];
+    /** The calculated digest. */
+    unsigned char   abDigest[MD5SUM_MAX_DIGEST];
+} MD5SUMJOB;
+typedef MD5SUMJOB *PMD5SUMJOB;
+typedef MD5SUMJOB const *PCMD5SUMJOB;
+
+/**
+ * The files queued up for hashing.
+ *
+ * Files are reported in the order they were given, so results look the same
+ * as when hashing them one by one.
+ */
+typedef struct MD5SUMBATCH
+{
+    PMD5SUMJOB      paJobs;
+    unsigned        cJobs;
+    unsigned        cAllocated;
+    /** Set if any job wants a progress indicator, forcing inline hashing. */
+    unsigned        fInline;
+#ifdef MD5SUM_WITH_THREADS
+    /** The next job for a worker to pick up. */
+    unsigned        iNext;
+    pthread_mutex_t Mtx;
+    pthread_cond_t  CondDone;
+#endif
+} MD5SUMBATCH;
+typedef MD5SUMBATCH *PMD5SUMBATCH;
+
 
 /**
  * Prints the usage and return 1.
@@ -51,9 +160,9 @@
 static int usage(FILE *pOut)
 {
     fprintf(pOut,
-            "usage: md5sum [-bt] [-o list-file] file(s)\n"
-            "   or: md5sum [-btwq] -c list-file(s)\n"
-            "   or: md5sum [-btq] -C MD5 file\n"
+            "usage: md5sum [-bts] [-o list-file] file(s)\n"
+            "   or: md5sum [-btswq] -c list-file(s)\n"
+            "   or: md5sum [-btsq] -C MD5 file\n"
             "\n"
             " -c, --check       Check MD5 and files found in the specified list file(s).\n"
             "                   The default is to compute MD5 sums of the specified files\n"
@@ -65,6 +174,7 @@ static int usage(FILE *pOut)
             " -p, --progress    Show progress indicator on large files.\n"
             " -o, --output      Name of the output list file. Useful with -p.\n"
             " -q, --status      Be quiet.\n"
+            " -s, --sha256      Use SHA-256 rather than MD5 digests.\n"
             " -w, --warn        Ignored. Always warn, unless quiet.\n"
             " -h, --help        This usage info.\n"
             " -v, --version     Show version information and exit.\n"
@@ -76,14 +186,15 @@ static int usage(FILE *pOut)
 /**
  * Makes a string out of the given digest.
  *
- * @param   pDigest     The MD5 digest.
+ * @param   pDigest     The digest.
+ * @param   cbDigest    The digest size.
  * @param   pszDigest   Where to put the digest string. Must be able to
- *                      hold at least 33 bytes.
+ *                      hold at least cbDigest * 2 + 1 bytes.
  */
-static void digest_to_string(unsigned char pDigest[16], char *pszDigest)
+static void digest_to_string(unsigned char *pDigest, unsigned cbDigest, char *pszDigest)
 {
     unsigned i;
-    for (i = 0; i < 16; i++)
+    for (i = 0; i < cbDigest; i++)
     {
         static char s_achDigits[17] = "0123456789abcdef";
         pszDigest[i*2]     = s_achDigits[(pDigest[i] >> 4)];
@@ -94,13 +205,14 @@ static void digest_to_string(unsigned char pDigest[16], char *pszDigest)
 
 
 /**
- * Attempts to convert a string to a MD5 digest.
+ * Attempts to convert a string to a digest.
  *
  * @returns 0 on success, 1-based position of the failure first error.
  * @param   pszDigest   The string to interpret.
- * @param   pDigest     Where to put the MD5 digest.
+ * @param   pDigest     Where to put the digest.
+ * @param   cbDigest    The expected digest size.
  */
-static int string_to_digest(const char *pszDigest, unsigned char pDigest[16])
+static int string_to_digest(const char *pszDigest, unsigned char *pDigest, unsigned cbDigest)
 {
     unsigned i;
     unsigned iBase = 1;
@@ -113,8 +225,8 @@ static int string_to_digest(const char *pszDigest, unsigned char pDigest[16])
         pszDigest++, iBase++;
 
     /* convert the digits. */
-    memset(pDigest, 0, 16);
-    for (i = 0; i < 32; i++, pszDigest++)
+    memset(pDigest, 0, cbDigest);
+    for (i = 0; i < cbDigest * 2; i++, pszDigest++)
     {
         int iDigit;
         if (*pszDigest >= '0' && *pszDigest <= '9')
@@ -290,23 +402,101 @@ static KU64 size_file(void *pvFile)
 
 
 /**
- * Calculates the md5sum of the sepecified file stream.
+ * Initializes a digest context.
+ *
+ * @param   pCtx        The context.
+ * @param   cbDigest    The digest size, 16 for MD5 and 32 for SHA-256.
+ */
+static void digest_init(PMD5SUMCTX pCtx, unsigned cbDigest)
+{
+    pCtx->cbDigest = cbDigest;
+    if (cbDigest == MD5SUM_SHA256_SIZE)
+        SHA256Init(&pCtx->u.Sha256);
+    else
+        MD5Init(&pCtx->u.Md5);
+}
+
+
+/**
+ * Feeds data to a digest context.
+ *
+ * @param   pCtx        The context.
+ * @param   pv          The data.
+ * @param   cb          The number of bytes, may exceed what the digest
+ *                      functions take in one call.
+ */
+static void digest_update(PMD5SUMCTX pCtx, const void *pv, size_t cb)
+{
+    const unsigned char *pb = (const unsigned char *)pv;
+    while (cb > 0)
+    {
+        unsigned cbChunk = cb > 0x40000000 ? 0x40000000 : (unsigned)cb;
+        if (pCtx->cbDigest == MD5SUM_SHA256_SIZE)
+            SHA256Update(&pCtx->u.Sha256, pb, cbChunk);
+        else
+            MD5Update(&pCtx->u.Md5, pb, cbChunk);
+        pb += cbChunk;
+        cb -= cbChunk;
+    }
+}
+
+
+/**
+ * Completes a digest calculation.
+ *
+ * @param   pCtx        The context.
+ * @param   pDigest     Where to return the digest.
+ */
+static void digest_final(PMD5SUMCTX pCtx, unsigned char *pDigest)
+{
+    if (pCtx->cbDigest == MD5SUM_SHA256_SIZE)
+        SHA256Final(pDigest, &pCtx->u.Sha256);
+    else
+        MD5Final(pDigest, &pCtx->u.Md5);
+}
+
+
+/**
+ * Calculates the digest of the sepecified file stream.
  *
  * @returns errno on failure, 0 on success.
  * @param   pvFile      The file stream.
- * @param   pDigest     Where to store the MD5 digest.
+ * @param   pDigest     Where to store the digest.
+ * @param   cbDigest    The digest size (selects the algorithm).
  * @param   fProgress   Whether to show a progress bar.
  * @param   pcbFile     Where to return the file size. Optional.
  */
-static int calc_md5sum(void *pvFile, unsigned char pDigest[16], unsigned fProgress, KU64 *pcbFile)
+static int calc_md5sum(void *pvFile, unsigned char *pDigest, unsigned cbDigest, unsigned fProgress, KU64 *pcbFile)
 {
     int cb;
     int rc = 0;
-    struct MD5Context Ctx;
+    MD5SUMCTX Ctx;
     unsigned uPercent = 0;
     KU64 off = 0;
     KU64 const cbFile = size_file(pvFile);
 
+#ifdef MD5SUM_WITH_MMAP
+    /* Big files are cheaper to map than to copy thru a buffer. */
+    if (!fProgress && cbFile >= MD5SUM_MMAP_MIN && cbFile == (size_t)cbFile)
+    {
+        void *pvMap = mmap(NULL, (size_t)cbFile, PROT_READ, MAP_PRIVATE, *(int *)pvFile, 0);
+        if (pvMap != MAP_FAILED)
+        {
+# ifdef MADV_SEQUENTIAL
+            madvise(pvMap, (size_t)cbFile, MADV_SEQUENTIAL);
+# endif
+            digest_init(&Ctx, cbDigest);
+            digest_update(&Ctx, pvMap, (size_t)cbFile);
+            digest_final(&Ctx, pDigest);
+            munmap(pvMap, (size_t)cbFile);
+            if (pcbFile)
+                *pcbFile = cbFile;
+            return 0;
+        }
+    }
+#endif
+
+    {
     /* Get a decent sized buffer assuming we'll be spending more time reading
        from the storage than doing MD5 sums.  (2MB was choosen based on recent
        SATA storage benchmarks which used that block size for sequential
@@ -334,13 +524,13 @@ static int calc_md5sum(void *pvFile, unsigned char pDigest[16], unsigned fProgre
     if (cbFile < cbBuf * 4)
         fProgress = 0;
 
-    MD5Init(&Ctx);
+    digest_init(&Ctx, cbDigest);
     for (;;)
     {
         /* process a chunk. */
         cb = read_file(pvFile, pabBufAligned, cbBuf);
         if (cb > 0)
-            MD5Update(&Ctx, (unsigned char *)pabBufAligned, cb);
+            digest_update(&Ctx, pabBufAligned, cb);
         else if (!cb)
             break;
         else
@@ -365,7 +555,7 @@ static int calc_md5sum(void *pvFile, unsigned char pDigest[16], unsigned fProgre
             }
         }
     }
-    MD5Final(pDigest, &Ctx);
+    digest_final(&Ctx, pDigest);
 
     if (pcbFile)
         *pcbFile = off;
@@ -374,96 +564,322 @@ static int calc_md5sum(void *pvFile, unsigned char pDigest[16], unsigned fProgre
         printf("\b\b\b\b    \b\b\b\b");
 
     free(pabBuf);
+    }
     return rc;
 }
 
 
 /**
- * Checks the if the specified digest matches the digest of the file stream.
+ * Queues a file for hashing.
  *
- * @returns 0 on match, -1 on mismatch, errno value (positive) on failure.
- * @param   pvFile      The file stream.
- * @param   Digest      The MD5 digest.
- * @param   fProgress   Whether to show an progress indicator on large files.
+ * @returns Pointer to the job (zeroed except for the file name and mode),
+ *          NULL on allocation failure.
+ * @param   pBatch          The batch.
+ * @param   pszFilename     The file name.
+ * @param   fCopy           Whether to make a copy of the file name.
+ * @param   pOpts           The job options to copy (see MD5SUMJOB).
  */
-static int check_md5sum(void *pvFile, unsigned char Digest[16], unsigned fProgress)
+static PMD5SUMJOB md5sum_add_job(PMD5SUMBATCH pBatch, const char *pszFilename, int fCopy, PCMD5SUMJOB pOpts)
 {
-    unsigned char DigestFile[16];
-    int rc;
+    PMD5SUMJOB pJob;
 
-    rc = calc_md5sum(pvFile, DigestFile, fProgress, NULL);
-    if (!rc)
-        rc = memcmp(Digest, DigestFile, 16) ? -1 : 0;
-    return rc;
+    if (pBatch->cJobs >= pBatch->cAllocated)
+    {
+        unsigned   cNew = pBatch->cAllocated ? pBatch->cAllocated * 2 : 64;
+        PMD5SUMJOB paNew = (PMD5SUMJOB)realloc(pBatch->paJobs, cNew * sizeof(paNew[0]));
+        if (!paNew)
+            return NULL;
+        pBatch->paJobs = paNew;
+        pBatch->cAllocated = cNew;
+    }
+
+    pJob = &pBatch->paJobs[pBatch->cJobs];
+    *pJob = *pOpts;
+    pJob->pszFree = NULL;
+    if (fCopy)
+    {
+        pJob->pszFree = strdup(pszFilename);
+        if (!pJob->pszFree)
+            return NULL;
+        pszFilename = pJob->pszFree;
+    }
+    pJob->pszFilename = pszFilename;
+    pBatch->cJobs++;
+    if (pJob->fProgress)
+        pBatch->fInline = 1;
+    return pJob;
 }
 
 
 /**
- * Checks if the specified file matches the given MD5 digest.
+ * Opens and hashes the file of a job.
  *
- * @returns 0 if it matches, 1 if it doesn't or an error occurs.
- * @param   pszFilename The name of the file to check.
- * @param   pszDigest   The MD5 digest string.
- * @param   fText       Whether to open the file in text or binary mode.
- * @param   fQuiet      Whether to go about this in a quiet fashion or not.
- * @param   fProgress   Whether to show an progress indicator on large files.
+ * @param   pJob        The job.
+ * @param   fInline     Set if we're on the main thread and reporting right
+ *                      after, clear on a worker thread (no output).
  */
-static int check_one_file(const char *pszFilename, const char *pszDigest, unsigned fText, unsigned fQuiet, unsigned fProgress)
+static void md5sum_job_hash(PMD5SUMJOB pJob, unsigned fInline)
 {
-    unsigned char Digest[16];
-    int rc;
+    unsigned const fProgress = fInline && pJob->fProgress;
+    void *pvFile = open_file(pJob->pszFilename, pJob->fText);
+    if (pvFile)
+    {
+        if (pJob->fCheck ? fInline && !pJob->fQuiet : fProgress && pJob->pOutput)
+            fprintf(stdout, "%s: ", pJob->pszFilename);
 
-    rc = string_to_digest(pszDigest, Digest);
-    if (!rc)
+        pJob->rc = calc_md5sum(pvFile, pJob->abDigest, pJob->cbDigest, fProgress, &pJob->cbFile);
+        close_file(pvFile);
+
+        if (!pJob->fCheck && fProgress && pJob->pOutput)
+        {
+            size_t cch = strlen(pJob->pszFilename) + 2;
+            while (cch-- > 0)
+                fputc('\b', stdout);
+        }
+    }
+    else
+    {
+        pJob->fOpenFailed = 1;
+        pJob->rc = errno;
+    }
+}
+
+
+/**
+ * Reports the outcome of a job.
+ *
+ * @returns 0 on success, 1 on failure or mismatch.
+ * @param   pJob        The job.
+ * @param   fInline     Whether md5sum_job_hash was called inline (the
+ *                      "file: " prefix has been printed then).
+ */
+static int md5sum_job_report(PMD5SUMJOB pJob, unsigned fInline)
+{
+    int rc = pJob->rc;
+
+    if (pJob->fOpenFailed)
     {
-        void *pvFile;
+        if (!pJob->fQuiet)
+            errx(1, "Failed to open '%s': %s", pJob->pszFilename, strerror(rc));
+        return 1;
+    }
 
-        pvFile = open_file(pszFilename, fText);
-        if (pvFile)
+    if (pJob->fCheck)
+    {
+        if (!rc)
+            rc = memcmp(pJob->abExpected, pJob->abDigest, pJob->cbDigest) ? -1 : 0;
+        if (!pJob->fQuiet)
         {
-            if (!fQuiet)
-                fprintf(stdout, "%s: ", pszFilename);
-            rc = check_md5sum(pvFile, Digest, fProgress);
-            close_file(pvFile);
-            if (!fQuiet)
-            {
-                fprintf(stdout, "%s\n", !rc ? "OK" : rc < 0 ? "FAILURE" : "ERROR");
+            if (!fInline)
+                fprintf(stdout, "%s: ", pJob->pszFilename);
+            fprintf(stdout, "%s\n", !rc ? "OK" : rc < 0 ? "FAILURE" : "ERROR");
+            if (fInline)
                 fflush(stdout);
-                if (rc > 0)
-                    errx(1, "Error reading '%s': %s", pszFilename, strerror(rc));
-            }
-            if (rc)
-                rc = 1;
+            if (rc > 0)
+                errx(1, "Error reading '%s': %s", pJob->pszFilename, strerror(rc));
+        }
+        return rc ? 1 : 0;
+    }
+
+    if (!rc)
+    {
+        char szDigest[MD5SUM_MAX_DIGEST * 2 + 4];
+        digest_to_string(pJob->abDigest, pJob->cbDigest, szDigest);
+        if (!pJob->fManifest)
+        {
+            if (pJob->pOutput)
+                fprintf(pJob->pOutput, "%s %s%s\n", szDigest, pJob->fText ? "" : "*", pJob->pszFilename);
+            fprintf(stdout, "%s %s%s\n", szDigest, pJob->fText ? "" : "*", pJob->pszFilename);
         }
         else
         {
-            if (!fQuiet)
-                errx(1, "Failed to open '%s': %s", pszFilename, strerror(errno));
-            rc = 1;
+            const char *pszVar = pJob->cbDigest == MD5SUM_SHA256_SIZE ? "SHA256" : "MD5 ";
+            if (pJob->pOutput)
+                fprintf(pJob->pOutput, "%s_SIZE := %" KU64_PRI "\n%s_%s := %s\n", pJob->pszFilename, pJob->cbFile,
+                        pJob->pszFilename, pszVar, szDigest);
+            fprintf(stdout, "%s_SIZE := %" KU64_PRI "\n%s_%s := %s\n", pJob->pszFilename, pJob->cbFile,
+                    pJob->pszFilename, pszVar, szDigest);
         }
+        if (fInline)
+        {
+            if (pJob->pOutput)
+                fflush(pJob->pOutput);
+            fflush(stdout);
+        }
+        return 0;
     }
-    else
+
+    if (!pJob->fQuiet)
+        errx(1, "Failed to open '%s': %s", pJob->pszFilename, strerror(rc));
+    return 1;
+}
+
+
+#ifdef MD5SUM_WITH_THREADS
+/**
+ * Hashing thread.
+ */
+static void *md5sum_worker(void *pvUser)
+{
+    PMD5SUMBATCH pBatch = (PMD5SUMBATCH)pvUser;
+
+    pthread_mutex_lock(&pBatch->Mtx);
+    while (pBatch->iNext < pBatch->cJobs)
     {
-        errx(1, "Malformed MD5 digest '%s'!", pszDigest);
-        errx(1, "                      %*s^", rc - 1, "");
-        rc = 1;
+        PMD5SUMJOB pJob = &pBatch->paJobs[pBatch->iNext++];
+        pthread_mutex_unlock(&pBatch->Mtx);
+
+        md5sum_job_hash(pJob, 0 /*fInline*/);
+
+        pthread_mutex_lock(&pBatch->Mtx);
+        pJob->fDone = 1;
+        pthread_cond_broadcast(&pBatch->CondDone);
     }
+    pthread_mutex_unlock(&pBatch->Mtx);
+    return NULL;
+}
+#endif
+
+
+/**
+ * Hashes and reports the queued files, in order.
+ *
+ * Unless a progress indicator was requested, the files are hashed on a
+ * couple of threads while the calling thread reports them as they
+ * complete.
+ *
+ * @returns 0 if all went fine, 1 if one or more failed or mismatched.
+ * @param   pBatch      The batch.  Empty on return.
+ */
+static int md5sum_flush(PMD5SUMBATCH pBatch)
+{
+    int rc = 0;
+    unsigned i;
+    unsigned fDone = 0;
 
+#ifdef MD5SUM_WITH_THREADS
+    if (pBatch->cJobs > 1 && !pBatch->fInline)
+    {
+        pthread_t aThreads[MD5SUM_MAX_THREADS];
+        unsigned  cThreads = 0;
+        long      cMax = sysconf(_SC_NPROCESSORS_ONLN);
+        sigset_t  SigSetAll, SigSetOld;
+
+        if (cMax > MD5SUM_MAX_THREADS)
+            cMax = MD5SUM_MAX_THREADS;
+        if (cMax > (long)pBatch->cJobs)
+            cMax = pBatch->cJobs;
+
+        pBatch->iNext = 0;
+        pthread_mutex_init(&pBatch->Mtx, NULL);
+        pthread_cond_init(&pBatch->CondDone, NULL);
+
+        /* Keep signals on the main thread (kmk). */
+        sigfillset(&SigSetAll);
+        pthread_sigmask(SIG_BLOCK, &SigSetAll, &SigSetOld);
+        while ((long)cThreads < cMax)
+        {
+            if (pthread_create(&aThreads[cThreads], NULL, md5sum_worker, pBatch) != 0)
+                break;
+            cThreads++;
+        }
+        pthread_sigmask(SIG_SETMASK, &SigSetOld, NULL);
+
+        if (cThreads > 0)
+        {
+            for (i = 0; i < pBatch->cJobs; i++)
+            {
+                pthread_mutex_lock(&pBatch->Mtx);
+                while (!pBatch->paJobs[i].fDone)
+                    pthread_cond_wait(&pBatch->CondDone, &pBatch->Mtx);
+                pthread_mutex_unlock(&pBatch->Mtx);
+                rc |= md5sum_job_report(&pBatch->paJobs[i], 0 /*fInline*/);
+            }
+            while (cThreads > 0)
+                pthread_join(aThreads[--cThreads], NULL);
+            for (i = 0; i < pBatch->cJobs; i++)
+                if (pBatch->paJobs[i].pOutput)
+                    fflush(pBatch->paJobs[i].pOutput);
+            fflush(stdout);
+            fDone = 1;
+        }
+
+        pthread_cond_destroy(&pBatch->CondDone);
+        pthread_mutex_destroy(&pBatch->Mtx);
+    }
+#endif
+
+    if (!fDone)
+        for (i = 0; i < pBatch->cJobs; i++)
+        {
+            md5sum_job_hash(&pBatch->paJobs[i], 1 /*fInline*/);
+            rc |= md5sum_job_report(&pBatch->paJobs[i], 1 /*fInline*/);
+        }
+
+    for (i = 0; i < pBatch->cJobs; i++)
+        free(pBatch->paJobs[i].pszFree);
+    pBatch->cJobs = 0;
+    pBatch->fInline = 0;
     return rc;
 }
 
 
 /**
- * Checks the specified md5.lst file.
+ * Flushes the batch if it's grown big.
+ *
+ * @returns md5sum_flush status or 0.
+ * @param   pBatch      The batch.
+ */
+static int md5sum_maybe_flush(PMD5SUMBATCH pBatch)
+{
+    return pBatch->cJobs >= MD5SUM_MAX_BATCH ? md5sum_flush(pBatch) : 0;
+}
+
+
+/**
+ * Queues checking if the specified file matches the given digest.
+ *
+ * @returns 0 if queued, 1 on malformed digest or other failure.
+ * @param   pBatch      The batch to add it to.
+ * @param   pszFilename The name of the file to check.
+ * @param   pszDigest   The digest string.
+ * @param   pOpts       The job options.
+ */
+static int check_one_file(PMD5SUMBATCH pBatch, const char *pszFilename, const char *pszDigest, PCMD5SUMJOB pOpts)
+{
+    unsigned char Digest[MD5SUM_MAX_DIGEST];
+    PMD5SUMJOB pJob;
+    int rc;
+
+    rc = string_to_digest(pszDigest, Digest, pOpts->cbDigest);
+    if (rc)
+    {
+        const char *pszAlgo = MD5SUM_ALGO_NAME(pOpts->cbDigest);
+        errx(1, "Malformed %s digest '%s'!", pszAlgo, pszDigest);
+        errx(1, "%*s^", (int)(sizeof("Malformed  digest '") - 1 + strlen(pszAlgo)) + rc - 1, "");
+        return 1;
+    }
+
+    pJob = md5sum_add_job(pBatch, pszFilename, 0 /*fCopy*/, pOpts);
+    if (!pJob)
+        return errx(1, "Out of memory!");
+    pJob->fCheck = 1;
+    memcpy(pJob->abExpected, Digest, sizeof(Digest));
+    return md5sum_maybe_flush(pBatch);
+}
+
+
+/**
+ * Queues checking the files in the specified md5.lst file.
  *
  * @returns 0 if all checks out file, 1 if one or more fails or there are read errors.
+ * @param   pBatch          The batch to add the files to.
  * @param   pszFilename     The name of the file.
- * @param   fText           The default mode, text or binary. Only used when fBinaryTextOpt is true.
  * @param   fBinaryTextOpt  Whether a -b or -t option was specified and should be used.
- * @param   fQuiet          Whether to be quiet.
- * @param   fProgress   Whether to show an progress indicator on large files.
+ * @param   pOpts           The job options.  fText is the default mode, only
+ *                          used when fBinaryTextOpt is true.
  */
-static int check_files(const char *pszFilename, int fText, int fBinaryTextOpt, int fQuiet, unsigned fProgress)
+static int check_files(PMD5SUMBATCH pBatch, const char *pszFilename, int fBinaryTextOpt, PCMD5SUMJOB pOpts)
 {
     int rc = 0;
     FILE *pFile;
@@ -513,7 +929,7 @@ static int check_files(const char *pszFilename, int fText, int fBinaryTextOpt, i
 
                 /* check for binary asterix */
                 if (*psz != '*')
-                    fLineText = fBinaryTextOpt ? fText : 0;
+                    fLineText = fBinaryTextOpt ? pOpts->fText : 0;
                 else
                 {
                     fLineText = 0;
@@ -521,51 +937,41 @@ static int check_files(const char *pszFilename, int fText, int fBinaryTextOpt, i
                 }
                 if (*psz)
                 {
-                    unsigned char Digest[16];
+                    unsigned char Digest[MD5SUM_MAX_DIGEST];
 
                     /* the rest is filename. */
                     pszFilename = psz;
 
                     /*
-                     * Do the job.
+                     * Queue the job.
                      */
-                    rc2 = string_to_digest(pszDigest, Digest);
+                    rc2 = string_to_digest(pszDigest, Digest, pOpts->cbDigest);
                     if (!rc2)
                     {
-                        void *pvFile = open_file(pszFilename, fLineText);
-                        if (pvFile)
+                        PMD5SUMJOB pJob = md5sum_add_job(pBatch, pszFilename, 1 /*fCopy*/, pOpts);
+                        if (pJob)
                         {
-                            if (!fQuiet)
-                                fprintf(stdout, "%s: ", pszFilename);
-                            rc2 = check_md5sum(pvFile, Digest, fProgress);
-                            close_file(pvFile);
-                            if (!fQuiet)
-                            {
-                                fprintf(stdout, "%s\n", !rc2 ? "OK" : rc2 < 0 ? "FAILURE" : "ERROR");
-                                fflush(stdout);
-                                if (rc2 > 0)
-                                    errx(1, "Error reading '%s': %s", pszFilename, strerror(rc2));
-                            }
-                            if (rc2)
-                                rc = 1;
+                            pJob->fText = fLineText;
+                            pJob->fCheck = 1;
+                            memcpy(pJob->abExpected, Digest, sizeof(Digest));
+                            rc |= md5sum_maybe_flush(pBatch);
                         }
                         else
                         {
-                            if (!fQuiet)
-                                errx(1, "Failed to open '%s': %s", pszFilename, strerror(errno));
-                            rc = 1;
+                            rc = errx(1, "Out of memory!");
+                            break;
                         }
                     }
-                    else if (!fQuiet)
+                    else if (!pOpts->fQuiet)
                     {
                         errx(1, "%s (%d): Ignoring malformed digest '%s' (digest)", pszFilename, iLine, pszDigest);
                         errx(1, "%s (%d):                            %*s^", pszFilename, iLine, rc2 - 1, "");
                     }
                 }
-                else if (!fQuiet)
+                else if (!pOpts->fQuiet)
                     errx(1, "%s (%d): Ignoring malformed line!", pszFilename, iLine);
             }
-            else if (!fQuiet)
+            else if (!pOpts->fQuiet)
                 errx(1, "%s (%d): Ignoring malformed line!", pszFilename, iLine);
         } /* while more lines */
 
@@ -581,83 +987,6 @@ static int check_files(const char *pszFilename, int fText, int fBinaryTextOpt, i
 }
 
 
-/**
- * Calculates the MD5 sum for one file and prints it.
- *
- * @returns 0 on success, 1 on any kind of failure.
- * @param   pszFilename     The file to process.
- * @param   fText           The mode to open the file in.
- * @param   fQuiet          Whether to be quiet or verbose about errors.
- * @param   fManifest       Whether to format the output like a fetch manifest.
- * @param   fProgress       Whether to show an progress indicator on large files.
- * @param   pOutput         Where to write the list. Progress is always written to stdout.
- */
-static int md5sum_file(const char *pszFilename, unsigned fText, unsigned fQuiet, unsigned fProgress,
-                       unsigned fManifest, FILE *pOutput)
-{
-    int rc;
-    void *pvFile;
-
-    /*
-     * Calculate and print the MD5 sum for one file.
-     */
-    pvFile = open_file(pszFilename, fText);
-    if (pvFile)
-    {
-        unsigned char Digest[16];
-        KU64 cbFile = 0;
-
-        if (fProgress && pOutput)
-            fprintf(stdout, "%s: ", pszFilename);
-
-        rc = calc_md5sum(pvFile, Digest, fProgress, &cbFile);
-        close_file(pvFile);
-
-        if (fProgress && pOutput)
-        {
-            size_t cch = strlen(pszFilename) + 2;
-            while (cch-- > 0)
-                fputc('\b', stdout);
-        }
-
-        if (!rc)
-        {
-            char szDigest[36];
-            digest_to_string(Digest, szDigest);
-            if (!fManifest)
-            {
-                if (pOutput)
-                    fprintf(pOutput, "%s %s%s\n", szDigest, fText ? "" : "*", pszFilename);
-                fprintf(stdout, "%s %s%s\n", szDigest, fText ? "" : "*", pszFilename);
-            }
-            else
-            {
-                if (pOutput)
-                    fprintf(pOutput, "%s_SIZE := %" KU64_PRI "\n%s_MD5  := %s\n", pszFilename, cbFile, pszFilename, szDigest);
-                fprintf(stdout, "%s_SIZE := %" KU64_PRI "\n%s_MD5  := %s\n", pszFilename, cbFile, pszFilename, szDigest);
-            }
-            if (pOutput)
-                fflush(pOutput);
-            fflush(stdout);
-        }
-        else
-        {
-            if (!fQuiet)
-                errx(1, "Failed to open '%s': %s", pszFilename, strerror(rc));
-            rc = 1;
-        }
-    }
-    else
-    {
-        if (!fQuiet)
-            errx(1, "Failed to open '%s': %s", pszFilename, strerror(errno));
-        rc = 1;
-    }
-    return rc;
-}
-
-
-
 /**
  * md5sum, calculates and checks the md5sum of files.
  * Somewhat similar to the GNU coreutil md5sum command.
@@ -673,10 +1002,15 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
     int fManifest  = 0;
     int fProgress = 0;
     int fNoMoreOptions = 0;
+    unsigned cbDigest = MD5SUM_MD5_SIZE;
     const char *pszOutput = NULL;
     FILE *pOutput = NULL;
+    MD5SUMBATCH Batch;
+    MD5SUMJOB Opts;
 
     g_progname = argv[0];
+    memset(&Batch, 0, sizeof(Batch));
+    memset(&Opts, 0, sizeof(Opts));
 
     /*
      * Print usage if no arguments.
@@ -716,6 +1050,8 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
                     psz = "p";
                 else if (!strcmp(psz, "-status"))
                     psz = "q";
+                else if (!strcmp(psz, "-sha256"))
+                    psz = "s";
                 else if (!strcmp(psz, "-warn"))
                     psz = "w";
                 else if (!strcmp(psz, "-help"))
@@ -755,15 +1091,23 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
                         fQuiet = 1;
                         break;
 
+                    case 's':
+                        cbDigest = MD5SUM_SHA256_SIZE;
+                        break;
+
                     case 'w':
                         /* ignored */
                         break;
 
                     case 'h':
+                        md5sum_flush(&Batch);
+                        free(Batch.paJobs);
                         usage(stdout);
                         return 0;
 
                     case 'v':
+                        md5sum_flush(&Batch);
+                        free(Batch.paJobs);
                         return kbuild_version(argv[0]);
 
                     /*
@@ -781,6 +1125,8 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
                         else
                         {
                             errx(1, "'-C' is missing the MD5 sum!");
+                            md5sum_flush(&Batch);
+                            free(Batch.paJobs);
                             return 1;
                         }
                         if (i + 1 < argc)
@@ -788,10 +1134,18 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
                         else
                         {
                             errx(1, "'-C' is missing the filename!");
+                            md5sum_flush(&Batch);
+                            free(Batch.paJobs);
                             return 1;
                         }
 
-                        rc |= check_one_file(pszFilename, pszDigest, fText, fQuiet, fProgress && !fQuiet);
+                        Opts.fText     = fText;
+                        Opts.fQuiet    = fQuiet;
+                        Opts.fManifest = fManifest;
+                        Opts.fProgress = fProgress && !fQuiet;
+                        Opts.cbDigest  = cbDigest;
+                        Opts.pOutput   = NULL;
+                        rc |= check_one_file(&Batch, pszFilename, pszDigest, &Opts);
                         psz = "\0";
                         break;
                     }
@@ -804,6 +1158,8 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
                         if (fChecking)
                         {
                             errx(1, "'-o' cannot be used with -c or -C!");
+                            md5sum_flush(&Batch);
+                            free(Batch.paJobs);
                             return 1;
                         }
 
@@ -814,6 +1170,8 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
                         else
                         {
                             errx(1, "'-o' is missing the file name!");
+                            md5sum_flush(&Batch);
+                            free(Batch.paJobs);
                             return 1;
                         }
 
@@ -823,19 +1181,34 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
 
                     default:
                         errx(1, "Invalid option '%c'! (%s)", *psz, argv[i]);
+                        md5sum_flush(&Batch);
+                        free(Batch.paJobs);
                         return usage(stderr);
                 }
             } while (*++psz);
         }
         else if (fChecking)
-            rc |= check_files(argv[i], fText, fBinaryTextOpt, fQuiet, fProgress && !fQuiet);
+        {
+            Opts.fText     = fText;
+            Opts.fQuiet    = fQuiet;
+            Opts.fManifest = fManifest;
+            Opts.fProgress = fProgress && !fQuiet;
+            Opts.cbDigest  = cbDigest;
+            Opts.pOutput   = NULL;
+            rc |= check_files(&Batch, argv[i], fBinaryTextOpt, &Opts);
+        }
         else
         {
+            PMD5SUMJOB pJob;
+
             /* lazily open the output if specified. */
             if (pszOutput)
             {
                 if (pOutput)
+                {
+                    rc |= md5sum_flush(&Batch);
                     fclose(pOutput);
+                }
                 pOutput = fopen(pszOutput, "w");
                 if (!pOutput)
                 {
@@ -845,13 +1218,24 @@ int kmk_builtin_md5sum(int argc, char **argv, char **envp)
                 pszOutput = NULL;
             }
 
-            rc |= md5sum_file(argv[i], fText, fQuiet, fProgress && !fQuiet && !fManifest, fManifest, pOutput);
+            Opts.fText     = fText;
+            Opts.fQuiet    = fQuiet;
+            Opts.fManifest = fManifest;
+            Opts.fProgress = fProgress && !fQuiet && !fManifest;
+            Opts.cbDigest  = cbDigest;
+            Opts.pOutput   = pOutput;
+            pJob = md5sum_add_job(&Batch, argv[i], 0 /*fCopy*/, &Opts);
+            if (pJob)
+                rc |= md5sum_maybe_flush(&Batch);
+            else
+                rc = errx(1, "Out of memory!");
         }
         i++;
     }
 
+    rc |= md5sum_flush(&Batch);
+    free(Batch.paJobs);
     if (pOutput)
         fclose(pOutput);
     return rc;
 }
-
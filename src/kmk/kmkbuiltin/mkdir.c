@@ -70,6 +70,11 @@ __FBSDID("$FreeBSD: src/bin/mkdir/mkdir.c,v 1.28 2004/04/06 20:06:48 markm Exp $
 #endif
 #include "kmkbuiltin.h"
 
+#ifdef KMK
+/** The max path length we bother looking up in the cache. */
+# define MKDIR_CACHE_MAX_PATH	4096
+#endif
+
 
 static int vflag;
 static struct option long_options[] =
@@ -82,6 +87,7 @@ static struct option long_options[] =
 
 extern void * bsd_setmode(const char *p);
 extern mode_t bsd_getmode(const void *bbox, mode_t omode);
+extern mode_t bsd_getumask(void);
 
 static int	build(char *, mode_t);
 static int	usage(FILE *);
@@ -152,8 +158,16 @@ kmk_builtin_mkdir(int argc, char *argv[], char **envp)
 			else
                                 warn("mkdir: %s", *argv);
 			success = 0;
-		} else if (vflag)
-			(void)printf("%s\n", *argv);
+		} else {
+#ifdef KMK
+			char szAbs[MKDIR_CACHE_MAX_PATH];
+			size_t cchAbs = kBuiltinMkDirCacheNormalize(*argv, szAbs, sizeof(szAbs));
+			if (cchAbs)
+				kBuiltinMkDirCacheAdd(szAbs, cchAbs);
+#endif
+			if (vflag)
+				(void)printf("%s\n", *argv);
+		}
 
 		if (!success)
 			exitval = 1;
@@ -179,8 +193,43 @@ build(char *path, mode_t omode)
 	mode_t numask, oumask;
 	int first, last, retval;
 	char *p;
+	size_t len;
+#ifdef KMK
+	char szAbs[MKDIR_CACHE_MAX_PATH];
+	size_t cchAbs, cchKnown = 0;
 
-	const size_t len = strlen(path);
+	/*
+	 * kmk: Nothing to do if the directory is known to exist.  Otherwise,
+	 * unless verbose, start the walk below the deepest parent known to
+	 * exist (using the absolute path).  A hit costs a stat, since the
+	 * directory may have been removed behind our back (rm -rf in a shell,
+	 * a sub-kmk), in which case the cache is dropped and we do the full
+	 * walk.
+	 */
+	cchAbs = kBuiltinMkDirCacheNormalize(path, szAbs, sizeof(szAbs));
+	if (cchAbs) {
+		if (kBuiltinMkDirCacheLookup(szAbs, cchAbs)) {
+			if (stat(szAbs, &sb) == 0 && S_ISDIR(sb.st_mode))
+				return 0;
+			kBuiltinMkDirCacheInvalidate();
+		} else if (!vflag) {
+			size_t off = cchAbs;
+			while (off-- > 1)
+				if (szAbs[off] == '/' && kBuiltinMkDirCacheLookup(szAbs, off)) {
+					szAbs[off] = '\0';
+					if (stat(szAbs, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+						cchKnown = off;
+						path = szAbs;
+					} else
+						kBuiltinMkDirCacheInvalidate();
+					szAbs[off] = '/';
+					break;
+				}
+		}
+	}
+#endif
+
+	len = strlen(path);
 	p = alloca(len + 1);
 	path = memcpy(p, path, len + 1);
 
@@ -194,7 +243,7 @@ build(char *path, mode_t omode)
 #endif
 
 	p = path;
-	oumask = 0;
+	oumask = numask = 0;
 	retval = 0;
 #if defined(_MSC_VER) || defined(__EMX__)
 	if (    (    (p[0] >= 'A' && p[0] <= 'Z')
@@ -217,6 +266,10 @@ build(char *path, mode_t omode)
 #endif
 	if (p[0] == '/')		/* Skip leading '/'. */
 		++p;
+#ifdef KMK
+	if (cchKnown)
+		p = path + cchKnown + 1;
+#endif
 	for (first = 1, last = 0; !last ; ++p) {
 		if (p[0] == '\0')
 			last = 1;
@@ -235,16 +288,16 @@ build(char *path, mode_t omode)
 			 * mkdir -p -m $(umask -S),u+wx $(dirname dir) &&
 			 *    mkdir [-m mode] dir
 			 *
-			 * We change the user's umask and then restore it,
-			 * instead of doing chmod's.
+			 * kmk: We don't change the user's umask and restore it,
+			 * as we may be running on the builtin worker thread while
+			 * the main thread spawns processes that would inherit it.
+			 * Instead intermediate directories are chmod'ed if the
+			 * umask denies the owner write or search permission.
 			 */
-			oumask = umask(0);
+			oumask = bsd_getumask();
 			numask = oumask & ~(S_IWUSR | S_IXUSR);
-			(void)umask(numask);
 			first = 0;
 		}
-		if (last)
-			(void)umask(oumask);
 		if (mkdir(path, last ? omode : S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
 			if (errno == EEXIST || errno == EISDIR
 			    || errno == ENOSYS  /* (solaris crap) */
@@ -267,13 +320,29 @@ build(char *path, mode_t omode)
 				retval = 1;
 				break;
 			}
-		} else if (vflag)
-			printf("%s\n", path);
+		} else {
+			if (!last && numask != oumask
+			    && chmod(path, (S_IRWXU | S_IRWXG | S_IRWXO) & ~numask) < 0) {
+				warn("chmod: %s", path);
+				retval = 1;
+				break;
+			}
+			if (vflag)
+				printf("%s\n", path);
+		}
 		if (!last)
 		    *p = '/';
 	}
-	if (!first && !last)
-		(void)umask(oumask);
+#ifdef KMK
+	/* kmk: Remember the directory and its parents. */
+	if (!retval && cchAbs) {
+		size_t off;
+		for (off = cchKnown + 1; off < cchAbs; off++)
+			if (szAbs[off] == '/')
+				kBuiltinMkDirCacheAdd(szAbs, off);
+		kBuiltinMkDirCacheAdd(szAbs, cchAbs);
+	}
+#endif
 	return (retval);
 }
 
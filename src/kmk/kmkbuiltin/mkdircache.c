@@ -0,0 +1,295 @@
+/* $Id$ */
+/** @file
+ * Cache of directories known to exist, for kmk_builtin_mkdir -p.
+ *
+ * Every compile rule tends to do 'mkdir -p' on its output directory, and
+ * with a deep output tree each of those costs a mkdir and a stat for every
+ * path component.  Once a directory has been created or found to exist, it
+ * is entered into this cache together with all its parents, so the next
+ * 'mkdir -p' on it or a sibling only has to deal with what's new.
+ *
+ * The cache only lives for the kmk process and uses the same open addressing
+ * hash table code (hash.c) as dir.c.  It is flushed entirely when
+ * kmk_builtin_rm, kmk_builtin_rmdir or kmk_builtin_mv remove or move away
+ * a directory, and by kmk_builtin_dircache / $(dircache-ctl invalidate).
+ * Since directories may also be removed by external commands, a hit is
+ * confirmed with a stat() of the directory by the caller.
+ *
+ * The builtins using the cache may run on the builtin worker thread while
+ * the main thread invalidates it, so all access is serialized by a lock.
+ */
+
+/*
+ * Copyright (c) 2026 knut st. osmundsen <bird-kBuild-spamx@anduin.net>
+ *
+ * This file is part of kBuild.
+ *
+ * kBuild is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * kBuild is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with kBuild.  If not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/*******************************************************************************
+*   Header Files                                                               *
+*******************************************************************************/
+#include "make.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+# include <direct.h>
+# include "mscfakes.h"
+#else
+# include <unistd.h>
+#endif
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+# include <pthread.h>
+#endif
+#include "hash.h"
+#include "kmkbuiltin.h"
+
+
+/*******************************************************************************
+*   Defined Constants And Macros                                               *
+*******************************************************************************/
+/** Checks for a path separator. */
+#if defined(_MSC_VER) || defined(__EMX__)
+# define MKDIRCACHE_IS_SLASH(a_ch)  ((a_ch) == '/' || (a_ch) == '\\')
+#else
+# define MKDIRCACHE_IS_SLASH(a_ch)  ((a_ch) == '/')
+#endif
+
+/** @def MKDIRCACHE_LOCK
+ * Enters the cache lock. */
+/** @def MKDIRCACHE_UNLOCK
+ * Leaves the cache lock. */
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+# define MKDIRCACHE_LOCK()          pthread_mutex_lock(&g_MkDirCacheMtx)
+# define MKDIRCACHE_UNLOCK()        pthread_mutex_unlock(&g_MkDirCacheMtx)
+#else
+# define MKDIRCACHE_LOCK()          do { } while (0)
+# define MKDIRCACHE_UNLOCK()        do { } while (0)
+#endif
+
+
+/*******************************************************************************
+*   Structures and Typedefs                                                    *
+*******************************************************************************/
+/**
+ * A cache entry, also used as lookup key.
+ */
+typedef struct MKDIRCACHEENTRY
+{
+    /** The path length. */
+    size_t                  cchPath;
+    /** The path, szPath for entries in the table.  Not necessarily
+     * terminated for lookup keys. */
+    const char             *pchPath;
+    /** The absolute normalized path. */
+    char                    szPath[1];
+} MKDIRCACHEENTRY;
+typedef MKDIRCACHEENTRY *PMKDIRCACHEENTRY;
+typedef const MKDIRCACHEENTRY *PCMKDIRCACHEENTRY;
+
+
+/*******************************************************************************
+*   Global Variables                                                           *
+*******************************************************************************/
+/** The directories known to exist, MKDIRCACHEENTRY items. */
+static struct hash_table    g_MkDirCache;
+/** Set when g_MkDirCache has been initialized. */
+static int                  g_fMkDirCacheInitialized = 0;
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+/** Protects the cache. */
+static pthread_mutex_t      g_MkDirCacheMtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static unsigned long mkdir_cache_hash_1(const void *pvKey)
+{
+    PCMKDIRCACHEENTRY pKey = (PCMKDIRCACHEENTRY)pvKey;
+    return_STRING_N_HASH_1(pKey->pchPath, pKey->cchPath);
+}
+
+static unsigned long mkdir_cache_hash_2(const void *pvKey)
+{
+    PCMKDIRCACHEENTRY pKey = (PCMKDIRCACHEENTRY)pvKey;
+    return_STRING_N_HASH_2(pKey->pchPath, pKey->cchPath);
+}
+
+static int mkdir_cache_hash_cmp(const void *pvKey1, const void *pvKey2)
+{
+    PCMKDIRCACHEENTRY pKey1 = (PCMKDIRCACHEENTRY)pvKey1;
+    PCMKDIRCACHEENTRY pKey2 = (PCMKDIRCACHEENTRY)pvKey2;
+    if (pKey1->cchPath != pKey2->cchPath)
+        return pKey1->cchPath < pKey2->cchPath ? -1 : 1;
+    return memcmp(pKey1->pchPath, pKey2->pchPath, pKey1->cchPath);
+}
+
+
+/**
+ * Turns a path into the absolute form used for the cache keys.
+ *
+ * Duplicate slashes and '.' components are dropped.  Paths with '..'
+ * components are not cached, as symbolic links make them ambiguous.
+ *
+ * @returns The length of the result, 0 if the path isn't cacheable.
+ * @param   pszPath     The path as given to mkdir.
+ * @param   pszBuf      The output buffer.
+ * @param   cbBuf       The size of the output buffer.
+ */
+size_t kBuiltinMkDirCacheNormalize(const char *pszPath, char *pszBuf, size_t cbBuf)
+{
+    size_t off;
+
+    /*
+     * Start with the current directory if the path is relative.
+     */
+#if defined(_MSC_VER) || defined(__EMX__)
+    if (    ((*pszPath >= 'A' && *pszPath <= 'Z') || (*pszPath >= 'a' && *pszPath <= 'z'))
+        &&  pszPath[1] == ':')
+    {
+        if (!MKDIRCACHE_IS_SLASH(pszPath[2]) || cbBuf < 3)
+            return 0; /* drive relative */
+        pszBuf[0] = pszPath[0];
+        pszBuf[1] = ':';
+        off = 2;
+        pszPath += 2;
+    }
+    else if (MKDIRCACHE_IS_SLASH(pszPath[0]) && MKDIRCACHE_IS_SLASH(pszPath[1]))
+        return 0; /* UNC */
+    else
+#endif
+    if (MKDIRCACHE_IS_SLASH(*pszPath))
+        off = 0;
+    else
+    {
+        if (!getcwd(pszBuf, (int)cbBuf))
+            return 0;
+        off = strlen(pszBuf);
+        while (off > 0 && MKDIRCACHE_IS_SLASH(pszBuf[off - 1]))
+            off--;
+    }
+
+    /*
+     * Append the components.
+     */
+    for (;;)
+    {
+        const char *pszStart;
+        size_t      cchComp;
+
+        while (MKDIRCACHE_IS_SLASH(*pszPath))
+            pszPath++;
+        if (!*pszPath)
+            break;
+        pszStart = pszPath;
+        while (*pszPath && !MKDIRCACHE_IS_SLASH(*pszPath))
+            pszPath++;
+        cchComp = pszPath - pszStart;
+
+        if (cchComp == 1 && pszStart[0] == '.')
+            continue;
+        if (cchComp == 2 && pszStart[0] == '.' && pszStart[1] == '.')
+            return 0;
+        if (off + 1 + cchComp >= cbBuf)
+            return 0;
+        pszBuf[off++] = '/';
+        memcpy(&pszBuf[off], pszStart, cchComp);
+        off += cchComp;
+    }
+    pszBuf[off] = '\0';
+    return off;
+}
+
+
+/**
+ * Checks if a directory is known to exist.
+ *
+ * The caller should confirm a hit with stat() and call
+ * kBuiltinMkDirCacheInvalidate() if the directory is gone.
+ *
+ * @returns 1 if it is, 0 if not known.
+ * @param   pchPath     The normalized path (kBuiltinMkDirCacheNormalize).
+ *                      Need not be terminated.
+ * @param   cchPath     The length of the path.
+ */
+int kBuiltinMkDirCacheLookup(const char *pchPath, size_t cchPath)
+{
+    int fFound = 0;
+    MKDIRCACHEENTRY Key;
+    if (!cchPath)
+        return 0;
+    Key.cchPath = cchPath;
+    Key.pchPath = pchPath;
+
+    MKDIRCACHE_LOCK();
+    if (g_fMkDirCacheInitialized && g_MkDirCache.ht_fill)
+        fFound = !HASH_VACANT(*hash_find_slot(&g_MkDirCache, &Key));
+    MKDIRCACHE_UNLOCK();
+    return fFound;
+}
+
+
+/**
+ * Records that a directory exists.
+ *
+ * @param   pchPath     The normalized path (kBuiltinMkDirCacheNormalize).
+ *                      Need not be terminated.
+ * @param   cchPath     The length of the path.
+ */
+void kBuiltinMkDirCacheAdd(const char *pchPath, size_t cchPath)
+{
+    MKDIRCACHEENTRY Key;
+    void          **ppvSlot;
+    if (!cchPath)
+        return;
+    Key.cchPath = cchPath;
+    Key.pchPath = pchPath;
+
+    MKDIRCACHE_LOCK();
+    if (!g_fMkDirCacheInitialized)
+    {
+        hash_init(&g_MkDirCache, 256, mkdir_cache_hash_1, mkdir_cache_hash_2, mkdir_cache_hash_cmp);
+        g_fMkDirCacheInitialized = 1;
+    }
+    ppvSlot = hash_find_slot(&g_MkDirCache, &Key);
+    if (HASH_VACANT(*ppvSlot))
+    {
+        PMKDIRCACHEENTRY pEntry = (PMKDIRCACHEENTRY)malloc(sizeof(*pEntry) + cchPath);
+        if (pEntry)
+        {
+            pEntry->cchPath = cchPath;
+            pEntry->pchPath = pEntry->szPath;
+            memcpy(pEntry->szPath, pchPath, cchPath);
+            pEntry->szPath[cchPath] = '\0';
+            hash_insert_at(&g_MkDirCache, pEntry, ppvSlot);
+        }
+    }
+    MKDIRCACHE_UNLOCK();
+}
+
+
+/**
+ * Forgets everything, called when directories have been removed or moved.
+ *
+ * The cache isn't pruned by prefix because symbolic links may make the same
+ * directory known under different names.
+ */
+void kBuiltinMkDirCacheInvalidate(void)
+{
+    MKDIRCACHE_LOCK();
+    if (g_fMkDirCacheInitialized && g_MkDirCache.ht_fill)
+        hash_free_items(&g_MkDirCache);
+    MKDIRCACHE_UNLOCK();
+}
+
@@ -102,6 +102,9 @@ static int	do_move(char *, char *);
 static int	fastcopy(char *, char *, struct stat *);
 static int	copy(char *, char *);
 #endif
+#ifdef KMK
+static void	mv_invalidate_dir_cache(const char *);
+#endif
 static int	usage(FILE *);
 
 extern void bsd_strmode(mode_t mode, char *p);
@@ -239,6 +242,20 @@ kmk_builtin_mv(int argc, char *argv[], char **envp)
 	return rval;
 }
 
+#ifdef KMK
+/*
+ * kmk: Forget the directories known to exist (mkdir -p cache) if a
+ * directory was moved, as its old path and subdirectories are gone.
+ */
+static void
+mv_invalidate_dir_cache(const char *to)
+{
+	struct stat sb;
+	if (!lstat(to, &sb) && S_ISDIR(sb.st_mode))
+		kBuiltinMkDirCacheInvalidate();
+}
+#endif
+
 static int
 do_move(char *from, char *to)
 {
@@ -287,6 +304,9 @@ do_move(char *from, char *to)
 		}
 	}
 	if (!rename(from, to)) {
+#ifdef KMK
+		mv_invalidate_dir_cache(to);
+#endif
 		if (vflg)
 			printf("%s -> %s\n", from, to);
 		return (0);
@@ -295,6 +315,9 @@ do_move(char *from, char *to)
 	if (errno == EEXIST) {
 		remove(to);
 		if (!rename(from, to)) {
+# ifdef KMK
+			mv_invalidate_dir_cache(to);
+# endif
 			if (vflg)
 				printf("%s -> %s\n", from, to);
 			return (0);
@@ -97,12 +97,14 @@ static char  **gargv;
 #if !defined(kmk_builtin_printf) && !defined(BUILTIN) && !defined(SHELL)
 static char *g_o = NULL;
 #endif
+#ifdef kmk_builtin_printf
 static struct option long_options[] =
 {
     { "help",   					no_argument, 0, 261 },
     { "version",   					no_argument, 0, 262 },
     { 0, 0,	0, 0 },
 };
+#endif
 
 
 static int	 common_printf(int argc, char *argv[]);
@@ -165,8 +167,17 @@ static size_t	g_cchBuf;
 int kmk_builtin_printf(int argc, char *argv[], char **envp)
 {
 	int rc;
+#ifdef kmk_builtin_printf
 	int ch;
+#else
+	int i;
+#endif
 
+#if !defined(SHELL) && !defined(BUILTIN) && !defined(kmk_builtin_printf) /* kmk did this already. */
+	(void)setlocale (LC_ALL, "");
+#endif
+
+#ifdef kmk_builtin_printf
 	/* kmk: reset getopt, set progname and reset buffer. */
 	g_progname = argv[0];
 	opterr = 1;
@@ -174,10 +185,6 @@ int kmk_builtin_printf(int argc, char *argv[], char **envp)
 	optopt = 0;
 	optind = 0; /* init */
 
-#if !defined(SHELL) && !defined(BUILTIN) && !defined(kmk_builtin_printf) /* kmk did this already. */
-	(void)setlocale (LC_ALL, "");
-#endif
-
 	while ((ch = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
 		switch (ch) {
 		case 261:
@@ -192,6 +199,27 @@ int kmk_builtin_printf(int argc, char *argv[], char **envp)
 	}
 	argc -= optind;
 	argv += optind;
+#else
+	/* kmk: Runs on the main thread while other builtins may be using getopt
+	   on the worker thread, so deal with the two options by hand. */
+	g_progname = argv[0];
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+		if (!strcmp(argv[i], "--")) {
+			i++;
+			break;
+		}
+		if (!strcmp(argv[i], "--help")) {
+			usage(stdout);
+			return 0;
+		}
+		if (!strcmp(argv[i], "--version"))
+			return kbuild_version(argv[0]);
+		warnx("unknown option: %s", argv[i]);
+		return usage(stderr);
+	}
+	argc -= i;
+	argv += i;
+#endif
 
 	if (argc < 1) {
 		return usage(stderr);
@@ -77,6 +77,12 @@
 # include "variable.h"
 #endif
 
+/* In kmk the file orders are also applied to ourselves when running a builtin
+   command in-process, so the save and restore code is needed with posix_spawn. */
+#if !defined(USE_POSIX_SPAWN) || defined(KMK)
+# define USE_FD_ORDER_SAVING
+#endif
+
 #ifdef __OS2__
 # define INCL_BASE
 # include <os2.h>
@@ -168,6 +174,9 @@ static int usage(FILE *pOut,  const char *argv0)
             "\n"
             "The -v switch is for making the thing more verbose.\n"
             "\n"
+            "Inside kmk, a kmk_builtin_xxx program is run in-process with the file\n"
+            "descriptor operations temporarily applied, unless -c or stdin is used.\n"
+            "\n"
             "This command was originally just a quick hack to avoid invoking the shell\n"
             "on Windows (cygwin) where forking is very expensive and has exhibited\n"
             "stability issues on SMP machines.  It has since grown into something like\n"
@@ -200,7 +209,7 @@ typedef struct REDIRECTORDERS
     int         fOpen;
     /** The filename - NULL if close only. */
     const char *pszFilename;
-#ifndef USE_POSIX_SPAWN
+#ifdef USE_FD_ORDER_SAVING
     /** Saved file descriptor. */
     int         fdSaved;
     /** Saved flags. */
@@ -505,7 +514,7 @@ static void kRedirectCleanupFdOrders(unsigned cOrders, REDIRECTORDERS *paOrders,
 }
 
 
-#ifndef USE_POSIX_SPAWN
+#ifdef USE_FD_ORDER_SAVING
 
 /**
  * Saves a file handle to one which isn't inherited and isn't affected by the
@@ -551,7 +560,7 @@ static int kRedirectSaveHandle(REDIRECTORDERS *pToSave, unsigned cOrders, REDIRE
         HANDLE hCurProc = GetCurrentProcess();
 # endif
         int aFdTries[32];
-        int cTries = 0;
+        unsigned cTries = 0;
         do
         {
             /* Duplicate the handle (windows makes this complicated). */
@@ -575,7 +584,7 @@ static int kRedirectSaveHandle(REDIRECTORDERS *pToSave, unsigned cOrders, REDIRE
             fdDup = dup(fdToSave);
             if (fdDup == -1)
             {
-                fprintf(*ppWorkingStdErr, "%s: dup(%#x) failed: %u\n", g_progname, fdToSave, strerror(errno));
+                fprintf(*ppWorkingStdErr, "%s: dup(%#x) failed: %s\n", g_progname, fdToSave, strerror(errno));
                 break;
             }
 #endif
@@ -647,14 +656,16 @@ static void kRedirectRestoreFdOrders(unsigned cOrders, REDIRECTORDERS *paOrders,
             if (dup2(paOrders[i].fdSaved, paOrders[i].fdTarget) != -1)
 #endif
             {
-                close(paOrders[i].fdSaved);
-                paOrders[i].fdSaved = -1;
-
                 if (fRestoreStdErr)
                 {
+                    /* This closes fdSaved too. */
+                    fclose(*ppWorkingStdErr);
                     *ppWorkingStdErr = stderr;
                     assert(fileno(stderr) == paOrders[i].fdTarget);
                 }
+                else
+                    close(paOrders[i].fdSaved);
+                paOrders[i].fdSaved = -1;
             }
 #ifndef KBUILD_OS_WINDOWS
             else
@@ -662,6 +673,10 @@ static void kRedirectRestoreFdOrders(unsigned cOrders, REDIRECTORDERS *paOrders,
                         g_progname, paOrders[i].fdSaved, paOrders[i].fdTarget, strerror(errno));
 #endif
         }
+        /* The target wasn't open before, so close it again (matters when
+           running in-process, as we stick around). */
+        else if (paOrders[i].enmOrder != kRedirectOrder_Close)
+            close(paOrders[i].fdTarget);
 
 #ifndef KBUILD_OS_WINDOWS
         if (paOrders[i].fSaved != -1)
@@ -771,7 +786,7 @@ static int kRedirectExecFdOrders(unsigned cOrders, REDIRECTORDERS *paOrders, FIL
     return 0;
 }
 
-#endif /* !USE_POSIX_SPAWN */
+#endif /* USE_FD_ORDER_SAVING */
 
 
 /**
@@ -931,7 +946,17 @@ static int kRedirectDoSpawn(const char *pszExecutable, int cArgs, char **papszAr
                     *pPidSpawned = 0;
                 }
 #else
-                rcExit = posix_spawnp(pPidSpawned, pszExecutable, pFileActions, NULL /*pAttr*/, papszArgs, papszEnvVars);
+# ifdef CONFIG_WITH_POSIX_SPAWN_JOBS
+                /* Use kmk's PATH lookup cache with the child PATH (so -E PATH=
+                   is honoured, unlike posix_spawnp which searches ours) and
+                   only fall back on posix_spawnp if that fails, as it deals
+                   with ENOEXEC scripts. */
+                const char *pszResolved = spawn_resolve_program(pszExecutable, papszEnvVars);
+                if (pszResolved)
+                    rcExit = posix_spawn(pPidSpawned, pszResolved, pFileActions, NULL /*pAttr*/, papszArgs, papszEnvVars);
+                if (!pszResolved || rcExit != 0)
+# endif
+                    rcExit = posix_spawnp(pPidSpawned, pszExecutable, pFileActions, NULL /*pAttr*/, papszArgs, papszEnvVars);
                 if (rcExit == 0)
                 {
                     if (cVerbosity > 0)
@@ -1028,6 +1053,96 @@ static int kRedirectDoSpawn(const char *pszExecutable, int cArgs, char **papszAr
 }
 
 
+#ifdef KMK
+/**
+ * Checks whether the command can be run in-process, i.e. whether it is a
+ * plain builtin command and the file orders can be undone afterwards.
+ *
+ * Close orders (merely marking the handle no-inherit) and stdin redirections
+ * (buffered stdin state) are left to a real child.
+ *
+ * @returns The builtin entry point if it can, NULL if not.
+ * @param   pszExecutable       The executable.
+ * @param   papszArgs           The child argument vector.
+ * @param   cOrders             Number of file operation orders.
+ * @param   paOrders            The file operation orders.
+ */
+static FNKMKBUILTINMAIN *kRedirectGetInProcessBuiltin(const char *pszExecutable, char **papszArgs,
+                                                     unsigned cOrders, REDIRECTORDERS *paOrders)
+{
+    unsigned i;
+    if (pszExecutable != papszArgs[0])
+        return NULL;
+    for (i = 0; i < cOrders; i++)
+        if (   paOrders[i].enmOrder == kRedirectOrder_Close
+            || paOrders[i].fdTarget == 0)
+            return NULL;
+    return kmk_builtin_get_main(pszExecutable);
+}
+
+
+/**
+ * Runs a builtin command in-process with the file orders temporarily applied
+ * to our own handles, saving a fork+exec of kmk_builtin_xxx.
+ *
+ * @returns Exit code.
+ * @param   pfnMain             The builtin entry point.
+ * @param   cArgs               Number of arguments.
+ * @param   papszArgs           The argument vector.
+ * @param   papszEnvVars        The environment vector.
+ * @param   pszCwd              The current working directory of the command.
+ * @param   pszSavedCwd         The saved current working directory.  This is
+ *                              NULL if the CWD doesn't need changing.
+ * @param   cOrders             Number of file operation orders.
+ * @param   paOrders            The file operation orders.
+ * @param   cVerbosity          The verbosity level.
+ * @param   pfIsChildExitCode   Where to indicate whether the return exit code
+ *                              is from the command or from our setup efforts.
+ */
+static int kRedirectDoInProcess(FNKMKBUILTINMAIN *pfnMain, int cArgs, char **papszArgs, char **papszEnvVars,
+                                const char *pszCwd, const char *pszSavedCwd, unsigned cOrders, REDIRECTORDERS *paOrders,
+                                unsigned cVerbosity, KBOOL *pfIsChildExitCode)
+{
+    const char *pszSavedProgName = g_progname;
+    FILE       *pWorkingStdErr   = NULL;
+    int         rcExit;
+
+    *pfIsChildExitCode = K_FALSE;
+    if (cVerbosity > 0)
+        warnx("debug: running %s in-process", papszArgs[0]);
+
+    if (pszSavedCwd && chdir(pszCwd) < 0)
+        return errx(10, "Failed to change directory to '%s'", pszCwd);
+
+    /* Anything buffered belongs to the current handles. */
+    fflush(stdout);
+    fflush(stderr);
+    rcExit = kRedirectExecFdOrders(cOrders, paOrders, &pWorkingStdErr);
+    if (rcExit == 0)
+    {
+        rcExit = pfnMain(cArgs, papszArgs, papszEnvVars);
+# ifdef CONFIG_WITH_APPEND_BUFFERING
+        /* No child owns an append done this way, so nobody would flush it. */
+        if (pfnMain == kmk_builtin_append && kmk_builtin_append_flush() != 0 && rcExit == 0)
+            rcExit = 1;
+# endif
+        g_progname = pszSavedProgName;
+        *pfIsChildExitCode = K_TRUE;
+        if (cVerbosity > 0)
+            warnx("debug: exit code: %d", rcExit);
+
+        fflush(stdout);
+        fflush(stderr);
+        kRedirectRestoreFdOrders(cOrders, paOrders, &pWorkingStdErr);
+    }
+
+    if (pszSavedCwd && chdir(pszSavedCwd) < 0)
+        warn("Failed to restore directory to '%s'", pszSavedCwd);
+    return rcExit;
+}
+#endif /* KMK */
+
+
 /**
  * The function that does almost everything here... ugly.
  */
@@ -1394,8 +1509,9 @@ int main(int argc, char **argv, char **envp)
                 aOrders[cOrders].fOpen            = 0;
                 aOrders[cOrders].fRemoveOnFailure = 0;
                 aOrders[cOrders].pszFilename      = NULL;
-#ifndef USE_POSIX_SPAWN
+#ifdef USE_FD_ORDER_SAVING
                 aOrders[cOrders].fdSaved          = -1;
+                aOrders[cOrders].fSaved           = -1;
 #endif
             }
             else
@@ -1658,6 +1774,28 @@ int main(int argc, char **argv, char **envp)
      */
     if (rcExit == 0 && iArg < argc)
     {
+#ifdef KMK
+        /*
+         * Builtin commands are run in-process when possible.
+         */
+        FNKMKBUILTINMAIN *pfnBuiltin = kRedirectGetInProcessBuiltin(pszExecutable, &argv[iArg], cOrders, aOrders);
+# ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+        /* Running a builtin or changing the current directory or standard
+           handles of the process must not happen under the feet of the
+           builtins on the worker thread. */
+#  ifdef USE_POSIX_SPAWN
+        KBOOL const fLock = pfnBuiltin != NULL || pszSavedCwd != NULL;
+#  else
+        KBOOL const fLock = K_TRUE;
+#  endif
+        if (fLock)
+            kmk_builtin_lock();
+# endif
+        if (pfnBuiltin)
+            rcExit = kRedirectDoInProcess(pfnBuiltin, argc - iArg, &argv[iArg], papszEnvVars, szCwd, pszSavedCwd,
+                                          cOrders, aOrders, cVerbosity, &fChildExitCode);
+        else
+#endif
         /*
          * Do the spawning in a separate function (main is far to large as it is by now).
          */
@@ -1671,6 +1809,10 @@ int main(int argc, char **argv, char **envp)
                                   pPidSpawned,
 #endif
                                   &fChildExitCode);
+#if defined(KMK) && defined(CONFIG_WITH_KMK_BUILTIN_THREADS)
+        if (fLock)
+            kmk_builtin_unlock();
+#endif
     }
     else if (rcExit == 0)
     {
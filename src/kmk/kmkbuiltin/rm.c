@@ -89,6 +89,15 @@ static char sccsid[] = "@(#)rm.c	8.5 (Berkeley) 4/18/94";
 #include "kbuild_protection.h"
 #include "k/kDefs.h"	/* for K_OS */
 
+/* Linux gets a multi-threaded tree removal engine that doesn't use fts. */
+#if defined(__linux__)
+# define RM_WITH_PARALLEL_TREE
+# include <pthread.h>
+# include <signal.h>
+# include <sys/syscall.h>
+# include <dirent.h>
+#endif
+
 #if defined(__EMX__) || defined(KBUILD_OS_WINDOWS)
 # define IS_SLASH(ch)   ( (ch) == '/' || (ch) == '\\' )
 # define HAVE_DOS_PATHS 1
@@ -112,6 +121,7 @@ static char sccsid[] = "@(#)rm.c	8.5 (Berkeley) 4/18/94";
 extern void bsd_strmode(mode_t mode, char *p);
 
 static int dflag, eval, fflag, iflag, Pflag, vflag, Wflag, stdin_ok;
+static int fParallel;
 #ifdef KBUILD_OS_WINDOWS
 static int fUseNtDeleteFile;
 #endif
@@ -132,6 +142,8 @@ static struct option long_options[] =
 #ifdef KBUILD_OS_WINDOWS
     { "nt-delete-file",					no_argument, 0, 268 },
 #endif
+    { "parallel",					no_argument, 0, 269 },
+    { "no-parallel",					no_argument, 0, 270 },
     { 0, 0,	0, 0 },
 };
 
@@ -141,6 +153,9 @@ static void	checkdot(char **);
 static int	rm_file(char **);
 static int	rm_overwrite(char *, struct stat *);
 static int	rm_tree(char **);
+#ifdef RM_WITH_PARALLEL_TREE
+static int	rm_tree_parallel(char **);
+#endif
 static int	usage(FILE *);
 
 #if 1
@@ -167,6 +182,7 @@ kmk_builtin_rm(int argc, char *argv[], char **envp)
 	/* reinitialize globals */
 	argv0 = argv[0];
 	dflag = eval = fflag = iflag = Pflag = vflag = Wflag = stdin_ok = 0;
+	fParallel = 1;
 #ifdef KBUILD_OS_WINDOWS
 	fUseNtDeleteFile = 0;
 #endif
@@ -241,6 +257,12 @@ kmk_builtin_rm(int argc, char *argv[], char **envp)
 			fUseNtDeleteFile = 1;
 			break;
 #endif
+		case 269:
+			fParallel = 1;
+			break;
+		case 270:
+			fParallel = 0;
+			break;
 		case '?':
 		default:
 			kBuildProtectionTerm(&g_ProtData);
@@ -266,6 +288,11 @@ kmk_builtin_rm(int argc, char *argv[], char **envp)
 				eval |= rm_tree(argv);
 			else
 				eval |= rm_file(argv);
+#ifdef KMK
+			/* kmk: Directories may be gone, drop the mkdir -p cache. */
+			if (rflag || dflag)
+				kBuiltinMkDirCacheInvalidate();
+#endif
 		}
 	} else {
 		eval = 1;
@@ -295,6 +322,15 @@ rm_tree(char **argv)
 		}
 	}
 
+#ifdef RM_WITH_PARALLEL_TREE
+	/*
+	 * Unless we may have to ask questions or overwrite files, let
+	 * rm_tree_parallel do the job.
+	 */
+	if (fParallel && !iflag && !Pflag && !Wflag && (fflag || !stdin_ok))
+		return rm_tree_parallel(argv);
+#endif
+
 	/*
 	 * Remove a file hierarchy.  If forcing removal (-f), or interactive
 	 * (-i) or can't ask anyway (stdin_ok), don't stat the file.
@@ -308,6 +344,10 @@ rm_tree(char **argv)
 #define	SKIPPED	1
 
 	flags = FTS_PHYSICAL;
+#ifdef CONFIG_WITH_KMK_BUILTIN_THREADS
+	/* kmk: we may be on a worker thread, the cwd belongs to make. */
+	flags |= FTS_NOCHDIR;
+#endif
 	if (!needstat)
 		flags |= FTS_NOSTAT;
 #ifdef FTS_WHITEOUT
@@ -478,6 +518,337 @@ err:
 	return eval;
 }
 
+#ifdef RM_WITH_PARALLEL_TREE
+
+/*
+ * Parallel tree removal.
+ *
+ * Each directory gets a node which is pushed onto a work stack.  Whoever
+ * pops it opens it relative to the parent's handle, reads it with getdents64,
+ * unlinks the non-directories relative to its own handle and pushes the
+ * subdirectories.  A node is referenced by its own scan and by each
+ * subdirectory node; when the last reference goes away the directory is
+ * empty, its handle is closed and it is removed relative to the parent's
+ * handle, releasing the parent.  So no system call ever sees more than one
+ * path component below the top, which keeps deep trees from running into
+ * ENAMETOOLONG and a component swapped for a symbolic link from redirecting
+ * the removal (O_NOFOLLOW).  The full path is only kept for messages.  Helper
+ * threads are started as work piles up, so small trees are done entirely on
+ * the calling thread.
+ *
+ * Since we never follow symbolic links, everything below a command line
+ * argument is deeper than the argument itself, so the protection check done
+ * up front in rm_tree covers it.
+ */
+
+/** The max number of helper threads. */
+#define RM_MAX_THREADS	8
+/** The initial directory listing buffer size, doubled as needed. */
+#define RM_DIR_BUF_SIZE	(32 * 1024)
+
+/** A directory being removed. */
+typedef struct RMDIRNODE
+{
+	struct RMDIRNODE *pParent;	/* The parent, NULL for the top. */
+	struct RMDIRNODE *pNext;	/* Next on the work stack. */
+	unsigned cRefs;			/* The scan plus live subdirectories. */
+	int fd;				/* The directory handle, -1 until scanned. */
+	size_t offName;			/* Where the name starts in szPath. */
+	size_t cchPath;
+	char szPath[1];
+} RMDIRNODE;
+
+/** The linux getdents64 record. */
+struct rm_dirent64
+{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+static struct
+{
+	pthread_mutex_t Mtx;
+	pthread_cond_t Cond;
+	RMDIRNODE *pStack;		/* Directories waiting to be read. */
+	unsigned cIdle;			/* Threads waiting on Cond. */
+	unsigned cThreads;		/* Helper threads started. */
+	unsigned cMaxThreads;
+	int fDone;			/* Set when the top directory is gone. */
+	pthread_t aThreads[RM_MAX_THREADS];
+} g_RmPool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0, { 0 } };
+
+static void *rm_par_worker(void *);
+
+static void
+rm_par_error(const char *operation, const char *path, const char *name, int rc)
+{
+	pthread_mutex_lock(&g_RmPool.Mtx);
+	fprintf(stderr, "%s: %s: %s%s%s: %s " CUR_LINE() "\n", operation, argv0,
+	        path, name ? "/" : "", name ? name : "", strerror(rc));
+	eval = 1;
+	pthread_mutex_unlock(&g_RmPool.Mtx);
+}
+
+static RMDIRNODE *
+rm_par_new_node(RMDIRNODE *pParent, const char *name, size_t cchName)
+{
+	size_t cchDir = pParent ? pParent->cchPath + 1 : 0;
+	RMDIRNODE *pNode = (RMDIRNODE *)malloc(sizeof(*pNode) + cchDir + cchName);
+	if (!pNode)
+		return NULL;
+	pNode->pParent = pParent;
+	pNode->pNext = NULL;
+	pNode->cRefs = 1;
+	pNode->fd = -1;
+	pNode->offName = cchDir;
+	if (pParent) {
+		memcpy(pNode->szPath, pParent->szPath, pParent->cchPath);
+		pNode->szPath[pParent->cchPath] = '/';
+	}
+	memcpy(&pNode->szPath[cchDir], name, cchName);
+	pNode->cchPath = cchDir + cchName;
+	pNode->szPath[pNode->cchPath] = '\0';
+	return pNode;
+}
+
+/* Pushes a directory onto the work stack; caller owns the mutex. */
+static void
+rm_par_push(RMDIRNODE *pNode)
+{
+	pNode->pNext = g_RmPool.pStack;
+	g_RmPool.pStack = pNode;
+	if (g_RmPool.cIdle)
+		pthread_cond_signal(&g_RmPool.Cond);
+	else if (g_RmPool.cThreads < g_RmPool.cMaxThreads) {
+		/* Keep signals on make's threads. */
+		sigset_t SigSetAll, SigSetOld;
+		sigfillset(&SigSetAll);
+		pthread_sigmask(SIG_BLOCK, &SigSetAll, &SigSetOld);
+		if (pthread_create(&g_RmPool.aThreads[g_RmPool.cThreads], NULL, rm_par_worker, NULL) == 0)
+			g_RmPool.cThreads++;
+		else
+			g_RmPool.cMaxThreads = g_RmPool.cThreads;
+		pthread_sigmask(SIG_SETMASK, &SigSetOld, NULL);
+	}
+}
+
+/* Drops a reference, removing the directory (and maybe parents) when unused. */
+static void
+rm_par_release(RMDIRNODE *pNode)
+{
+	while (pNode) {
+		RMDIRNODE *pParent;
+
+		pthread_mutex_lock(&g_RmPool.Mtx);
+		if (--pNode->cRefs != 0) {
+			pthread_mutex_unlock(&g_RmPool.Mtx);
+			return;
+		}
+		pthread_mutex_unlock(&g_RmPool.Mtx);
+
+		/* The parent handle stays open while we hold a reference to it. */
+		pParent = pNode->pParent;
+		if (pNode->fd >= 0)
+			close(pNode->fd);
+		if (unlinkat(pParent ? pParent->fd : AT_FDCWD, &pNode->szPath[pNode->offName], AT_REMOVEDIR) == 0) {
+			if (vflag)
+				(void)printf("%s\n", pNode->szPath);
+		} else if (!fflag || errno != ENOENT)
+			rm_par_error("rmdir", pNode->szPath, NULL, errno);
+		free(pNode);
+		if (!pParent) {
+			pthread_mutex_lock(&g_RmPool.Mtx);
+			g_RmPool.fDone = 1;
+			pthread_cond_broadcast(&g_RmPool.Cond);
+			pthread_mutex_unlock(&g_RmPool.Mtx);
+		}
+		pNode = pParent;
+	}
+}
+
+/*
+ * Reads the whole of a directory.  Unlinking entries while still reading
+ * makes some file systems (NFS, FUSE) skip entries, so this comes first.
+ * Returns the getdents64 records (heap) and their size in *pcb.
+ */
+static char *
+rm_par_read_dir(RMDIRNODE *pNode, int fd, size_t *pcb)
+{
+	size_t cbAlloc = RM_DIR_BUF_SIZE;
+	size_t cb = 0;
+	char *pb = malloc(cbAlloc);
+	while (pb) {
+		long cbRead;
+		if (cbAlloc - cb < RM_DIR_BUF_SIZE) {
+			char *pbNew = realloc(pb, cbAlloc * 2);
+			if (!pbNew) {
+				rm_par_error("malloc", pNode->szPath, NULL, ENOMEM);
+				break;
+			}
+			pb = pbNew;
+			cbAlloc *= 2;
+		}
+		cbRead = syscall(SYS_getdents64, fd, pb + cb, cbAlloc - cb);
+		if (cbRead <= 0) {
+			if (cbRead < 0)
+				rm_par_error("getdents64", pNode->szPath, NULL, errno);
+			break;
+		}
+		cb += cbRead;
+	}
+	if (!pb)
+		rm_par_error("malloc", pNode->szPath, NULL, ENOMEM);
+	*pcb = cb;
+	return pb;
+}
+
+/* Reads a directory, unlinking files and queueing subdirectories. */
+static void
+rm_par_scan(RMDIRNODE *pNode)
+{
+	RMDIRNODE *pParent = pNode->pParent;
+	int fd = openat(pParent ? pParent->fd : AT_FDCWD, &pNode->szPath[pNode->offName],
+	                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd >= 0) {
+		size_t cb;
+		size_t off;
+		char *pb = rm_par_read_dir(pNode, fd, &cb);
+
+		/* Kept open for the subdirectories, closed by rm_par_release. */
+		pNode->fd = fd;
+		if (pb) {
+			for (off = 0; off < cb; ) {
+				struct rm_dirent64 *pEnt = (struct rm_dirent64 *)(pb + off);
+				const char *name = pEnt->d_name;
+				RMDIRNODE *pChild;
+				off += pEnt->d_reclen;
+
+				if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+					continue;
+				if (pEnt->d_type != DT_DIR) {
+					if (unlinkat(fd, name, 0) == 0) {
+						if (vflag)
+							(void)printf("%s/%s\n", pNode->szPath, name);
+						continue;
+					}
+					/* d_type may be DT_UNKNOWN on some file systems. */
+					if (errno != EISDIR) {
+						if (!fflag || errno != ENOENT)
+							rm_par_error("unlink", pNode->szPath, name, errno);
+						continue;
+					}
+				}
+
+				pChild = rm_par_new_node(pNode, name, strlen(name));
+				if (!pChild) {
+					rm_par_error("malloc", pNode->szPath, name, ENOMEM);
+					continue;
+				}
+				pthread_mutex_lock(&g_RmPool.Mtx);
+				pNode->cRefs++;
+				rm_par_push(pChild);
+				pthread_mutex_unlock(&g_RmPool.Mtx);
+			}
+			free(pb);
+		}
+	} else {
+		int rc = errno;
+		if (pParent && (rc == ENOTDIR || rc == ELOOP)) {
+			/* Swapped for something else since the parent was read. */
+			if (unlinkat(pParent->fd, &pNode->szPath[pNode->offName], 0) == 0) {
+				if (vflag)
+					(void)printf("%s\n", pNode->szPath);
+				free(pNode);
+				rm_par_release(pParent);
+				return;
+			}
+			rc = errno;
+		}
+		if (!fflag || rc != ENOENT)
+			rm_par_error("open", pNode->szPath, NULL, rc);
+	}
+
+	rm_par_release(pNode);
+}
+
+static void *
+rm_par_worker(void *pvUser)
+{
+	pthread_mutex_lock(&g_RmPool.Mtx);
+	for (;;) {
+		RMDIRNODE *pNode = g_RmPool.pStack;
+		if (pNode) {
+			g_RmPool.pStack = pNode->pNext;
+			pthread_mutex_unlock(&g_RmPool.Mtx);
+			rm_par_scan(pNode);
+			pthread_mutex_lock(&g_RmPool.Mtx);
+		} else if (g_RmPool.fDone)
+			break;
+		else {
+			g_RmPool.cIdle++;
+			pthread_cond_wait(&g_RmPool.Cond, &g_RmPool.Mtx);
+			g_RmPool.cIdle--;
+		}
+	}
+	pthread_mutex_unlock(&g_RmPool.Mtx);
+	(void)pvUser;
+	return NULL;
+}
+
+static int
+rm_tree_parallel(char **argv)
+{
+	long cCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char *f;
+
+	while ((f = *argv++) != NULL) {
+		struct stat sb;
+		RMDIRNODE *pTop;
+		size_t cch;
+		unsigned i;
+
+		if (lstat(f, &sb)) {
+			if (!fflag || errno != ENOENT) {
+				fprintf(stderr, "lstat: %s: %s: %s " CUR_LINE() "\n", argv0, f, strerror(errno));
+				eval = 1;
+			}
+			continue;
+		}
+		if (!S_ISDIR(sb.st_mode)) {
+			if (unlink(f) == 0) {
+				if (vflag)
+					(void)printf("%s\n", f);
+			} else if (!fflag || errno != ENOENT) {
+				fprintf(stderr, "unlink: %s: %s: %s " CUR_LINE() "\n", argv0, f, strerror(errno));
+				eval = 1;
+			}
+			continue;
+		}
+
+		cch = strlen(f);
+		while (cch > 1 && IS_SLASH(f[cch - 1]))
+			cch--;
+		if (!(pTop = rm_par_new_node(NULL, f, cch)))
+			return err(1, "malloc");
+
+		/* The calling thread works too, helpers are started on demand. */
+		g_RmPool.pStack = pTop;
+		g_RmPool.cIdle = 0;
+		g_RmPool.cThreads = 0;
+		g_RmPool.cMaxThreads = cCpus > RM_MAX_THREADS ? RM_MAX_THREADS : cCpus > 1 ? (unsigned)cCpus - 1 : 0;
+		g_RmPool.fDone = 0;
+		rm_par_worker(NULL);
+		for (i = 0; i < g_RmPool.cThreads; i++)
+			pthread_join(g_RmPool.aThreads[i], NULL);
+	}
+	return eval;
+}
+
+#endif /* RM_WITH_PARALLEL_TREE */
+
 static int
 rm_file(char **argv)
 {
@@ -781,6 +1152,9 @@ usage(FILE *pf)
 		"       Will disable the protection file protection for all operations.\n"
 		"   --protection-depth\n"
 		"       Number or path indicating the file protection depth. Default: %d\n"
+		"   --parallel, --no-parallel\n"
+		"       Whether -R may remove directories concurrently on several threads.\n"
+		"       Default: enabled where supported (Linux).\n"
 		"\n"
 		"Environment:\n"
 		"    KMK_RM_DISABLE_PROTECTION\n"
@@ -149,6 +149,10 @@ kmk_builtin_rmdir(int argc, char *argv[], char **envp)
 			errors |= rm_path(*argv);
 	}
 
+#ifdef KMK
+	/* kmk: Drop the mkdir -p cache of directories known to exist. */
+	kBuiltinMkDirCacheInvalidate();
+#endif
 	return errors;
 }
 
@@ -195,6 +195,40 @@ common:			if (set->cmd2 & CMD2_CLR) {
 
 #define	STANDARD_BITS	(S_ISUID|S_ISGID|S_IRWXU|S_IRWXG|S_IRWXO)
 
+/* kmk: The file mode creation mask and whether it's been read. */
+static mode_t	g_fUmask;
+static int	g_fUmaskValid = 0;
+
+/*
+ * kmk: Get the file mode creation mask without changing it.
+ *
+ * Reading the umask means setting it, and a temporary value could be
+ * inherited by a process spawned on another thread.  So it's only read
+ * once; kmk does that on the main thread before starting the builtin
+ * worker thread.  Since it's possible that the caller is opening files
+ * inside a signal handler, protect them as best we can.
+ */
+mode_t
+bsd_getumask(void)
+{
+#ifndef _MSC_VER
+	sigset_t signset, sigoset;
+#endif
+
+	if (!g_fUmaskValid) {
+#ifndef _MSC_VER
+		sigfillset(&signset);
+		(void)sigprocmask(SIG_BLOCK, &signset, &sigoset);
+#endif
+		(void)umask(g_fUmask = umask(0));
+#ifndef _MSC_VER
+		(void)sigprocmask(SIG_SETMASK, &sigoset, NULL);
+#endif
+		g_fUmaskValid = 1;
+	}
+	return g_fUmask;
+}
+
 void *
 bsd_setmode(p)
 	const char *p;
@@ -202,9 +236,6 @@ bsd_setmode(p)
 	int perm, who;
 	char op, *ep;
 	BITCMD *set, *saveset, *endset;
-#ifndef _MSC_VER
-	sigset_t signset, sigoset;
-#endif
 	mode_t mask;
 	int equalopdone = 0;	/* pacify gcc */
 	int permXbits, setlen;
@@ -214,19 +245,9 @@ bsd_setmode(p)
 
 	/*
 	 * Get a copy of the mask for the permissions that are mask relative.
-	 * Flip the bits, we want what's not set.  Since it's possible that
-	 * the caller is opening files inside a signal handler, protect them
-	 * as best we can.
+	 * Flip the bits, we want what's not set.
 	 */
-#ifndef _MSC_VER
-	sigfillset(&signset);
-	(void)sigprocmask(SIG_BLOCK, &signset, &sigoset);
-#endif
-	(void)umask(mask = umask(0));
-	mask = ~mask;
-#ifndef _MSC_VER
-	(void)sigprocmask(SIG_SETMASK, &sigoset, NULL);
-#endif
+	mask = ~bsd_getumask();
 
 	setlen = SET_LEN + 2;
 
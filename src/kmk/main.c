@@ -91,6 +91,7 @@ void verify_file_data_base (void);
 void print_variable_stats (void);
 void print_dir_stats (void);
 void print_file_stats (void);
+void print_job_stats (void);
 #endif
 
 #if defined HAVE_WAITPID || defined HAVE_WAIT3
@@ -364,6 +365,23 @@ int process_priority = 0;
 int process_affinity = 0;
 #endif /* KMK */
 
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+/* Memory budget for the jobs in MB, 0 if unlimited.  */
+
+unsigned int max_memory_mb = 0;
+static unsigned int default_max_memory_mb = 0;
+
+/* File remembering the peak memory use of targets across runs.  */
+
+static struct stringlist *memory_history_files = 0;
+#endif
+
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+/* File caching directory listings between runs and sub-makes.  */
+
+static struct stringlist *dir_cache_files = 0;
+#endif
+
 #if defined (CONFIG_WITH_MAKE_STATS) || defined (CONFIG_WITH_MINIMAL_STATS)
 /* When set, we'll gather expensive statistics like for the heap. */
 
@@ -464,6 +482,17 @@ static const char *const usage[] =
     N_("\
   --nice                      Alias for --priority=1\n"),
 #endif /* KMK */
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+    N_("\
+  --max-memory=MB             Don't start more jobs if their expected peak\n\
+                              memory use exceeds MB or the available memory.\n"),
+    N_("\
+  --memory-history=FILE       Remember the peak memory use of targets in FILE.\n"),
+#endif
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+    N_("\
+  --dir-cache=FILE            Cache directory listings between runs in FILE.\n"),
+#endif
 #ifdef CONFIG_PRETTY_COMMAND_PRINTING
     N_("\
   --pretty-command-printing   Makes the command echo easier to read.\n"),
@@ -537,6 +566,16 @@ static const struct command_switch switches[] =
     { CHAR_MAX+15, positive_int, (char *) &process_affinity, 1, 1, 0,
       (char *) &process_affinity, (char *) &process_affinity, "affinity" },
     { CHAR_MAX+17, flag, (char *) &process_priority, 1, 1, 0, 0, 0, "nice" },
+#endif
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+    { CHAR_MAX+18, positive_int, (char *) &max_memory_mb, 1, 1, 0, 0,
+      (char *) &default_max_memory_mb, "max-memory" },
+    { CHAR_MAX+19, string, (char *) &memory_history_files, 1, 1, 0, 0, 0,
+      "memory-history" },
+#endif
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+    { CHAR_MAX+20, string, (char *) &dir_cache_files, 1, 1, 0, 0, 0,
+      "dir-cache" },
 #endif
     { 'q', flag, &question_flag, 1, 1, 1, 0, 0, "question" },
     { 'r', flag, &no_builtin_rules_flag, 1, 1, 0, 0, 0, "no-builtin-rules" },
@@ -1382,6 +1421,29 @@ open_tmpfile(char **name, const char *template)
 char space_map[space_map_size];
 #endif /* CONFIG_WITH_FAST_IS_SPACE */
 
+#if defined (CONFIG_WITH_MEMORY_THROTTLING) || defined (CONFIG_WITH_PERSISTENT_DIR_CACHE)
+/* Returns the file named by the last instance of a file switch shared with
+   the sub-makes, made absolute so sub-makes working in other directories
+   get the same file.  The switch is reduced to that one value so it's
+   passed on that way.  Returns NULL if the switch wasn't given.  */
+
+static const char *
+shared_file_switch (struct stringlist *sl)
+{
+  const char *path;
+
+  if (!sl)
+    return 0;
+  path = sl->list[sl->idx - 1];
+  if (path[0] != '/' && starting_directory)
+    path = xstrdup (concat (3, starting_directory, "/", path));
+  sl->list[0] = path;
+  sl->list[1] = 0;
+  sl->idx = 1;
+  return path;
+}
+#endif
+
 
 #ifdef _AMIGA
 int
@@ -2130,6 +2192,12 @@ main (int argc, char **argv, char **envp)
 
   define_variable_cname ("CURDIR", current_directory, o_file, 0);
 
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+  /* Set up the directory cache before we start looking at files.  */
+  if (dir_cache_files)
+    dir_cache_init (shared_file_switch (dir_cache_files));
+#endif
+
   /* Read any stdin makefiles into temporary files.  */
 
   if (makefiles != 0)
@@ -2464,6 +2532,10 @@ main (int argc, char **argv, char **envp)
     }
 #endif
 
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+  job_memory_init (shared_file_switch (memory_history_files));
+#endif
+
 #ifndef MAKE_SYMLINKS
   if (check_symlink_flag)
     {
@@ -3902,6 +3974,7 @@ print_stats ()
   print_variable_stats ();
   print_file_stats ();
   print_dir_stats ();
+  print_job_stats ();
 # ifdef KMK
   print_kbuild_define_stats ();
 # endif
@@ -4028,6 +4101,13 @@ die (int status)
 #endif
         verify_file_data_base ();
 
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+      job_memory_term ();
+#endif
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+      dir_cache_term ();
+#endif
+
       clean_jobserver (status);
 
       /* Try to move back to the original directory.  This is essential on
@@ -585,6 +585,10 @@ int file_impossible_p (const char *);
 void file_impossible (const char *);
 const char *dir_name (const char *);
 void hash_init_directories (void);
+#ifdef CONFIG_WITH_PERSISTENT_DIR_CACHE
+void dir_cache_init (const char *);
+void dir_cache_term (void);
+#endif
 
 void define_default_variables (void);
 void set_default_suffixes (void);
@@ -772,6 +776,12 @@ extern int second_target_expansion;
 #ifdef CONFIG_PRETTY_COMMAND_PRINTING
 extern int pretty_command_printing;
 #endif
+#ifdef CONFIG_WITH_PRINT_STATS_SWITCH
+extern int print_stats_flag;
+#endif
+#ifdef CONFIG_WITH_MEMORY_THROTTLING
+extern unsigned int max_memory_mb;
+#endif
 #ifdef CONFIG_WITH_PRINT_TIME_SWITCH
 extern int print_time_min, print_time_width;
 #endif
@@ -51,9 +51,11 @@
 # include "nt_fullpath.h"
 # include "nt/ntstat.h"
 #else
+# define USE_POSIX_MMAP
 # include <dirent.h>
 # include <unistd.h>
 # include <stdint.h>
+# include <sys/mman.h>
 #endif
 
 #include "kDep.h"
@@ -75,8 +77,39 @@ extern int kwFsPathExists(const char *pszPath);
 /*******************************************************************************
 *   Global Variables                                                           *
 *******************************************************************************/
-/** List of dependencies. */
+/** List of dependencies, in insertion order. */
 static PDEP g_pDeps = NULL;
+/** The last dependency in the list. */
+static PDEP g_pDepsTail = NULL;
+/** Hash table of the dependencies (DEP::pNextHash chains). */
+static PDEP *g_papDepsHash = NULL;
+/** The number of buckets in g_papDepsHash, a power of two. */
+static unsigned g_cDepsHash = 0;
+/** The number of dependencies in the list. */
+static unsigned g_cDeps = 0;
+
+
+/* sdbm:
+   This algorithm was created for sdbm (a public-domain reimplementation of
+   ndbm) database library. it was found to do well in scrambling bits,
+   causing better distribution of the keys and fewer splits. it also happens
+   to be a good general hashing function with good distribution. the actual
+   function is hash(i) = hash(i - 1) * 65599 + str[i]; what is included below
+   is the faster version used in gawk. [there is even a faster, duff-device
+   version] the magic constant 65599 was picked out of thin air while
+   experimenting with different constants, and turns out to be a prime.
+   this is one of the algorithms used in berkeley db (see sleepycat) and
+   elsewhere. */
+static unsigned sdbm(const char *str, size_t size)
+{
+    unsigned hash = 0;
+    int c;
+
+    while (size-- > 0 && (c = *(unsigned const char *)str++))
+        hash = c + (hash << 6) + (hash << 16) - hash;
+
+    return hash;
+}
 
 
 /**
@@ -109,87 +142,354 @@ static void fixcase(char *pszFilename)
 
 #elif K_OS != K_OS_WINDOWS
 
+/** A directory in the fixcase() cache. */
+typedef struct DEPDIR
+{
+    /** Next directory in the hash bucket. */
+    struct DEPDIR  *pNext;
+    /** The sdbm() hash of szPath. */
+    unsigned        uHash;
+    /** Set if all the components of the path were found. */
+    int             fComplete;
+    /** Set if papszNames has been loaded. */
+    int             fListed;
+    /** The number of names in the directory listing. */
+    unsigned        cNames;
+    /** The directory listing, sorted case insensitively. NULL if not loaded
+     * or if the directory couldn't be opened. */
+    char          **papszNames;
+    /** The case corrected path, same length as szPath. */
+    char           *pszFixed;
+    /** The length of the path. */
+    size_t          cchPath;
+    /** The path as given. */
+    char            szPath[1];
+} DEPDIR, *PDEPDIR;
+
+/** The number of buckets in g_apDepDirs. */
+#define DEPDIR_HASH_SIZE    1024
+
+/** The fixcase() directory cache, hashed on the path as given.
+ * So each directory is only resolved and listed once per depCleanup() . */
+static PDEPDIR g_apDepDirs[DEPDIR_HASH_SIZE];
+
+
+/**
+ * qsort/bsearch callback for the directory listings.
+ */
+static int depDirCompareNames(const void *pv1, const void *pv2)
+{
+    return strcasecmp(*(const char * const *)pv1, *(const char * const *)pv2);
+}
+
+
+/**
+ * Looks up a name case insensitively in a directory listing, reading the
+ * listing if necessary.
+ *
+ * @returns The name with the correct case, NULL if not found.
+ * @param   pDir        The directory.
+ * @param   pszName     The name to look for.
+ */
+static const char *depDirFindName(PDEPDIR pDir, const char *pszName)
+{
+    char **ppszName;
+
+    if (!pDir->fListed)
+    {
+        DIR *pDirHandle = opendir(pDir->cchPath ? pDir->pszFixed : ".");
+        pDir->fListed = 1;
+        if (pDirHandle)
+        {
+            struct dirent *pEntry;
+            unsigned cAlloc = 0;
+            while ((pEntry = readdir(pDirHandle)) != NULL)
+            {
+                if (pDir->cNames >= cAlloc)
+                {
+                    void *pvNew;
+                    cAlloc = cAlloc ? cAlloc * 2 : 64;
+                    pvNew = realloc(pDir->papszNames, cAlloc * sizeof(pDir->papszNames[0]));
+                    if (!pvNew)
+                        break;
+                    pDir->papszNames = (char **)pvNew;
+                }
+                pDir->papszNames[pDir->cNames] = strdup(pEntry->d_name);
+                if (!pDir->papszNames[pDir->cNames])
+                    break;
+                pDir->cNames++;
+            }
+            closedir(pDirHandle);
+            qsort(pDir->papszNames, pDir->cNames, sizeof(pDir->papszNames[0]), depDirCompareNames);
+        }
+    }
+
+    if (!pDir->cNames)
+        return NULL;
+    ppszName = (char **)bsearch(&pszName, pDir->papszNames, pDir->cNames, sizeof(pDir->papszNames[0]), depDirCompareNames);
+    return ppszName ? *ppszName : NULL;
+}
+
+
+/**
+ * Corrects the case of the last component of a path.
+ *
+ * @returns 1 if it exists (with the corrected case), 0 if not.
+ * @param   pParent     The parent directory.
+ * @param   pszPath     The path, with the parent part already corrected.
+ * @param   offName     The offset of the last component.
+ */
+static int depDirFixName(PDEPDIR pParent, char *pszPath, size_t offName)
+{
+    struct stat s;
+    const char *pszName;
+    if (!stat(pszPath, &s))
+        return 1;
+    pszName = depDirFindName(pParent, &pszPath[offName]);
+    if (!pszName)
+        return 0;
+    strcpy(&pszPath[offName], pszName);
+    return 1;
+}
+
+
+/**
+ * Splits off the last component of a path.
+ *
+ * @returns The offset of the last component.
+ * @param   pszPath     The path.
+ * @param   cchPath     The length of the path, without trailing slashes.
+ * @param   pcchParent  Where to return the length of the parent path
+ *                      without the separating slashes.
+ */
+static size_t depDirSplit(const char *pszPath, size_t cchPath, size_t *pcchParent)
+{
+    size_t offName = cchPath;
+    size_t cchParent;
+    while (offName > 0 && pszPath[offName - 1] != '/')
+        offName--;
+    cchParent = offName;
+    while (cchParent > 0 && pszPath[cchParent - 1] == '/')
+        cchParent--;
+    *pcchParent = cchParent ? cchParent : offName; /* the root */
+    return offName;
+}
+
+
+/**
+ * Gets the cache entry for a directory, resolving its case.
+ *
+ * @returns The directory.
+ * @param   pszPath     The directory path. Does not need to be terminated.
+ * @param   cchPath     The length of the path, without trailing slashes.
+ */
+static PDEPDIR depDirGet(const char *pszPath, size_t cchPath)
+{
+    unsigned    uHash = sdbm(pszPath, cchPath);
+    PDEPDIR    *ppBucket = &g_apDepDirs[uHash % DEPDIR_HASH_SIZE];
+    PDEPDIR     pDir;
+    size_t      offName;
+    size_t      cchParent;
+
+    for (pDir = *ppBucket; pDir; pDir = pDir->pNext)
+        if (    pDir->uHash == uHash
+            &&  pDir->cchPath == cchPath
+            &&  !memcmp(pDir->szPath, pszPath, cchPath))
+            return pDir;
+
+    pDir = (PDEPDIR)calloc(1, sizeof(*pDir) + cchPath * 2 + 1);
+    if (!pDir)
+    {
+        fprintf(stderr, "\nOut of memory! (requested %lx bytes)\n\n",
+                (unsigned long)(sizeof(*pDir) + cchPath * 2 + 1));
+        exit(1);
+    }
+    pDir->uHash = uHash;
+    pDir->cchPath = cchPath;
+    memcpy(pDir->szPath, pszPath, cchPath);
+    pDir->pszFixed = &pDir->szPath[cchPath + 1];
+    memcpy(pDir->pszFixed, pszPath, cchPath);
+    pDir->fComplete = 1;
+
+    /*
+     * Unless it's the root or the current directory, correct the parent
+     * and then the last component.
+     */
+    offName = depDirSplit(pszPath, cchPath, &cchParent);
+    if (offName < cchPath)
+    {
+        PDEPDIR pParent = depDirGet(pszPath, cchParent);
+        memcpy(pDir->pszFixed, pParent->pszFixed, cchParent);
+        pDir->fComplete = pParent->fComplete
+                       && depDirFixName(pParent, pDir->pszFixed, offName);
+    }
+
+    pDir->pNext = *ppBucket;
+    *ppBucket = pDir;
+    return pDir;
+}
+
+
+/**
+ * Frees the fixcase() directory cache.
+ */
+static void depDirCleanup(void)
+{
+    unsigned i;
+    for (i = 0; i < DEPDIR_HASH_SIZE; i++)
+        while (g_apDepDirs[i])
+        {
+            PDEPDIR pDir = g_apDepDirs[i];
+            g_apDepDirs[i] = pDir->pNext;
+            while (pDir->cNames > 0)
+                free(pDir->papszNames[--pDir->cNames]);
+            free(pDir->papszNames);
+            free(pDir);
+        }
+}
+
+
 /**
  * Corrects the case of a path.
  *
+ * The directories are resolved through a cache, so the directories shared by
+ * the dependencies are only stat'ed and listed once.
+ *
  * @param   pszPath     Pointer to the path, both input and output.
  */
 static void fixcase(char *pszFilename)
 {
-    char *psz;
+    size_t  cch = strlen(pszFilename);
+    size_t  offName;
+    size_t  cchParent;
+    PDEPDIR pParent;
+
+    while (cch > 0 && pszFilename[cch - 1] == '/')
+        cch--;
+    offName = depDirSplit(pszFilename, cch, &cchParent);
+    if (offName >= cch)
+        return;
 
     /*
-     * Skip the root.
+     * Correct the directory part and then the name, giving up at the first
+     * component that can't be found (like the directory part did).
      */
-    psz = pszFilename;
-    while (*psz == '/')
-        psz++;
+    pParent = depDirGet(pszFilename, cchParent);
+    memcpy(pszFilename, pParent->pszFixed, cchParent);
+    if (pParent->fComplete)
+    {
+        char chSaved = pszFilename[cch];
+        pszFilename[cch] = '\0';
+        depDirFixName(pParent, pszFilename, offName);
+        pszFilename[cch] = chSaved;
+    }
+}
 
-    /*
-     * Iterate all the components.
-     */
-    while (*psz)
+#endif /* !OS/2 && !Windows */
+
+
+/**
+ * Grows the dependency hash table, rehashing the dependencies.
+ */
+static void depGrowHash(void)
+{
+    unsigned    cNew = g_cDepsHash ? g_cDepsHash * 2 : 256;
+    PDEP       *papNew = (PDEP *)calloc(cNew, sizeof(papNew[0]));
+    PDEP        pDep;
+    if (!papNew)
     {
-        char  chSlash;
-        struct stat s;
-        char   *pszStart = psz;
+        fprintf(stderr, "\nOut of memory! (requested %lx bytes)\n\n",
+                (unsigned long)(cNew * sizeof(papNew[0])));
+        exit(1);
+    }
 
-        /*
-         * Find the next slash (or end of string) and terminate the string there.
-         */
-        while (*psz != '/' && *psz)
-            psz++;
-        chSlash = *psz;
-        *psz = '\0';
+    for (pDep = g_pDeps; pDep; pDep = pDep->pNext)
+    {
+        PDEP *ppBucket = &papNew[pDep->uHash & (cNew - 1)];
+        pDep->pNextHash = *ppBucket;
+        *ppBucket = pDep;
+    }
+    free(g_papDepsHash);
+    g_papDepsHash = papNew;
+    g_cDepsHash = cNew;
+}
 
-        /*
-         * Does this part exist?
-         * If not we'll enumerate the directory and search for an case-insensitive match.
-         */
-        if (stat(pszFilename, &s))
-        {
-            struct dirent  *pEntry;
-            DIR            *pDir;
-            if (pszStart == pszFilename)
-                pDir = opendir(*pszFilename ? pszFilename : ".");
-            else
-            {
-                pszStart[-1] = '\0';
-                pDir = opendir(pszFilename);
-                pszStart[-1] = '/';
-            }
-            if (!pDir)
-            {
-                *psz = chSlash;
-                break; /* giving up, if we fail to open the directory. */
-            }
 
-            while ((pEntry = readdir(pDir)) != NULL)
-            {
-                if (!strcasecmp(pEntry->d_name, pszStart))
-                {
-                    strcpy(pszStart, pEntry->d_name);
-                    break;
-                }
-            }
-            closedir(pDir);
-            if (!pEntry)
-            {
-                *psz = chSlash;
-                break;  /* giving up if not found. */
-            }
-        }
+/**
+ * Looks up a dependency in the hash table.
+ *
+ * @returns Pointer to the dependency if found, NULL if not.
+ * @param   pszFilename     The filename. Does not need to be terminated.
+ * @param   cchFilename     The length of the filename.
+ * @param   uHash           The sdbm() hash of the filename.
+ */
+static PDEP depLookup(const char *pszFilename, size_t cchFilename, unsigned uHash)
+{
+    PDEP pDep;
+    if (!g_cDepsHash)
+        return NULL;
+    for (pDep = g_papDepsHash[uHash & (g_cDepsHash - 1)]; pDep; pDep = pDep->pNextHash)
+        if (    pDep->uHash == uHash
+            &&  pDep->cchFilename == cchFilename
+            &&  !memcmp(pDep->szFilename, pszFilename, cchFilename))
+            return pDep;
+    return NULL;
+}
+
+
+/**
+ * Appends a dependency to the list and enters it into the hash table.
+ *
+ * @param   pDep            The dependency, uHash must be set.
+ */
+static void depInsert(PDEP pDep)
+{
+    PDEP *ppBucket;
+
+    pDep->pNext = NULL;
+    if (g_pDepsTail)
+        g_pDepsTail->pNext = pDep;
+    else
+        g_pDeps = pDep;
+    g_pDepsTail = pDep;
+    g_cDeps++;
 
-        /* restore the slash and press on. */
-        *psz = chSlash;
-        while (*psz == '/')
-            psz++;
+    if (g_cDeps > g_cDepsHash)
+        depGrowHash(); /* (includes pDep) */
+    else
+    {
+        ppBucket = &g_papDepsHash[pDep->uHash & (g_cDepsHash - 1)];
+        pDep->pNextHash = *ppBucket;
+        *ppBucket = pDep;
     }
+}
 
-    return;
+
+/**
+ * Empties the dependency list and hash table, returning the list.
+ *
+ * @returns The head of the old list.
+ */
+static PDEP depDetach(void)
+{
+    PDEP pDeps = g_pDeps;
+    g_pDeps = g_pDepsTail = NULL;
+    g_cDeps = 0;
+    if (g_cDepsHash)
+        memset(g_papDepsHash, 0, g_cDepsHash * sizeof(g_papDepsHash[0]));
+    return pDeps;
 }
 
-#endif /* !OS/2 && !Windows */
+
+/**
+ * Gets the head of the dependency list.
+ *
+ * @returns Pointer to the first dependency, NULL if the list is empty.
+ */
+PDEP depFirst(void)
+{
+    return g_pDeps;
+}
 
 
 /**
@@ -199,12 +499,12 @@ void depOptimize(int fFixCase, int fQuiet, const char *pszIgnoredExt)
 {
     /*
      * Walk the list correct the names and re-insert them.
+     * Dependencies with unchanged names are moved over as-is, keeping the hash.
      */
     size_t  cchIgnoredExt = pszIgnoredExt ? strlen(pszIgnoredExt) : 0;
-    PDEP    pDepOrg = g_pDeps;
-    PDEP    pDep = g_pDeps;
-    g_pDeps = NULL;
-    for (; pDep; pDep = pDep->pNext)
+    PDEP    pDepNext;
+    PDEP    pDep = depDetach();
+    for (; pDep; pDep = pDepNext)
     {
 #ifndef PATH_MAX
         char        szFilename[_MAX_PATH + 1];
@@ -215,13 +515,17 @@ void depOptimize(int fFixCase, int fQuiet, const char *pszIgnoredExt)
 #if !defined(KWORKER) && !defined(KMK)
         struct stat s;
 #endif
+        pDepNext = pDep->pNext;
 
         /*
          * Skip some fictive names like <built-in> and <command line>.
          */
         if (    pDep->szFilename[0] == '<'
             &&  pDep->szFilename[pDep->cchFilename - 1] == '>')
+        {
+            free(pDep);
             continue;
+        }
         pszFilename = pDep->szFilename;
 
         /*
@@ -230,7 +534,10 @@ void depOptimize(int fFixCase, int fQuiet, const char *pszIgnoredExt)
         if (   pszIgnoredExt
             && pDep->cchFilename > cchIgnoredExt
             && memcmp(&pDep->szFilename[pDep->cchFilename - cchIgnoredExt], pszIgnoredExt, cchIgnoredExt) == 0)
+        {
+            free(pDep);
             continue;
+        }
 
 #if K_OS != K_OS_OS2 && K_OS != K_OS_WINDOWS
         /*
@@ -280,23 +587,21 @@ void depOptimize(int fFixCase, int fQuiet, const char *pszIgnoredExt)
                             &&  pszFilename[2] != '\\')))
                )
                 fprintf(stderr, "kDep: Skipping '%s' - %s!\n", pszFilename, strerror(errno));
+            free(pDep);
             continue;
         }
 
         /*
          * Insert the corrected dependency.
          */
-        depAdd(pszFilename, strlen(pszFilename));
-    }
-
-    /*
-     * Free the old ones.
-     */
-    while (pDepOrg)
-    {
-        pDep = pDepOrg;
-        pDepOrg = pDepOrg->pNext;
-        free(pDep);
+        if (    pszFilename == pDep->szFilename
+            &&  !depLookup(pszFilename, pDep->cchFilename, pDep->uHash))
+            depInsert(pDep);
+        else
+        {
+            depAdd(pszFilename, strlen(pszFilename));
+            free(pDep);
+        }
     }
 }
 
@@ -327,29 +632,6 @@ void depPrintStubs(FILE *pOutput)
 }
 
 
-/* sdbm:
-   This algorithm was created for sdbm (a public-domain reimplementation of
-   ndbm) database library. it was found to do well in scrambling bits,
-   causing better distribution of the keys and fewer splits. it also happens
-   to be a good general hashing function with good distribution. the actual
-   function is hash(i) = hash(i - 1) * 65599 + str[i]; what is included below
-   is the faster version used in gawk. [there is even a faster, duff-device
-   version] the magic constant 65599 was picked out of thin air while
-   experimenting with different constants, and turns out to be a prime.
-   this is one of the algorithms used in berkeley db (see sleepycat) and
-   elsewhere. */
-static unsigned sdbm(const char *str, size_t size)
-{
-    unsigned hash = 0;
-    int c;
-
-    while (size-- > 0 && (c = *(unsigned const char *)str++))
-        hash = c + (hash << 6) + (hash << 16) - hash;
-
-    return hash;
-}
-
-
 /**
  * Adds a dependency.
  *
@@ -361,17 +643,13 @@ PDEP depAdd(const char *pszFilename, size_t cchFilename)
 {
     unsigned    uHash = sdbm(pszFilename, cchFilename);
     PDEP        pDep;
-    PDEP        pDepPrev;
 
     /*
      * Check if we've already got this one.
      */
-    pDepPrev = NULL;
-    for (pDep = g_pDeps; pDep; pDepPrev = pDep, pDep = pDep->pNext)
-        if (    pDep->uHash == uHash
-            &&  pDep->cchFilename == cchFilename
-            &&  !memcmp(pDep->szFilename, pszFilename, cchFilename))
-            return pDep;
+    pDep = depLookup(pszFilename, cchFilename, uHash);
+    if (pDep)
+        return pDep;
 
     /*
      * Add it.
@@ -388,17 +666,7 @@ PDEP depAdd(const char *pszFilename, size_t cchFilename)
     memcpy(pDep->szFilename, pszFilename, cchFilename);
     pDep->szFilename[cchFilename] = '\0';
     pDep->uHash = uHash;
-
-    if (pDepPrev)
-    {
-        pDep->pNext = pDepPrev->pNext;
-        pDepPrev->pNext = pDep;
-    }
-    else
-    {
-        pDep->pNext = g_pDeps;
-        g_pDeps = pDep;
-    }
+    depInsert(pDep);
     return pDep;
 }
 
@@ -408,14 +676,19 @@ PDEP depAdd(const char *pszFilename, size_t cchFilename)
  */
 void depCleanup(void)
 {
-    PDEP pDep = g_pDeps;
-    g_pDeps = NULL;
+    PDEP pDep = depDetach();
     while (pDep)
     {
         PDEP pFree = pDep;
         pDep = pDep->pNext;
         free(pFree);
     }
+    free(g_papDepsHash);
+    g_papDepsHash = NULL;
+    g_cDepsHash = 0;
+#if K_OS != K_OS_OS2 && K_OS != K_OS_WINDOWS
+    depDirCleanup();
+#endif
 }
 
 
@@ -505,6 +778,17 @@ void *depReadFileIntoMemory(FILE *pInput, size_t *pcbFile, void **ppvOpaque)
             fprintf(stderr, "kDep: warning: CreateFileMapping failed, %d.\n", GetLastError());
     }
 
+#elif defined(USE_POSIX_MMAP)
+    /* The opaque value is the mapping size, which is never zero. */
+    if (cbFile > 0)
+    {
+        pvFile = mmap(NULL, cbFile, PROT_READ, MAP_PRIVATE, fileno(pInput), 0);
+        if (pvFile != MAP_FAILED)
+        {
+            *ppvOpaque = (void *)(uintptr_t)cbFile;
+            return pvFile;
+        }
+    }
 #endif
 
     /*
@@ -543,6 +827,12 @@ void depFreeFileMemory(void *pvFile, void *pvOpaque)
         CloseHandle(pvOpaque);
         return;
     }
+#elif defined(USE_POSIX_MMAP)
+    if (pvOpaque)
+    {
+        munmap(pvFile, (size_t)(uintptr_t)pvOpaque);
+        return;
+    }
 #endif
     free(pvFile);
 }
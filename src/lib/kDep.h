@@ -37,6 +37,8 @@ typedef struct DEP
 {
     /** Next dependency in the list. */
     struct DEP *pNext;
+    /** Next dependency in the hash table bucket. */
+    struct DEP *pNextHash;
     /** The filename hash. */
     unsigned    uHash;
     /** The length of the filename. */
@@ -47,6 +49,7 @@ typedef struct DEP
 
 
 extern PDEP depAdd(const char *pszFilename, size_t cchFilename);
+extern PDEP depFirst(void);
 extern void depOptimize(int fFixCase, int fQuiet, const char *pszIgnoredExt);
 extern void depPrint(FILE *pOutput);
 extern void depPrintStubs(FILE *pOutput);
@@ -90,9 +90,22 @@ void MD5Update(struct MD5Context *ctx, const unsigned char *buf, unsigned len)
     /* Process data in 64-byte chunks */
 
     while (len >= 64) {
-	memcpy(ctx->in, buf, 64);
-	byteReverse(ctx->in, 16);
-	MD5Transform(ctx->buf, (uint32 *) ctx->in);
+#if K_ENDIAN == K_ENDIAN_LITTLE
+	/* Nothing to swap, so transform straight from the caller's buffer
+	   when alignment permits (MD5Transform doesn't modify it). */
+# if K_ARCH == K_ARCH_X86_32 || K_ARCH == K_ARCH_AMD64
+	if (1)
+# else
+	if (!((uintptr_t)buf & 3))
+# endif
+	    MD5Transform(ctx->buf, (uint32 *) buf);
+	else
+#endif
+	{
+	    memcpy(ctx->in, buf, 64);
+	    byteReverse(ctx->in, 16);
+	    MD5Transform(ctx->buf, (uint32 *) ctx->in);
+	}
 	buf += 64;
 	len -= 64;
     }
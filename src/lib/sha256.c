@@ -0,0 +1,158 @@
+/* $Id$ */
+/** @file
+ * SHA-256 message digest (FIPS 180-4).
+ *
+ * Same interface as md5.c: declare a SHA256Context, call SHA256Init, feed it
+ * with SHA256Update and collect the 32 byte digest with SHA256Final.
+ */
+
+/*
+ * Copyright (c) 2026 knut st. osmundsen <bird-kBuild-spamx@anduin.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * Alternatively, the content of this file may be used under the terms of the
+ * GPL version 2 or later, or LGPL version 2.1 or later.
+ */
+
+#include <string.h>
+#include "sha256.h"
+
+
+/* The round constants. */
+static const uint32_t g_au32K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define S0(x)       (ROR(x,  2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)       (ROR(x,  6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define s0(x)       (ROR(x,  7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define s1(x)       (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+/*
+ * Processes one 64 byte block.
+ */
+static void SHA256Transform(uint32_t state[8], const unsigned char *blk)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    unsigned i;
+
+    for (i = 0; i < 16; i++, blk += 4)
+        w[i] = (uint32_t)blk[0] << 24 | (uint32_t)blk[1] << 16 | (uint32_t)blk[2] << 8 | blk[3];
+    for (; i < 64; i++)
+        w[i] = s1(w[i - 2]) + w[i - 7] + s0(w[i - 15]) + w[i - 16];
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = h + S1(e) + CH(e, f, g) + g_au32K[i] + w[i];
+        uint32_t t2 = S0(a) + MAJ(a, b, c);
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void SHA256Init(struct SHA256Context *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->bits[0] = 0;
+    ctx->bits[1] = 0;
+}
+
+void SHA256Update(struct SHA256Context *ctx, const unsigned char *buf, unsigned len)
+{
+    uint32_t t = ctx->bits[0];
+
+    /* Update the bit count. */
+    if ((ctx->bits[0] = t + ((uint32_t)len << 3)) < t)
+        ctx->bits[1]++;
+    ctx->bits[1] += len >> 29;
+    t = (t >> 3) & 0x3f;
+
+    /* Top up a partial block. */
+    if (t) {
+        unsigned cb = 64 - t;
+        if (len < cb) {
+            memcpy(ctx->in + t, buf, len);
+            return;
+        }
+        memcpy(ctx->in + t, buf, cb);
+        SHA256Transform(ctx->state, ctx->in);
+        buf += cb;
+        len -= cb;
+    }
+
+    /* Whole blocks straight from the caller's buffer. */
+    while (len >= 64) {
+        SHA256Transform(ctx->state, buf);
+        buf += 64;
+        len -= 64;
+    }
+
+    memcpy(ctx->in, buf, len);
+}
+
+void SHA256Final(unsigned char digest[32], struct SHA256Context *ctx)
+{
+    unsigned count = (ctx->bits[0] >> 3) & 0x3f;
+    unsigned i;
+
+    /* Pad with 0x80 and zeros up to 56 mod 64, then the big endian bit count. */
+    ctx->in[count++] = 0x80;
+    if (count > 56) {
+        memset(ctx->in + count, 0, 64 - count);
+        SHA256Transform(ctx->state, ctx->in);
+        count = 0;
+    }
+    memset(ctx->in + count, 0, 56 - count);
+    for (i = 0; i < 4; i++) {
+        ctx->in[56 + i] = (unsigned char)(ctx->bits[1] >> (24 - i * 8));
+        ctx->in[60 + i] = (unsigned char)(ctx->bits[0] >> (24 - i * 8));
+    }
+    SHA256Transform(ctx->state, ctx->in);
+
+    for (i = 0; i < 8; i++) {
+        digest[i * 4]     = (unsigned char)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+    memset(ctx, 0, sizeof(*ctx));       /* In case it's sensitive */
+}